@@ -0,0 +1,109 @@
+#!/bin/bash
+#
+# Benchmarks qvz, normally run by make bench. The inner routines are timed on their own by
+# qvz_bench micro, then synthetic files are encoded and decoded to measure throughput, rate
+# and MSE. The results are compared with a baseline saved earlier by ./bench.sh --save, and
+# the script fails if anything got worse by more than the tolerance.
+#
+# Environment:
+#   BENCH_LINES           Lines in each synthetic file (default: 500000)
+#   BENCH_LENGTH          Scores per line (default: 100)
+#   BENCH_DIR             Where the files and results are kept (default: bench_data)
+#   BENCH_BASELINE        Baseline to compare against or save (default: bench_baseline.txt)
+#   BENCH_TOLERANCE       Percent a time or throughput may get worse (default: 5)
+#   BENCH_RATE_TOLERANCE  Percent the bits per symbol or MSE may get worse (default: 1)
+
+QVZ=bin/qvz
+BENCH=bin/qvz_bench
+LINES=${BENCH_LINES:-500000}
+LENGTH=${BENCH_LENGTH:-100}
+DIR=${BENCH_DIR:-bench_data}
+BASELINE=${BENCH_BASELINE:-bench_baseline.txt}
+TOLERANCE=${BENCH_TOLERANCE:-5}
+RATE_TOLERANCE=${BENCH_RATE_TOLERANCE:-1}
+RESULTS=$DIR/results.txt
+TIMEFORMAT=%R
+
+if [ ! -x $QVZ ] || [ ! -x $BENCH ]; then
+	echo "$QVZ and $BENCH are missing, build them with make bench."
+	exit 1
+fi
+
+mkdir -p $DIR
+: > $RESULTS
+
+# Encodes input with the given options and decodes it again, recording each as name_...
+# The synthetic input is made the first time it is needed, from a fixed seed, so every run
+# and every version of qvz codes the same data
+run_e2e() {
+	local name=$1 data=$2 clusters=$3
+	local input=$DIR/$data.txt
+	local enc dec rate mse bytes
+	shift 3
+
+	if [ ! -f $input ]; then
+		$BENCH generate $LINES $LENGTH $clusters 1 > $input || exit 1
+	fi
+	bytes=$(wc -c < $input)
+
+	enc=$( { time $QVZ "$@" -s -u $DIR/$name.ref $input $DIR/$name.q > $DIR/$name.stats; } 2>&1 ) || exit 1
+	dec=$( { time $QVZ -x $DIR/$name.q $DIR/$name.dec > /dev/null; } 2>&1 ) || exit 1
+	if ! cmp -s $DIR/$name.ref $DIR/$name.dec; then
+		echo "$name: the decoded file differs from what the encoder reconstructed."
+		exit 1
+	fi
+
+	rate=$(tail -n 1 $DIR/$name.stats | awk -F', *' '{print $2}')
+	mse=$($BENCH mse $input $DIR/$name.dec | awk '{print $2}')
+	awk -v n=$name -v b=$bytes -v l=$LINES -v e=$enc -v d=$dec -v r=$rate -v m=$mse 'BEGIN {
+		printf "%s_encode, %.3f, MB/s\n", n, b / e / 1e6
+		printf "%s_encode_lines, %.0f, lines/s\n", n, l / e
+		printf "%s_decode, %.3f, MB/s\n", n, b / d / 1e6
+		printf "%s_decode_lines, %.0f, lines/s\n", n, l / d
+		printf "%s_rate, %.4f, bits/symbol\n", n, r
+		printf "%s_mse, %.4f, mse\n", n, m
+	}' | tee -a $RESULTS
+	rm -f $DIR/$name.ref $DIR/$name.dec $DIR/$name.q $DIR/$name.stats
+}
+
+echo "Microbenchmarks:"
+$BENCH micro | tee -a $RESULTS
+if [ ${PIPESTATUS[0]} -ne 0 ]; then
+	exit 1
+fi
+
+echo "End to end ($LINES lines of $LENGTH scores):"
+run_e2e synth1 synth1 1 -c 1 -f 0.5
+run_e2e synth3 synth3 3 -c 3 -f 0.5
+run_e2e synth3_range synth3 3 -c 3 -f 0.5 -e R
+
+if [ "$1" == "--save" ]; then
+	cp $RESULTS $BASELINE
+	echo "Saved the results as the baseline in $BASELINE."
+	exit 0
+fi
+
+if [ ! -f $BASELINE ]; then
+	echo "There is no baseline in $BASELINE to compare against, save one with ./bench.sh --save."
+	exit 0
+fi
+
+# Throughputs (units per second) should go up and everything else should go down
+echo "Compared with $BASELINE:"
+awk -F', *' -v tol=$TOLERANCE -v rtol=$RATE_TOLERANCE '
+	NR == FNR { base[$1] = $2; next }
+	($1 in base) && base[$1] != 0 {
+		change = 100 * ($2 - base[$1]) / base[$1]
+		worse = ($3 ~ /\/s$/) ? -change : change
+		limit = ($3 == "bits/symbol" || $3 == "mse") ? rtol : tol
+		flag = (worse > limit) ? "REGRESSION" : ""
+		if (flag != "")
+			regressions += 1
+		printf "%-32s %14s %14s %+8.2f%% %s\n", $1, base[$1], $2, change, flag
+	}
+	END {
+		if (regressions) {
+			printf "%d results got worse by more than the tolerance.\n", regressions
+			exit 1
+		}
+	}' $BASELINE $RESULTS
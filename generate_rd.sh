@@ -1,17 +1,14 @@
 #!/bin/bash
+#
+# Collects a rate-distortion curve of an input file: generate_rd.sh INPUT RESULTS
+# Writes the rate, distortion and time of every target to RESULTS
 
-idx=0
 STATSFILE=`mktemp rd_statsXXXXXX`
-while [ $idx -lt 20 ]; do
-	# If doing ratiod encoding
-	comp=$(echo "$idx*0.05" | bc -l)
-	bin/qvz -c 1 -f $comp -s $1 $2 | tee -a $STATSFILE
+# If doing ratiod encoding
+bin/qvz -c 1 --sweep 0:0.95:0.05 $1 | tee -a $STATSFILE
 
-	# Fixed rate encoding
-	#comp=$(echo "$idx*0.10" | bc -l)
-	#bin/qvz -c 3 -r $comp -s $1 $2 | tee -a $STATSFILE
+# Fixed rate encoding
+#bin/qvz -c 3 -r 0 --sweep 0:1.9:0.1 $1 | tee -a $STATSFILE
 
-	idx=$((idx+1))
-done
-awk '{print $2 $4 $6}' $STATSFILE > $3
+awk '{print $2 $4 $6}' $STATSFILE > $2
 rm -f $STATSFILE
@@ -8,19 +8,35 @@
 
 #define MAX_KMEANS_ITERATIONS 1000
 
+// Number of lines that k-means++ seeding draws the initial centers from
+#define KMEANS_SEED_LINES 65536
+
+// Lines handled by one clustering task, must divide MAX_LINES_PER_BLOCK so tasks never span blocks
+#define CLUSTER_CHUNK_LINES 50000
+
 // Memory management
 struct cluster_list_t *alloc_cluster_list(struct quality_file_t *info);
 void free_cluster_list(struct cluster_list_t *);
+struct cluster_accumulator_t *alloc_cluster_accumulators(struct quality_file_t *info, uint32_t count);
+void free_cluster_accumulators(struct cluster_accumulator_t *acc, uint32_t count);
 
 // Clustering algorithm internals
-uint8_t cluster_lines(struct line_block_t *block, struct quality_file_t *info);
+uint8_t cluster_lines(struct line_block_t *block, uint32_t first, uint32_t count, struct quality_file_t *info, struct cluster_accumulator_t *acc);
+void reduce_cluster_accumulators(struct quality_file_t *info, struct cluster_accumulator_t *acc, uint32_t count);
 double recalculate_means(struct quality_file_t *info);
-uint8_t do_cluster_assignment(struct line_t *line, struct quality_file_t *info);
-uint8_t assign_cluster(struct line_t *line, struct quality_file_t *info);
-void find_distance(struct line_t *line, struct cluster_t *cluster, struct quality_file_t *t);
+void update_cluster_separation(struct quality_file_t *info);
+uint8_t do_cluster_assignment(struct line_t *line, struct kmeans_bounds_t *bound, struct quality_file_t *info, struct cluster_accumulator_t *acc);
+uint8_t assign_cluster(struct line_t *line, struct quality_file_t *info, const uint64_t *distances);
+uint64_t find_distance(struct line_t *line, struct cluster_t *cluster, struct quality_file_t *info);
+
+// Runtime dispatch of the vectorized distance kernels
+distance_kernel_t select_distance_kernel(uint8_t verbose);
+distance_kernel_t list_distance_kernels(uint32_t i, const char **name);
 
 // Clustering interface
-void initialize_kmeans_clustering(struct quality_file_t *info);
-void do_kmeans_clustering(struct quality_file_t *info);
+void initialize_kmeans_clustering(struct quality_file_t *info, struct line_block_t *blocks, uint32_t block_count);
+uint32_t run_kmeans_iterations(struct quality_file_t *info, struct line_block_t *blocks, uint32_t block_count);
+uint8_t do_kmeans_clustering(struct quality_file_t *info);
+void assign_clusters(struct quality_file_t *info, struct line_block_t *blocks, uint32_t block_count);
 
 #endif
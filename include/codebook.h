@@ -18,10 +18,31 @@
 #include "quantizer.h"
 #include "lines.h"
 
+struct metrics_t;
+
 #define MODE_RATIO		0	// Traditional implementation, output bitrate is scaled from input
 #define MODE_FIXED		1	// Fixed rate per symbol
 #define MODE_FIXED_MSE	2	// Fixed average MSE per column
 
+// Lines counted per statistics task, and the most memory the per thread count tensors may use
+#define STATS_CHUNK_LINES			50000
+#define STATS_TENSOR_BUDGET			((size_t) 1 << 28)
+
+// Binary codebooks, see write_codebook
+#define CODEBOOK_REPEAT_PREVIOUS	0		// Quantizer is the same as the one before it
+#define CODEBOOK_REPEAT_CONTEXT		0xff	// Quantizer is the same as the one two before it
+
+// Codebook cache files (-B) start with this magic and a version byte
+#define CODEBOOK_CACHE_MAGIC		"QVB\0"
+#define CODEBOOK_CACHE_VERSION		2
+#define CODEBOOK_CACHE_HEADER_LENGTH	28
+
+// Default largest KL divergence (bits) between current and cached statistics of any column
+#define CODEBOOK_CACHE_TOLERANCE	0.05
+
+// Probability added to every entry of a cached PMF when comparing it with the current one
+#define CODEBOOK_CACHE_EPSILON		1e-9
+
 /**
  * Options for the compression process
  */
@@ -32,11 +53,29 @@ struct qv_options_t {
 	uint8_t clusters;
     uint8_t uncompressed;
     uint8_t distortion;
+	uint8_t coder;				// Entropy coder backend for compression
+	uint8_t dither;				// Quantizer selection generator for compression
 	char *dist_file;
     char *uncompressed_name;
+	char *codebook_file;		// Codebook cache to reuse or create, NULL for none
+	uint8_t fastq;				// Input is a FASTQ file rather than only quality lines
+	char *sidecar_name;			// File for the other lines of each FASTQ record, NULL for none
+	double codebook_tolerance;	// Largest divergence per column for reusing cached codebooks
 	double ratio;		// Used for parameter to all modes
 	double e_dist;		// Expected distortion as calculated during optimization
+	double e_rate;		// Expected bits per symbol as calculated during optimization
+	uint8_t estimate;			// Only report the expected rate and distortion, don't encode
 	double cluster_threshold;
+	uint64_t kmeans_sample;		// Lines to fit cluster centers on, 0 to use every line
+	uint64_t stats_sample;		// Lines to gather statistics from, 0 to use every line
+	uint64_t stream_training;	// Lines at the start of a streamed input to train on, 0 to load the whole file
+	uint32_t threads;			// Worker threads for segment coding
+	uint32_t segment_lines;		// Lines per independently coded segment, 0 for a single segment
+	struct metrics_t *metrics;	// Stage timings and coding statistics to collect, NULL for none
+	uint8_t stats_step;			// Count the adaptive stats add for every symbol coded
+	uint8_t stats_fast_step;	// Count the fast half of two-rate mixing adds, 0 for a single rate
+	uint32_t stats_limit;		// Total at which the adaptive stats are rescaled
+	uint8_t stats_priors;		// Start the adaptive stats from priors trained with the codebooks
 };
 
 /**
@@ -48,6 +87,7 @@ struct cond_pmf_list_t {
 	uint32_t columns;
 	const struct alphabet_t *alphabet;
 	struct pmf_t **pmfs;
+	struct pmf_list_t *storage;		// Arena the PMFs are allocated from
 	struct pmf_list_t *marginal_pmfs;
 };
 
@@ -68,6 +108,43 @@ struct cond_quantizer_list_t {
 	struct qv_options_t *options;
 };
 
+/**
+ * A quantizer copied inline into a compiled codebook, with direct tables so that neither
+ * coding direction needs to look anything up in an alphabet
+ */
+struct codebook_quantizer_t {
+	symbol_t q[ALPHABET_SIZE];			// Input symbol to output symbol
+	uint8_t state[ALPHABET_SIZE];		// Input symbol to output state (index in the output alphabet)
+	symbol_t symbols[ALPHABET_SIZE];	// Output state to output symbol
+	uint32_t states;					// Size of the output alphabet
+};
+
+/**
+ * Everything needed to code one left context of one column: the quantized ratio that
+ * picks between the two quantizers and the low and high quantizers themselves
+ */
+struct codebook_context_t {
+	uint8_t qratio;
+	struct codebook_quantizer_t q[2];
+};
+
+/**
+ * Flattened copy of a cluster's conditional quantizer list, laid out for the coding loops.
+ * Every context lives in one array, column by column, so a quantizer is found with a single
+ * index instead of a chain of pointer loads. Quantizer 2*k+h is the low (h=0) or high (h=1)
+ * quantizer of context k, which is also the index of its adaptive stats. The context for
+ * a left context symbol is read straight from a columns x ALPHABET_SIZE table
+ */
+struct compiled_codebook_t {
+	uint32_t columns;
+	uint32_t contexts;
+	uint32_t *column_offset;				// First context of each column
+	uint32_t *context_index;				// Context of each (column, left symbol), or ALPHABET_SYMBOL_NOT_FOUND
+	struct codebook_context_t *ctx;
+};
+
+#define COMPILED_QUANTIZER(book, k) (&(book)->ctx[(k) >> 1].q[(k) & 1])
+
 // Memory management
 struct cond_pmf_list_t *alloc_conditional_pmf_list(const struct alphabet_t *alphabet, uint32_t columns);
 struct cond_quantizer_list_t *alloc_conditional_quantizer_list(uint32_t columns);
@@ -86,20 +163,28 @@ void store_cond_quantizers_indexed(struct quantizer_t *restrict lo, struct quant
 struct quantizer_t *choose_quantizer(struct cond_quantizer_list_t *list, struct well_state_t *well, uint32_t column, symbol_t prev, uint32_t *q_idx);
 uint32_t find_state_encoding(struct quantizer_t *codebook, symbol_t value);
 
+// Compiled codebooks for coding
+struct compiled_codebook_t *compile_codebook(struct cond_quantizer_list_t *list);
+void free_compiled_codebook(struct compiled_codebook_t *book);
+void compile_codebooks(struct quality_file_t *info);
+void free_compiled_codebooks(struct quality_file_t *info);
+uint32_t choose_compiled_quantizer(const struct compiled_codebook_t *book, uint8_t r, uint32_t column, symbol_t prev);
+
 // Meat of the implementation
-void calculate_statistics(struct quality_file_t *);
+uint8_t calculate_statistics(struct quality_file_t *);
 double optimize_for_entropy(struct pmf_t *pmf, struct distortion_t *dist, double target, struct quantizer_t **lo, struct quantizer_t **hi);
 void generate_codebooks(struct quality_file_t *info);
 
 // Master functions to handle codebooks in the output file
 void write_codebooks(FILE *fp, struct quality_file_t *info);
 void write_codebook(FILE *fp, struct cond_quantizer_list_t *quantizers);
-void read_codebooks(FILE *fp, struct quality_file_t *info);
+uint8_t read_codebooks(FILE *fp, struct quality_file_t *info);
 struct cond_quantizer_list_t *read_codebook(FILE *fp, struct quality_file_t *info);
 
-#define MAX_CODEBOOK_LINE_LENGTH 3366
-#define COPY_Q_TO_LINE(line, q, i, size) for (i = 0; i < size; ++i) { line[i] = q[i] + 33; }
-#define COPY_Q_FROM_LINE(line, q, i, size) for (i = 0; i < size; ++i) { q[i] = line[i] - 33; }
+// Codebook cache files that persist codebooks between encodes
+uint8_t write_codebook_cache(const char *path, struct quality_file_t *info);
+uint8_t read_codebook_cache(const char *path, struct quality_file_t *info);
+
 
 void print_codebook(struct cond_quantizer_list_t *);
 
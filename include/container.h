@@ -0,0 +1,41 @@
+#ifndef _CONTAINER_H_
+#define _CONTAINER_H_
+/**
+ * Container header at the start of every compressed file, which describes the file well
+ * enough to decode it: what wrote it, how many lines it holds, how its segments were
+ * coded and the seed that quantizer selection starts from
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "lines.h"
+
+#define CONTAINER_MAGIC				"\x89QVZ"
+#define CONTAINER_VERSION			2		// Newest version, written only when version 1 can't describe the file
+
+// Length of the header of each version. Later versions may append fields, so the header
+// records its own length and readers skip whatever they don't understand
+#define CONTAINER_HEADER_LENGTH_V1	151
+#define CONTAINER_HEADER_LENGTH		158
+#define CONTAINER_PREFIX_LENGTH		7		// Magic, version and header length
+
+// Flags byte of the header
+#define CONTAINER_VARIABLE_LENGTH	0x01	// Lines are not all the same length
+#define CONTAINER_CLUSTER_MEANS		0x02	// Cluster centers follow the codebooks, in codebook files
+
+// Adaptive model flags byte of a version 2 header
+#define CONTAINER_MODEL_PRIORS		0x01	// Priors for the adaptive stats follow the codebooks
+
+// Line count of a streamed file that couldn't be filled in afterwards (e.g. written to a pipe)
+#define CONTAINER_LINES_UNKNOWN		UINT64_MAX
+
+off_t write_container_header(FILE *fp, struct quality_file_t *info, uint8_t streamed, uint8_t flags);
+void update_container_lines(FILE *fp, off_t pos, uint64_t lines);
+uint8_t read_container_header(FILE *fp, struct quality_file_t *info, uint8_t *flags);
+
+// CRC-32C of the coded bytes of a segment
+uint32_t segment_checksum(const uint8_t *data, size_t size);
+
+#endif
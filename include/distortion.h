@@ -10,15 +10,20 @@
 #define DISTORTION_CUSTOM			4
 
 /**
- * Used to store distortion matrix information that is used during quantizer generation
+ * Used to store distortion matrix information that is used during quantizer generation.
+ * The built in measures only depend on the difference between the true and reconstructed
+ * values, so they are kept as one entry per difference, while a custom measure is a full
+ * matrix of floats indexed by x + symbols*y, so each reconstruction's column is contiguous
  */
 struct distortion_t {
-	double *distortion;
+	double *by_difference;	// Distortion of each |x - y| for the built in measures, NULL for custom
+	float *matrix;			// Custom distortion matrix, NULL for the built in measures
 	uint8_t symbols;
+	uint8_t type;		// DISTORTION_* the matrix was generated from, which allows faster quantizer design
 };
 
 // Memory management functions
-struct distortion_t *alloc_distortion_matrix(uint8_t symbols);
+struct distortion_t *alloc_distortion_matrix(uint8_t symbols, uint8_t type);
 void free_distortion_matrix(struct distortion_t *);
 
 // Methods for generating distortion matrices of different types
@@ -28,8 +33,38 @@ struct distortion_t *gen_manhattan_distortion(uint8_t symbols);
 struct distortion_t *gen_lorentzian_distortion(uint8_t symbols);
 struct distortion_t *gen_custom_distortion(uint8_t symbols, const char *filename);
 
+/**
+ * Retrieve the distortion for a pair (x, y). Generally x is the true value and
+ * y is the reconstructed value
+ */
+static inline double get_distortion(const struct distortion_t *dist, uint8_t x, uint8_t y) {
+	if (dist->matrix)
+		return dist->matrix[x + dist->symbols*y];
+	return dist->by_difference[(x > y) ? x - y : y - x];
+}
+
+/**
+ * Typed accessors, for loops over a single measure. get_difference_distortion works for
+ * any built in measure, and a custom measure is read a reconstruction column at a time
+ */
+static inline double get_mse_distortion(uint8_t x, uint8_t y) {
+	return (double) ((x - y)*(x - y));
+}
+
+static inline double get_manhattan_distortion(uint8_t x, uint8_t y) {
+	return (double) ((x > y) ? x - y : y - x);
+}
+
+static inline double get_difference_distortion(const struct distortion_t *dist, uint8_t x, uint8_t y) {
+	return dist->by_difference[(x > y) ? x - y : y - x];
+}
+
+static inline const float *get_custom_distortion_column(const struct distortion_t *dist, uint8_t y) {
+	return dist->matrix + dist->symbols*y;
+}
+
 // Accessors
-double get_distortion(struct distortion_t *dist, uint8_t x, uint8_t y);
+double get_line_distortion(const struct distortion_t *dist, const uint8_t *x, const uint8_t *y, uint32_t columns);
 
 void print_distortion(struct distortion_t *dist);
 
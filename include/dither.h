@@ -0,0 +1,32 @@
+#ifndef _DITHER_H_
+#define _DITHER_H_
+/**
+ * Counter based generator for the 7 bit values that choose between the low and high
+ * quantizer of every symbol. Each value is a hash of the segment key, the line within the
+ * segment and the column, so a whole line is produced at once without any state carried
+ * from one symbol to the next
+ */
+
+#include <stdint.h>
+
+#include "well.h"
+
+// Quantizer selection generators, recorded in the file
+#define DITHER_WELL				0	// WELL-1024a, one draw after another
+#define DITHER_COUNTER			1	// Hash of the line and column
+
+// Kernels write whole blocks of this many values, so buffers must be padded to a multiple of it
+#define DITHER_BLOCK			32
+
+struct dither_key_t {
+	uint32_t line;			// Mixed into the line number
+	uint32_t column;		// Mixed into every word of a line
+};
+
+typedef void (*dither_kernel_t)(const struct dither_key_t *key, uint32_t line, uint32_t columns, uint8_t *out);
+
+void dither_seed_segment(struct dither_key_t *key, const struct well_state_t *seed, uint32_t segment);
+dither_kernel_t select_dither_kernel(uint8_t verbose);
+dither_kernel_t list_dither_kernels(uint32_t i, const char **name);
+
+#endif
@@ -3,6 +3,7 @@
 
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include "pmf.h"
 #include "distortion.h"
@@ -10,29 +11,51 @@
 
 // This limits us to chunks that aren't too big to fit into a modest amount of memory at a time
 #define MAX_LINES_PER_BLOCK			1000000
-#define MAX_READS_PER_LINE			1022
-#define READ_LINEBUF_LENGTH			(MAX_READS_PER_LINE+2)
 
 // Error codes for reading a line block
 #define LF_ERROR_NONE				0
 #define LF_ERROR_NOT_FOUND			1
 #define LF_ERROR_NO_MEMORY			2
 #define LF_ERROR_TOO_LONG			4
+#define LF_ERROR_BAD_LENGTH			8
+#define LF_ERROR_NOT_FASTQ			16
+#define LF_ERROR_SIDECAR			32
+
+// Bytes of a file that are scanned for newlines at a time
+#define NEWLINE_SCAN_CHUNK			(1 << 16)
+
+// Lines that streamed encoding designs its codebooks from unless told otherwise
+#define STREAM_TRAINING_LINES		MAX_LINES_PER_BLOCK
+
+// Most lines that a batch sharing one set of codebooks samples from all of its inputs to train on
+#define BATCH_TRAINING_LINES		MAX_LINES_PER_BLOCK
 
 /**
  * Points to a single line, which may be a pointer to a file in memory
  */
 struct line_t {
 	uint8_t cluster;		// Assigned cluster ID
+	uint32_t length;		// Number of quality scores in the line, at most the file's columns
 	const symbol_t *m_data;	// Pointer to part of mmap'd region, has no offsets applied, do not modify!
 };
 
+/**
+ * Distance bounds for a line, in Euclidean (not squared) distance, that let clustering skip
+ * lines whose assignment can't have changed since the last iteration
+ */
+struct kmeans_bounds_t {
+	float upper;			// Upper bound on the distance to the assigned center
+	float lower;			// Lower bound on the distance to any other center
+};
+
 /**
  * Points to a block of lines for incremental processing
  */
 struct line_block_t {
 	uint32_t count;
 	struct line_t *lines;
+	struct kmeans_bounds_t *bounds;	// Only allocated while clustering
+	symbol_t *data;					// Storage for the lines when read from a stream, NULL if mapped
 };
 
 /**
@@ -41,22 +64,46 @@ struct line_block_t {
 struct cluster_t {
 	// Used to do clustering
 	uint8_t id;					// Cluster ID
-	uint32_t count;				// Number of lines in this cluster
+	uint64_t count;				// Number of lines in this cluster
 	symbol_t *mean;				// Mean values for this cluster
 	uint64_t *accumulator;		// Accumulator for finding a new cluster center
+	uint64_t *ends;				// Lines of each length in this cluster, only for variable length files
+	double moved;				// Distance the mean moved in the last iteration
+	double separation;			// Half the distance to the nearest other mean
 
 	// Used after clustering is done
 	struct cond_pmf_list_t *training_stats;
 	struct cond_quantizer_list_t *qlist;
+	struct compiled_codebook_t *book;	// Flattened qlist used while coding
+	uint8_t *priors;					// Starting frequencies of the states of every quantizer, or NULL
 };
 
+/**
+ * Computes the squared distance from a line's data to each of the first k cluster means
+ */
+typedef void (*distance_kernel_t)(const symbol_t *data, const struct cluster_t *clusters, uint32_t k, uint32_t columns, uint64_t *out);
+
 /**
  * Stores all clusters
  */
 struct cluster_list_t {
 	uint8_t count;
 	struct cluster_t *clusters;
-	double *distances;			// Temporary storage for distances to each cluster center
+	double max_moved;			// Largest distance moved by any mean in the last iteration
+	distance_kernel_t distance;	// Kernel used for assignment, kept here so that files can be clustered at the same time
+};
+
+/**
+ * Thread-private partial results for one k-means iteration, reduced into the clusters
+ * once every thread is done with its share of the lines
+ */
+struct cluster_accumulator_t {
+	uint64_t *count;			// Lines assigned to each cluster
+	uint64_t *sum;				// Column sums per cluster, cluster-major
+	uint64_t *ends;				// Line length histogram per cluster, cluster-major, or NULL
+	uint64_t *distances;		// Scratch storage for distances to each cluster center
+	uint8_t changed;			// At least one line changed clusters
+	uint8_t incremental;		// Counts and sums are changes since the last iteration, not totals
 };
 
 /**
@@ -66,7 +113,9 @@ struct quality_file_t {
 	struct alphabet_t *alphabet;
 	char *path;
 	uint64_t lines;
-	uint32_t columns;
+	uint32_t columns;			// Length of the longest line
+	uint64_t symbols;			// Total number of quality scores in all lines
+	uint8_t variable_length;	// Lines are not all the same length
 	uint32_t block_count;
 	struct line_block_t *blocks;
 	uint8_t cluster_count;
@@ -74,11 +123,31 @@ struct quality_file_t {
 	struct distortion_t *dist;
 	struct qv_options_t *opts;
 	struct well_state_t well;
+	uint8_t coder;				// Entropy coder backend used for the segments
+	uint8_t dither;				// Generator that chooses between each pair of quantizers
+	uint8_t stats_step;			// Adaptive model of the quality contexts, see update_stats
+	uint8_t stats_fast_step;
+	uint32_t stats_limit;
+	uint8_t stats_priors;		// The clusters have priors, stored after the codebooks
 };
 
+/**
+ * Writes the offset of every newline in data[0, len) to out, which must have room for len
+ * entries, and returns how many there were
+ */
+typedef uint32_t (*newline_kernel_t)(const char *data, uint32_t len, uint32_t *out);
+
 // Memory management
 uint32_t load_file(const char *path, struct quality_file_t *info, uint64_t max_lines);
+uint32_t load_stream(FILE *fp, struct quality_file_t *info, uint64_t max_lines);
+uint32_t load_fastq(const char *path, struct quality_file_t *info, const char *sidecar);
+uint32_t load_lines(const uint8_t **lines, const uint32_t *lengths, uint64_t count, struct quality_file_t *info);
+uint32_t read_stream_block(FILE *fp, struct quality_file_t *info, struct line_block_t *block, uint32_t max_lines);
 uint32_t alloc_blocks(struct quality_file_t *info);
 void free_blocks(struct quality_file_t *info);
 
+// Runtime dispatch of the vectorized newline kernels
+newline_kernel_t select_newline_kernel(uint8_t verbose);
+newline_kernel_t list_newline_kernels(uint32_t i, const char **name);
+
 #endif
@@ -0,0 +1,78 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+/**
+ * Stage timings and coding statistics collected during encoding and written out as JSON
+ * (--metrics), for tracking performance from one run or release to the next
+ */
+
+#include "util.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+// Most named stages one run records
+#define METRICS_MAX_STAGES			16
+
+/**
+ * Wall clock and processor time of one stage. Processor time is summed over every thread
+ * of the process, so it exceeds the wall time when the stage runs in parallel
+ */
+struct stage_metric_t {
+	const char *name;
+	double wall;				// Seconds
+	double cpu;					// Seconds
+	double moved;				// Largest distance a cluster mean moved, k-means iterations only
+};
+
+/**
+ * Marks the start of a stage
+ */
+struct stage_timer_t {
+	struct hrtimer_t wall;
+	double cpu;
+};
+
+/**
+ * Coding statistics of one segment, gathered privately while it is coded and merged into
+ * the run's totals afterwards. Bits are the information content of each symbol under the
+ * adaptive statistics it was coded with, which is what the entropy coder spends on it up
+ * to the coder's own rounding
+ */
+struct segment_metrics_t {
+	double *column_bits;
+	uint64_t *column_symbols;
+	double *cluster_bits;
+	uint64_t *cluster_symbols;
+	uint64_t rescales;			// Times update_stats halved the counts of a context
+};
+
+struct metrics_t {
+	struct stage_metric_t stages[METRICS_MAX_STAGES];
+	uint32_t stage_count;
+	struct stage_metric_t *iterations;	// One per k-means iteration
+	uint32_t iteration_count;
+	uint32_t iteration_capacity;
+	uint32_t columns;
+	uint8_t clusters;
+	struct segment_metrics_t totals;
+	pthread_mutex_t lock;		// Serializes merging segments from the coding threads
+};
+
+struct quality_file_t;
+
+struct metrics_t *alloc_metrics(void);
+void free_metrics(struct metrics_t *m);
+
+// Stage timing
+void start_stage(struct stage_timer_t *timer);
+void stop_stage(struct metrics_t *m, struct stage_timer_t *timer, const char *name);
+void add_kmeans_iteration(struct metrics_t *m, struct stage_timer_t *timer, double moved);
+
+// Per segment coding statistics
+struct segment_metrics_t *alloc_segment_metrics(uint32_t columns, uint8_t clusters);
+void merge_segment_metrics(struct metrics_t *m, struct segment_metrics_t *s, uint32_t columns, uint8_t clusters);
+
+uint64_t get_peak_rss(void);
+void write_metrics(const char *path, struct metrics_t *m, struct quality_file_t *info, uint64_t bytes, const double *distortion);
+
+#endif
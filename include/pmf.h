@@ -10,23 +10,36 @@
 
 #define ALPHABET_INDEX_SIZE_HINT			72
 
+// Number of quality scores representable in the input (Phred 0 to 71)
+#define ALPHABET_SIZE						72
+
+// 64 bit words in an alphabet's membership bitset
+#define ALPHABET_MASK_WORDS					((ALPHABET_SIZE + 63) / 64)
+
 // Unfortunately this is a bit brittle so don't change it
 typedef uint8_t symbol_t;
 
 /**
  * Structure that stores information about an alphabet including
- * the number of symbols and a list of the symbols themselves
+ * the number of symbols and a list of the symbols themselves. Alphabets are
+ * always subsets of the ALPHABET_SIZE input symbols, so the symbol list and
+ * index table have a fixed capacity and live in the same allocation as the
+ * structure, and membership is also kept as a bitset
  */
 struct alphabet_t {
 	uint32_t size;
 	symbol_t *symbols;
 	uint32_t *indexes;
+	uint64_t mask[ALPHABET_MASK_WORDS];
 };
 
 /**
  * Structure for defining and storing a single PMF in a manner that is
  * useful for computing empirical PMFs, but also allows PMFs to be manipulated
- * as a set of probabilities (not just as empirical counts)
+ * as a set of probabilities (not just as empirical counts). The probabilities
+ * and counts are fixed width slabs of ALPHABET_SIZE entries stored right after
+ * the structure, so a PMF is a single allocation and can be retargeted to a
+ * different alphabet without reallocating
  */
 struct pmf_t {
 	uint8_t pmf_ready;
@@ -37,10 +50,13 @@ struct pmf_t {
 };
 
 /**
- * Stores a list of PMFs, used to track sets of conditional PMFs
+ * Stores a list of PMFs, used to track sets of conditional PMFs. The pointer
+ * array and every PMF are carved out of one arena allocation with room for
+ * capacity PMFs, so lists can be reset and reused as scratch space
  */
 struct pmf_list_t {
 	uint32_t size;
+	uint32_t capacity;
 	struct pmf_t **pmfs;
 };
 
@@ -52,11 +68,14 @@ struct pmf_list_t *alloc_pmf_list(uint32_t size, const struct alphabet_t *alphab
 void free_alphabet(struct alphabet_t *);
 void free_pmf(struct pmf_t *);
 void free_pmf_list(struct pmf_list_t *);
+void reset_pmf_list(struct pmf_list_t *list, uint32_t size, const struct alphabet_t *alphabet);
+void copy_alphabet(struct alphabet_t *dst, const struct alphabet_t *src);
 
 // PMF access
 uint32_t is_pmf_valid(struct pmf_t *);
 uint32_t get_symbol_index(const struct alphabet_t *alphabet, symbol_t symbol);
 double get_probability(struct pmf_t *pmf, uint32_t idx);
+const double *get_probabilities(struct pmf_t *pmf);
 double get_symbol_probability(struct pmf_t *pmf, symbol_t symbol);
 double get_entropy(struct pmf_t *pmf);
 double get_kl_divergence(struct pmf_t *p, struct pmf_t *q);
@@ -76,7 +95,7 @@ uint32_t alphabet_contains(const struct alphabet_t *alphabet, symbol_t symbol);
 uint32_t get_symbol_index(const struct alphabet_t *alphabet, symbol_t symbol);
 
 // Compute the union of two alphabets
-void alphabet_union(const struct alphabet_t *restrict a, const struct alphabet_t *restrict b, struct alphabet_t *result);
+void alphabet_union(const struct alphabet_t *a, const struct alphabet_t *b, struct alphabet_t *result);
 
 // Display routines
 void print_alphabet(const struct alphabet_t *);
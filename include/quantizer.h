@@ -19,6 +19,7 @@ struct quantizer_t {
 	symbol_t *restrict q;
     double ratio;
 	double mse;
+	double entropy;
 };
 
 // Memory management
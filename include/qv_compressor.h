@@ -15,14 +15,53 @@
 #include <string.h>
 
 #include "codebook.h"
+#include "dither.h"
 
 #define m_arith  22
 
-#define OS_STREAM_BUF_LEN		(4096*4096)
+// Output streams start this big and double as needed
+#define OS_STREAM_INITIAL_LEN	(1 << 16)
 
 #define COMPRESSION 0
 #define DECOMPRESSION 1
 
+// Segment count of a file whose segments each carry their own line and byte counts
+#define SEGMENTS_STREAMED		UINT32_MAX
+
+// Bytes per segment in the index, and in front of each segment of a streamed file
+#define SEGMENT_INDEX_ENTRY		24		// Lines, offset, size and checksum
+#define SEGMENT_RECORD_LENGTH	16		// Lines, size and checksum
+
+// Status of decoding a file's segments
+#define DECODE_OK				0
+#define DECODE_ERROR_TRUNCATED	1	// The file ends inside the segment index or a segment
+#define DECODE_ERROR_CORRUPT	2	// The segment index doesn't add up, or a segment doesn't match its checksum
+
+// Checksum of the placeholder index entries written before the segments are coded. The
+// entries also have no bytes, which no coded segment matches, so a file whose index was
+// never filled in is rejected rather than decoded
+#define SEGMENT_CHECKSUM_PLACEHOLDER	0xffffffff
+
+// Entropy coder backends, recorded in the file
+#define CODER_ARITHMETIC		0	// Bitwise arithmetic coder
+#define CODER_RANGE				1	// Bytewise range coder
+
+// Line lengths are coded as a flag for full length lines, then up to this many bytes
+#define LENGTH_CODE_BYTES		4
+
+// Range coder renormalizes whenever the range drops below this
+#define RANGE_CODER_TOP			(1u << 24)
+
+// Adaptive model of the quality contexts, where the defaults are what files without a model
+// in their container header use. Totals above STATS_LIMIT_MAX would cost both coders precision
+#define STATS_STEP_DEFAULT		8
+#define STATS_LIMIT_MAX			(1u << (m_arith - 3))
+#define STATS_LIMIT_MIN			(1u << 10)
+#define STATS_FAST_SHIFT		2		// Fast counts are halved at this fraction (as a shift) of the limit
+#define STATS_PRIOR_SCALE		255		// Stored prior of a state that always occurs
+#define STATS_PRIOR_SYMBOLS		16		// Symbols of evidence that a prior is worth
+#define STATS_PRIOR_LINES		100000	// Most training lines priors are counted from
+
 typedef struct Arithmetic_code_t {
     int32_t scale3;
     
@@ -31,68 +70,157 @@ typedef struct Arithmetic_code_t {
     uint32_t t;
 
     uint32_t m;
-	uint32_t r;			// Rescaling condition
 }*Arithmetic_code;
 
+typedef struct range_coder_t {
+	uint64_t low;
+	uint32_t range;
+	uint32_t code;
+	uint8_t cache;		// Byte held back in case a carry propagates into it
+	uint64_t cache_size;
+}*Range_code;
+
 typedef struct os_stream_t {
-	FILE *fp;
-	uint8_t *buf;
-	uint32_t bufPos;
-	uint8_t bitPos;
+	uint8_t *buf;			// Output buffer, owned by the stream
+	const uint8_t *in;		// Input data, not owned and never modified
+	size_t size;			// Capacity of buf, or length of in
+	size_t pos;				// Next byte of buf or in
+	uint64_t bits;			// Bit accumulator, right aligned for output and left aligned for input
+	uint32_t bit_count;		// Number of valid bits in the accumulator
 	uint64_t written;
 } *osStream;
 
 typedef struct stream_stats_t {
     uint32_t *counts;
+	uint32_t *cumulative;	// Sum of counts below each symbol, alphabetCard+1 entries ending in n
     uint32_t alphabetCard;
     uint32_t step;
     uint32_t n;
+	uint32_t rescales;		// Times the counts were halved since the stats were reset
+	uint32_t limit;			// Total above which the counts are halved
+	uint32_t *fast;			// Part of the counts from the fast rate when mixing, otherwise NULL
+	uint32_t fast_n;
+	uint32_t fast_step;		// Part of step that goes to the fast counts
 } *stream_stats_ptr_t;
 
 typedef struct arithStream_t {
 	stream_stats_ptr_t cluster_stats;
-    stream_stats_ptr_t ***stats;
+	stream_stats_ptr_t length_stats[LENGTH_CODE_BYTES+1];	// Full length flag and length bytes, only for variable length files
+    struct stream_stats_t **stats;	// Per cluster arena, indexed like the compiled codebook quantizers
+	uint8_t coder;
     Arithmetic_code a;
+	Range_code rc;
     osStream os;
 }*arithStream;
 
 typedef struct qv_compressor_t{
     arithStream Quals;
+	struct well_state_t well;	// Per segment quantizer selection state, for DITHER_WELL
+	struct dither_key_t key;	// Per segment quantizer selection key, for DITHER_COUNTER
+	dither_kernel_t kernel;
+	uint8_t *selection;			// Selection values for the current line, padded to DITHER_BLOCK
 }*qv_compressor;
 
+/**
+ * Describes one independently coded run of lines. Each segment has its own arithmetic
+ * coder, adaptive stats and WELL state, so segments can be coded on separate threads
+ */
+struct qv_segment_t {
+	uint32_t id;
+	uint64_t first_line;
+	uint32_t lines;
+	uint8_t *data;				// Coded bytes for this segment
+	size_t size;
+	uint64_t offset;			// Position of the coded bytes, counted from the end of the index
+	uint32_t checksum;			// CRC-32C of the coded bytes
+	uint8_t mapped;				// Data points into a mapping of the input and isn't freed
+	uint8_t status;				// DECODE_OK, or why the segment couldn't be decoded
+	char *text;					// Quantized values for these lines, as text (-u or decoder output)
+	size_t text_size;			// Bytes of text, including the newlines
+	double distortion;			// Sum of per line average distortion
+};
+
+/**
+ * One file of a batch compressed together with start_qv_batch_compression
+ */
+struct qv_batch_file_t {
+	struct quality_file_t *info;
+	FILE *fout;
+	uint64_t bytes;				// Bytes written for the segment index and segments
+	double distortion;			// Average per line distortion, if it was measured
+};
+
 
 
 
 // Stream interface
-struct os_stream_t *alloc_os_stream(FILE *fp, uint8_t in);
+struct os_stream_t *alloc_os_stream(void);
+struct os_stream_t *alloc_os_stream_reader(const uint8_t *data, size_t size);
 void free_os_stream(struct os_stream_t *);
+uint8_t *stream_release_buffer(struct os_stream_t *os, size_t *size);
+void stream_rewind(struct os_stream_t *os, const uint8_t *data, size_t size);
 uint8_t stream_read_bit(struct os_stream_t *);
 uint32_t stream_read_bits(struct os_stream_t *os, uint8_t len);
 void stream_write_bit(struct os_stream_t *, uint8_t);
 void stream_write_bits(struct os_stream_t *os, uint32_t dw, uint8_t len);
+uint8_t stream_read_byte(struct os_stream_t *os);
+void stream_write_byte(struct os_stream_t *os, uint8_t byte);
 void stream_finish_byte(struct os_stream_t *);
 void stream_write_buffer(struct os_stream_t *);
 
 // Arithmetic ncoder interface
 Arithmetic_code initialize_arithmetic_encoder(uint32_t m);
+void reset_arithmetic_encoder(Arithmetic_code a);
 void arithmetic_encoder_step(Arithmetic_code a, stream_stats_ptr_t stats, int32_t x, osStream os);
 int encoder_last_step(Arithmetic_code a, osStream os);
 uint32_t arithmetic_decoder_step(Arithmetic_code a, stream_stats_ptr_t stats, osStream is);
-uint32_t decoder_last_step(Arithmetic_code a, stream_stats_ptr_t stats);
+
+// Range coder interface
+Range_code initialize_range_coder(void);
+void reset_range_coder(Range_code rc);
+void range_encoder_step(Range_code rc, stream_stats_ptr_t stats, uint32_t x, osStream os);
+void range_encoder_last_step(Range_code rc, osStream os);
+void range_decoder_start(Range_code rc, osStream is);
+uint32_t range_decoder_step(Range_code rc, stream_stats_ptr_t stats, osStream is);
 
 // Encoding stats management
-stream_stats_ptr_t **initialize_stream_stats(struct cond_quantizer_list_t *q_list);
-void update_stats(stream_stats_ptr_t stats, uint32_t x, uint32_t r);
+stream_stats_ptr_t alloc_stream_stats(uint32_t alphabetCard);
+void reset_stream_stats(struct stream_stats_t *s, uint32_t count);
+void free_stream_stat(stream_stats_ptr_t stats);
+struct stream_stats_t *initialize_stream_stats(const struct compiled_codebook_t *book, const uint8_t *priors, struct quality_file_t *info);
+void reset_context_stats(struct stream_stats_t *s, const struct compiled_codebook_t *book, const uint8_t *priors, struct quality_file_t *info);
+void update_stats(stream_stats_ptr_t stats, uint32_t x);
+void train_stats_priors(struct quality_file_t *info);
 
 // Quality value compression interface
-void compress_qv(arithStream as, uint32_t x, uint8_t cluster, uint32_t column, uint32_t idx);
+void compress_qv(arithStream as, uint32_t x, uint8_t cluster, uint32_t idx);
 void qv_write_cluster(arithStream as, uint8_t cluster);
-uint32_t decompress_qv(arithStream as, uint8_t cluster, uint32_t column, uint32_t idx);
+uint32_t decompress_qv(arithStream as, uint8_t cluster, uint32_t idx);
 uint8_t qv_read_cluster(arithStream as);
-
-qv_compressor initialize_qv_compressor(FILE *fout, uint8_t streamDirection, struct quality_file_t *info);
-
-uint32_t start_qv_compression(struct quality_file_t *info, FILE *fout, double *dis, FILE * funcompressed);
-void start_qv_decompression(FILE *fout, FILE *fin, struct quality_file_t *info);
+void qv_write_length(arithStream as, uint32_t length, uint32_t columns);
+uint32_t qv_read_length(arithStream as, uint32_t columns);
+void qv_finish_stream(arithStream as);
+
+void choose_well_seed(struct quality_file_t *info);
+arithStream initialize_arithStream(struct os_stream_t *os, uint8_t decompressor_flag, struct quality_file_t *info);
+void reset_arithStream(arithStream as, uint8_t decompressor_flag, struct quality_file_t *info, const uint8_t *data, size_t size);
+uint64_t count_stream_rescales(arithStream as, struct quality_file_t *info);
+void free_arithStream(arithStream as, struct quality_file_t *info);
+qv_compressor initialize_qv_compressor(struct os_stream_t *os, uint8_t streamDirection, struct quality_file_t *info, uint32_t segment);
+void reset_qv_compressor(qv_compressor qvc, uint8_t streamDirection, struct quality_file_t *info, uint32_t segment, const uint8_t *data, size_t size);
+void free_qv_compressor(qv_compressor qvc, struct quality_file_t *info);
+void draw_line_selection(qv_compressor qvc, struct quality_file_t *info, uint32_t line, uint32_t columns);
+
+// Segment coding
+void compress_segment(struct quality_file_t *info, struct qv_segment_t *segment, uint8_t keep_text, uint8_t measure, qv_compressor reuse);
+uint8_t decompress_segment(struct quality_file_t *info, struct qv_segment_t *segment, qv_compressor reuse);
+void put_segment_record(uint8_t *buf, struct qv_segment_t *segment);
+uint8_t get_segment_record(const uint8_t *buf, struct qv_segment_t *segment);
+
+uint64_t start_qv_compression(struct quality_file_t *info, FILE *fout, double *dis, FILE * funcompressed);
+uint64_t start_qv_stream_compression(struct quality_file_t *info, FILE *fin, FILE *fout, double *dis, FILE *funcompressed);
+void start_qv_batch_compression(struct qv_batch_file_t *files, uint32_t count, uint32_t threads, uint8_t measure);
+uint8_t start_qv_decompression(FILE *fout, FILE *fin, struct quality_file_t *info);
+uint8_t decompress_range(FILE *fout, FILE *fin, struct quality_file_t *info, uint64_t first_line, uint64_t count, uint64_t *lines);
 
 #endif
@@ -0,0 +1,71 @@
+#ifndef _QVZ_H_
+#define _QVZ_H_
+/**
+ * Entry points for using qvz from other programs without going through the command line.
+ *
+ * Besides decoding whole files, quality scores can be coded in process a chunk at a time.
+ * Codebooks are trained once (or read from a file saved earlier), and any number of encoder
+ * and decoder contexts can share them. A context keeps its coder and adaptive stats between
+ * chunks, so coding a chunk allocates nothing once the buffers have grown to fit it. Every
+ * chunk is coded independently of the others, starting from fresh statistics, and is
+ * stored the way a segment of a streamed file is, as a record of its line count, size and
+ * checksum followed by its coded bytes. Chunk n of a context must be decoded as chunk n
+ * since the context was created or reset, because its quantizer selection depends on it.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "codebook.h"
+
+// Status of the chunk coding and file decoding functions
+#define QVZ_OK					0
+#define QVZ_ERROR_BAD_LINE		1	// A line is longer than the codebooks allow or has a score outside the alphabet
+#define QVZ_ERROR_TRUNCATED		2	// A chunk or file is shorter than its records or index say
+#define QVZ_ERROR_CORRUPT		3	// A chunk or segment doesn't match its checksum, or a segment index doesn't add up
+#define QVZ_ERROR_MEMORY		4	// The output or the line buffers can't grow to fit the chunk
+#define QVZ_ERROR_FORMAT		5	// A file can't be opened, or its header or codebooks can't be read
+
+// Returned in place of a line count when a whole file can't be decoded
+#define QVZ_DECODE_FAILED		UINT64_MAX
+
+/**
+ * Growable output of the chunk coding functions, which append to it. Start from all zeros,
+ * reuse it for as long as needed and release it with qvz_free_buffer
+ */
+struct qvz_buffer_t {
+	uint8_t *data;
+	size_t size;			// Bytes in use
+	size_t capacity;		// Bytes allocated
+};
+
+struct qvz_codebooks_t;
+struct qvz_encoder_t;
+struct qvz_decoder_t;
+
+void qvz_default_options(struct qv_options_t *opts);
+void qvz_free_buffer(struct qvz_buffer_t *buf);
+
+// Codebooks, shared read only by every context made from them
+struct qvz_codebooks_t *qvz_train_codebooks(const uint8_t **lines, const uint32_t *lengths, uint64_t count, struct qv_options_t *opts);
+void qvz_write_codebooks(FILE *fp, struct qvz_codebooks_t *books);
+struct qvz_codebooks_t *qvz_read_codebooks(FILE *fp);
+void qvz_free_codebooks(struct qvz_codebooks_t *books);
+
+// Encoding
+struct qvz_encoder_t *qvz_encoder_create(struct qvz_codebooks_t *books, struct qv_options_t *opts);
+uint32_t qvz_encode_lines(struct qvz_encoder_t *ctx, const uint8_t **lines, const uint32_t *lengths, uint32_t count, struct qvz_buffer_t *out);
+void qvz_encoder_reset(struct qvz_encoder_t *ctx);
+void qvz_encoder_free(struct qvz_encoder_t *ctx);
+
+// Decoding
+struct qvz_decoder_t *qvz_decoder_create(struct qvz_codebooks_t *books);
+uint32_t qvz_decode_lines(struct qvz_decoder_t *ctx, const uint8_t *data, size_t size, size_t *used, struct qvz_buffer_t *out);
+void qvz_decoder_reset(struct qvz_decoder_t *ctx);
+void qvz_decoder_free(struct qvz_decoder_t *ctx);
+
+// Decoding whole files, damaged files return QVZ_DECODE_FAILED and set the status
+uint64_t qvz_decode_stream(FILE *fin, FILE *fout, struct qv_options_t *opts, uint64_t first_line, uint64_t count, uint32_t *status);
+uint64_t qvz_decode_range(const char *path, uint64_t first_line, uint64_t count, FILE *fout, uint32_t *status);
+
+#endif
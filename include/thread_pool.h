@@ -0,0 +1,21 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+/**
+ * Minimal portable wrapper for running independent tasks on a set of worker threads
+ */
+
+#include <stdint.h>
+
+/**
+ * Body of a parallel task. The task index identifies the unit of work, and the thread
+ * index (0 to threads-1) can be used to select thread-private scratch storage
+ */
+typedef void (*parallel_task_t)(void *arg, uint32_t task, uint32_t thread);
+
+// Number of processors available to run worker threads on
+uint32_t get_cpu_count(void);
+
+// Runs tasks 0 through tasks-1 on up to the given number of threads and waits for all of them
+void run_parallel(uint32_t threads, uint32_t tasks, parallel_task_t fn, void *arg);
+
+#endif
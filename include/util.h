@@ -8,6 +8,7 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <float.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -51,6 +52,38 @@ double get_timer_interval(struct hrtimer_t *timer);
 // ceiling(log2()) function used in bit calculations
 int cb_log2(int x);
 
+/**
+ * Stores a 32 bit value in network order, which every multibyte field of a file uses
+ */
+static inline void put_be32(uint8_t *buf, uint32_t x) {
+	buf[0] = (uint8_t) (x >> 24);
+	buf[1] = (uint8_t) (x >> 16);
+	buf[2] = (uint8_t) (x >> 8);
+	buf[3] = (uint8_t) x;
+}
+
+/**
+ * Reads a 32 bit value stored in network order
+ */
+static inline uint32_t get_be32(const uint8_t *buf) {
+	return (((uint32_t) buf[0]) << 24) | (((uint32_t) buf[1]) << 16) | (((uint32_t) buf[2]) << 8) | buf[3];
+}
+
+/**
+ * Stores a 64 bit value in network order
+ */
+static inline void put_be64(uint8_t *buf, uint64_t x) {
+	put_be32(buf, (uint32_t) (x >> 32));
+	put_be32(buf+4, (uint32_t) x);
+}
+
+/**
+ * Reads a 64 bit value stored in network order
+ */
+static inline uint64_t get_be64(const uint8_t *buf) {
+	return (((uint64_t) get_be32(buf)) << 32) | get_be32(buf+4);
+}
+
 // Missing log2 function
 #ifndef LINUX
 	#define log2(x) (log(x)/log(2.0))
@@ -16,5 +16,6 @@ struct well_state_t {
 
 uint32_t well_1024a(struct well_state_t *state);
 uint32_t well_1024a_bits(struct well_state_t *state, uint8_t bits);
+void well_seed_segment(struct well_state_t *state, const struct well_state_t *seed, uint32_t segment);
 
 #endif
@@ -0,0 +1,22 @@
+#ifndef _WRITER_H_
+#define _WRITER_H_
+/**
+ * Background writer that takes finished output buffers off the coding threads, so that
+ * writing one batch of segments overlaps with coding the next
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Most bytes that may be queued before new writes wait for the queue to drain
+#define WRITER_QUEUE_LIMIT		((size_t) 1 << 26)
+
+struct async_writer_t;
+
+struct async_writer_t *start_async_writer(void);
+void async_write(struct async_writer_t *w, FILE *fp, void *block, const void *data, size_t size);
+void async_write_copy(struct async_writer_t *w, FILE *fp, const void *data, size_t size);
+void flush_async_writer(struct async_writer_t *w);
+void stop_async_writer(struct async_writer_t *w);
+
+#endif
@@ -8,13 +8,21 @@ Arithmetic_code initialize_arithmetic_encoder(uint32_t m) {
     a_code = (Arithmetic_code) calloc(1, sizeof(struct Arithmetic_code_t));
     
     a_code->m = m;
-	a_code->r = 1 << (m - 3);
-    a_code->l = 0;
-	a_code->u = (1 << m) - 1;
+	reset_arithmetic_encoder(a_code);
     
     return a_code;
 }
 
+/**
+ * Returns the coder to its initial interval so it can start another stream
+ */
+void reset_arithmetic_encoder(Arithmetic_code a) {
+	a->scale3 = 0;
+	a->l = 0;
+	a->u = (1 << a->m) - 1;
+	a->t = 0;
+}
+
 /**
  * E1/E2 check for the MSB of the lower and upper regions being the same, indicating that a bit has
  * been determined and must be sent to the output stream
@@ -25,7 +33,7 @@ void arithmetic_encoder_step(Arithmetic_code a, stream_stats_ptr_t stats, int32_
     uint64_t range = 0;
     uint8_t msbU = 0, msbL = 0, E1_E2 = 0, E3 = 0, smsbL = 0, smsbU = 0;
     uint32_t cumCountX, cumCountX_1;
-    int32_t i;
+	uint8_t pending;
 
 	// These are actually constants, need to lift a->m out of the struct because it is compile-time constant
 	uint32_t msb_shift = a->m - 1;
@@ -36,11 +44,8 @@ void arithmetic_encoder_step(Arithmetic_code a, stream_stats_ptr_t stats, int32_
 
 	assert(x < stats->alphabetCard);
     
-	cumCountX_1 = 0;
-	for (i = 0; i < x; ++i) {
-		cumCountX_1 += stats->counts[i];
-	}
-	cumCountX = cumCountX_1 + stats->counts[x];
+	cumCountX_1 = stats->cumulative[x];
+	cumCountX = stats->cumulative[x+1];
 
 	assert(cumCountX_1 < cumCountX);
     
@@ -73,8 +78,9 @@ void arithmetic_encoder_step(Arithmetic_code a, stream_stats_ptr_t stats, int32_
             
 			// Write any extra bits based on the number of rescalings without an output before now
             while (a->scale3 > 0) {
-				stream_write_bit(os, !msbL);
-                a->scale3 -= 1;
+				pending = (a->scale3 > 32) ? 32 : a->scale3;
+				stream_write_bits(os, msbL ? 0 : UINT32_MAX, pending);
+                a->scale3 -= pending;
             }
         }
 		else { // E3 is true
@@ -98,14 +104,16 @@ void arithmetic_encoder_step(Arithmetic_code a, stream_stats_ptr_t stats, int32_
 
 int encoder_last_step(Arithmetic_code a, osStream os) {
     uint8_t msbL = a->l >> (a->m - 1);
+	uint8_t pending;
 
     // Write the msb of the tag (l)
 	stream_write_bit(os, msbL);
     
     // write as many !msbL as scale3 left
     while (a->scale3 > 0) {
-		stream_write_bit(os, !msbL);
-        a->scale3 -= 1;
+		pending = (a->scale3 > 32) ? 32 : a->scale3;
+		stream_write_bits(os, msbL ? 0 : UINT32_MAX, pending);
+        a->scale3 -= pending;
     }
     
     // write the rest of the tag (l)
@@ -117,8 +125,8 @@ int encoder_last_step(Arithmetic_code a, osStream os) {
 
 uint32_t arithmetic_decoder_step(Arithmetic_code a, stream_stats_ptr_t stats, osStream is) {
     uint64_t range = 0, tagGap = 0;
-    int32_t k = 0, x = -1, i;
-    uint32_t subRange = 0, cumCountX = 0, cumCountX_1 = 0, cumCount = 0;
+    uint32_t x, lo, hi, mid;
+    uint32_t subRange = 0, cumCountX = 0, cumCountX_1 = 0;
     
     uint8_t msbU = 0, msbL = 0, E1_E2 = 0, E3 = 0, smsbL = 0, smsbU = 0;
     
@@ -130,17 +138,21 @@ uint32_t arithmetic_decoder_step(Arithmetic_code a, stream_stats_ptr_t stats, os
     range = a->u - a->l + 1;
     tagGap = a->t - a->l + 1;
     
-	// @todo figure this out
+	// Scale the tag into the count domain and find the symbol whose cumulative interval holds it
     subRange = (uint32_t)((tagGap * stats->n - 1) / range);
-    while (subRange >= cumCount)
-        cumCount += stats->counts[k++];
-    x = --k;
-  
-	cumCountX_1 = 0;
-	for (i = 0; i < x; ++i) {
-		cumCountX_1 += stats->counts[i];
+	lo = 0;
+	hi = stats->alphabetCard;
+	while (hi - lo > 1) {
+		mid = (lo + hi) >> 1;
+		if (stats->cumulative[mid] <= subRange)
+			lo = mid;
+		else
+			hi = mid;
 	}
-	cumCountX = cumCountX_1 + stats->counts[x];
+	x = lo;
+
+	cumCountX_1 = stats->cumulative[x];
+	cumCountX = stats->cumulative[x+1];
     
     a->u = a->l + (uint32_t)((range * cumCountX) / stats->n) - 1;
     a->l = a->l + (uint32_t)((range * cumCountX_1) / stats->n);
@@ -186,21 +198,3 @@ uint32_t arithmetic_decoder_step(Arithmetic_code a, stream_stats_ptr_t stats, os
     
     return x;
 }
-
-uint32_t decoder_last_step(Arithmetic_code a, stream_stats_ptr_t stats) {
-    uint64_t range, tagGap, subRange;
-    uint32_t k = 0, cumCount = 0, x;
-    
-    range = a->u - a->l + 1;
-    tagGap = a->t - a->l + 1;
-    
-    subRange = (tagGap * stats->n -1) / range;
-    
-    while (subRange >= cumCount)
-        cumCount += stats->counts[k++];
-    
-    x = --k;
-    
-    return x;
-}
-
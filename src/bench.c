@@ -0,0 +1,587 @@
+/**
+ * Benchmark helper for qvz, built with make bench. It makes synthetic quality scores from a
+ * first order Markov model, times the innermost routines of the codec on their own, checks
+ * the vector kernels against the scalar ones, and measures the distortion between two
+ * quality files for the end to end runs in bench.sh
+ */
+
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "codebook.h"
+#include "cluster.h"
+#include "qv_compressor.h"
+#include "dither.h"
+#include "well.h"
+
+// Range of the scores the generator produces, as Phred values
+#define GEN_MIN_SCORE			2
+#define GEN_MAX_SCORE			41
+
+// Symbols coded by each entropy coder benchmark, and the alphabet they are drawn from
+#define BENCH_SYMBOLS			(1 << 24)
+#define BENCH_STATES			8
+
+// Lines and centers used by the distance benchmarks
+#define BENCH_LINES				(1 << 14)
+#define BENCH_COLUMNS			100
+#define BENCH_CENTERS			8
+
+// Longest line and number of lines compared by the kernel checks
+#define CHECK_COLUMNS			1000
+#define CHECK_LINES				4096
+
+// Most centers the distance check compares a line with, not a multiple of the four that
+// the vector kernels take at a time
+#define CHECK_CENTERS			11
+
+// Length and number of the lines that make the distance kernels add their 32 bit lanes
+// into the 64 bit sums several times over
+#define CHECK_LONG_COLUMNS		(3 << 20)
+#define CHECK_LONG_LINES		4
+
+// Longest line the distortion measurement reads
+#define MSE_MAX_LINE			(1 << 16)
+
+/**
+ * Parameters of the Markov chain of one synthetic cluster. Each score is pulled from the
+ * one before it toward the cluster's quality profile at that column, plus Gaussian noise,
+ * and once a read drops to the lowest score it tends to stay there
+ */
+struct gen_cluster_t {
+	double start;				// Profile at the first column
+	double end;					// Profile at the last column
+	double pull;				// Weight of the profile against the previous score
+	double noise;				// Standard deviation of the step
+	double drop;				// Chance per column of falling to the lowest score
+	double stay;				// Chance per column of staying there after a drop
+};
+
+/**
+ * Uniform double in [0, 1) from the generator
+ */
+static double well_uniform(struct well_state_t *well) {
+	return well_1024a(well) / 4294967296.0;
+}
+
+/**
+ * Standard normal value from the generator, by the Box-Muller transform
+ */
+static double well_normal(struct well_state_t *well) {
+	double u = 1.0 - well_uniform(well);
+	double v = well_uniform(well);
+
+	return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+/**
+ * Seeds a WELL state from a single number, so that a seed always produces the same data
+ */
+static void seed_well(struct well_state_t *well, uint32_t seed) {
+	uint32_t i;
+	uint64_t x = seed;
+
+	for (i = 0; i < 32; ++i) {
+		// splitmix64
+		x += 0x9e3779b97f4a7c15ULL;
+		well->state[i] = (uint32_t) ((x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL >> 32);
+	}
+	well->n = 0;
+}
+
+/**
+ * Writes lines of length Phred+33 scores to fp, each from one of clusters Markov chains
+ * whose parameters are spread out from each other, so that qvz has clusters to find
+ */
+static void generate(FILE *fp, uint64_t lines, uint32_t length, uint32_t clusters, uint32_t seed) {
+	struct well_state_t well;
+	struct gen_cluster_t *model = (struct gen_cluster_t *) calloc(clusters, sizeof(struct gen_cluster_t));
+	char *line = (char *) malloc(length + 1);
+	struct gen_cluster_t *c;
+	double x, target, spread;
+	uint64_t i;
+	uint32_t k, s;
+	uint8_t dropped;
+
+	seed_well(&well, seed);
+	for (k = 0; k < clusters; ++k) {
+		spread = (clusters > 1) ? ((double) k) / (clusters - 1) : 0.5;
+		model[k].start = 38.0 - 4.0*spread;
+		model[k].end = 34.0 - 20.0*spread;
+		model[k].pull = 0.3 + 0.2*spread;
+		model[k].noise = 2.0 + 3.0*spread;
+		model[k].drop = 0.0005 + 0.004*spread;
+		model[k].stay = 0.9;
+	}
+
+	line[length] = '\n';
+	for (i = 0; i < lines; ++i) {
+		c = &model[well_1024a(&well) % clusters];
+		x = c->start;
+		dropped = 0;
+
+		for (s = 0; s < length; ++s) {
+			if (dropped && well_uniform(&well) < c->stay) {
+				x = GEN_MIN_SCORE;
+			}
+			else if (well_uniform(&well) < c->drop) {
+				x = GEN_MIN_SCORE;
+				dropped = 1;
+			}
+			else {
+				target = c->start + (c->end - c->start) * s / (length > 1 ? length - 1 : 1);
+				x = floor((1.0 - c->pull) * x + c->pull * target + c->noise * well_normal(&well) + 0.5);
+				if (x < GEN_MIN_SCORE)
+					x = GEN_MIN_SCORE;
+				if (x > GEN_MAX_SCORE)
+					x = GEN_MAX_SCORE;
+				dropped = 0;
+			}
+			line[s] = (char) (x + 33);
+		}
+
+		if (fwrite(line, 1, length + 1, fp) != length + 1) {
+			printf("Unable to write output.\n");
+			exit(1);
+		}
+	}
+
+	free(line);
+	free(model);
+}
+
+/**
+ * Prints one benchmark result in the name, value, unit form that bench.sh reads
+ */
+static void report(const char *name, double value, const char *unit) {
+	printf("%s, %.3f, %s\n", name, value, unit);
+	fflush(stdout);
+}
+
+/**
+ * Times update_stats and both entropy coders on skewed symbols from a small alphabet, like
+ * the output states of a quantizer. The coders use the trained stats without updating
+ * them, so each step is timed apart from the model update, and the decoded symbols are
+ * checked against the input
+ */
+static void bench_entropy_coders(struct well_state_t *well) {
+	uint8_t *symbols = (uint8_t *) malloc(BENCH_SYMBOLS);
+	Arithmetic_code a = initialize_arithmetic_encoder(m_arith);
+	Range_code rc = initialize_range_coder();
+	stream_stats_ptr_t stats = alloc_stream_stats(BENCH_STATES);
+	struct os_stream_t *os, *is;
+	struct hrtimer_t timer;
+	uint8_t *data;
+	size_t size;
+	uint32_t i, x, errors = 0;
+
+	// Roughly geometric, so one state dominates the way it does in real data
+	for (i = 0; i < BENCH_SYMBOLS; ++i) {
+		x = 0;
+		while (x < BENCH_STATES - 1 && (well_1024a(well) & 3) == 0)
+			x += 1;
+		symbols[i] = (uint8_t) x;
+	}
+
+	start_timer(&timer);
+	for (i = 0; i < BENCH_SYMBOLS; ++i) {
+		update_stats(stats, symbols[i]);
+	}
+	stop_timer(&timer);
+	report("update_stats", 1e9 * get_timer_interval(&timer) / BENCH_SYMBOLS, "ns/symbol");
+
+	// Arithmetic coder
+	os = alloc_os_stream();
+	start_timer(&timer);
+	for (i = 0; i < BENCH_SYMBOLS; ++i) {
+		arithmetic_encoder_step(a, stats, symbols[i], os);
+	}
+	encoder_last_step(a, os);
+	stop_timer(&timer);
+	report("arithmetic_encoder_step", 1e9 * get_timer_interval(&timer) / BENCH_SYMBOLS, "ns/symbol");
+	data = stream_release_buffer(os, &size);
+	report("arithmetic_bits", 8.0 * size / BENCH_SYMBOLS, "bits/symbol");
+
+	is = alloc_os_stream_reader(data, size);
+	reset_arithmetic_encoder(a);
+	a->t = stream_read_bits(is, a->m);
+	start_timer(&timer);
+	for (i = 0; i < BENCH_SYMBOLS; ++i) {
+		errors += arithmetic_decoder_step(a, stats, is) != symbols[i];
+	}
+	stop_timer(&timer);
+	report("arithmetic_decoder_step", 1e9 * get_timer_interval(&timer) / BENCH_SYMBOLS, "ns/symbol");
+	free_os_stream(is);
+	free(data);
+
+	// Range coder
+	free_os_stream(os);
+	os = alloc_os_stream();
+	start_timer(&timer);
+	for (i = 0; i < BENCH_SYMBOLS; ++i) {
+		range_encoder_step(rc, stats, symbols[i], os);
+	}
+	range_encoder_last_step(rc, os);
+	stop_timer(&timer);
+	report("range_encoder_step", 1e9 * get_timer_interval(&timer) / BENCH_SYMBOLS, "ns/symbol");
+	data = stream_release_buffer(os, &size);
+
+	is = alloc_os_stream_reader(data, size);
+	reset_range_coder(rc);
+	range_decoder_start(rc, is);
+	start_timer(&timer);
+	for (i = 0; i < BENCH_SYMBOLS; ++i) {
+		errors += range_decoder_step(rc, stats, is) != symbols[i];
+	}
+	stop_timer(&timer);
+	report("range_decoder_step", 1e9 * get_timer_interval(&timer) / BENCH_SYMBOLS, "ns/symbol");
+	free_os_stream(is);
+	free(data);
+
+	if (errors) {
+		printf("Entropy coder benchmark decoded %u symbols wrong.\n", errors);
+		exit(1);
+	}
+
+	free_os_stream(os);
+	free_stream_stat(stats);
+	free(rc);
+	free(a);
+	free(symbols);
+}
+
+/**
+ * Times the distance from a line to a cluster center, both one center at a time with
+ * find_distance and all of them at once with the dispatched kernel that clustering uses
+ */
+static void bench_distances(struct well_state_t *well) {
+	symbol_t *data = (symbol_t *) malloc(BENCH_LINES * BENCH_COLUMNS);
+	struct line_t *lines = (struct line_t *) calloc(BENCH_LINES, sizeof(struct line_t));
+	struct cluster_t *clusters = (struct cluster_t *) calloc(BENCH_CENTERS, sizeof(struct cluster_t));
+	distance_kernel_t kernel = select_distance_kernel(0);
+	uint64_t out[BENCH_CENTERS];
+	struct hrtimer_t timer;
+	uint32_t i, k, pass, passes = 64;
+	uint64_t check = 0;
+
+	for (i = 0; i < BENCH_LINES * BENCH_COLUMNS; ++i) {
+		data[i] = (symbol_t) (35 + well_1024a(well) % 40);
+	}
+	for (i = 0; i < BENCH_LINES; ++i) {
+		lines[i].length = BENCH_COLUMNS;
+		lines[i].m_data = &data[i * BENCH_COLUMNS];
+	}
+	for (k = 0; k < BENCH_CENTERS; ++k) {
+		clusters[k].id = (uint8_t) k;
+		clusters[k].mean = (symbol_t *) malloc(BENCH_COLUMNS);
+		memcpy(clusters[k].mean, lines[k].m_data, BENCH_COLUMNS);
+	}
+
+	start_timer(&timer);
+	for (pass = 0; pass < passes; ++pass) {
+		for (i = 0; i < BENCH_LINES; ++i) {
+			for (k = 0; k < BENCH_CENTERS; ++k) {
+				check += find_distance(&lines[i], &clusters[k], NULL);
+			}
+		}
+	}
+	stop_timer(&timer);
+	report("find_distance", 1e9 * get_timer_interval(&timer) / ((double) passes * BENCH_LINES * BENCH_CENTERS), "ns/distance");
+
+	start_timer(&timer);
+	for (pass = 0; pass < passes; ++pass) {
+		for (i = 0; i < BENCH_LINES; ++i) {
+			kernel(lines[i].m_data, clusters, BENCH_CENTERS, BENCH_COLUMNS, out);
+			for (k = 0; k < BENCH_CENTERS; ++k) {
+				check -= out[k];
+			}
+		}
+	}
+	stop_timer(&timer);
+	report("distance_kernel", 1e9 * get_timer_interval(&timer) / ((double) passes * BENCH_LINES * BENCH_CENTERS), "ns/distance");
+
+	if (check != 0) {
+		printf("Distance kernel disagrees with find_distance.\n");
+		exit(1);
+	}
+
+	for (k = 0; k < BENCH_CENTERS; ++k) {
+		free(clusters[k].mean);
+	}
+	free(clusters);
+	free(lines);
+	free(data);
+}
+
+/**
+ * Times the design of single quantizers for every state count and of the quantizer pairs
+ * the ratio mode picks, for a PMF shaped like one column of Illumina scores under MSE
+ */
+static void bench_quantizers(void) {
+	struct alphabet_t *alphabet = alloc_alphabet(ALPHABET_SIZE);
+	struct distortion_t *dist = generate_distortion_matrix(ALPHABET_SIZE, DISTORTION_MSE);
+	struct pmf_t *pmf = alloc_pmf(alphabet);
+	struct quantizer_t *q, *lo, *hi;
+	struct hrtimer_t timer;
+	uint32_t i, states, rounds = 2000, calls = 0;
+	double entropy;
+
+	for (i = GEN_MIN_SCORE; i <= GEN_MAX_SCORE; ++i) {
+		pmf->counts[i] = 1 + (uint32_t) (100000.0 * exp(-(i - 36.0)*(i - 36.0) / 18.0));
+		pmf->total += pmf->counts[i];
+	}
+	pmf->counts[GEN_MIN_SCORE] += 5000;
+	pmf->total += 5000;
+	recalculate_pmf(pmf);
+	entropy = get_entropy(pmf);
+
+	start_timer(&timer);
+	for (i = 0; i < rounds; ++i) {
+		for (states = 1; states <= BENCH_STATES; ++states) {
+			q = generate_quantizer(pmf, dist, states);
+			free_quantizer(q);
+			calls += 1;
+		}
+	}
+	stop_timer(&timer);
+	report("generate_quantizer", 1e6 * get_timer_interval(&timer) / calls, "us/call");
+
+	start_timer(&timer);
+	for (i = 0; i < rounds; ++i) {
+		optimize_for_entropy(pmf, dist, 0.5 * entropy, &lo, &hi);
+		free_quantizer(lo);
+		free_quantizer(hi);
+	}
+	stop_timer(&timer);
+	report("optimize_for_entropy", 1e6 * get_timer_interval(&timer) / rounds, "us/call");
+
+	free_pmf(pmf);
+	free_distortion_matrix(dist);
+	free_alphabet(alphabet);
+}
+
+/**
+ * Prints the mean squared error between two quality files as MSE: value, with the error of
+ * each line averaged over its columns before averaging over lines, like mse_check.c but for
+ * any number of lines of any length
+ */
+static void measure_mse(const char *original, const char *reconstructed) {
+	FILE *f1 = fopen(original, "r");
+	FILE *f2 = fopen(reconstructed, "r");
+	char *line1 = (char *) malloc(MSE_MAX_LINE);
+	char *line2 = (char *) malloc(MSE_MAX_LINE);
+	uint64_t lines = 0;
+	uint32_t i, columns;
+	int32_t diff;
+	double error, distortion = 0.0;
+
+	if (!f1 || !f2) {
+		perror("Unable to open quality file");
+		exit(1);
+	}
+
+	while (fgets(line1, MSE_MAX_LINE, f1)) {
+		if (!fgets(line2, MSE_MAX_LINE, f2)) {
+			printf("%s has fewer lines than %s.\n", reconstructed, original);
+			exit(1);
+		}
+
+		columns = (uint32_t) strcspn(line1, "\r\n");
+		if (strcspn(line2, "\r\n") != columns) {
+			printf("Line %llu has different lengths in the two files.\n", (unsigned long long) lines);
+			exit(1);
+		}
+
+		error = 0.0;
+		for (i = 0; i < columns; ++i) {
+			diff = (int32_t) line1[i] - (int32_t) line2[i];
+			error += diff*diff;
+		}
+		if (columns > 0)
+			distortion += error / columns;
+		lines += 1;
+	}
+
+	printf("MSE: %f\n", lines ? distortion / lines : 0.0);
+
+	free(line1);
+	free(line2);
+	fclose(f1);
+	fclose(f2);
+}
+
+/**
+ * Checks every dither kernel the processor supports against the scalar one, value by value,
+ * for every line length up to CHECK_COLUMNS
+ */
+static void check_dither_kernels(struct well_state_t *well) {
+	uint8_t *expected = (uint8_t *) malloc(CHECK_COLUMNS + DITHER_BLOCK);
+	uint8_t *actual = (uint8_t *) malloc(CHECK_COLUMNS + DITHER_BLOCK);
+	dither_kernel_t reference = list_dither_kernels(0, NULL), kernel;
+	struct dither_key_t key;
+	const char *name;
+	uint32_t i, k, line, columns;
+
+	for (k = 1; (kernel = list_dither_kernels(k, &name)) != NULL; ++k) {
+		for (i = 0; i < CHECK_LINES; ++i) {
+			dither_seed_segment(&key, well, well_1024a(well));
+			line = (i < CHECK_COLUMNS) ? i : well_1024a(well);
+			columns = (i <= CHECK_COLUMNS) ? i : well_1024a(well) % (CHECK_COLUMNS + 1);
+			reference(&key, line, columns, expected);
+			kernel(&key, line, columns, actual);
+			if (memcmp(expected, actual, columns) != 0) {
+				printf("%s dither kernel disagrees with the scalar kernel on a line of %u columns.\n", name, columns);
+				exit(1);
+			}
+		}
+		printf("%s dither kernel matches the scalar kernel.\n", name);
+	}
+
+	free(expected);
+	free(actual);
+}
+
+/**
+ * Checks every newline kernel the processor supports against the scalar one, offset by
+ * offset, on chunks of every length up to CHECK_COLUMNS and every alignment, with newlines
+ * from rare to on every byte
+ */
+static void check_newline_kernels(struct well_state_t *well) {
+	char *data = (char *) malloc(CHECK_COLUMNS + 32);
+	uint32_t *expected = (uint32_t *) malloc((CHECK_COLUMNS + 32) * sizeof(uint32_t));
+	uint32_t *actual = (uint32_t *) malloc((CHECK_COLUMNS + 32) * sizeof(uint32_t));
+	newline_kernel_t reference = list_newline_kernels(0, NULL), kernel;
+	const char *name;
+	uint32_t i, j, k, len, start, every, n;
+
+	for (k = 1; (kernel = list_newline_kernels(k, &name)) != NULL; ++k) {
+		for (i = 0; i < CHECK_LINES; ++i) {
+			len = (i <= CHECK_COLUMNS) ? i : well_1024a(well) % (CHECK_COLUMNS + 1);
+			start = i % 32;
+			every = 1 + well_1024a(well) % 128;
+			for (j = 0; j < len; ++j) {
+				data[start + j] = (well_1024a(well) % every == 0) ? '\n' : (char) (33 + well_1024a(well) % 94);
+			}
+
+			n = reference(data + start, len, expected);
+			if (kernel(data + start, len, actual) != n || memcmp(expected, actual, n * sizeof(uint32_t)) != 0) {
+				printf("%s newline kernel disagrees with the scalar kernel on a chunk of %u bytes.\n", name, len);
+				exit(1);
+			}
+		}
+		printf("%s newline kernel matches the scalar kernel.\n", name);
+	}
+
+	free(data);
+	free(expected);
+	free(actual);
+}
+
+/**
+ * Checks every distance kernel the processor supports against the scalar one, center by
+ * center. Lines of every length up to CHECK_COLUMNS at every alignment are compared with
+ * up to CHECK_CENTERS random centers, then a few lines of about CHECK_LONG_COLUMNS scores
+ * with centers at the far end of the score range, so they come as close to overflowing
+ * the lanes as quality scores can
+ */
+static void check_distance_kernels(struct well_state_t *well) {
+	symbol_t *data = (symbol_t *) malloc(CHECK_LONG_COLUMNS + 32);
+	struct cluster_t clusters[CHECK_CENTERS];
+	uint64_t expected[CHECK_CENTERS], actual[CHECK_CENTERS];
+	distance_kernel_t reference = list_distance_kernels(0, NULL), kernel;
+	const char *name;
+	uint32_t i, j, k, c, columns, start, centers;
+
+	for (c = 0; c < CHECK_CENTERS; ++c) {
+		clusters[c].mean = (symbol_t *) malloc(CHECK_LONG_COLUMNS);
+	}
+
+	for (k = 1; (kernel = list_distance_kernels(k, &name)) != NULL; ++k) {
+		for (i = 0; i < CHECK_LINES + CHECK_LONG_LINES; ++i) {
+			start = i % 32;
+			centers = 1 + i % CHECK_CENTERS;
+			if (i < CHECK_LINES) {
+				columns = (i <= CHECK_COLUMNS) ? i : well_1024a(well) % (CHECK_COLUMNS + 1);
+				for (j = 0; j < columns; ++j) {
+					data[start + j] = (symbol_t) (well_1024a(well) % 128);
+				}
+				for (c = 0; c < centers; ++c) {
+					for (j = 0; j < columns; ++j) {
+						clusters[c].mean[j] = (symbol_t) (well_1024a(well) % 128);
+					}
+				}
+			}
+			else {
+				columns = CHECK_LONG_COLUMNS - well_1024a(well) % 64;
+				for (j = 0; j < columns; ++j) {
+					data[start + j] = (well_1024a(well) & 1) ? 127 : 0;
+				}
+				for (c = 0; c < centers; ++c) {
+					for (j = 0; j < columns; ++j) {
+						clusters[c].mean[j] = (c % 2 == 0) ? 127 - data[start + j] : (symbol_t) (well_1024a(well) % 128);
+					}
+				}
+			}
+
+			reference(data + start, clusters, centers, columns, expected);
+			kernel(data + start, clusters, centers, columns, actual);
+			if (memcmp(expected, actual, centers * sizeof(uint64_t)) != 0) {
+				printf("%s distance kernel disagrees with the scalar kernel on a line of %u columns and %u centers.\n", name, columns, centers);
+				exit(1);
+			}
+		}
+		printf("%s distance kernel matches the scalar kernel.\n", name);
+	}
+
+	for (c = 0; c < CHECK_CENTERS; ++c) {
+		free(clusters[c].mean);
+	}
+	free(data);
+}
+
+static void usage(char *name) {
+	printf("Usage: %s generate [lines] [length] [clusters] [seed] > [file]\n", name);
+	printf("       %s micro\n", name);
+	printf("       %s check\n", name);
+	printf("       %s mse [original] [reconstructed]\n", name);
+	printf("generate writes synthetic quality lines from a first order Markov model with [clusters] kinds of reads,\n");
+	printf("micro prints the time of each inner routine as name, value, unit, check compares every vector kernel\n");
+	printf("with the scalar one and fails if any disagree, and mse prints the MSE between two files.\n");
+}
+
+int main(int argc, char **argv) {
+	struct well_state_t well;
+
+	if (argc >= 5 && strcmp(argv[1], "generate") == 0) {
+		if (atoi(argv[3]) <= 0 || atoi(argv[4]) <= 0) {
+			printf("Length and clusters must be positive.\n");
+			exit(1);
+		}
+		generate(stdout, strtoull(argv[2], NULL, 10), (uint32_t) atoi(argv[3]), (uint32_t) atoi(argv[4]), argc > 5 ? (uint32_t) strtoul(argv[5], NULL, 10) : 1);
+	}
+	else if (argc == 2 && strcmp(argv[1], "micro") == 0) {
+		seed_well(&well, 1);
+		bench_entropy_coders(&well);
+		bench_distances(&well);
+		bench_quantizers();
+	}
+	else if (argc == 2 && strcmp(argv[1], "check") == 0) {
+		seed_well(&well, 1);
+		check_dither_kernels(&well);
+		check_newline_kernels(&well);
+		check_distance_kernels(&well);
+	}
+	else if (argc == 4 && strcmp(argv[1], "mse") == 0) {
+		measure_mse(argv[2], argv[3]);
+	}
+	else {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	return 0;
+}
@@ -1,10 +1,10 @@
 /**
  * k-means clustering implementation in C
  * 
- * The approach here is parallelizable and should be migrated to a block-based implementation
- * using opencl in order to run faster, or possibly just multithreaded, but I have left it
- * in plain C for the time being to get it working quickly. Note that the means established
- * are discrete values, rather than continuous.
+ * Each iteration is a single pass over the lines that both assigns clusters and accumulates
+ * the sums for the new centers. The pass is split into chunks of lines that run on worker
+ * threads with thread-private accumulators, which are reduced once all chunks are done.
+ * Note that the means established are discrete values, rather than continuous.
  */
 
 #include "util.h"
@@ -17,6 +17,8 @@
 #include "pmf.h"
 #include "codebook.h"
 #include "cluster.h"
+#include "thread_pool.h"
+#include "metrics.h"
 
 /**
  * Allocate the memory used for the clusters based on the number wanted and column config
@@ -28,7 +30,7 @@ struct cluster_list_t *alloc_cluster_list(struct quality_file_t *info) {
 	// Allocate array of cluster structures
 	rtn->count = info->cluster_count;
 	rtn->clusters = (struct cluster_t *) calloc(info->cluster_count, sizeof(struct cluster_t));
-	rtn->distances = (double *) calloc(info->cluster_count, sizeof(double));
+	rtn->distance = select_distance_kernel(0);
 
 	// Fill in each cluster
 	for (j = 0; j < info->cluster_count; ++j) {
@@ -36,6 +38,8 @@ struct cluster_list_t *alloc_cluster_list(struct quality_file_t *info) {
 		rtn->clusters[j].count = 0;
 		rtn->clusters[j].mean = (symbol_t *) calloc(info->columns, sizeof(symbol_t));
 		rtn->clusters[j].accumulator = (uint64_t *) calloc(info->columns, sizeof(uint64_t));
+		if (info->variable_length)
+			rtn->clusters[j].ends = (uint64_t *) calloc(info->columns+1, sizeof(uint64_t));
 		rtn->clusters[j].training_stats = alloc_conditional_pmf_list(info->alphabet, info->columns);
 	}
 
@@ -51,66 +55,145 @@ void free_cluster_list(struct cluster_list_t *clusters) {
 	for (j = 0; j < clusters->count; ++j) {
 		free(clusters->clusters[j].mean);
 		free(clusters->clusters[j].accumulator);
+		free(clusters->clusters[j].ends);
+		free(clusters->clusters[j].priors);
 		free_conditional_pmf_list(clusters->clusters[j].training_stats);
 	}
-	free(clusters->distances);
 	free(clusters->clusters);
 	free(clusters);
 }
 
 /**
- * Calculates cluster assignments for the block of lines given, and return
- * status indicating that at least one line changed clusters
+ * Allocate one set of partial sums per worker thread
  */
-uint8_t cluster_lines(struct line_block_t *block, struct quality_file_t *info) {
+struct cluster_accumulator_t *alloc_cluster_accumulators(struct quality_file_t *info, uint32_t count) {
+	uint32_t i;
+	struct cluster_accumulator_t *rtn = (struct cluster_accumulator_t *) calloc(count, sizeof(struct cluster_accumulator_t));
+
+	for (i = 0; i < count; ++i) {
+		rtn[i].count = (uint64_t *) calloc(info->cluster_count, sizeof(uint64_t));
+		rtn[i].sum = (uint64_t *) calloc(info->cluster_count * info->columns, sizeof(uint64_t));
+		rtn[i].distances = (uint64_t *) calloc(info->cluster_count, sizeof(uint64_t));
+		if (info->variable_length)
+			rtn[i].ends = (uint64_t *) calloc(info->cluster_count * (info->columns+1), sizeof(uint64_t));
+	}
+
+	return rtn;
+}
+
+/**
+ * Deallocate the per thread partial sums
+ */
+void free_cluster_accumulators(struct cluster_accumulator_t *acc, uint32_t count) {
+	uint32_t i;
+
+	for (i = 0; i < count; ++i) {
+		free(acc[i].count);
+		free(acc[i].sum);
+		free(acc[i].distances);
+		free(acc[i].ends);
+	}
+	free(acc);
+}
+
+/**
+ * Calculates cluster assignments for a range of lines within the given block, accumulating
+ * each line into its new cluster's partial sums, and return status indicating that at
+ * least one line changed clusters
+ */
+uint8_t cluster_lines(struct line_block_t *block, uint32_t first, uint32_t count, struct quality_file_t *info, struct cluster_accumulator_t *acc) {
 	uint32_t i;
 	uint8_t changed = 0;
 
-	for (i = 0; i < block->count; ++i) {
-		changed |= do_cluster_assignment(&block->lines[i], info);
+	for (i = first; i < first + count; ++i) {
+		changed |= do_cluster_assignment(&block->lines[i], block->bounds ? &block->bounds[i] : NULL, info, acc);
 	}
 
+	acc->changed |= changed;
 	return changed;
 }
 
 /**
- * Updates the cluster means based on their assigned lines. Also clears the line count for
- * the next iteration.
+ * Sums the per thread partial results into the cluster counts and accumulators, and
+ * clears the partial results for the next iteration. Incremental results are applied on
+ * top of the previous totals, relying on unsigned wraparound for the subtractions
  */
-double recalculate_means(struct quality_file_t *info) {
-	uint32_t block, line_idx;
-	uint32_t i, j;
-	struct line_t *line;
+void reduce_cluster_accumulators(struct quality_file_t *info, struct cluster_accumulator_t *acc, uint32_t count) {
+	uint32_t t, i, j;
 	struct cluster_t *cluster;
-	uint8_t new_mean;
-	double dist, moved;
-	double move_max = 0.0;
 
-	// Reset cluster accumulators for new center calculation
 	for (i = 0; i < info->cluster_count; ++i) {
-		memset(info->clusters->clusters[i].accumulator, 0, info->columns*sizeof(uint64_t));
-	}
+		cluster = &info->clusters->clusters[i];
+		if (!acc[0].incremental) {
+			cluster->count = 0;
+			memset(cluster->accumulator, 0, info->columns*sizeof(uint64_t));
+			if (cluster->ends)
+				memset(cluster->ends, 0, (info->columns+1)*sizeof(uint64_t));
+		}
 
-	// Iterate linewise to accumulate into cluster centers
-	for (block = 0; block < info->block_count; ++block) {
-		for (line_idx = 0; line_idx < info->blocks[block].count; ++line_idx) {
-			line = &info->blocks[block].lines[line_idx];
-			cluster = &info->clusters->clusters[line->cluster];
-			for (i = 0; i < info->columns; ++i) {
-				cluster->accumulator[i] += line->m_data[i];
+		for (t = 0; t < count; ++t) {
+			cluster->count += acc[t].count[i];
+			for (j = 0; j < info->columns; ++j) {
+				cluster->accumulator[j] += acc[t].sum[i*info->columns + j];
+			}
+			if (cluster->ends) {
+				for (j = 0; j <= info->columns; ++j) {
+					cluster->ends[j] += acc[t].ends[i*(info->columns+1) + j];
+				}
 			}
 		}
 	}
 
+	for (t = 0; t < count; ++t) {
+		memset(acc[t].count, 0, info->cluster_count*sizeof(uint64_t));
+		memset(acc[t].sum, 0, info->cluster_count*info->columns*sizeof(uint64_t));
+		if (acc[t].ends)
+			memset(acc[t].ends, 0, info->cluster_count*(info->columns+1)*sizeof(uint64_t));
+		acc[t].changed = 0;
+	}
+}
+
+/**
+ * Updates the cluster means based on the accumulators filled in during assignment. Clusters
+ * that ended up empty keep their previous mean. When lines have different lengths, each
+ * column is averaged over the lines long enough to reach it, and columns that no line in
+ * the cluster reaches keep their previous mean
+ * @return The largest squared distance moved by any mean
+ */
+double recalculate_means(struct quality_file_t *info) {
+	uint32_t i, j;
+	uint64_t covered;
+	struct cluster_t *cluster;
+	uint8_t new_mean;
+	double dist, moved;
+	double move_max = 0.0;
+
+	info->clusters->max_moved = 0.0;
+
 	// Now find new cluster centers and compute motion
 	for (i = 0; i < info->cluster_count; ++i) {
 		cluster = &info->clusters->clusters[i];
 		dist = 0.0;
 		moved = 0.0;
+		cluster->moved = 0.0;
+
+		if (cluster->count == 0) {
+			if (info->opts->verbose)
+				printf("Cluster %d is empty.\n", i);
+			continue;
+		}
 
+		covered = cluster->count;
 		for (j = 0; j < info->columns; ++j) {
+			// Lines of length j stop short of this column
+			if (cluster->ends) {
+				covered -= cluster->ends[j];
+				if (covered == 0)
+					break;
+			}
+
 			// Integer division to find the mean, guaranteed to be less than the alphabet size
-			new_mean = (uint8_t) (cluster->accumulator[j] / cluster->count);
+			new_mean = (uint8_t) (cluster->accumulator[j] / covered);
 
 			// Also figure out how far we've moved
 			dist = new_mean - cluster->mean[j];
@@ -120,6 +203,10 @@ double recalculate_means(struct quality_file_t *info) {
 			cluster->mean[j] = new_mean;
 		}
 
+		cluster->moved = sqrt(moved);
+		if (cluster->moved > info->clusters->max_moved)
+			info->clusters->max_moved = cluster->moved;
+
 		if (moved > move_max)
 			move_max = moved;
 
@@ -127,32 +214,119 @@ double recalculate_means(struct quality_file_t *info) {
 			printf("Cluster %d moved %f.\n", i, moved);
 	}
 
+	update_cluster_separation(info);
 	return move_max;
 }
 
 /**
- * Compare each line to each cluster to find distances
+ * Finds half the distance from each mean to its nearest neighbor. A line closer to its
+ * own center than this can't be closer to any other center
  */
-uint8_t do_cluster_assignment(struct line_t *line, struct quality_file_t *info) {
-	uint8_t i;
+void update_cluster_separation(struct quality_file_t *info) {
+	uint32_t i, j;
+	uint64_t d;
+	struct cluster_t *clusters = info->clusters->clusters;
+
+	for (i = 0; i < info->cluster_count; ++i) {
+		clusters[i].separation = FLT_MAX;
+	}
 
 	for (i = 0; i < info->cluster_count; ++i) {
-		find_distance(line, &info->clusters->clusters[i], info);
+		for (j = i+1; j < info->cluster_count; ++j) {
+			info->clusters->distance(clusters[i].mean, &clusters[j], 1, info->columns, &d);
+			if (0.5*sqrt(d) < clusters[i].separation)
+				clusters[i].separation = 0.5*sqrt(d);
+			if (0.5*sqrt(d) < clusters[j].separation)
+				clusters[j].separation = 0.5*sqrt(d);
+		}
+	}
+}
+
+/**
+ * Compare each line to each cluster to find distances, then assign the line and add it
+ * to the partial sums for its cluster.
+ *
+ * When bounds are available on an incremental pass, the bounds are first loosened by how
+ * far the centers moved (Hamerly's algorithm). If the line is still provably closest to its
+ * current center the distance computations are skipped, and since the line didn't move its
+ * contribution to the sums doesn't change either. Lines that do change clusters move their
+ * contribution from the old cluster's sums to the new one.
+ *
+ * Lines shorter than the file are compared with the centers over their own columns only.
+ * The bounds still hold in that subspace, except for the separation between centers, which
+ * is measured over every column and so is only used for full length lines
+ */
+uint8_t do_cluster_assignment(struct line_t *line, struct kmeans_bounds_t *bound, struct quality_file_t *info, struct cluster_accumulator_t *acc) {
+	uint8_t changed;
+	uint8_t prev = line->cluster;
+	uint32_t j;
+	uint64_t d, best, second;
+	uint64_t *sum;
+	struct cluster_t *clusters = info->clusters->clusters;
+	float limit;
+
+	if (bound && acc->incremental) {
+		bound->upper += (float) clusters[prev].moved;
+		bound->lower -= (float) info->clusters->max_moved;
+		limit = bound->lower;
+		if (line->length == info->columns && clusters[prev].separation > limit)
+			limit = (float) clusters[prev].separation;
+		if (bound->upper <= limit)
+			return 0;
+
+		// Tighten the upper bound with the exact distance and try again
+		info->clusters->distance(line->m_data, &clusters[prev], 1, line->length, &d);
+		bound->upper = sqrtf((float) d);
+		if (bound->upper <= limit)
+			return 0;
+	}
+
+	info->clusters->distance(line->m_data, clusters, info->cluster_count, line->length, acc->distances);
+	changed = assign_cluster(line, info, acc->distances);
+
+	if (bound) {
+		best = acc->distances[line->cluster];
+		second = UINT64_MAX;
+		for (j = 0; j < info->cluster_count; ++j) {
+			if (j != line->cluster && acc->distances[j] < second)
+				second = acc->distances[j];
+		}
+		bound->upper = sqrtf((float) best);
+		bound->lower = (second == UINT64_MAX) ? FLT_MAX : sqrtf((float) second);
+	}
+
+	if (acc->incremental) {
+		if (!changed)
+			return 0;
+
+		acc->count[prev] -= 1;
+		sum = &acc->sum[prev * info->columns];
+		for (j = 0; j < line->length; ++j) {
+			sum[j] -= line->m_data[j];
+		}
+		if (acc->ends)
+			acc->ends[prev * (info->columns+1) + line->length] -= 1;
 	}
 
-	return assign_cluster(line, info);
+	acc->count[line->cluster] += 1;
+	sum = &acc->sum[line->cluster * info->columns];
+	for (j = 0; j < line->length; ++j) {
+		sum[j] += line->m_data[j];
+	}
+	if (acc->ends)
+		acc->ends[line->cluster * (info->columns+1) + line->length] += 1;
+
+	return changed;
 }
 
 /**
  * Assigns a cluster based on the one with the lowest distance
  */
-uint8_t assign_cluster(struct line_t *line, struct quality_file_t *info) {
+uint8_t assign_cluster(struct line_t *line, struct quality_file_t *info, const uint64_t *distances) {
 	uint8_t id = 0;
 	uint8_t prev_id = line->cluster;
 	uint8_t i;
-	struct cluster_t *cluster;
-	double *distances = info->clusters->distances;
-	double d = distances[0];
+	uint64_t d = distances[0];
 
 	// Find the cluster with minimum distance
 	for (i = 1; i < info->cluster_count; ++i) {
@@ -164,73 +338,188 @@ uint8_t assign_cluster(struct line_t *line, struct quality_file_t *info) {
 
 	// Assign to that cluster
 	line->cluster = id;
-	cluster = &info->clusters->clusters[id];
-	cluster->count += 1;
 
 	return (prev_id == id) ? 0 : 1;
 }
 
 /**
- * Take a line and cluster information and calculates the distance, storing it in the line information vector
+ * Take a line and cluster information and calculates the squared distance between them. This
+ * is the reference for the kernels selected by select_distance_kernel()
  */
-void find_distance(struct line_t *line, struct cluster_t *cluster, struct quality_file_t *info) {
-	double d = 0.0;
+uint64_t find_distance(struct line_t *line, struct cluster_t *cluster, struct quality_file_t *info) {
+	uint64_t d = 0;
 	uint32_t i;
-	uint32_t data, mean;
+	int32_t diff;
 
-	for (i = 0; i < info->columns; ++i) {
-		data = line->m_data[i];
-		mean = cluster->mean[i];
-		d += (data - mean) * (data - mean);
+	for (i = 0; i < line->length; ++i) {
+		diff = (int32_t) line->m_data[i] - (int32_t) cluster->mean[i];
+		d += diff*diff;
 	}
-	info->clusters->distances[cluster->id] = d;
+	return d;
+}
+
+/**
+ * Looks up a line by its position across a list of blocks
+ */
+static struct line_t *get_block_line(struct line_block_t *blocks, uint64_t idx) {
+	return &blocks[idx / MAX_LINES_PER_BLOCK].lines[idx % MAX_LINES_PER_BLOCK];
 }
 
 /**
- * Initialize the cluster means based on the data given, using random selection
+ * Uniform random integer in [0, n) drawn from the given generator
  */
-void initialize_kmeans_clustering(struct quality_file_t *info) {
+static uint64_t random_index(struct well_state_t *well, uint64_t n) {
+	uint64_t r = ((uint64_t) well_1024a(well) << 32) | well_1024a(well);
+	return r % n;
+}
+
+/**
+ * Initialize the cluster means with k-means++ seeding. The first center is a random line
+ * and each next center is drawn with probability proportional to its squared distance from
+ * the nearest center chosen so far. Candidates are an evenly spaced subset of at most
+ * KMEANS_SEED_LINES lines from the given blocks. A short line chosen as a center is padded
+ * out to the full width by repeating its last score. The draws come from a generator of
+ * this call's own with a fixed seed, so a file always gets the same centers, whatever else
+ * is being clustered at the same time
+ */
+void initialize_kmeans_clustering(struct quality_file_t *info, struct line_block_t *blocks, uint32_t block_count) {
 	uint8_t j;
-	uint32_t block_id;
-	uint32_t line_id;
+	uint32_t i, n;
+	uint64_t d, lines = 0;
+	uint64_t pick;
+	double total, target;
+	struct line_t **candidates;
+	symbol_t fill;
+	uint64_t *nearest;
 	struct cluster_list_t *clusters = info->clusters;
+	struct well_state_t well, seed;
+
+	// Chosen again only to report it, alloc_cluster_list has already picked it
+	clusters->distance = select_distance_kernel(info->opts->verbose);
+
+	memset(&seed, 0, sizeof(struct well_state_t));
+	well_seed_segment(&well, &seed, 0);
+
+	for (i = 0; i < block_count; ++i) {
+		lines += blocks[i].count;
+	}
+	n = (lines < KMEANS_SEED_LINES) ? (uint32_t) lines : KMEANS_SEED_LINES;
 
+	candidates = (struct line_t **) calloc(n, sizeof(struct line_t *));
+	nearest = (uint64_t *) calloc(n, sizeof(uint64_t));
+	for (i = 0; i < n; ++i) {
+		candidates[i] = get_block_line(blocks, (i * lines) / n);
+		nearest[i] = UINT64_MAX;
+	}
+
+	pick = random_index(&well, n);
 	for (j = 0; j < info->cluster_count; ++j) {
-		block_id = rand() % info->block_count;
-		line_id = rand() % info->blocks[block_id].count;
-		memcpy(clusters->clusters[j].mean, info->blocks[block_id].lines[line_id].m_data, info->columns*sizeof(uint8_t));
+		memcpy(clusters->clusters[j].mean, candidates[pick]->m_data, candidates[pick]->length*sizeof(uint8_t));
+		fill = candidates[pick]->length ? candidates[pick]->m_data[candidates[pick]->length-1] : 33;
+		memset(clusters->clusters[j].mean + candidates[pick]->length, fill, (info->columns - candidates[pick]->length)*sizeof(uint8_t));
 		if (info->opts->verbose) {
-			printf("Chose block %d, line %d.\n", block_id, line_id);
+			printf("Chose line %llu.\n", (unsigned long long) ((pick * lines) / n));
+		}
+
+		// Update the distance of every candidate to its nearest center
+		total = 0.0;
+		for (i = 0; i < n; ++i) {
+			clusters->distance(candidates[i]->m_data, &clusters->clusters[j], 1, candidates[i]->length, &d);
+			if (d < nearest[i])
+				nearest[i] = d;
+			total += nearest[i];
+		}
+
+		// Draw the next center, falling back to a uniform pick if every candidate is already a center
+		if (total == 0.0) {
+			pick = random_index(&well, n);
+			continue;
+		}
+		target = total * (random_index(&well, 1 << 30) / (double) (1 << 30));
+		for (pick = 0; pick < n-1; ++pick) {
+			target -= nearest[pick];
+			if (target < 0)
+				break;
 		}
 	}
+
+	update_cluster_separation(info);
+
+	free(candidates);
+	free(nearest);
 }
 
+struct cluster_job_t {
+	struct quality_file_t *info;
+	struct line_block_t *blocks;
+	struct cluster_accumulator_t *acc;
+};
+
 /**
- * Do k-means clustering over the set of blocks given to produce a set of clusters that
- * fills the cluster list given
+ * Clustering task covering one chunk of a block. The last block may have fewer chunks
+ * than the others, in which case the extra tasks do nothing
+ */
+static void cluster_chunk_task(void *arg, uint32_t task, uint32_t thread) {
+	struct cluster_job_t *job = (struct cluster_job_t *) arg;
+	struct line_block_t *block = &job->blocks[task / (MAX_LINES_PER_BLOCK / CLUSTER_CHUNK_LINES)];
+	uint32_t first = (task % (MAX_LINES_PER_BLOCK / CLUSTER_CHUNK_LINES)) * CLUSTER_CHUNK_LINES;
+	uint32_t count = CLUSTER_CHUNK_LINES;
+
+	if (first >= block->count)
+		return;
+	if (first + count > block->count)
+		count = block->count - first;
+	cluster_lines(block, first, count, job->info, &job->acc[thread]);
+}
+
+/**
+ * Runs one assignment pass over the blocks on the worker threads and reduces the results
  */
-void do_kmeans_clustering(struct quality_file_t *info) {
+static void run_kmeans_pass(struct quality_file_t *info, struct cluster_job_t *job, uint32_t block_count, uint8_t incremental) {
+	uint32_t threads = info->opts->threads;
+	uint32_t t;
+
+	for (t = 0; t < threads; ++t) {
+		job->acc[t].incremental = incremental;
+	}
+
+	run_parallel(threads, block_count * (MAX_LINES_PER_BLOCK / CLUSTER_CHUNK_LINES), cluster_chunk_task, job);
+	reduce_cluster_accumulators(info, job->acc, threads);
+}
+
+/**
+ * Iterate k-means over the given blocks, starting from the current means, until the centers
+ * stop moving. The first pass computes all distances and full sums, and later passes use
+ * distance bounds to skip lines and only apply changes in assignment to the sums
+ * @return Number of iterations run
+ */
+uint32_t run_kmeans_iterations(struct quality_file_t *info, struct line_block_t *blocks, uint32_t block_count) {
 	uint32_t iter_count = 0;
 	uint32_t j;
 	uint8_t loop = 1;
 	double moved;
-	struct cluster_list_t *clusters = info->clusters;
+	struct cluster_job_t job;
+	struct stage_timer_t iteration;
 
-	initialize_kmeans_clustering(info);
+	job.info = info;
+	job.blocks = blocks;
+	job.acc = alloc_cluster_accumulators(info, info->opts->threads);
 
-	while (iter_count < MAX_KMEANS_ITERATIONS && loop) {
-		for (j = 0; j < clusters->count; ++j) {
-			clusters->clusters[j].count = 0;
-		}
+	for (j = 0; j < block_count; ++j) {
+		blocks[j].bounds = (struct kmeans_bounds_t *) calloc(blocks[j].count, sizeof(struct kmeans_bounds_t));
+	}
 
-		for (j = 0; j < info->block_count; ++j) {
-			cluster_lines(&info->blocks[j], info);
-		}
+	while (iter_count < MAX_KMEANS_ITERATIONS && loop) {
+		if (info->opts->metrics)
+			start_stage(&iteration);
+		run_kmeans_pass(info, &job, block_count, iter_count > 0);
 
 		loop = 0;
 		moved = recalculate_means(info);
 		if (moved > info->opts->cluster_threshold)
 			loop = 1;
+		if (info->opts->metrics)
+			add_kmeans_iteration(info->opts->metrics, &iteration, moved);
 
 		iter_count += 1;
 		if (info->opts->verbose) {
@@ -238,7 +527,66 @@ void do_kmeans_clustering(struct quality_file_t *info) {
 		}
 	}
 
+	for (j = 0; j < block_count; ++j) {
+		free(blocks[j].bounds);
+		blocks[j].bounds = NULL;
+	}
+	free_cluster_accumulators(job.acc, info->opts->threads);
+
+	return iter_count;
+}
+
+/**
+ * Assigns every line of the given blocks to its nearest center without moving the centers,
+ * for lines that arrive after the clustering was fit
+ */
+void assign_clusters(struct quality_file_t *info, struct line_block_t *blocks, uint32_t block_count) {
+	struct cluster_job_t job;
+
+	job.info = info;
+	job.blocks = blocks;
+	job.acc = alloc_cluster_accumulators(info, info->opts->threads);
+	run_kmeans_pass(info, &job, block_count, 0);
+	free_cluster_accumulators(job.acc, info->opts->threads);
+}
+
+/**
+ * Do k-means clustering over the set of blocks given to produce a set of clusters that
+ * fills the cluster list given. If a sample size is set, the centers are fit on an evenly
+ * spaced sample of the lines and every line is then assigned in a single final pass
+ * @return 1, or 0 if the sample can't be allocated
+ */
+uint8_t do_kmeans_clustering(struct quality_file_t *info) {
+	uint32_t iter_count;
+	uint64_t i;
+	struct quality_file_t sample;
+
+	if (info->opts->kmeans_sample == 0 || info->opts->kmeans_sample >= info->lines) {
+		initialize_kmeans_clustering(info, info->blocks, info->block_count);
+		iter_count = run_kmeans_iterations(info, info->blocks, info->block_count);
+	}
+	else {
+		// Sample lines share the file's data, only the line records are copied
+		sample = *info;
+		sample.lines = info->opts->kmeans_sample;
+		if (alloc_blocks(&sample) != LF_ERROR_NONE) {
+			printf("Unable to allocate clustering sample.\n");
+			return 0;
+		}
+		for (i = 0; i < sample.lines; ++i) {
+			*get_block_line(sample.blocks, i) = *get_block_line(info->blocks, (i * info->lines) / sample.lines);
+		}
+
+		initialize_kmeans_clustering(info, sample.blocks, sample.block_count);
+		iter_count = run_kmeans_iterations(info, sample.blocks, sample.block_count);
+		free_blocks(&sample);
+
+		// Final assignment of the whole file against the fitted centers
+		assign_clusters(info, info->blocks, info->block_count);
+	}
+
 	if (info->opts->verbose) {
 		printf("\nTotal number of iterations: %d.\n", iter_count);
 	}
+	return 1;
 }
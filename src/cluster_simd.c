@@ -0,0 +1,300 @@
+/**
+ * Distance kernels for k-means assignment. Each kernel computes the squared Euclidean
+ * distance from one line to every cluster center with integer arithmetic, and the
+ * fastest kernel supported by the processor is chosen at runtime.
+ *
+ * The vector kernels take the absolute difference of unsigned bytes, then square and
+ * pairwise add it into 16 bit lanes with a u8 x s8 multiply-add. Quality characters are
+ * below 128, so each pair is at most 2*127^2 and can't overflow, and the 16 bit pairs
+ * are widened into 32 bit accumulators. Those are added into 64 bit sums at least every
+ * DISTANCE_LANE_STEPS steps, before they can overflow, so lines of any length are exact.
+ * Centers are processed four at a time so that each chunk of the line is loaded once per
+ * group of four.
+ */
+
+#include "util.h"
+
+#include <stdio.h>
+
+#include "cluster.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define CLUSTER_SIMD_X86
+#elif defined(__aarch64__)
+	#include <arm_neon.h>
+	#define CLUSTER_SIMD_NEON
+#endif
+
+// Steps a 32 bit lane can take before it has to be added into the 64 bit sums. Every step
+// adds at most 4*127^2 to a lane
+#define DISTANCE_LANE_STEPS		32768
+
+/**
+ * Portable kernel, one center at a time
+ */
+static void cluster_distances_scalar(const symbol_t *data, const struct cluster_t *clusters, uint32_t k, uint32_t columns, uint64_t *out) {
+	uint32_t c, i;
+	int32_t d;
+	uint64_t sum;
+
+	for (c = 0; c < k; ++c) {
+		sum = 0;
+		for (i = 0; i < columns; ++i) {
+			d = (int32_t) data[i] - (int32_t) clusters[c].mean[i];
+			sum += d*d;
+		}
+		out[c] = sum;
+	}
+}
+
+/**
+ * Picks the means for a group of four centers starting at c, repeating the first center
+ * when fewer than four are left so the vector loops don't need a separate tail case
+ */
+static void cluster_group_means(const struct cluster_t *clusters, uint32_t k, uint32_t c, const symbol_t **m) {
+	uint32_t j;
+
+	for (j = 0; j < 4; ++j) {
+		m[j] = clusters[(c + j < k) ? c + j : c].mean;
+	}
+}
+
+/**
+ * Finishes the columns left over after the vector loop and stores the valid results for a group
+ */
+static void cluster_group_store(const symbol_t *data, const symbol_t **m, uint64_t *d, uint32_t first, uint32_t columns, uint32_t k, uint32_t c, uint64_t *out) {
+	uint32_t i, j;
+	int32_t diff;
+
+	for (j = 0; j < 4 && c + j < k; ++j) {
+		for (i = first; i < columns; ++i) {
+			diff = (int32_t) data[i] - (int32_t) m[j][i];
+			d[j] += diff*diff;
+		}
+		out[c+j] = d[j];
+	}
+}
+
+/**
+ * End of the next run of vector steps of the given width starting at column i, which
+ * stops before the 32 bit lanes could overflow
+ */
+static uint32_t cluster_lane_end(uint32_t i, uint32_t columns, uint32_t width) {
+	return (columns - i > width * DISTANCE_LANE_STEPS) ? i + width * DISTANCE_LANE_STEPS : columns;
+}
+
+/**
+ * Adds up n 32 bit lanes without overflowing
+ */
+static uint64_t cluster_lane_sum(const uint32_t *lanes, uint32_t n) {
+	uint64_t sum = 0;
+	uint32_t j;
+
+	for (j = 0; j < n; ++j) {
+		sum += lanes[j];
+	}
+	return sum;
+}
+
+#ifdef CLUSTER_SIMD_X86
+
+#define SQ_DIFF_SSE(x, y, ones) \
+	_mm_madd_epi16(_mm_maddubs_epi16(_mm_sub_epi8(_mm_max_epu8(x, y), _mm_min_epu8(x, y)), _mm_sub_epi8(_mm_max_epu8(x, y), _mm_min_epu8(x, y))), ones)
+
+#define SQ_DIFF_AVX2(x, y, ones) \
+	_mm256_madd_epi16(_mm256_maddubs_epi16(_mm256_sub_epi8(_mm256_max_epu8(x, y), _mm256_min_epu8(x, y)), _mm256_sub_epi8(_mm256_max_epu8(x, y), _mm256_min_epu8(x, y))), ones)
+
+__attribute__((target("sse4.1")))
+static uint64_t hsum_epi32_sse(__m128i v) {
+	uint32_t lanes[4];
+
+	_mm_storeu_si128((__m128i *) lanes, v);
+	return cluster_lane_sum(lanes, 4);
+}
+
+/**
+ * SSE4.1 kernel, 16 columns per step
+ */
+__attribute__((target("sse4.1")))
+static void cluster_distances_sse41(const symbol_t *data, const struct cluster_t *clusters, uint32_t k, uint32_t columns, uint64_t *out) {
+	const __m128i ones = _mm_set1_epi16(1);
+	const symbol_t *m[4];
+	uint64_t d[4];
+	uint32_t c, i, end;
+	__m128i x, a0, a1, a2, a3;
+
+	for (c = 0; c < k; c += 4) {
+		cluster_group_means(clusters, k, c, m);
+		d[0] = d[1] = d[2] = d[3] = 0;
+
+		for (i = 0; i + 16 <= columns;) {
+			a0 = a1 = a2 = a3 = _mm_setzero_si128();
+			end = cluster_lane_end(i, columns, 16);
+			for (; i + 16 <= end; i += 16) {
+				x = _mm_loadu_si128((const __m128i *) (data + i));
+				a0 = _mm_add_epi32(a0, SQ_DIFF_SSE(x, _mm_loadu_si128((const __m128i *) (m[0] + i)), ones));
+				a1 = _mm_add_epi32(a1, SQ_DIFF_SSE(x, _mm_loadu_si128((const __m128i *) (m[1] + i)), ones));
+				a2 = _mm_add_epi32(a2, SQ_DIFF_SSE(x, _mm_loadu_si128((const __m128i *) (m[2] + i)), ones));
+				a3 = _mm_add_epi32(a3, SQ_DIFF_SSE(x, _mm_loadu_si128((const __m128i *) (m[3] + i)), ones));
+			}
+
+			d[0] += hsum_epi32_sse(a0);
+			d[1] += hsum_epi32_sse(a1);
+			d[2] += hsum_epi32_sse(a2);
+			d[3] += hsum_epi32_sse(a3);
+		}
+		cluster_group_store(data, m, d, i, columns, k, c, out);
+	}
+}
+
+__attribute__((target("avx2")))
+static uint64_t hsum_epi32_avx2(__m256i v) {
+	uint32_t lanes[8];
+
+	_mm256_storeu_si256((__m256i *) lanes, v);
+	return cluster_lane_sum(lanes, 8);
+}
+
+/**
+ * AVX2 kernel, 32 columns per step
+ */
+__attribute__((target("avx2")))
+static void cluster_distances_avx2(const symbol_t *data, const struct cluster_t *clusters, uint32_t k, uint32_t columns, uint64_t *out) {
+	const __m256i ones = _mm256_set1_epi16(1);
+	const symbol_t *m[4];
+	uint64_t d[4];
+	uint32_t c, i, end;
+	__m256i x, a0, a1, a2, a3;
+
+	for (c = 0; c < k; c += 4) {
+		cluster_group_means(clusters, k, c, m);
+		d[0] = d[1] = d[2] = d[3] = 0;
+
+		for (i = 0; i + 32 <= columns;) {
+			a0 = a1 = a2 = a3 = _mm256_setzero_si256();
+			end = cluster_lane_end(i, columns, 32);
+			for (; i + 32 <= end; i += 32) {
+				x = _mm256_loadu_si256((const __m256i *) (data + i));
+				a0 = _mm256_add_epi32(a0, SQ_DIFF_AVX2(x, _mm256_loadu_si256((const __m256i *) (m[0] + i)), ones));
+				a1 = _mm256_add_epi32(a1, SQ_DIFF_AVX2(x, _mm256_loadu_si256((const __m256i *) (m[1] + i)), ones));
+				a2 = _mm256_add_epi32(a2, SQ_DIFF_AVX2(x, _mm256_loadu_si256((const __m256i *) (m[2] + i)), ones));
+				a3 = _mm256_add_epi32(a3, SQ_DIFF_AVX2(x, _mm256_loadu_si256((const __m256i *) (m[3] + i)), ones));
+			}
+
+			d[0] += hsum_epi32_avx2(a0);
+			d[1] += hsum_epi32_avx2(a1);
+			d[2] += hsum_epi32_avx2(a2);
+			d[3] += hsum_epi32_avx2(a3);
+		}
+		cluster_group_store(data, m, d, i, columns, k, c, out);
+	}
+}
+
+#endif
+
+#ifdef CLUSTER_SIMD_NEON
+
+/**
+ * NEON kernel, 16 columns per step
+ */
+static void cluster_distances_neon(const symbol_t *data, const struct cluster_t *clusters, uint32_t k, uint32_t columns, uint64_t *out) {
+	const symbol_t *m[4];
+	uint64_t d[4];
+	uint32_t c, i, j, end;
+	uint8x16_t x, diff;
+	uint32x4_t a[4];
+
+	for (c = 0; c < k; c += 4) {
+		cluster_group_means(clusters, k, c, m);
+		for (j = 0; j < 4; ++j) {
+			d[j] = 0;
+		}
+
+		for (i = 0; i + 16 <= columns;) {
+			for (j = 0; j < 4; ++j) {
+				a[j] = vdupq_n_u32(0);
+			}
+			end = cluster_lane_end(i, columns, 16);
+			for (; i + 16 <= end; i += 16) {
+				x = vld1q_u8(data + i);
+				for (j = 0; j < 4; ++j) {
+					diff = vabdq_u8(x, vld1q_u8(m[j] + i));
+					a[j] = vpadalq_u16(a[j], vmull_u8(vget_low_u8(diff), vget_low_u8(diff)));
+					a[j] = vpadalq_u16(a[j], vmull_u8(vget_high_u8(diff), vget_high_u8(diff)));
+				}
+			}
+
+			for (j = 0; j < 4; ++j) {
+				d[j] += vaddlvq_u32(a[j]);
+			}
+		}
+		cluster_group_store(data, m, d, i, columns, k, c, out);
+	}
+}
+
+#endif
+
+/**
+ * Chooses the best distance kernel for the processor we're running on
+ */
+distance_kernel_t select_distance_kernel(uint8_t verbose) {
+#ifdef CLUSTER_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		if (verbose)
+			printf("Using AVX2 distance kernel.\n");
+		return cluster_distances_avx2;
+	}
+	if (__builtin_cpu_supports("sse4.1")) {
+		if (verbose)
+			printf("Using SSE4.1 distance kernel.\n");
+		return cluster_distances_sse41;
+	}
+#endif
+#ifdef CLUSTER_SIMD_NEON
+	if (verbose)
+		printf("Using NEON distance kernel.\n");
+	return cluster_distances_neon;
+#endif
+	if (verbose)
+		printf("Using scalar distance kernel.\n");
+	return cluster_distances_scalar;
+}
+
+/**
+ * Lists the distance kernels the processor we're running on supports, the portable one
+ * first, so that they can be checked against each other
+ * @param i Index of the kernel
+ * @param name Set to the name of the kernel, may be NULL
+ * @return The kernel, or NULL once i is past the last one
+ */
+distance_kernel_t list_distance_kernels(uint32_t i, const char **name) {
+	distance_kernel_t kernels[4];
+	const char *names[4];
+	uint32_t n = 0;
+
+	kernels[n] = cluster_distances_scalar;
+	names[n++] = "scalar";
+#ifdef CLUSTER_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1")) {
+		kernels[n] = cluster_distances_sse41;
+		names[n++] = "SSE4.1";
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		kernels[n] = cluster_distances_avx2;
+		names[n++] = "AVX2";
+	}
+#endif
+#ifdef CLUSTER_SIMD_NEON
+	kernels[n] = cluster_distances_neon;
+	names[n++] = "NEON";
+#endif
+
+	if (i >= n)
+		return NULL;
+	if (name)
+		*name = names[i];
+	return kernels[i];
+}
@@ -1,9 +1,11 @@
 #include "codebook.h"
 #include "lines.h"
 #include "cluster.h"
+#include "thread_pool.h"
 
 #include <stdio.h>
 #include <assert.h>
+#include <math.h>
 
 #if defined(LINUX) || defined(__APPLE__)
 	#include <arpa/inet.h>
@@ -17,18 +19,14 @@
  */
 struct cond_pmf_list_t *alloc_conditional_pmf_list(const struct alphabet_t *alphabet, uint32_t columns) {
 	uint32_t count = 1 + alphabet->size*(columns-1);
-	uint32_t i;
 	struct cond_pmf_list_t *list = (struct cond_pmf_list_t *) calloc(1, sizeof(struct cond_pmf_list_t));
 
-	// We need one array of PMF pointers that will index into the buffer allocated above, for the columns
 	list->columns = columns;
 	list->alphabet = alphabet;
-	list->pmfs = (struct pmf_t **) calloc(count, sizeof(struct pmf_t *));
 
 	// All PMFs are stored in a flat array, the accessor function will resolve a PMF's address
-	for (i = 0; i < count; ++i) {
-		list->pmfs[i] = alloc_pmf(alphabet);
-	}
+	list->storage = alloc_pmf_list(count, alphabet);
+	list->pmfs = list->storage->pmfs;
 
 	return list;
 }
@@ -38,15 +36,12 @@ struct cond_pmf_list_t *alloc_conditional_pmf_list(const struct alphabet_t *alph
  * @param list The conditional pmf list to deallocate
  */
 void free_conditional_pmf_list(struct cond_pmf_list_t *list) {
-	uint32_t count = 1 + list->alphabet->size * (list->columns - 1);
-	uint32_t i;
+	free_pmf_list(list->storage);
 
-	for (i = 0; i < count; ++i) {
-		free_pmf(list->pmfs[i]);
-	}
+	// Marginals only exist once statistics have been calculated
+	if (list->marginal_pmfs)
+		free_pmf_list(list->marginal_pmfs);
 	free(list);
-
-	free_pmf_list(list->marginal_pmfs);
 }
 
 /**
@@ -73,7 +68,8 @@ void free_cond_quantizer_list(struct cond_quantizer_list_t *list) {
 
 	for (i = 0; i < list->columns; ++i) {
 		if (list->q[i]) {
-			for (j = 0; j < list->input_alphabets[i]->size; ++j) {
+			// Every context has a low and a high quantizer
+			for (j = 0; j < 2*list->input_alphabets[i]->size; ++j) {
 				if (list->q[i][j])
 					free_quantizer(list->q[i][j]);
 			}
@@ -179,44 +175,240 @@ uint32_t find_state_encoding(struct quantizer_t *q, symbol_t value) {
 }
 
 /**
- * Calculates the statistics, producing a conditional pmf list per cluster and storing
- * it directly inside the cluster in question
+ * Flattens a conditional quantizer list into a compiled codebook and precomputes the direct
+ * state tables. Nothing is borrowed from the list, so it may be freed afterwards
  */
-void calculate_statistics(struct quality_file_t *info) {
-	uint32_t block, line_idx, column;
-	uint32_t j;
-	uint8_t c;
-	struct line_t *line;
-	struct cluster_t *cluster;
-	struct cond_pmf_list_t *pmf_list;
-
-	for (block = 0; block < info->block_count; ++block) {
-		for (line_idx = 0; line_idx < info->blocks[block].count; ++line_idx) {
-			line = &info->blocks[block].lines[line_idx];
-			cluster = &info->clusters->clusters[line->cluster];
-			pmf_list = cluster->training_stats;
-
-			// First, find conditional PMFs
-			pmf_increment(get_cond_pmf(pmf_list, 0, 0), line->m_data[0] - 33);
-			for (column = 1; column < info->columns; ++column) {
-				pmf_increment(get_cond_pmf(pmf_list, column, line->m_data[column-1] - 33), line->m_data[column] - 33);
+struct compiled_codebook_t *compile_codebook(struct cond_quantizer_list_t *list) {
+	struct compiled_codebook_t *book = (struct compiled_codebook_t *) calloc(1, sizeof(struct compiled_codebook_t));
+	struct codebook_context_t *ctx;
+	struct quantizer_t *q;
+	struct alphabet_t *input;
+	uint32_t column, j, h, k, size;
+
+	book->columns = list->columns;
+	book->column_offset = (uint32_t *) calloc(list->columns, sizeof(uint32_t));
+	book->context_index = (uint32_t *) malloc(list->columns*ALPHABET_SIZE*sizeof(uint32_t));
+	for (column = 0; column < list->columns; ++column) {
+		input = list->input_alphabets[column];
+		book->column_offset[column] = book->contexts;
+		for (k = 0; k < ALPHABET_SIZE; ++k) {
+			book->context_index[column*ALPHABET_SIZE + k] = ALPHABET_SYMBOL_NOT_FOUND;
+		}
+		for (j = 0; j < input->size; ++j) {
+			if (input->symbols[j] < ALPHABET_SIZE)
+				book->context_index[column*ALPHABET_SIZE + input->symbols[j]] = book->contexts + j;
+		}
+		book->contexts += input->size;
+	}
+
+	book->ctx = (struct codebook_context_t *) calloc(book->contexts, sizeof(struct codebook_context_t));
+	for (column = 0; column < list->columns; ++column) {
+		for (j = 0; j < list->input_alphabets[column]->size; ++j) {
+			ctx = &book->ctx[book->column_offset[column] + j];
+			ctx->qratio = list->qratio[column][j];
+			for (h = 0; h < 2; ++h) {
+				q = list->q[column][2*j+h];
+				size = (q->alphabet->size < ALPHABET_SIZE) ? q->alphabet->size : ALPHABET_SIZE;
+				for (k = 0; k < size; ++k) {
+					ctx->q[h].q[k] = q->q[k];
+					ctx->q[h].state[k] = (uint8_t) get_symbol_index(q->output_alphabet, q->q[k]);
+				}
+				ctx->q[h].states = q->output_alphabet->size;
+				for (k = 0; k < q->output_alphabet->size && k < ALPHABET_SIZE; ++k) {
+					ctx->q[h].symbols[k] = q->output_alphabet->symbols[k];
+				}
 			}
 		}
 	}
 
-	// Then find unconditional PMFs for each cluster once the full conditional ones are ready
+	return book;
+}
+
+/**
+ * Deallocates a compiled codebook
+ */
+void free_compiled_codebook(struct compiled_codebook_t *book) {
+	free(book->ctx);
+	free(book->context_index);
+	free(book->column_offset);
+	free(book);
+}
+
+/**
+ * Compiles the quantizer list of every cluster for coding
+ */
+void compile_codebooks(struct quality_file_t *info) {
+	uint8_t c;
+
 	for (c = 0; c < info->cluster_count; ++c) {
-		cluster = &info->clusters->clusters[c];
-		pmf_list = cluster->training_stats;
-
-		pmf_list->marginal_pmfs = alloc_pmf_list(info->columns, pmf_list->alphabet);
-		combine_pmfs(get_cond_pmf(pmf_list, 0, 0), pmf_list->marginal_pmfs->pmfs[0], 1.0, 0.0, pmf_list->marginal_pmfs->pmfs[0]);
-		for (column = 1; column < info->columns; ++column) {
-			for (j = 0; j < pmf_list->alphabet->size; ++j) {
-				combine_pmfs(pmf_list->marginal_pmfs->pmfs[column], get_cond_pmf(pmf_list, column, j), 1.0, get_probability(pmf_list->marginal_pmfs->pmfs[column-1], j), pmf_list->marginal_pmfs->pmfs[column]);
+		info->clusters->clusters[c].book = compile_codebook(info->clusters->clusters[c].qlist);
+	}
+}
+
+/**
+ * Deallocates the compiled codebooks of every cluster
+ */
+void free_compiled_codebooks(struct quality_file_t *info) {
+	uint8_t c;
+
+	for (c = 0; c < info->cluster_count; ++c) {
+		free_compiled_codebook(info->clusters->clusters[c].book);
+		info->clusters->clusters[c].book = NULL;
+	}
+}
+
+/**
+ * Same as choose_quantizer for a compiled codebook, given the 7 bit selection value for
+ * the symbol instead of drawing it
+ * @return Index of the chosen quantizer and of its adaptive stats
+ */
+uint32_t choose_compiled_quantizer(const struct compiled_codebook_t *book, uint8_t r, uint32_t column, symbol_t prev) {
+	uint32_t idx = book->context_index[column*ALPHABET_SIZE + prev];
+	assert(idx != ALPHABET_SYMBOL_NOT_FOUND);
+	if (r >= book->ctx[idx].qratio)
+		return 2*idx+1;
+	return 2*idx;
+}
+
+/**
+ * Work for gathering statistics in parallel. Each thread counts its share of the lines into
+ * a private dense tensor of [cluster][column][left context][symbol] counts, and the tensors
+ * are summed into the conditional pmfs once every line has been counted
+ */
+struct stats_job_t {
+	struct quality_file_t *info;
+	uint64_t lines;				// Lines to count, either the whole file or the sample size
+	uint32_t symbols;			// Alphabet size, the stride of the innermost two dimensions
+	uint32_t threads;
+	uint32_t **counts;			// One tensor per thread
+};
+
+/**
+ * Counts one line into its cluster's slice of a count tensor
+ */
+static void add_line_statistics(struct stats_job_t *job, uint32_t *counts, struct line_t *line) {
+	uint32_t column;
+	uint32_t A = job->symbols;
+	uint32_t *c = counts + ((size_t) line->cluster) * job->info->columns * A * A;
+
+	if (line->length == 0)
+		return;
+
+	c[line->m_data[0] - 33] += 1;
+	for (column = 1; column < line->length; ++column) {
+		c += A*A;
+		c[(line->m_data[column-1] - 33) * A + line->m_data[column] - 33] += 1;
+	}
+}
+
+/**
+ * Counts one chunk of lines. With a stats_sample, line i of the sample is the first line of
+ * the i-th of n equal strata of the file, so slow drift over the run is represented
+ */
+static void statistics_chunk_task(void *arg, uint32_t task, uint32_t thread) {
+	struct stats_job_t *job = (struct stats_job_t *) arg;
+	struct quality_file_t *info = job->info;
+	uint64_t i, idx;
+	uint64_t first = ((uint64_t) task) * STATS_CHUNK_LINES;
+	uint64_t end = (first + STATS_CHUNK_LINES < job->lines) ? first + STATS_CHUNK_LINES : job->lines;
+
+	for (i = first; i < end; ++i) {
+		idx = (job->lines == info->lines) ? i : (i * info->lines) / job->lines;
+		add_line_statistics(job, job->counts[thread], &info->blocks[idx / MAX_LINES_PER_BLOCK].lines[idx % MAX_LINES_PER_BLOCK]);
+	}
+}
+
+/**
+ * Sums the thread tensors for one column of one cluster into the cluster's conditional pmfs
+ */
+static void statistics_merge_task(void *arg, uint32_t task, uint32_t thread) {
+	struct stats_job_t *job = (struct stats_job_t *) arg;
+	struct quality_file_t *info = job->info;
+	uint32_t A = job->symbols;
+	uint32_t column = task % info->columns;
+	uint32_t contexts = (column == 0) ? 1 : A;
+	uint32_t t, j, x;
+	size_t base = ((size_t) task) * A * A;
+	struct pmf_t *pmf;
+
+	for (j = 0; j < contexts; ++j) {
+		pmf = get_cond_pmf(info->clusters->clusters[task / info->columns].training_stats, column, j);
+		for (t = 0; t < job->threads; ++t) {
+			for (x = 0; x < A; ++x) {
+				pmf->counts[x] += job->counts[t][base + j*A + x];
+				pmf->total += job->counts[t][base + j*A + x];
+			}
+		}
+		pmf->pmf_ready = 0;
+	}
+}
+
+/**
+ * Finds the unconditional pmf of every column of one cluster from its merged conditional pmfs
+ */
+static void statistics_marginal_task(void *arg, uint32_t task, uint32_t thread) {
+	struct stats_job_t *job = (struct stats_job_t *) arg;
+	struct cond_pmf_list_t *pmf_list = job->info->clusters->clusters[task].training_stats;
+	uint32_t column, j;
+
+	pmf_list->marginal_pmfs = alloc_pmf_list(job->info->columns, pmf_list->alphabet);
+	combine_pmfs(get_cond_pmf(pmf_list, 0, 0), pmf_list->marginal_pmfs->pmfs[0], 1.0, 0.0, pmf_list->marginal_pmfs->pmfs[0]);
+	for (column = 1; column < job->info->columns; ++column) {
+		for (j = 0; j < pmf_list->alphabet->size; ++j) {
+			combine_pmfs(pmf_list->marginal_pmfs->pmfs[column], get_cond_pmf(pmf_list, column, j), 1.0, get_probability(pmf_list->marginal_pmfs->pmfs[column-1], j), pmf_list->marginal_pmfs->pmfs[column]);
+		}
+	}
+}
+
+/**
+ * Calculates the statistics, producing a conditional pmf list per cluster and storing
+ * it directly inside the cluster in question. With a stats_sample only that many evenly
+ * spaced lines are counted. The lines are counted in chunks on the worker threads, with
+ * as many threads as there is room for a count tensor each within STATS_TENSOR_BUDGET
+ * @return 1, or 0 if the count tables can't be allocated
+ */
+uint8_t calculate_statistics(struct quality_file_t *info) {
+	uint32_t t, tasks;
+	uint64_t n = info->opts->stats_sample;
+	size_t tensor;
+	struct stats_job_t job;
+
+	job.info = info;
+	job.lines = (n == 0 || n >= info->lines) ? info->lines : n;
+	job.symbols = info->alphabet->size;
+	tensor = ((size_t) info->cluster_count) * info->columns * job.symbols * job.symbols;
+
+	job.threads = info->opts->threads;
+	if (job.threads > STATS_TENSOR_BUDGET / (tensor * sizeof(uint32_t)))
+		job.threads = (uint32_t) (STATS_TENSOR_BUDGET / (tensor * sizeof(uint32_t)));
+	if (job.threads == 0)
+		job.threads = 1;
+
+	job.counts = (uint32_t **) calloc(job.threads, sizeof(uint32_t *));
+	for (t = 0; t < job.threads; ++t) {
+		job.counts[t] = (uint32_t *) calloc(tensor, sizeof(uint32_t));
+		if (!job.counts[t]) {
+			printf("Unable to allocate statistics tables.\n");
+			while (t > 0) {
+				free(job.counts[--t]);
 			}
+			free(job.counts);
+			return 0;
 		}
 	}
+
+	tasks = (uint32_t) ((job.lines + STATS_CHUNK_LINES - 1) / STATS_CHUNK_LINES);
+	run_parallel(job.threads, tasks, statistics_chunk_task, &job);
+	run_parallel(job.threads, info->cluster_count * info->columns, statistics_merge_task, &job);
+
+	for (t = 0; t < job.threads; ++t) {
+		free(job.counts[t]);
+	}
+	free(job.counts);
+
+	// Then find unconditional PMFs for each cluster once the full conditional ones are ready
+	run_parallel(info->opts->threads, info->cluster_count, statistics_marginal_task, &job);
+	return 1;
 }
 
 /**
@@ -236,6 +428,8 @@ double optimize_for_entropy(struct pmf_t *pmf, struct distortion_t *dist, double
 	if (target == 0.0) {
 		*lo = generate_quantizer(pmf, dist, 1);
 		*hi = generate_quantizer(pmf, dist, 1);
+		(*lo)->entropy = 0.0;
+		(*hi)->entropy = 0.0;
 		
 		free_pmf(pmf_temp);
 		return 1.0;
@@ -243,6 +437,7 @@ double optimize_for_entropy(struct pmf_t *pmf, struct distortion_t *dist, double
 	
 	q_temp = generate_quantizer(pmf, dist, states);
 	hi_entropy = get_entropy(apply_quantizer(q_temp, pmf, pmf_temp));
+	q_temp->entropy = hi_entropy;
 	*hi = q_temp;
 	*lo = alloc_quantizer(pmf->alphabet);
 
@@ -254,6 +449,7 @@ double optimize_for_entropy(struct pmf_t *pmf, struct distortion_t *dist, double
 		states += 1;
 		q_temp = generate_quantizer(pmf, dist, states);
 		hi_entropy = get_entropy(apply_quantizer(q_temp, pmf, pmf_temp));
+		q_temp->entropy = hi_entropy;
 		*hi = q_temp;
 	} while (hi_entropy < target && states < pmf->alphabet->size);
 
@@ -285,61 +481,83 @@ void compute_qpmf_quan_list(struct quantizer_t *q_lo, struct quantizer_t *q_hi,
             if (q_hi->q[x] == q_symbol)
                 q_x_pmf->pmfs[x]->pmf[idx] += (1-ratio);
         }
+
+		// Already in probability form, and marking it here keeps later concurrent readers from doing so
+		q_x_pmf->pmfs[x]->pmf_ready = 1;
     }
 }
 
-void compute_qpmf_list(struct pmf_list_t *qpmf_list, struct cond_pmf_list_t *in_pmfs, uint32_t column, struct pmf_list_t *prev_qpmf_list, struct alphabet_t * q_alphabet_union, struct alphabet_t * prev_q_alphabet_union, struct cond_quantizer_list_t *q_list) {
+/**
+ * Computes row k of P(Q_i | X_i), that is P(Q_i | X_i = k), from the previous column's
+ * quantizers. The sum over X_{i-1} only depends on which previous quantizer pair was
+ * used, so it is found once per pair rather than once per output symbol
+ */
+void compute_qpmf(struct pmf_list_t *qpmf_list, struct cond_pmf_list_t *in_pmfs, uint32_t column, struct pmf_list_t *prev_qpmf_list, struct alphabet_t * q_alphabet_union, struct alphabet_t * prev_q_alphabet_union, struct cond_quantizer_list_t *q_list, uint32_t k) {
     symbol_t x;
-    double p_q_xq = 0.0, p_temp = 0.0;
-    uint32_t q_symbol, idx, k, j;
+    double p_q_xq = 0.0;
+    uint32_t q_symbol, idx, j;
     struct quantizer_t *q_hi, *q_lo;
-    
-    // compute P(Q_i | X_i)
-    for (k = 0; k < qpmf_list->size; k++) {
-        // compute P(Q_i | X_i = k)
-        for (idx = 0; idx < q_alphabet_union->size; idx++) {
-            q_symbol = q_alphabet_union->symbols[idx];
-            
-            // compute P(Q_i = q_symbol | X_i = k)
-            for (j = 0; j < prev_q_alphabet_union->size; j++) {
-                p_q_xq = 0.0;
-
-                // extract the jth quantizers of X_i;
-                q_lo = get_cond_quantizer_indexed(q_list, column-1, 2*j);
-                q_hi = get_cond_quantizer_indexed(q_list, column-1, (2*j)+1);
-                
-                // Given the quantizers q_lo and q_hi, compute P(Q_i = q_symbol|X_i = k ,Q_{i-1} chooses the jth quantizer of X_i)
-                if (q_lo->q[k] == q_symbol)
-                    p_q_xq += q_lo->ratio;
-                
-                if (q_hi->q[k] == q_symbol)
-                    p_q_xq += q_hi->ratio;
-                
-                p_temp = 0;
-                for (x = 0; x < prev_qpmf_list->size; ++x) {
-                    p_temp += get_probability(prev_qpmf_list->pmfs[x], j) * get_probability(get_cond_pmf(in_pmfs, column-1, x), k) * get_probability(in_pmfs->marginal_pmfs->pmfs[column-2], x);
-                }
-                qpmf_list->pmfs[k]->pmf[idx] += p_q_xq * p_temp;
-            }
-        }
-        
-        // Normilize P(Q_i | X_i = k)
-        qpmf_list->pmfs[k]->pmf_ready = 1;
-        renormalize_pmf(qpmf_list->pmfs[k]);
-    }
+	double *p_temp = (double *) _alloca(prev_q_alphabet_union->size*sizeof(double));
+	const double *marginal = get_probabilities(in_pmfs->marginal_pmfs->pmfs[column-2]);
+	const double *prev_q;
+	double p_k, p_x;
+
+	// Weight of the jth quantizer pair of X_i given X_i = k, summed one X_{i-1} at a time
+	// so that the inner loop runs over contiguous probabilities
+	memset(p_temp, 0, prev_q_alphabet_union->size*sizeof(double));
+	for (x = 0; x < prev_qpmf_list->size; ++x) {
+		prev_q = get_probabilities(prev_qpmf_list->pmfs[x]);
+		p_k = get_probability(get_cond_pmf(in_pmfs, column-1, x), k);
+		p_x = marginal[x];
+		for (j = 0; j < prev_q_alphabet_union->size; j++) {
+			p_temp[j] += prev_q[j] * p_k * p_x;
+		}
+	}
+
+	// compute P(Q_i = q_symbol | X_i = k)
+	for (idx = 0; idx < q_alphabet_union->size; idx++) {
+		q_symbol = q_alphabet_union->symbols[idx];
+
+		for (j = 0; j < prev_q_alphabet_union->size; j++) {
+			p_q_xq = 0.0;
+
+			// extract the jth quantizers of X_i;
+			q_lo = get_cond_quantizer_indexed(q_list, column-1, 2*j);
+			q_hi = get_cond_quantizer_indexed(q_list, column-1, (2*j)+1);
+
+			// Given the quantizers q_lo and q_hi, compute P(Q_i = q_symbol|X_i = k ,Q_{i-1} chooses the jth quantizer of X_i)
+			if (q_lo->q[k] == q_symbol)
+				p_q_xq += q_lo->ratio;
+
+			if (q_hi->q[k] == q_symbol)
+				p_q_xq += q_hi->ratio;
+
+			qpmf_list->pmfs[k]->pmf[idx] += p_q_xq * p_temp[j];
+		}
+	}
+
+	// Normilize P(Q_i | X_i = k)
+	qpmf_list->pmfs[k]->pmf_ready = 1;
+	renormalize_pmf(qpmf_list->pmfs[k]);
 }
 
 void compute_xpmf_list(struct pmf_list_t *qpmf_list, struct cond_pmf_list_t *in_pmfs, uint32_t column, struct pmf_list_t *xpmf_list, struct alphabet_t * q_alphabet_union){
     symbol_t x;
     uint32_t idx, k;
+	const double *marginal = get_probabilities(in_pmfs->marginal_pmfs->pmfs[column-1]);
+	const double *cond;
+	double *out, p_q, p_x;
     
     // compute P(X_{i+1} | Q_i)
     for (idx = 0; idx < q_alphabet_union->size; idx++) {
-        // compute P(X_{i+1} | Q_i = q)
-        for (k = 0; k < qpmf_list->size; k++) {
-            // compute P(X_{i+1} = k | Q_i = q)
-            for (x = 0; x < qpmf_list->size; ++x) {
-                xpmf_list->pmfs[idx]->pmf[k] += get_probability(qpmf_list->pmfs[x], idx) * get_probability(get_cond_pmf(in_pmfs, column, x), k) * get_probability(in_pmfs->marginal_pmfs->pmfs[column-1], x);
+        // compute P(X_{i+1} = k | Q_i = q) for every k at once, adding in one X_i at a time
+		out = xpmf_list->pmfs[idx]->pmf;
+        for (x = 0; x < qpmf_list->size; ++x) {
+			p_q = get_probability(qpmf_list->pmfs[x], idx);
+			cond = get_probabilities(get_cond_pmf(in_pmfs, column, x));
+			p_x = marginal[x];
+            for (k = 0; k < qpmf_list->size; k++) {
+                out[k] += p_q * cond[k] * p_x;
             }
         }
         // Normilize P(X_{i+1} | Q_i = q)
@@ -349,323 +567,892 @@ void compute_xpmf_list(struct pmf_list_t *qpmf_list, struct cond_pmf_list_t *in_
 }
 
 /**
- * For a set of already clustered data, generate codebooks for each cluster and
- * store them inside the cluster data structure
+ * State carried from one column to the next for one cluster while its codebook is generated
  */
-void generate_codebooks(struct quality_file_t *info) {
-	// Stuff for state allocation and mixing
-	double ratio;
-    
-	// Miscellaneous variables
-	uint32_t column, j;
-	double total_mse;
-    
-	// Output list of conditional quantizers
+struct codebook_state_t {
 	struct cond_quantizer_list_t *q_list;
-    
-	// Constant alphabet of all possible input symbols
-	const struct alphabet_t *A = info->alphabet;
-    
-	// Temporary/extra pointers
-	struct quantizer_t *q_lo;
-    struct quantizer_t *q_hi;
-    
+	struct cond_pmf_list_t *in_pmfs;
+
 	// List of conditionally quantized PMFs after quantizer has been added out
 	struct pmf_list_t *xpmf_list;
-    
+
 	// List of conditionally quantized PMFs after the next quantizer was applied
 	struct pmf_list_t *qpmf_list;
 	struct pmf_list_t *prev_qpmf_list;
-    
+
 	// Alphabet of all possible quantizer outputs from the previous column
 	struct alphabet_t *q_output_union;
-    struct alphabet_t *q_prev_output_union;
+	struct alphabet_t *q_prev_output_union;
 
-	uint8_t cluster_id;
-	struct cond_pmf_list_t *in_pmfs;
+	// Storage from two columns back, reused for the next column instead of reallocating
+	struct pmf_list_t *spare_qpmf_list;
+	struct alphabet_t *spare_output_union;
+
+	uint32_t first_task;		// First quantizer task of this cluster in the current column
+	double distortion;			// Expected distortion summed over the columns so far
+	double rate;				// Expected bits summed over the columns so far
+};
+
+/**
+ * Fraction of a cluster's training lines that are long enough to reach the given column,
+ * which is always 1 unless the lines have different lengths
+ */
+static double column_coverage(struct quality_file_t *info, struct cond_pmf_list_t *pmf_list, uint32_t column) {
+	uint32_t j;
+	uint64_t total = 0;
+	uint32_t first = get_cond_pmf(pmf_list, 0, 0)->total;
+
+	if (!info->variable_length || column == 0)
+		return 1.0;
+	if (first == 0)
+		return 0.0;
+
+	for (j = 0; j < pmf_list->alphabet->size; ++j) {
+		total += get_cond_pmf(pmf_list, column, j)->total;
+	}
+	return total / (double) first;
+}
+
+/**
+ * Work shared by the tasks of one column across every cluster
+ */
+struct codebook_job_t {
+	struct quality_file_t *info;
+	struct codebook_state_t *state;
+	uint32_t column;
+};
+
+/**
+ * Finds and stores the quantizer pair for one left context j of one column, or for the
+ * single unconditional context of column 0. Every call works on its own PMF and its own
+ * quantizer slots, so calls for different contexts and clusters can run concurrently
+ */
+static void optimize_context(struct quality_file_t *info, struct codebook_state_t *state, uint32_t column, uint32_t j) {
 	struct qv_options_t *opts = info->opts;
-	struct distortion_t *dist = info->dist;
+	struct quantizer_t *q_lo, *q_hi;
+	struct pmf_t *pmf;
+	double ratio, mass = 0.0;
+	uint32_t x;
 
-	for (cluster_id = 0; cluster_id < info->cluster_count; ++cluster_id) {
-		q_list = alloc_conditional_quantizer_list(info->columns);
-		info->clusters->clusters[cluster_id].qlist = q_list;
-		in_pmfs = info->clusters->clusters[cluster_id].training_stats;
-    
-    	// For the column 0 the quantizers aren't conditional, so find them directly
-    	q_output_union = alloc_alphabet(1);
-    	cond_quantizer_init_column(q_list, 0, q_output_union);
-		q_list->options = opts;
-    
-    	// Initialize the new pmfs (dummy)
-    	qpmf_list = alloc_pmf_list(A->size, q_output_union);
+	if (column == 0)
+		pmf = get_cond_pmf(state->in_pmfs, 0, 0);
+	else
+		pmf = state->xpmf_list->pmfs[j];
+
+	// With sampled statistics, or when streaming, the rest of the input can reach contexts the
+	// statistics never did, so those get the column marginal rather than a quantizer designed for nothing
+	if (opts->stream_training || (opts->stats_sample != 0 && opts->stats_sample < info->lines)) {
+		for (x = 0; x < pmf->alphabet->size; ++x)
+			mass += get_probability(pmf, x);
+		if (mass == 0.0)
+			pmf = state->in_pmfs->marginal_pmfs->pmfs[column];
+	}
+
+	// @todo handle fixed mse target
+	if (opts->mode == MODE_RATIO)
+		ratio = optimize_for_entropy(pmf, info->dist, get_entropy(pmf)*opts->ratio, &q_lo, &q_hi);
+	else
+		ratio = optimize_for_entropy(pmf, info->dist, opts->ratio, &q_lo, &q_hi);
+	q_lo->ratio = ratio;
+	q_hi->ratio = 1-ratio;
+	store_cond_quantizers_indexed(q_lo, q_hi, ratio, state->q_list, column, j);
+}
+
+/**
+ * Task for one quantizer pair, numbered across all clusters for the current column
+ */
+static void optimize_context_task(void *arg, uint32_t task, uint32_t thread) {
+	struct codebook_job_t *job = (struct codebook_job_t *) arg;
+	uint32_t c = 0;
+
+	while (c+1 < job->info->cluster_count && job->state[c+1].first_task <= task)
+		c += 1;
+	optimize_context(job->info, &job->state[c], job->column, task - job->state[c].first_task);
+}
+
+/**
+ * Task for one row of P(Q_i | X_i) of one cluster, for the current column
+ */
+static void compute_qpmf_task(void *arg, uint32_t task, uint32_t thread) {
+	struct codebook_job_t *job = (struct codebook_job_t *) arg;
+	uint32_t size = job->info->alphabet->size;
+	struct codebook_state_t *state = &job->state[task / size];
+
+	compute_qpmf(state->qpmf_list, state->in_pmfs, job->column, state->prev_qpmf_list, state->q_output_union, state->q_prev_output_union, state->q_list, task % size);
+}
+
+/**
+ * Task for P(X_{i+1} | Q_i) of one cluster, for the current column
+ */
+static void compute_xpmf_task(void *arg, uint32_t task, uint32_t thread) {
+	struct codebook_job_t *job = (struct codebook_job_t *) arg;
+	struct codebook_state_t *state = &job->state[task];
+
+	compute_xpmf_list(state->qpmf_list, state->in_pmfs, job->column, state->xpmf_list, state->q_output_union);
+}
+
+/**
+ * For a set of already clustered data, generate codebooks for each cluster and
+ * store them inside the cluster data structure. Columns depend on each other, so the
+ * clusters advance a column at a time together, and within each column the rows of
+ * P(Q_i | X_i) and the quantizer pairs of every cluster are spread over the threads.
+ * The expected rate and distortion of the design are left in opts->e_rate and e_dist
+ */
+void generate_codebooks(struct quality_file_t *info) {
+	// Miscellaneous variables
+	uint32_t column, j, tasks;
+	uint8_t c;
+	symbol_t x;
+	double p_ctx, coverage;
+	uint32_t threads = info->opts->threads ? info->opts->threads : 1;
+	struct codebook_state_t *state = (struct codebook_state_t *) calloc(info->cluster_count, sizeof(struct codebook_state_t));
+	struct codebook_state_t *s;
+	struct codebook_job_t job;
+	struct quantizer_t *q_lo, *q_hi;
     
-    	// Handle column zero specially
-		// @todo handle fixed mse target
-		if (opts->mode == MODE_RATIO)
-			ratio = optimize_for_entropy(get_cond_pmf(in_pmfs, 0, 0), dist, get_entropy(get_cond_pmf(in_pmfs, 0, 0))*opts->ratio, &q_lo, &q_hi);
-		else
-			ratio = optimize_for_entropy(get_cond_pmf(in_pmfs, 0, 0), dist, opts->ratio, &q_lo, &q_hi);
-		q_lo->ratio = ratio;
-		q_hi->ratio = 1-ratio;
-		total_mse = ratio*q_lo->mse + (1-ratio)*q_hi->mse;
-    	store_cond_quantizers(q_lo, q_hi, ratio, q_list, 0, 0);
+	// Constant alphabet of all possible input symbols
+	const struct alphabet_t *A = info->alphabet;
+
+	job.info = info;
+	job.state = state;
+
+	// For the column 0 the quantizers aren't conditional, so find them directly
+	for (c = 0; c < info->cluster_count; ++c) {
+		s = &state[c];
+		s->q_list = alloc_conditional_quantizer_list(info->columns);
+		info->clusters->clusters[c].qlist = s->q_list;
+		s->in_pmfs = info->clusters->clusters[c].training_stats;
+		s->q_list->options = info->opts;
+
+    	s->q_output_union = alloc_alphabet(1);
+    	cond_quantizer_init_column(s->q_list, 0, s->q_output_union);
+		s->first_task = c;
     
-    	// free the used pmfs and alphabet
+    	// Initialize the new pmfs (dummy), and the scratch lists that are reused for every column
+    	s->qpmf_list = alloc_pmf_list(A->size, s->q_output_union);
+		s->spare_qpmf_list = alloc_pmf_list(A->size, s->q_output_union);
+		s->xpmf_list = alloc_pmf_list(A->size, A);
+		s->spare_output_union = alloc_alphabet(0);
+	}
+
+	job.column = 0;
+	run_parallel(threads, info->cluster_count, optimize_context_task, &job);
+
+	for (c = 0; c < info->cluster_count; ++c) {
+		s = &state[c];
+		q_lo = get_cond_quantizer_indexed(s->q_list, 0, 0);
+		q_hi = get_cond_quantizer_indexed(s->q_list, 0, 1);
+		s->distortion = q_lo->ratio*q_lo->mse + q_hi->ratio*q_hi->mse;
+		s->rate = q_lo->ratio*q_lo->entropy + q_hi->ratio*q_hi->entropy;
+
     	// (do not free q_prev_output_union and prev_qpmf_output as it's the first assignment).
-    	q_prev_output_union = q_output_union;
-    	prev_qpmf_list = qpmf_list;
+    	s->q_prev_output_union = s->q_output_union;
+    	s->prev_qpmf_list = s->qpmf_list;
+	}
     
-    	// Start computing the quantizers of the rest of the columns
-    	for (column = 1; column < info->columns; column++) {
+	// Start computing the quantizers of the rest of the columns
+	for (column = 1; column < info->columns; column++) {
+		job.column = column;
+
+		for (c = 0; c < info->cluster_count; ++c) {
+			s = &state[c];
+
         	// Compute the next output alphabet union over all quantizers for this column
-			q_output_union = duplicate_alphabet(get_cond_quantizer_indexed(q_list, column-1, 0)->output_alphabet);
-			for (j = 1; j < 2*q_prev_output_union->size; ++j) {
-				alphabet_union(q_output_union, get_cond_quantizer_indexed(q_list, column-1, j)->output_alphabet, q_output_union);
+			s->q_output_union = s->spare_output_union;
+			copy_alphabet(s->q_output_union, get_cond_quantizer_indexed(s->q_list, column-1, 0)->output_alphabet);
+			for (j = 1; j < 2*s->q_prev_output_union->size; ++j) {
+				alphabet_union(s->q_output_union, get_cond_quantizer_indexed(s->q_list, column-1, j)->output_alphabet, s->q_output_union);
 			}
-        	cond_quantizer_init_column(q_list, column, q_output_union);
+        	cond_quantizer_init_column(s->q_list, column, s->q_output_union);
         	
         	// Initialize the new pmfs
-        	qpmf_list = alloc_pmf_list(A->size, q_output_union);
-        	xpmf_list = alloc_pmf_list(q_output_union->size, A);
-        
-        	// Compute P(Q_i|X_i)
-        	if (column == 1)
-        	    compute_qpmf_quan_list(q_lo, q_hi, qpmf_list, ratio, q_output_union);
-        	else
-        	    compute_qpmf_list(qpmf_list, in_pmfs, column, prev_qpmf_list, q_output_union, q_prev_output_union, q_list);
+        	s->qpmf_list = s->spare_qpmf_list;
+        	reset_pmf_list(s->qpmf_list, A->size, s->q_output_union);
+        	reset_pmf_list(s->xpmf_list, s->q_output_union->size, A);
+
+        	// Compute P(Q_i|X_i) directly from the column 0 quantizers
+        	if (column == 1) {
+				q_lo = get_cond_quantizer_indexed(s->q_list, 0, 0);
+				q_hi = get_cond_quantizer_indexed(s->q_list, 0, 1);
+        	    compute_qpmf_quan_list(q_lo, q_hi, s->qpmf_list, q_lo->ratio, s->q_output_union);
+			}
+		}
+
+        // Compute P(Q_i|X_i) one row per task otherwise
+		if (column > 1)
+			run_parallel(threads, info->cluster_count * A->size, compute_qpmf_task, &job);
         	
-        	// Compute P(X_{i+1}|Q_i)
-        	compute_xpmf_list(qpmf_list, in_pmfs, column, xpmf_list, q_output_union);
-        
-        	// for each previous value Q_i compute the quantizers
-        	for (j = 0; j < q_output_union->size; ++j) {
-        	    // Find and save quantizers
-				// @todo handle fixed mse target
-				if (opts->mode == MODE_RATIO)
-					ratio = optimize_for_entropy(xpmf_list->pmfs[j], dist, get_entropy(xpmf_list->pmfs[j])*opts->ratio, &q_lo, &q_hi);
-				else
-					ratio = optimize_for_entropy(xpmf_list->pmfs[j], dist, opts->ratio, &q_lo, &q_hi);
-				q_lo->ratio = ratio;
-				q_hi->ratio = 1-ratio;
-        	    store_cond_quantizers_indexed(q_lo, q_hi, ratio, q_list, column, j);
-
-				// This actually needs to be scaled by the probability of this quantizer pair being used to be accurate, uniform assumption is an approximation
-				total_mse += (ratio*q_lo->mse + (1-ratio)*q_hi->mse) / q_output_union->size;
-        	}
+		// Compute P(X_{i+1}|Q_i)
+		run_parallel(threads, info->cluster_count, compute_xpmf_task, &job);
+
+		// For each previous value Q_i of each cluster compute the quantizers
+		tasks = 0;
+		for (c = 0; c < info->cluster_count; ++c) {
+			state[c].first_task = tasks;
+			tasks += state[c].q_output_union->size;
+		}
+		run_parallel(threads, tasks, optimize_context_task, &job);
+
+		for (c = 0; c < info->cluster_count; ++c) {
+			s = &state[c];
+
+			// Each quantizer pair is used in proportion to P(Q_{i-1} = j) = sum_x P(Q_{i-1} = j | X_{i-1} = x) P(X_{i-1} = x),
+			// among the lines that reach this column at all
+			coverage = column_coverage(info, s->in_pmfs, column);
+			for (j = 0; j < s->q_output_union->size; ++j) {
+				p_ctx = 0.0;
+				for (x = 0; x < A->size; ++x) {
+					p_ctx += get_probability(s->qpmf_list->pmfs[x], j) * get_probability(s->in_pmfs->marginal_pmfs->pmfs[column-1], x);
+				}
+				q_lo = get_cond_quantizer_indexed(s->q_list, column, 2*j);
+				q_hi = get_cond_quantizer_indexed(s->q_list, column, 2*j+1);
+				s->distortion += coverage * p_ctx * (q_lo->ratio*q_lo->mse + q_hi->ratio*q_hi->mse);
+				s->rate += coverage * p_ctx * (q_lo->ratio*q_lo->entropy + q_hi->ratio*q_hi->entropy);
+			}
         
-        	// deallocated the memory of the used pmfs and alphabet
-        	free(q_prev_output_union);
-        	q_prev_output_union = q_output_union;
-	        free_pmf_list(prev_qpmf_list);
-			prev_qpmf_list = qpmf_list;
-	        free_pmf_list(xpmf_list);
-    	}
+        	// The previous column's pmfs and alphabet become the storage for the next one
+        	s->spare_output_union = s->q_prev_output_union;
+        	s->q_prev_output_union = s->q_output_union;
+			s->spare_qpmf_list = s->prev_qpmf_list;
+			s->prev_qpmf_list = s->qpmf_list;
+		}
+	}
     	
-		// Final cleanup, things we saved at the end of the final iteration that aren't needed
-		free_pmf_list(qpmf_list);
-    	free(q_output_union);
+	// Final cleanup, things we saved at the end of the final iteration that aren't needed,
+	// and the per symbol expectations of the whole file, with clusters weighted by their lines
+	info->opts->e_dist = 0.0;
+	info->opts->e_rate = 0.0;
+	for (c = 0; c < info->cluster_count; ++c) {
+		info->opts->e_dist += state[c].distortion * info->clusters->clusters[c].count / (double) info->symbols;
+		info->opts->e_rate += state[c].rate * info->clusters->clusters[c].count / (double) info->symbols;
+		free_pmf_list(state[c].qpmf_list);
+		free_pmf_list(state[c].spare_qpmf_list);
+		free_pmf_list(state[c].xpmf_list);
+    	free_alphabet(state[c].q_output_union);
+		free_alphabet(state[c].spare_output_union);
+	}
+	free(state);
+}
+
+/**
+ * Number of states of all the quantizers of a codebook together, which is how many priors
+ * it has
+ */
+static uint32_t count_codebook_states(struct cond_quantizer_list_t *quantizers) {
+	uint32_t i, j, k, states = 0;
+
+	for (i = 0; i < quantizers->columns; ++i) {
+		k = (i == 0) ? 1 : quantizers->input_alphabets[i]->size;
+		for (j = 0; j < 2*k; ++j) {
+			states += get_cond_quantizer_indexed(quantizers, i, j)->output_alphabet->size;
+		}
 	}
+	return states;
 }
 
 /**
- * Writes all of the codebooks for the set of quantizers given, along with necessary
- * metadata (columns, lines, cluster counts) first
+ * Writes the codebooks of every cluster in order. The cluster count, columns and lines
+ * they go with are in the container header in front of them. When the header says the
+ * adaptive stats start from priors, the priors of every cluster follow, each as a 4 byte
+ * length in network order and one byte per state of every quantizer, in the order of the
+ * compiled quantizers
  */
 void write_codebooks(FILE *fp, struct quality_file_t *info) {
-	uint32_t columns, lines;
 	uint32_t j;
-	char linebuf[1];
-
-	// Header line is number of clusters (1 byte)
-	// number of columns (4), total number of lines (4), then a newline
-	columns = htonl(info->columns);
-	lines = htonl((uint32_t)info->lines);
-	linebuf[0] = info->cluster_count;
-	fwrite(linebuf, sizeof(char), 1, fp);
-	fwrite(&columns, sizeof(uint32_t), 1, fp);
-	fwrite(&lines, sizeof(uint32_t), 1, fp);
-
-	// Now, write each cluster's codebook in order
+	uint8_t length[4];
+
 	for (j = 0; j < info->cluster_count; ++j) {
 		write_codebook(fp, info->clusters->clusters[j].qlist);
 	}
+
+	if (!info->stats_priors)
+		return;
+	for (j = 0; j < info->cluster_count; ++j) {
+		put_be32(length, count_codebook_states(info->clusters->clusters[j].qlist));
+		fwrite(length, sizeof(uint8_t), 4, fp);
+		fwrite(info->clusters->clusters[j].priors, sizeof(uint8_t), get_be32(length), fp);
+	}
 }
 
 /**
- * Writes a codebook to a file that will be used by the decoder to initialize the arithmetic decoder
- * identically to how it was set up during encoding. The format for the file is:
- * Line 1: 1 byte ratio offset by 33 to be human readable
- * Line 2: 1 byte per quantizer symbol for column 0, low
- * Line 3: 1 byte per quantizer symbol for column 0, high
- * Lines (1+3j, 2+3j, 3+3j):
- *  1: 1 byte per ratio per unique output of previous column
- *  2: 1 byte per quantizer symbol for each low quantizer in order of symbols in previous column
- *  3: 1 byte per quantizer symbol for each high quantizer in order of symbols in previous column
+ * Growable byte buffer that a codebook is built in before it is written
+ */
+struct codebook_buffer_t {
+	uint8_t *data;
+	uint32_t size;
+	uint32_t capacity;
+};
+
+static void put_codebook_byte(struct codebook_buffer_t *buf, uint8_t byte) {
+	if (buf->size == buf->capacity) {
+		buf->capacity = buf->capacity ? 2*buf->capacity : 4096;
+		buf->data = (uint8_t *) realloc(buf->data, buf->capacity);
+	}
+	buf->data[buf->size++] = byte;
+}
+
+/**
+ * Writes one quantizer as a list of its regions. Quantizers are step functions, so a
+ * quantizer with S states is described by the width of each region and the offset of its
+ * reconstruction point from the start of the region, modulo 256. The first S-1 regions
+ * take one byte each, width in the high nibble and offset in the low one, unless either is
+ * too big, in which case a zero byte is followed by the width and offset as whole bytes.
+ * The reconstruction point is normally inside its region, but a custom distortion measure
+ * can put it anywhere, which the whole byte offset can still describe. The last region's
+ * width is implied by the alphabet size, so only its offset is written. A quantizer that
+ * repeats the one just before it, or the one two before it (the same half of the previous
+ * context's pair), is written as a single byte instead
+ */
+static void put_codebook_quantizer(struct codebook_buffer_t *buf, const struct quantizer_t *q, const struct quantizer_t *prev, const struct quantizer_t *prev2) {
+	uint32_t size = q->alphabet->size;
+	uint32_t x, width, offset, start = 0, states = 1;
+
+	if (prev && memcmp(q->q, prev->q, size) == 0) {
+		put_codebook_byte(buf, CODEBOOK_REPEAT_PREVIOUS);
+		return;
+	}
+	if (prev2 && memcmp(q->q, prev2->q, size) == 0) {
+		put_codebook_byte(buf, CODEBOOK_REPEAT_CONTEXT);
+		return;
+	}
+
+	for (x = 1; x < size; ++x) {
+		if (q->q[x] != q->q[x-1])
+			states += 1;
+	}
+	put_codebook_byte(buf, (uint8_t) states);
+
+	for (x = 1; x <= size; ++x) {
+		if (x < size && q->q[x] == q->q[x-1])
+			continue;
+
+		width = x - start;
+		offset = (q->q[start] - start) & 0xff;
+		if (x == size)
+			put_codebook_byte(buf, (uint8_t) offset);
+		else if (width < 16 && offset < 16)
+			put_codebook_byte(buf, (uint8_t) ((width << 4) | offset));
+		else {
+			put_codebook_byte(buf, 0);
+			put_codebook_byte(buf, (uint8_t) width);
+			put_codebook_byte(buf, (uint8_t) offset);
+		}
+		start = x;
+	}
+}
+
+/**
+ * Writes a codebook that will be used by the decoder to initialize the arithmetic decoder
+ * identically to how it was set up during encoding. The codebook is a 4 byte length in
+ * network order followed by that many bytes, so that it can be read with a single read:
+ * Column 0: 1 byte ratio, then the low and high quantizers
+ * Column j: 1 byte ratio per unique output of the previous column, then the low and high
+ *           quantizer for each of those outputs in order
+ * Ratios are the chance (out of 128) of using the low quantizer, and quantizers are written
+ * by put_codebook_quantizer
  */
 void write_codebook(FILE *fp, struct cond_quantizer_list_t *quantizers) {
 	uint32_t i, j, k;
 	uint32_t columns = quantizers->columns;
-	struct quantizer_t *q_temp = get_cond_quantizer_indexed(quantizers, 0, 0);
-	uint32_t size = q_temp->alphabet->size;
-	uint32_t buflen = columns > size ? columns : size;
-	char *eol = "\n";
-	char *linebuf = (char *) _alloca(sizeof(char)*buflen);
-
-	// First line, ratio for zero context quantizer
-	linebuf[0] = quantizers->qratio[0][0] + 33;
-	linebuf[1] = eol[0];
-	fwrite(linebuf, sizeof(char), 2, fp);
-
-	// Second line is low quantizer
-	COPY_Q_TO_LINE(linebuf, q_temp->q, i, size);
-	fwrite(linebuf, sizeof(char), size, fp);
-	fwrite(eol, sizeof(char), 1, fp);
-
-	// Third line is high quantizer
-	q_temp = get_cond_quantizer_indexed(quantizers, 0, 1);
-	COPY_Q_TO_LINE(linebuf, q_temp->q, i, size);
-	fwrite(linebuf, sizeof(char), size, fp);
-	fwrite(eol, sizeof(char), 1, fp);
-
-	// Now for the rest of the columns, use the same format
-	for (i = 1; i < columns; ++i) {
-		// First a line containing ratios for each previous context
-		for (j = 0; j < quantizers->input_alphabets[i]->size; ++j) {
-			linebuf[j] = quantizers->qratio[i][j] + 33;
-		}
-		fwrite(linebuf, sizeof(char), quantizers->input_alphabets[i]->size, fp);
-		fwrite(eol, sizeof(char), 1, fp);
-
-		// Next, the low quantizers in index order
-		for (j = 0; j < quantizers->input_alphabets[i]->size; ++j) {
-			q_temp = get_cond_quantizer_indexed(quantizers, i, 2*j);
-			COPY_Q_TO_LINE(linebuf, q_temp->q, k, size);
-			fwrite(linebuf, sizeof(char), size, fp);
+	struct codebook_buffer_t buf;
+	struct quantizer_t *prev = NULL, *prev2 = NULL, *q;
+	uint8_t length[4];
+
+	memset(&buf, 0, sizeof(struct codebook_buffer_t));
+
+	for (i = 0; i < columns; ++i) {
+		k = (i == 0) ? 1 : quantizers->input_alphabets[i]->size;
+		for (j = 0; j < k; ++j) {
+			put_codebook_byte(&buf, quantizers->qratio[i][j]);
 		}
-		fwrite(eol, sizeof(char), 1, fp);
 
-		// Finally, the high quantizers in index order
-		for (j = 0; j < quantizers->input_alphabets[i]->size; ++j) {
-			q_temp = get_cond_quantizer_indexed(quantizers, i, 2*j+1);
-			COPY_Q_TO_LINE(linebuf, q_temp->q, k, size);
-			fwrite(linebuf, sizeof(char), size, fp);
+		for (j = 0; j < 2*k; ++j) {
+			q = get_cond_quantizer_indexed(quantizers, i, j);
+			put_codebook_quantizer(&buf, q, prev, prev2);
+			prev2 = prev;
+			prev = q;
 		}
-		fwrite(eol, sizeof(char), 1, fp);
 	}
+
+	put_be32(length, buf.size);
+	fwrite(length, sizeof(uint8_t), 4, fp);
+	fwrite(buf.data, sizeof(uint8_t), buf.size, fp);
+	free(buf.data);
 }
 
 /**
- * Reads in all of the codebooks for the clusters from the given file
+ * Reads in all of the codebooks for the clusters from the given file, once the container
+ * header has filled in how many clusters and columns there are
+ * @return 1, or 0 if they are truncated or corrupt, leaving what was read in info->clusters
  */
-void read_codebooks(FILE *fp, struct quality_file_t *info) {
+uint8_t read_codebooks(FILE *fp, struct quality_file_t *info) {
 	uint8_t j;
-	char line[9];
-
-	// Figure out how many clusters we have to set up cluster sizes
-	fread(line, sizeof(char), 9, fp);
-	info->cluster_count = line[0];
+	uint8_t length[4];
+	uint32_t size;
 
-	// Recover columns and lines as 32 bit integers
-	info->columns = (line[1] & 0xff) | ((line[2] << 8) & 0xff00) | ((line[3] << 16) & 0xff0000) | ((line[4] << 24) & 0xff000000);
-	info->columns = ntohl(info->columns);
-	info->lines = (line[5] & 0xff) | ((line[6] << 8) & 0xff00) | ((line[7] << 16) & 0xff0000) | ((line[8] << 24) & 0xff000000);
-	info->lines = ntohl(info->lines);
-	
-	// Can't allocate clusters until we know how many columns there are
 	info->clusters = alloc_cluster_list(info);
 
 	// Read codebooks in order
 	for (j = 0; j < info->cluster_count; ++j) {
 		info->clusters->clusters[j].qlist = read_codebook(fp, info);
+		if (!info->clusters->clusters[j].qlist)
+			return 0;
+	}
+
+	if (!info->stats_priors)
+		return 1;
+	for (j = 0; j < info->cluster_count; ++j) {
+		if (fread(length, sizeof(uint8_t), 4, fp) != 4 || get_be32(length) != count_codebook_states(info->clusters->clusters[j].qlist)) {
+			printf("Adaptive stats priors don't match the codebooks.\n");
+			return 0;
+		}
+		size = get_be32(length);
+		info->clusters->clusters[j].priors = (uint8_t *) malloc(size + 1);
+		if (!info->clusters->clusters[j].priors || fread(info->clusters->clusters[j].priors, sizeof(uint8_t), size, fp) != size) {
+			printf("Adaptive stats priors are truncated.\n");
+			return 0;
+		}
 	}
+	return 1;
+}
+
+/**
+ * Gives up on a quantizer that doesn't describe a valid one
+ * @return NULL, for get_codebook_quantizer to return
+ */
+static struct quantizer_t *corrupt_codebook(struct quantizer_t *q) {
+	free_quantizer(q);
+	return NULL;
 }
 
 /**
- * Reads a single codebook and sets up the quantizer list
+ * Reads one quantizer written by put_codebook_quantizer from the buffer at *pos
+ * @return The quantizer, or NULL if the codebook is corrupt
+ */
+static struct quantizer_t *get_codebook_quantizer(const uint8_t *data, uint32_t size, uint32_t *pos, const struct alphabet_t *A, const struct quantizer_t *prev, const struct quantizer_t *prev2) {
+	struct quantizer_t *q = alloc_quantizer(A);
+	uint32_t states, s, x, start = 0, width, offset;
+	uint8_t header;
+
+	if (*pos >= size)
+		return corrupt_codebook(q);
+	header = data[(*pos)++];
+
+	if (header == CODEBOOK_REPEAT_PREVIOUS || header == CODEBOOK_REPEAT_CONTEXT) {
+		if (header == CODEBOOK_REPEAT_CONTEXT)
+			prev = prev2;
+		if (!prev)
+			return corrupt_codebook(q);
+		memcpy(q->q, prev->q, A->size*sizeof(symbol_t));
+	}
+	else {
+		states = header;
+		if (states > A->size)
+			return corrupt_codebook(q);
+
+		for (s = 0; s < states; ++s) {
+			if (*pos >= size)
+				return corrupt_codebook(q);
+
+			if (s == states-1) {
+				width = A->size - start;
+				offset = data[(*pos)++];
+			}
+			else if (data[*pos] != 0) {
+				width = data[*pos] >> 4;
+				offset = data[*pos] & 0xf;
+				*pos += 1;
+			}
+			else {
+				if (*pos + 3 > size)
+					return corrupt_codebook(q);
+				width = data[*pos + 1];
+				offset = data[*pos + 2];
+				*pos += 3;
+			}
+
+			if (width == 0 || ((start + offset) & 0xff) >= A->size || start + width > A->size || (s < states-1 && start + width == A->size))
+				return corrupt_codebook(q);
+			for (x = start; x < start + width; ++x) {
+				q->q[x] = (symbol_t) ((start + offset) & 0xff);
+			}
+			start += width;
+		}
+	}
+
+	find_output_alphabet(q);
+	return q;
+}
+
+/**
+ * Reads a single codebook with one read and sets up the quantizer list
+ * @return The quantizer list, or NULL if the codebook is truncated or corrupt
  */
 struct cond_quantizer_list_t *read_codebook(FILE *fp, struct quality_file_t *info) {
-	uint32_t column, size;
+	uint32_t column, size, pos = 0, k;
 	uint32_t i, j;
-	struct quantizer_t *q_lo, *q_hi;
+	uint8_t length[4];
+	uint8_t *data;
+	struct quantizer_t *q, *prev = NULL, *prev2 = NULL;
 	struct cond_quantizer_list_t *qlist;
 	struct alphabet_t *uniques;
-	char line[MAX_CODEBOOK_LINE_LENGTH];
-	uint8_t qratio;
 	struct alphabet_t *A = info->alphabet;
-	uint32_t columns = info->columns;
 
-	uniques = alloc_alphabet(1);
+	if (fread(length, sizeof(uint8_t), 4, fp) != 4) {
+		printf("Compressed file is truncated in its codebooks.\n");
+		return NULL;
+	}
+	size = get_be32(length);
+	data = (uint8_t *) malloc(size);
+	if (!data || fread(data, sizeof(uint8_t), size, fp) != size) {
+		printf("Compressed file is truncated in its codebooks.\n");
+		free(data);
+		return NULL;
+	}
+
+	// Column 0 has a single context, later columns have one per output of the column before
 	qlist = alloc_conditional_quantizer_list(info->columns);
-	cond_quantizer_init_column(qlist, 0, uniques);
+	uniques = alloc_alphabet(1);
+	for (column = 0; column < info->columns; ++column) {
+		cond_quantizer_init_column(qlist, column, uniques);
+		k = uniques->size;
+		if (pos + k > size)
+			break;
+		for (i = 0; i < k; ++i) {
+			qlist->qratio[column][i] = data[pos++];
+		}
+
+		// Reset the union to collect this column's outputs
+		uniques->size = 0;
+		alphabet_compute_index(uniques);
+		for (j = 0; j < 2*k; ++j) {
+			q = get_codebook_quantizer(data, size, &pos, A, prev, prev2);
+			if (!q)
+				break;
+			qlist->q[column][j] = q;
+			alphabet_union(uniques, q->output_alphabet, uniques);
+			prev2 = prev;
+			prev = q;
+		}
+		if (j < 2*k)
+			break;
+	}
+
+	// We don't use the uniques from the last column
 	free_alphabet(uniques);
+	free(data);
 
-	// Next line is qratio for zero quantizer offset by 33
-	fgets(line, MAX_CODEBOOK_LINE_LENGTH, fp);
-	qratio = line[0] - 33;
-
-	// Allocate some quantizers and copy the tables from lines 3 and 4
-	q_lo = alloc_quantizer(A);
-	q_hi = alloc_quantizer(A);
-	fgets(line, MAX_CODEBOOK_LINE_LENGTH, fp);
-	COPY_Q_FROM_LINE(line, q_lo->q, j, A->size);
-	fgets(line, MAX_CODEBOOK_LINE_LENGTH, fp);
-	COPY_Q_FROM_LINE(line, q_hi->q, j, A->size);
-
-	// Fill in missing uniques information and store
-	find_output_alphabet(q_lo);
-	find_output_alphabet(q_hi);
-	uniques = alloc_alphabet(0);
-	alphabet_union(q_lo->output_alphabet, q_hi->output_alphabet, uniques);
-	store_cond_quantizers_indexed(q_lo, q_hi, 0.0, qlist, 0, 0);
-	qlist->qratio[0][0] = qratio;
-
-	// Now handle the remaining columns uniformly
-	for (column = 1; column < columns; ++column) {
-		// Initialize the column information so we can write to it directly
-		cond_quantizer_init_column(qlist, column, uniques);
-		size = uniques->size;
-		free_alphabet(uniques);
-		uniques = alloc_alphabet(0);
-		
-		// First line is the ratios
-		fgets(line, MAX_CODEBOOK_LINE_LENGTH, fp);
-		for (i = 0; i < size; ++i) {
-			qlist->qratio[column][i] = line[i] - 33;
+	if (column < info->columns) {
+		printf("Codebook is corrupt.\n");
+		free_cond_quantizer_list(qlist);
+		return NULL;
+	}
+	return qlist;
+}
+
+/**
+ * Probability of each (left context, symbol) pair in a column of a cluster's training data,
+ * indexed prev*ALPHABET_SIZE + symbol. Column 0 has no left context and uses prev = 0
+ */
+static void get_joint_pmf(struct cond_pmf_list_t *stats, uint32_t column, double *joint) {
+	uint32_t prev, x, size = stats->alphabet->size;
+	double p_prev;
+
+	memset(joint, 0, ALPHABET_SIZE*ALPHABET_SIZE*sizeof(double));
+	if (column == 0) {
+		for (x = 0; x < size; ++x) {
+			joint[x] = get_probability(get_cond_pmf(stats, 0, 0), x);
+		}
+		return;
+	}
+
+	for (prev = 0; prev < size; ++prev) {
+		p_prev = get_probability(stats->marginal_pmfs->pmfs[column-1], prev);
+		if (p_prev == 0.0)
+			continue;
+		for (x = 0; x < size; ++x) {
+			joint[prev*ALPHABET_SIZE + x] = p_prev * get_probability(get_cond_pmf(stats, column, prev), x);
 		}
+	}
+}
+
+/**
+ * 64 bit FNV-1a hash of a distortion measure's table, so that a cache made with one custom
+ * matrix is never used with another
+ */
+static uint64_t hash_distortion(struct distortion_t *dist) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	const uint8_t *bytes;
+	size_t i, size;
+
+	if (dist->matrix) {
+		bytes = (const uint8_t *) dist->matrix;
+		size = dist->symbols*dist->symbols*sizeof(float);
+	}
+	else {
+		bytes = (const uint8_t *) dist->by_difference;
+		size = dist->symbols*sizeof(double);
+	}
+
+	for (i = 0; i < size; ++i) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+/**
+ * Builds the header of a codebook cache file, holding everything other than the statistics
+ * that the codebooks depend on: magic, version, clusters, distortion type, mode, columns,
+ * the ratio and a hash of the distortion matrix
+ */
+static void make_codebook_cache_header(struct quality_file_t *info, uint8_t *header) {
+	uint64_t bits, hash;
+
+	memcpy(&bits, &info->opts->ratio, sizeof(uint64_t));
+	hash = hash_distortion(info->dist);
+
+	memcpy(header, CODEBOOK_CACHE_MAGIC, 4);
+	header[4] = CODEBOOK_CACHE_VERSION;
+	header[5] = info->cluster_count;
+	header[6] = info->dist->type;
+	header[7] = info->opts->mode;
+	put_be32(header+8, info->columns);
+	put_be32(header+12, (uint32_t) (bits >> 32));
+	put_be32(header+16, (uint32_t) bits);
+	put_be32(header+20, (uint32_t) (hash >> 32));
+	put_be32(header+24, (uint32_t) hash);
+}
+
+/**
+ * Saves the codebooks of every cluster to a cache file, together with the options they were
+ * designed for and a fingerprint of the statistics they were designed from. The fingerprint
+ * holds the nonzero entries of each column's joint PMF of left context and symbol, as
+ * (index, probability * 2^32) pairs in network order. The codebooks follow in the same
+ * format as in a compressed file
+ * @return 1, or 0 if the file can't be opened
+ */
+uint8_t write_codebook_cache(const char *path, struct quality_file_t *info) {
+	FILE *fp;
+	uint32_t column, k, count, buf[2];
+	uint8_t c;
+	double *joint;
+
+	uint8_t header[CODEBOOK_CACHE_HEADER_LENGTH];
+
+	fp = fopen(path, "wb");
+	if (!fp) {
+		perror("Unable to open codebook file for writing");
+		return 0;
+	}
+	joint = (double *) malloc(ALPHABET_SIZE*ALPHABET_SIZE*sizeof(double));
+
+	make_codebook_cache_header(info, header);
+	fwrite(header, sizeof(uint8_t), CODEBOOK_CACHE_HEADER_LENGTH, fp);
 
-		// Next line is a number of low quantizers
-		for (i = 0; i < size; ++i) {
-			q_lo = alloc_quantizer(A);
-			fread(line, A->size*sizeof(symbol_t), 1, fp);
-			COPY_Q_FROM_LINE(line, q_lo->q, j, A->size);
-			
-			find_output_alphabet(q_lo);
-			qlist->q[column][2*i] = q_lo;
-			alphabet_union(uniques, q_lo->output_alphabet, uniques);
+	for (c = 0; c < info->cluster_count; ++c) {
+		for (column = 0; column < info->columns; ++column) {
+			get_joint_pmf(info->clusters->clusters[c].training_stats, column, joint);
+
+			count = 0;
+			for (k = 0; k < ALPHABET_SIZE*ALPHABET_SIZE; ++k) {
+				if (joint[k] > 0.0)
+					count += 1;
+			}
+			buf[0] = htonl(count);
+			fwrite(buf, sizeof(uint32_t), 1, fp);
+
+			for (k = 0; k < ALPHABET_SIZE*ALPHABET_SIZE; ++k) {
+				if (joint[k] > 0.0) {
+					buf[0] = htonl(k);
+					buf[1] = htonl((uint32_t) (joint[k] * 4294967295.0));
+					fwrite(buf, sizeof(uint32_t), 2, fp);
+				}
+			}
 		}
+	}
+
+	for (c = 0; c < info->cluster_count; ++c) {
+		write_codebook(fp, info->clusters->clusters[c].qlist);
+	}
+
+	free(joint);
+	fclose(fp);
+	return 1;
+}
+
+/**
+ * One column of a cached fingerprint, holding the nonzero entries of its joint PMF
+ */
+struct cached_column_t {
+	uint32_t count;
+	uint32_t *index;
+	double *p;
+};
 
-		// Kill the line with fgets to handle \n or \r\n automatically
-		(void) fgets(line, 2, fp);
+/**
+ * Loads the codebooks of every cluster from a cache file written by write_codebook_cache,
+ * but only if they were designed with the same options and each current cluster can be
+ * matched to a different cached cluster whose statistics are within the tolerance set in the
+ * options. The distance between two clusters is the largest KL divergence of any column from
+ * the cached joint PMF to the current one, and clusters are matched greedily from the closest
+ * pair, since cluster numbering isn't stable between files. Statistics must already have
+ * been calculated
+ * @return 1 if the codebooks were loaded, 0 if they need to be generated
+ */
+uint8_t read_codebook_cache(const char *path, struct quality_file_t *info) {
+	FILE *fp;
+	uint32_t column, k, buf[2];
+	uint8_t header[CODEBOOK_CACHE_HEADER_LENGTH], expected[CODEBOOK_CACHE_HEADER_LENGTH];
+	uint32_t clusters = info->cluster_count, c, m, best_c = 0, best_m = 0;
+	uint8_t usable = 1;
+	double d, best, max_d = 0.0;
+	double unseen;
+	double *joint, *smoothed, *distance;
+	uint8_t *used_c, *used_m, *match;
+	struct cached_column_t *cached;
+	struct cached_column_t *col;
+	struct cond_quantizer_list_t **qlists;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return 0;
+
+	// The header has to match exactly what we would write for these options
+	make_codebook_cache_header(info, expected);
+	if (fread(header, sizeof(uint8_t), CODEBOOK_CACHE_HEADER_LENGTH, fp) != CODEBOOK_CACHE_HEADER_LENGTH
+			|| memcmp(header, expected, CODEBOOK_CACHE_HEADER_LENGTH) != 0) {
+		if (info->opts->verbose)
+			printf("Codebook file %s doesn't match these options.\n", path);
+		fclose(fp);
+		return 0;
+	}
 
-		// Next line is a number of high quantizers
-		for (i = 0; i < size; ++i) {
-			q_hi = alloc_quantizer(A);
-			fread(line, A->size*sizeof(symbol_t), 1, fp);
-			COPY_Q_FROM_LINE(line, q_hi->q, j, A->size);
+	// Load every cached fingerprint
+	cached = (struct cached_column_t *) calloc(clusters*info->columns, sizeof(struct cached_column_t));
+	for (k = 0; k < clusters*info->columns && usable; ++k) {
+		col = &cached[k];
+		if (fread(buf, sizeof(uint32_t), 1, fp) != 1 || ntohl(buf[0]) > ALPHABET_SIZE*ALPHABET_SIZE) {
+			usable = 0;
+			break;
+		}
+		col->count = ntohl(buf[0]);
+		col->index = (uint32_t *) malloc(col->count*sizeof(uint32_t));
+		col->p = (double *) malloc(col->count*sizeof(double));
+		for (m = 0; m < col->count; ++m) {
+			if (fread(buf, sizeof(uint32_t), 2, fp) != 2 || ntohl(buf[0]) >= ALPHABET_SIZE*ALPHABET_SIZE) {
+				usable = 0;
+				break;
+			}
+			col->index[m] = ntohl(buf[0]);
+			col->p[m] = ntohl(buf[1]) / 4294967295.0;
+		}
+	}
 
-			find_output_alphabet(q_hi);
-			qlist->q[column][2*i+1] = q_hi;
-			alphabet_union(uniques, q_hi->output_alphabet, uniques);
+	// Distance between each current cluster c and cached cluster m
+	joint = (double *) malloc(ALPHABET_SIZE*ALPHABET_SIZE*sizeof(double));
+	smoothed = (double *) malloc(ALPHABET_SIZE*ALPHABET_SIZE*sizeof(double));
+	distance = (double *) calloc(clusters*clusters, sizeof(double));
+	for (c = 0; c < clusters && usable; ++c) {
+		for (column = 0; column < info->columns; ++column) {
+			get_joint_pmf(info->clusters->clusters[c].training_stats, column, joint);
+			for (m = 0; m < clusters; ++m) {
+				// D(current || cached) over the current support, against the cached PMF with
+				// CODEBOOK_CACHE_EPSILON added to every entry so that it stays finite. Entries
+				// the cache has no record of are marked as negative
+				col = &cached[m*info->columns + column];
+				for (k = 0; k < ALPHABET_SIZE*ALPHABET_SIZE; ++k) {
+					smoothed[k] = -1.0;
+				}
+				for (k = 0; k < col->count; ++k) {
+					smoothed[col->index[k]] = col->p[k];
+				}
+
+				d = 0.0;
+				unseen = 0.0;
+				for (k = 0; k < ALPHABET_SIZE*ALPHABET_SIZE; ++k) {
+					if (joint[k] <= 0.0)
+						continue;
+					if (smoothed[k] < 0.0) {
+						unseen += joint[k];
+						smoothed[k] = 0.0;
+					}
+					d += joint[k] * log2(joint[k] * (1.0 + CODEBOOK_CACHE_EPSILON*ALPHABET_SIZE*ALPHABET_SIZE) / (smoothed[k] + CODEBOOK_CACHE_EPSILON));
+				}
+
+				// The cached codebooks were never designed for symbols their statistics didn't have
+				if (unseen > 0.0)
+					d = DBL_MAX;
+				if (d > distance[c*clusters + m])
+					distance[c*clusters + m] = d;
+			}
 		}
+	}
 
-		// Kill the line with fgets again
-		(void) fgets(line, 2, fp);
+	// Greedily pair up the closest clusters
+	used_c = (uint8_t *) calloc(clusters, sizeof(uint8_t));
+	used_m = (uint8_t *) calloc(clusters, sizeof(uint8_t));
+	match = (uint8_t *) calloc(clusters, sizeof(uint8_t));
+	for (k = 0; k < clusters && usable; ++k) {
+		best = DBL_MAX;
+		for (c = 0; c < clusters; ++c) {
+			for (m = 0; m < clusters; ++m) {
+				if (!used_c[c] && !used_m[m] && distance[c*clusters + m] < best) {
+					best = distance[c*clusters + m];
+					best_c = c;
+					best_m = m;
+				}
+			}
+		}
+		used_c[best_c] = 1;
+		used_m[best_m] = 1;
+		match[best_c] = (uint8_t) best_m;
+		if (best > max_d)
+			max_d = best;
+	}
+	if (max_d > info->opts->codebook_tolerance)
+		usable = 0;
+
+	if (info->opts->verbose) {
+		if (usable)
+			printf("Reusing codebooks from %s (largest column divergence %f bits).\n", path, max_d);
+		else if (max_d == DBL_MAX)
+			printf("Statistics have symbols the codebooks in %s weren't designed for, generating new codebooks.\n", path);
+		else
+			printf("Statistics differ from the codebooks in %s by %f bits, generating new codebooks.\n", path, max_d);
 	}
 
-	// We don't use the uniques from the last column
-	free_alphabet(uniques);
+	// Codebooks are stored in cached cluster order
+	if (usable) {
+		qlists = (struct cond_quantizer_list_t **) calloc(clusters, sizeof(struct cond_quantizer_list_t *));
+		for (m = 0; m < clusters && usable; ++m) {
+			qlists[m] = read_codebook(fp, info);
+			if (qlists[m])
+				qlists[m]->options = info->opts;
+			else
+				usable = 0;
+		}
+		for (c = 0; c < clusters; ++c) {
+			if (usable)
+				info->clusters->clusters[c].qlist = qlists[match[c]];
+			else if (qlists[c])
+				free_cond_quantizer_list(qlists[c]);
+		}
+		free(qlists);
+	}
 
-	return qlist;
+	for (k = 0; k < clusters*info->columns; ++k) {
+		free(cached[k].index);
+		free(cached[k].p);
+	}
+	free(cached);
+	free(joint);
+	free(smoothed);
+	free(distance);
+	free(used_c);
+	free(used_m);
+	free(match);
+	fclose(fp);
+	return usable;
 }
 
 /**
@@ -0,0 +1,254 @@
+/**
+ * Reads and writes the container header, and checksums the coded segments it describes.
+ * Every multibyte field is stored in network order so files move between machines:
+ *
+ * Bytes 0-3     magic, CONTAINER_MAGIC
+ * Byte 4        container version
+ * Bytes 5-6     length of the whole header, CONTAINER_HEADER_LENGTH_V1 for version 1 and
+ *               CONTAINER_HEADER_LENGTH for version 2
+ * Byte 7        flags, CONTAINER_VARIABLE_LENGTH and CONTAINER_CLUSTER_MEANS
+ * Byte 8        entropy coder, CODER_ARITHMETIC or CODER_RANGE
+ * Byte 9        number of clusters
+ * Bytes 10-13   number of columns, the length of the longest line
+ * Bytes 14-21   number of lines, or CONTAINER_LINES_UNKNOWN
+ * Bytes 22-149  WELL seed, 32 words, which also keys the counter based generator
+ * Byte 150      quantizer selection generator, DITHER_WELL or DITHER_COUNTER
+ *
+ * Version 2 adds the adaptive model, which version 1 files always code with the defaults:
+ *
+ * Byte 151      model flags, CONTAINER_MODEL_PRIORS
+ * Byte 152      step added to a symbol's count
+ * Byte 153      step of the fast counts, or 0 if counts aren't mixed
+ * Bytes 154-157 total count at which the counts are halved
+ *
+ * A file coded with the default model is written as version 1, so older readers keep
+ * working on it.
+ *
+ * The codebooks follow the header, then the segment index and the segments. Codebook files
+ * written through include/qvz.h have the same header and codebooks, followed by the cluster
+ * centers instead of any segments.
+ */
+
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "container.h"
+#include "qv_compressor.h"
+
+#define CONTAINER_LINES_OFFSET		14
+#define CONTAINER_SEED_OFFSET		22
+#define CONTAINER_DITHER_OFFSET		150
+#define CONTAINER_MODEL_OFFSET		151
+
+// Reflected CRC-32C (Castagnoli) polynomial, the one SSE4.2 computes in hardware
+#define CRC32C_POLYNOMIAL			0x82f63b78
+
+typedef uint32_t (*checksum_kernel_t)(uint32_t crc, const uint8_t *data, size_t size);
+
+static uint32_t crc32c_table[256];
+static checksum_kernel_t checksum_kernel;
+static pthread_once_t checksum_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Whether info is coded with anything but the default adaptive model, which needs a
+ * version 2 header to record it
+ */
+static uint8_t uses_custom_model(struct quality_file_t *info) {
+	return info->stats_step != STATS_STEP_DEFAULT || info->stats_fast_step != 0 || info->stats_limit != STATS_LIMIT_MAX || info->stats_priors;
+}
+
+/**
+ * Writes the container header for info, including the WELL seed that the segments will
+ * derive their states from, which must already be chosen. A streamed file doesn't know its
+ * line count yet, so it is written as unknown to be filled in by update_container_lines if
+ * the output allows it
+ * @param flags Flags to set besides CONTAINER_VARIABLE_LENGTH, which comes from info
+ * @return Position of the line count in fp, or -1 if fp isn't seekable
+ */
+off_t write_container_header(FILE *fp, struct quality_file_t *info, uint8_t streamed, uint8_t flags) {
+	uint8_t header[CONTAINER_HEADER_LENGTH];
+	uint32_t i, length = CONTAINER_HEADER_LENGTH_V1;
+	off_t pos;
+
+	memcpy(header, CONTAINER_MAGIC, 4);
+	header[4] = 1;
+	header[7] = flags | (info->variable_length ? CONTAINER_VARIABLE_LENGTH : 0);
+	header[8] = info->coder;
+	header[9] = info->cluster_count;
+	put_be32(header+10, info->columns);
+	put_be64(header+CONTAINER_LINES_OFFSET, streamed ? CONTAINER_LINES_UNKNOWN : info->lines);
+	for (i = 0; i < 32; ++i) {
+		put_be32(header + CONTAINER_SEED_OFFSET + 4*i, info->well.state[i]);
+	}
+	header[CONTAINER_DITHER_OFFSET] = info->dither;
+
+	if (uses_custom_model(info)) {
+		header[4] = CONTAINER_VERSION;
+		length = CONTAINER_HEADER_LENGTH;
+		header[CONTAINER_MODEL_OFFSET] = info->stats_priors ? CONTAINER_MODEL_PRIORS : 0;
+		header[CONTAINER_MODEL_OFFSET+1] = info->stats_step;
+		header[CONTAINER_MODEL_OFFSET+2] = info->stats_fast_step;
+		put_be32(header + CONTAINER_MODEL_OFFSET + 3, info->stats_limit);
+	}
+	header[5] = (uint8_t) (length >> 8);
+	header[6] = (uint8_t) length;
+
+	pos = ftello(fp);
+	fwrite(header, sizeof(uint8_t), length, fp);
+	return (pos < 0) ? -1 : pos + CONTAINER_LINES_OFFSET;
+}
+
+/**
+ * Fills in the line count of a streamed file once it is known, when the output can seek
+ * back to the header. Otherwise the count stays unknown, which decoders handle
+ */
+void update_container_lines(FILE *fp, off_t pos, uint64_t lines) {
+	uint8_t buf[8];
+
+	if (pos < 0 || fseeko(fp, pos, SEEK_SET) != 0)
+		return;
+
+	put_be64(buf, lines);
+	fwrite(buf, sizeof(uint8_t), 8, fp);
+	fseeko(fp, 0, SEEK_END);
+}
+
+/**
+ * Reads the container header into info, including the WELL seed, and leaves fp at the
+ * start of the codebooks. Fields appended by later versions of the header are skipped
+ * @param flags Set to the flags byte
+ * @return 1, or 0 if fp doesn't start with a header this version can read
+ */
+uint8_t read_container_header(FILE *fp, struct quality_file_t *info, uint8_t *flags) {
+	uint8_t header[CONTAINER_HEADER_LENGTH];
+	uint32_t length, known, i;
+
+	if (fread(header, sizeof(uint8_t), CONTAINER_PREFIX_LENGTH, fp) != CONTAINER_PREFIX_LENGTH || memcmp(header, CONTAINER_MAGIC, 4) != 0) {
+		printf("Input is not a qvz compressed file.\n");
+		return 0;
+	}
+	if (header[4] < 1 || header[4] > CONTAINER_VERSION) {
+		printf("Compressed file has container version %d, but only versions up to %d are supported.\n", header[4], CONTAINER_VERSION);
+		return 0;
+	}
+
+	length = (((uint32_t) header[5]) << 8) | header[6];
+	known = (header[4] == 1) ? CONTAINER_HEADER_LENGTH_V1 : CONTAINER_HEADER_LENGTH;
+	if (length < known || fread(header + CONTAINER_PREFIX_LENGTH, sizeof(uint8_t), known - CONTAINER_PREFIX_LENGTH, fp) != known - CONTAINER_PREFIX_LENGTH) {
+		printf("Compressed file header is truncated.\n");
+		return 0;
+	}
+	for (i = known; i < length; ++i) {
+		if (fgetc(fp) == EOF) {
+			printf("Compressed file header is truncated.\n");
+			return 0;
+		}
+	}
+
+	info->variable_length = (header[7] & CONTAINER_VARIABLE_LENGTH) ? 1 : 0;
+	info->coder = header[8];
+	if (info->coder != CODER_ARITHMETIC && info->coder != CODER_RANGE) {
+		printf("Unsupported entropy coder %d in compressed file.\n", info->coder);
+		return 0;
+	}
+	info->dither = header[CONTAINER_DITHER_OFFSET];
+	if (info->dither != DITHER_WELL && info->dither != DITHER_COUNTER) {
+		printf("Unsupported quantizer selection generator %d in compressed file.\n", info->dither);
+		return 0;
+	}
+	info->cluster_count = header[9];
+	info->columns = get_be32(header+10);
+	info->lines = get_be64(header+CONTAINER_LINES_OFFSET);
+
+	info->stats_step = STATS_STEP_DEFAULT;
+	info->stats_fast_step = 0;
+	info->stats_limit = STATS_LIMIT_MAX;
+	info->stats_priors = 0;
+	if (header[4] > 1) {
+		info->stats_priors = (header[CONTAINER_MODEL_OFFSET] & CONTAINER_MODEL_PRIORS) ? 1 : 0;
+		info->stats_step = header[CONTAINER_MODEL_OFFSET+1];
+		info->stats_fast_step = header[CONTAINER_MODEL_OFFSET+2];
+		info->stats_limit = get_be32(header + CONTAINER_MODEL_OFFSET + 3);
+		if (info->stats_step == 0 || info->stats_limit < STATS_LIMIT_MIN || info->stats_limit > STATS_LIMIT_MAX) {
+			printf("Unsupported adaptive model in compressed file.\n");
+			return 0;
+		}
+	}
+
+	// Must start at zero
+	memset(&info->well, 0, sizeof(struct well_state_t));
+	for (i = 0; i < 32; ++i) {
+		info->well.state[i] = get_be32(header + CONTAINER_SEED_OFFSET + 4*i);
+	}
+	*flags = header[7];
+	return 1;
+}
+
+/**
+ * Portable kernel, one table lookup per byte
+ */
+static uint32_t crc32c_table_kernel(uint32_t crc, const uint8_t *data, size_t size) {
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		crc = crc32c_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+/**
+ * SSE4.2 kernel, eight bytes per instruction
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42_kernel(uint32_t crc, const uint8_t *data, size_t size) {
+	uint64_t crc64 = crc, word;
+	size_t i = 0;
+
+	for (; i + 8 <= size; i += 8) {
+		memcpy(&word, data + i, sizeof(uint64_t));
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+	}
+	crc = (uint32_t) crc64;
+	for (; i < size; ++i) {
+		crc = __builtin_ia32_crc32qi(crc, data[i]);
+	}
+	return crc;
+}
+
+#endif
+
+/**
+ * Builds the lookup table and picks the fastest kernel, once for the whole process
+ */
+static void init_checksum(void) {
+	uint32_t i, j, crc;
+
+	for (i = 0; i < 256; ++i) {
+		crc = i;
+		for (j = 0; j < 8; ++j) {
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+		}
+		crc32c_table[i] = crc;
+	}
+
+	checksum_kernel = crc32c_table_kernel;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		checksum_kernel = crc32c_sse42_kernel;
+#endif
+}
+
+/**
+ * Checksums the coded bytes of a segment. Safe to call from several threads at once
+ */
+uint32_t segment_checksum(const uint8_t *data, size_t size) {
+	pthread_once(&checksum_once, init_checksum);
+	return ~checksum_kernel(~0u, data, size);
+}
@@ -7,12 +7,17 @@
 #include "util.h"
 
 /**
- * Allocates memory for a distortion matrix
+ * Allocates memory for a distortion matrix, with a table per difference for the built in
+ * measures or a full matrix for a custom one
  */
-struct distortion_t *alloc_distortion_matrix(uint8_t symbols) {
+struct distortion_t *alloc_distortion_matrix(uint8_t symbols, uint8_t type) {
 	struct distortion_t *rtn = (struct distortion_t *) calloc(1, sizeof(struct distortion_t));
 	rtn->symbols = symbols;
-	rtn->distortion = (double *) calloc(symbols*symbols, sizeof(double));
+	rtn->type = type;
+	if (type == DISTORTION_CUSTOM)
+		rtn->matrix = (float *) calloc(symbols*symbols, sizeof(float));
+	else
+		rtn->by_difference = (double *) calloc(symbols, sizeof(double));
 	return rtn;
 }
 
@@ -20,12 +25,14 @@ struct distortion_t *alloc_distortion_matrix(uint8_t symbols) {
  * Deallocates memory from a distortion matrix
  */
 void free_distortion_matrix(struct distortion_t *d) {
-	free(d->distortion);
+	free(d->by_difference);
+	free(d->matrix);
 	free(d);
 }
 
 /**
  * Public facing method for allocating distortion matrices
+ * @return The matrix, or NULL for a type that has to be read with gen_custom_distortion
  */
 struct distortion_t *generate_distortion_matrix(uint8_t symbols, int type) {
 	switch (type) {
@@ -37,10 +44,10 @@ struct distortion_t *generate_distortion_matrix(uint8_t symbols, int type) {
 			return gen_lorentzian_distortion(symbols);
 		case DISTORTION_CUSTOM:
 			printf("Custom distortion matrices should be allocated with gen_custom_distortion() instead.\n");
-			exit(1);
+			return NULL;
 		default:
 			printf("Invalid distortion type %d specified.\n", type);
-			exit(1);
+			return NULL;
 	}
 }
 
@@ -48,13 +55,11 @@ struct distortion_t *generate_distortion_matrix(uint8_t symbols, int type) {
  * Generate a distortion matrix according to the Manhattan distance (L1) metric
  */
 struct distortion_t *gen_manhattan_distortion(uint8_t symbols) {
-	struct distortion_t *rtn = alloc_distortion_matrix(symbols);
-	uint8_t x, y;
+	struct distortion_t *rtn = alloc_distortion_matrix(symbols, DISTORTION_MANHATTAN);
+	uint8_t d;
 
-	for (x = 0; x < symbols; ++x) {
-		for (y = 0; y < symbols; ++y) {
-			rtn->distortion[x + y*symbols] = abs(x - y);
-		}
+	for (d = 0; d < symbols; ++d) {
+		rtn->by_difference[d] = get_manhattan_distortion(d, 0);
 	}
 
 	return rtn;
@@ -64,13 +69,11 @@ struct distortion_t *gen_manhattan_distortion(uint8_t symbols) {
  * Generates a distortion matrix according to the MSE (L2) metric
  */
 struct distortion_t *gen_mse_distortion(uint8_t symbols) {
-	struct distortion_t *rtn = alloc_distortion_matrix(symbols);
-	uint8_t x, y;
+	struct distortion_t *rtn = alloc_distortion_matrix(symbols, DISTORTION_MSE);
+	uint8_t d;
 
-	for (x = 0; x < symbols; ++x) {
-		for (y = 0; y < symbols; ++y) {
-			rtn->distortion[x + y*symbols] = (x - y)*(x - y);
-		}
+	for (d = 0; d < symbols; ++d) {
+		rtn->by_difference[d] = get_mse_distortion(d, 0);
 	}
 
 	return rtn;
@@ -80,13 +83,11 @@ struct distortion_t *gen_mse_distortion(uint8_t symbols) {
  * Generates a distortion matrix according to the lorentzian (log-L1) metric
  */
 struct distortion_t *gen_lorentzian_distortion(uint8_t symbols) {
-	struct distortion_t *rtn = alloc_distortion_matrix(symbols);
-	uint8_t x, y;
+	struct distortion_t *rtn = alloc_distortion_matrix(symbols, DISTORTION_LORENTZ);
+	uint8_t d;
 
-	for (x = 0; x < symbols; ++x) {
-		for (y = 0; y < symbols; ++y) {
-			rtn->distortion[x + y*symbols] = log2( 1.0 + (double)(abs(x - y)) );
-		}
+	for (d = 0; d < symbols; ++d) {
+		rtn->by_difference[d] = log2( 1.0 + (double) d );
 	}
 
 	return rtn;
@@ -94,11 +95,13 @@ struct distortion_t *gen_lorentzian_distortion(uint8_t symbols) {
 
 /**
  * Reads in a custom distortion matrix specified in the given file
- * The file format is S rows of S columns containing double valued distortions
- * separated by commas. Lines beginning with a # are ignored as comments
+ * The file format is S rows of S columns containing real valued distortions
+ * separated by commas, which are stored as floats. Lines beginning with a # are
+ * ignored as comments
+ * @return The matrix, or NULL if the file can't be opened
  */
 struct distortion_t *gen_custom_distortion(uint8_t symbols, const char *filename) {
-	struct distortion_t *dist = alloc_distortion_matrix(symbols);
+	struct distortion_t *dist = alloc_distortion_matrix(symbols, DISTORTION_CUSTOM);
 	uint8_t x, y;
 	FILE *fp;
 	char line[1024];
@@ -108,7 +111,8 @@ struct distortion_t *gen_custom_distortion(uint8_t symbols, const char *filename
 	fp = fopen(filename, "rt");
 	if (!fp) {
 		perror("Unable to open distortion definition file");
-		exit(1);
+		free_distortion_matrix(dist);
+		return NULL;
 	}
 
 	x = 0;
@@ -122,14 +126,15 @@ struct distortion_t *gen_custom_distortion(uint8_t symbols, const char *filename
 
 		while (y < symbols && field != NULL) {
 			field += 1;
-			dist->distortion[x + symbols*y] = atof(field);
+			dist->matrix[x + symbols*y] = (float) atof(field);
 			field = strchr(field, ',');
 			y += 1;
 		}
 
 		while (y < symbols) {
 			missing = 1;
-			dist->distortion[x + symbols*y] = 0.0;
+			dist->matrix[x + symbols*y] = 0.0f;
+			y += 1;
 		}
 
 		if (missing) {
@@ -145,11 +150,38 @@ struct distortion_t *gen_custom_distortion(uint8_t symbols, const char *filename
 }
 
 /**
- * Retrieve the distortion for a pair (x, y). Generally x is the true value and
- * y is the reconstructed value. Handles the matrix->linear array indexing
+ * Total distortion of reconstructing the quality characters x as y over a line. Both are
+ * Phred+33 characters, as in the input. MSE and L1 are sums of integers, so they are
+ * accumulated exactly in integer lanes that the compiler vectorizes, and the other
+ * measures add up their table entries in column order
  */
-double get_distortion(struct distortion_t *dist, uint8_t x, uint8_t y) {
-	return dist->distortion[x + dist->symbols*y];
+double get_line_distortion(const struct distortion_t *dist, const uint8_t *x, const uint8_t *y, uint32_t columns) {
+	uint64_t total = 0;
+	int32_t d;
+	double error = 0.0;
+	uint32_t s;
+
+	switch (dist->type) {
+		case DISTORTION_MSE:
+			for (s = 0; s < columns; ++s) {
+				d = (int32_t) x[s] - (int32_t) y[s];
+				total += (uint32_t) (d*d);
+			}
+			return (double) total;
+		case DISTORTION_MANHATTAN:
+			for (s = 0; s < columns; ++s) {
+				d = (int32_t) x[s] - (int32_t) y[s];
+				total += (uint32_t) ((d < 0) ? -d : d);
+			}
+			return (double) total;
+		default:
+			break;
+	}
+
+	for (s = 0; s < columns; ++s) {
+		error += get_distortion(dist, x[s] - 33, y[s] - 33);
+	}
+	return error;
 }
 
 /**
@@ -173,7 +205,7 @@ void print_distortion(struct distortion_t *dist) {
 	for (x = 0; x < dist->symbols; ++x) {
 		printf(" %2d |", x);
 		for (y = 0; y < dist->symbols; ++y) {
-			printf("%2.2f|", dist->distortion[x + y*dist->symbols]);
+			printf("%2.2f|", get_distortion(dist, x, y));
 		}
 		printf("\n");
 	}
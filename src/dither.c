@@ -0,0 +1,225 @@
+/**
+ * Counter based quantizer selection values. The values of a line come from four per 32 bit
+ * word of a hash, where word w of line i is
+ *
+ *   h = mix(key.line ^ (i * 0x9e3779b9))
+ *   x = mix((h + w * 0x85ebca6b) ^ key.column)
+ *
+ * and its bytes, low byte first, are masked to 7 bits. mix is a two multiply integer
+ * finalizer. Nothing depends on the previous word, so the vector kernels hash a register's
+ * worth of words at a time, and the fastest kernel supported by the processor is chosen
+ * at runtime. Every kernel gives the same values.
+ */
+
+#include "util.h"
+
+#include <stdio.h>
+
+#include "dither.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define DITHER_SIMD_X86
+#elif defined(__aarch64__)
+	#include <arm_neon.h>
+	#define DITHER_SIMD_NEON
+#endif
+
+#define DITHER_LINE_STEP		0x9e3779b9
+#define DITHER_WORD_STEP		0x85ebca6b
+#define DITHER_MIX_1			0x7feb352d
+#define DITHER_MIX_2			0x846ca68b
+
+static uint32_t dither_mix(uint32_t x) {
+	x ^= x >> 16;
+	x *= DITHER_MIX_1;
+	x ^= x >> 15;
+	x *= DITHER_MIX_2;
+	x ^= x >> 16;
+	return x;
+}
+
+/**
+ * Derives the key of one segment from the seed stored with the file, so that every
+ * segment gets its own values and can be coded on its own
+ * @param key Key to initialize
+ * @param seed Seed state stored with the file
+ * @param segment Index of the segment the key will be used for
+ */
+void dither_seed_segment(struct dither_key_t *key, const struct well_state_t *seed, uint32_t segment) {
+	uint32_t i, h = dither_mix(segment + DITHER_LINE_STEP);
+
+	for (i = 0; i < 32; ++i) {
+		h = dither_mix(h ^ seed->state[i]) + i;
+	}
+
+	key->line = h;
+	key->column = dither_mix(h ^ DITHER_WORD_STEP);
+}
+
+/**
+ * Portable kernel, one word at a time
+ */
+static void dither_line_scalar(const struct dither_key_t *key, uint32_t line, uint32_t columns, uint8_t *out) {
+	uint32_t h = dither_mix(key->line ^ (line * DITHER_LINE_STEP));
+	uint32_t w, x;
+
+	for (w = 0; 4*w < columns; ++w) {
+		x = dither_mix((h + w * DITHER_WORD_STEP) ^ key->column);
+		out[4*w] = x & 0x7f;
+		out[4*w+1] = (x >> 8) & 0x7f;
+		out[4*w+2] = (x >> 16) & 0x7f;
+		out[4*w+3] = (x >> 24) & 0x7f;
+	}
+}
+
+#ifdef DITHER_SIMD_X86
+
+/**
+ * SSE4.1 kernel, 16 values per step
+ */
+__attribute__((target("sse4.1")))
+static void dither_line_sse41(const struct dither_key_t *key, uint32_t line, uint32_t columns, uint8_t *out) {
+	uint32_t h = dither_mix(key->line ^ (line * DITHER_LINE_STEP));
+	uint32_t i;
+	const __m128i m1 = _mm_set1_epi32((int32_t) DITHER_MIX_1);
+	const __m128i m2 = _mm_set1_epi32((int32_t) DITHER_MIX_2);
+	const __m128i k = _mm_set1_epi32((int32_t) key->column);
+	const __m128i step = _mm_set1_epi32((int32_t) (4 * DITHER_WORD_STEP));
+	const __m128i mask = _mm_set1_epi8(0x7f);
+	__m128i c = _mm_add_epi32(_mm_set1_epi32((int32_t) h), _mm_mullo_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32((int32_t) DITHER_WORD_STEP)));
+	__m128i x;
+
+	for (i = 0; i < columns; i += 16) {
+		x = _mm_xor_si128(c, k);
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+		x = _mm_mullo_epi32(x, m1);
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+		x = _mm_mullo_epi32(x, m2);
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+		_mm_storeu_si128((__m128i *) (out + i), _mm_and_si128(x, mask));
+		c = _mm_add_epi32(c, step);
+	}
+}
+
+/**
+ * AVX2 kernel, 32 values per step
+ */
+__attribute__((target("avx2")))
+static void dither_line_avx2(const struct dither_key_t *key, uint32_t line, uint32_t columns, uint8_t *out) {
+	uint32_t h = dither_mix(key->line ^ (line * DITHER_LINE_STEP));
+	uint32_t i;
+	const __m256i m1 = _mm256_set1_epi32((int32_t) DITHER_MIX_1);
+	const __m256i m2 = _mm256_set1_epi32((int32_t) DITHER_MIX_2);
+	const __m256i k = _mm256_set1_epi32((int32_t) key->column);
+	const __m256i step = _mm256_set1_epi32((int32_t) (8 * DITHER_WORD_STEP));
+	const __m256i mask = _mm256_set1_epi8(0x7f);
+	__m256i c = _mm256_add_epi32(_mm256_set1_epi32((int32_t) h), _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32((int32_t) DITHER_WORD_STEP)));
+	__m256i x;
+
+	for (i = 0; i < columns; i += 32) {
+		x = _mm256_xor_si256(c, k);
+		x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+		x = _mm256_mullo_epi32(x, m1);
+		x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+		x = _mm256_mullo_epi32(x, m2);
+		x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+		_mm256_storeu_si256((__m256i *) (out + i), _mm256_and_si256(x, mask));
+		c = _mm256_add_epi32(c, step);
+	}
+}
+
+#endif
+
+#ifdef DITHER_SIMD_NEON
+
+/**
+ * NEON kernel, 16 values per step
+ */
+static void dither_line_neon(const struct dither_key_t *key, uint32_t line, uint32_t columns, uint8_t *out) {
+	uint32_t h = dither_mix(key->line ^ (line * DITHER_LINE_STEP));
+	uint32_t i;
+	const uint32_t lanes[4] = {0, DITHER_WORD_STEP, 2*DITHER_WORD_STEP, 3*DITHER_WORD_STEP};
+	const uint32x4_t k = vdupq_n_u32(key->column);
+	const uint32x4_t step = vdupq_n_u32(4 * DITHER_WORD_STEP);
+	const uint8x16_t mask = vdupq_n_u8(0x7f);
+	uint32x4_t c = vaddq_u32(vdupq_n_u32(h), vld1q_u32(lanes));
+	uint32x4_t x;
+
+	for (i = 0; i < columns; i += 16) {
+		x = veorq_u32(c, k);
+		x = veorq_u32(x, vshrq_n_u32(x, 16));
+		x = vmulq_n_u32(x, DITHER_MIX_1);
+		x = veorq_u32(x, vshrq_n_u32(x, 15));
+		x = vmulq_n_u32(x, DITHER_MIX_2);
+		x = veorq_u32(x, vshrq_n_u32(x, 16));
+		vst1q_u8(out + i, vandq_u8(vreinterpretq_u8_u32(x), mask));
+		c = vaddq_u32(c, step);
+	}
+}
+
+#endif
+
+/**
+ * Chooses the best dither kernel for the processor we're running on
+ */
+dither_kernel_t select_dither_kernel(uint8_t verbose) {
+#ifdef DITHER_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		if (verbose)
+			printf("Using AVX2 dither kernel.\n");
+		return dither_line_avx2;
+	}
+	if (__builtin_cpu_supports("sse4.1")) {
+		if (verbose)
+			printf("Using SSE4.1 dither kernel.\n");
+		return dither_line_sse41;
+	}
+#endif
+#ifdef DITHER_SIMD_NEON
+	if (verbose)
+		printf("Using NEON dither kernel.\n");
+	return dither_line_neon;
+#endif
+	if (verbose)
+		printf("Using scalar dither kernel.\n");
+	return dither_line_scalar;
+}
+
+/**
+ * Lists the dither kernels the processor we're running on supports, the portable one first,
+ * so that they can be checked against each other
+ * @param i Index of the kernel
+ * @param name Set to the name of the kernel, may be NULL
+ * @return The kernel, or NULL once i is past the last one
+ */
+dither_kernel_t list_dither_kernels(uint32_t i, const char **name) {
+	dither_kernel_t kernels[4];
+	const char *names[4];
+	uint32_t n = 0;
+
+	kernels[n] = dither_line_scalar;
+	names[n++] = "scalar";
+#ifdef DITHER_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1")) {
+		kernels[n] = dither_line_sse41;
+		names[n++] = "SSE4.1";
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		kernels[n] = dither_line_avx2;
+		names[n++] = "AVX2";
+	}
+#endif
+#ifdef DITHER_SIMD_NEON
+	kernels[n] = dither_line_neon;
+	names[n++] = "NEON";
+#endif
+
+	if (i >= n)
+		return NULL;
+	if (name)
+		*name = names[i];
+	return kernels[i];
+}
@@ -8,76 +8,388 @@
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
 
 #include "lines.h"
+#include "codebook.h"
 
 /**
- * This reads data from the given file pointer into memory, breaking it into segments
- * of the given number of lines, to ease memory management issues at the cost of some
- * overhead. This assumes that the file consists entirely of quality scores with no
- * other lines in between
+ * Adds a line to the end of the file's blocks, starting a new block when the last one is full
+ * @param capacity Number of blocks allocated in info->blocks, updated as they grow
+ */
+static struct line_t *append_line(struct quality_file_t *info, uint32_t *capacity) {
+	struct line_block_t *block;
+
+	if (info->lines == ((uint64_t) info->block_count) * MAX_LINES_PER_BLOCK) {
+		if (info->block_count == *capacity) {
+			*capacity = *capacity ? 2 * *capacity : 1;
+			info->blocks = (struct line_block_t *) realloc(info->blocks, *capacity * sizeof(struct line_block_t));
+		}
+		block = &info->blocks[info->block_count];
+		memset(block, 0, sizeof(struct line_block_t));
+		block->lines = (struct line_t *) calloc(MAX_LINES_PER_BLOCK, sizeof(struct line_t));
+		if (!block->lines)
+			return NULL;
+		info->block_count += 1;
+	}
+
+	block = &info->blocks[info->block_count-1];
+	info->lines += 1;
+	return &block->lines[block->count++];
+}
+
+/**
+ * Adds a line of the given length to the index of the file. The widest line so far sets
+ * the number of columns, and the file is marked variable length once two lengths differ
+ */
+static uint32_t index_line(struct quality_file_t *info, uint32_t *capacity, const char *data, uint64_t length) {
+	struct line_t *line;
+
+	if (length > UINT32_MAX)
+		return LF_ERROR_TOO_LONG;
+	if (info->lines > 0 && length != info->blocks[0].lines[0].length)
+		info->variable_length = 1;
+	if (length > info->columns)
+		info->columns = (uint32_t) length;
+
+	line = append_line(info, capacity);
+	if (!line)
+		return LF_ERROR_NO_MEMORY;
+	line->m_data = (const symbol_t *) data;
+	line->length = (uint32_t) length;
+	info->symbols += length;
+
+	return LF_ERROR_NONE;
+}
+
+/**
+ * Maps the file and indexes every line of quality scores in it, breaking the index into
+ * blocks to ease memory management issues at the cost of some overhead. The lines are found
+ * a chunk at a time with the vectorized newline kernel, and may have any length. This assumes
+ * that the file consists entirely of quality scores with no other lines in between
  * @param path Path of the file to read
  * @param info Information structure to store in, this must be a valid pointer already
  * @param max_lines Maximum number of lines to read, will override the actual number in the file if >0
- * @todo @xxx This assumes we have only newlines in the file despite some vague attempts to handle \r\n as well
- * @todo @xxx It WILL break the mapping if given a file with \r characters
+ * @todo @xxx This assumes we have only newlines in the file, \r characters are taken as scores
  * @todo Implement windows analog to mmap to provide the same facility
  */
 uint32_t load_file(const char *path, struct quality_file_t *info, uint64_t max_lines) {
-	uint32_t status, block_idx, line_idx;
-	char line[READ_LINEBUF_LENGTH];
-	FILE *fp;
-	int fd;
+	uint32_t status = LF_ERROR_NONE, capacity = 0, len, count, i;
+	uint64_t pos, line_start = 0, size;
+	uint32_t *offsets;
+	newline_kernel_t kernel;
 	struct _stat finfo;
+	const char *data;
 	void *file_mmap;
+	int fd;
 
 	// Load metadata into the info structure
 	info->path = strdup(path);
-	fp = fopen(path, "rt");
 	fd = open(path, O_RDONLY);
-	if (!fp || fd == -1) {
+	if (fd == -1 || _stat(path, &finfo) != 0 || finfo.st_size == 0) {
+		if (fd != -1)
+			close(fd);
 		return LF_ERROR_NOT_FOUND;
 	}
 
-	// Use the first line to figure out how long the file is
-	fgets(line, READ_LINEBUF_LENGTH, fp);
-	info->columns = strlen(line) - 1;
-	if (info->columns > MAX_READS_PER_LINE) {
-		fclose(fp);
-		return LF_ERROR_TOO_LONG;
+	// mmap the file to set up constant pointers indexing it. The mapping outlives the
+	// descriptor, so a batch of many inputs doesn't hold one open for each
+	size = (uint64_t) finfo.st_size;
+	file_mmap = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (file_mmap == MAP_FAILED)
+		return LF_ERROR_NOT_FOUND;
+	madvise(file_mmap, size, MADV_SEQUENTIAL);
+	data = (const char *) file_mmap;
+
+	info->lines = 0;
+	info->columns = 0;
+	info->symbols = 0;
+	info->variable_length = 0;
+	info->block_count = 0;
+	info->blocks = NULL;
+	if (max_lines == 0)
+		max_lines = UINT64_MAX;
+
+	kernel = select_newline_kernel(info->opts ? info->opts->verbose : 0);
+	offsets = (uint32_t *) malloc(NEWLINE_SCAN_CHUNK * sizeof(uint32_t));
+
+	for (pos = 0; pos < size && status == LF_ERROR_NONE && info->lines < max_lines; pos += len) {
+		len = (size - pos < NEWLINE_SCAN_CHUNK) ? (uint32_t) (size - pos) : NEWLINE_SCAN_CHUNK;
+		count = kernel(data + pos, len, offsets);
+		for (i = 0; i < count && status == LF_ERROR_NONE && info->lines < max_lines; ++i) {
+			status = index_line(info, &capacity, data + line_start, pos + offsets[i] - line_start);
+			line_start = pos + offsets[i] + 1;
+		}
+	}
+
+	// The last line may not end in a newline
+	if (status == LF_ERROR_NONE && line_start < size && info->lines < max_lines)
+		status = index_line(info, &capacity, data + line_start, size - line_start);
+	if (status == LF_ERROR_NONE && info->columns == 0)
+		status = LF_ERROR_BAD_LENGTH;
+
+	free(offsets);
+	return status;
+}
+
+/**
+ * Reads up to max_lines more lines of info->columns quality scores from a stream into the
+ * block's own storage, which must have room for them, and points the block's lines at them.
+ * Streamed lines must all be as long as the first one, since they're read a block at a
+ * time without looking for the newlines first. A missing newline at the end of the stream
+ * is tolerated
+ * @return LF_ERROR_NONE, or LF_ERROR_BAD_LENGTH if a line doesn't have info->columns scores
+ */
+uint32_t read_stream_block(FILE *fp, struct quality_file_t *info, struct line_block_t *block, uint32_t max_lines) {
+	size_t stride = info->columns + 1;
+	symbol_t *start = block->data + block->count*stride;
+	size_t got = fread(start, sizeof(symbol_t), max_lines*stride, fp);
+	uint32_t i, lines;
+
+	if (got % stride == info->columns && feof(fp)) {
+		start[got] = '\n';
+		got += 1;
+	}
+	if (got % stride != 0)
+		return LF_ERROR_BAD_LENGTH;
+
+	lines = (uint32_t) (got / stride);
+	for (i = 0; i < lines; ++i) {
+		if (start[i*stride + info->columns] != '\n')
+			return LF_ERROR_BAD_LENGTH;
+		block->lines[block->count + i].m_data = start + i*stride;
+		block->lines[block->count + i].length = info->columns;
 	}
-	fclose(fp);
+	block->count += lines;
+	info->symbols += ((uint64_t) lines) * info->columns;
 
-	// Figure out how many lines we'll need depending on whether we were limited or not
-	_stat(path, &finfo);
-	info->lines = finfo.st_size / ((uint64_t) (info->columns+1));
-	if (max_lines > 0 && info->lines > max_lines) {
-		info->lines = max_lines;
+	return LF_ERROR_NONE;
+}
+
+/**
+ * Reads up to max_lines lines of quality scores from the start of a stream, such as a pipe,
+ * into memory owned by the blocks. The number of columns comes from the first line and
+ * the rest of the stream is left unread for the caller
+ */
+uint32_t load_stream(FILE *fp, struct quality_file_t *info, uint64_t max_lines) {
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t got;
+	uint32_t status, block_idx, want;
+	uint64_t lines_left;
+	struct line_block_t *block;
+
+	got = getline(&line, &line_size, fp);
+	if (got <= 1 || line[got-1] != '\n') {
+		free(line);
+		return (got <= 0) ? LF_ERROR_NOT_FOUND : LF_ERROR_BAD_LENGTH;
+	}
+	info->columns = (uint32_t) (got - 1);
+	info->symbols = 0;
+	info->variable_length = 0;
+
+	info->block_count = (uint32_t) ((max_lines + MAX_LINES_PER_BLOCK - 1) / MAX_LINES_PER_BLOCK);
+	info->blocks = (struct line_block_t *) calloc(info->block_count, sizeof(struct line_block_t));
+	if (!info->blocks)
+		return LF_ERROR_NO_MEMORY;
+
+	lines_left = max_lines;
+	info->lines = 0;
+	for (block_idx = 0; block_idx < info->block_count; ++block_idx) {
+		block = &info->blocks[block_idx];
+		want = (lines_left > MAX_LINES_PER_BLOCK) ? MAX_LINES_PER_BLOCK : (uint32_t) lines_left;
+		block->lines = (struct line_t *) calloc(want, sizeof(struct line_t));
+		block->data = (symbol_t *) malloc(((size_t) want) * (info->columns+1));
+		if (!block->lines || !block->data)
+			return LF_ERROR_NO_MEMORY;
+
+		// The first line was already consumed to find the width
+		if (block_idx == 0) {
+			memcpy(block->data, line, info->columns+1);
+			block->lines[0].m_data = block->data;
+			block->lines[0].length = info->columns;
+			block->count = 1;
+			info->symbols = info->columns;
+		}
+
+		status = read_stream_block(fp, info, block, want - block->count);
+		if (status != LF_ERROR_NONE)
+			return status;
+
+		info->lines += block->count;
+		lines_left -= block->count;
+		if (block->count == 0) {
+			free(block->lines);
+			free(block->data);
+			block->lines = NULL;
+			block->data = NULL;
+		}
+		if (block->count < want)
+			break;
+	}
+	info->block_count = (info->lines + MAX_LINES_PER_BLOCK - 1) / MAX_LINES_PER_BLOCK;
+	free(line);
+
+	return LF_ERROR_NONE;
+}
+
+/**
+ * Position within a FASTQ file while its records are being indexed
+ */
+struct fastq_scan_t {
+	struct quality_file_t *info;
+	const char *data;
+	uint64_t record_start;		// Offset of the current record's header line
+	uint32_t record_line;		// Line of the current record, 0 to 3
+	uint64_t sequence_length;	// Length of the current record's sequence line
+	uint32_t capacity;			// Blocks allocated in info->blocks
+	FILE *sidecar;
+};
+
+/**
+ * Handles one line of a FASTQ file, given by its offsets. The quality line of each record
+ * is added to the file, as long as it is as long as the record's sequence, and the other
+ * three are written to the sidecar if there is one
+ */
+static uint32_t fastq_line(struct fastq_scan_t *scan, uint64_t start, uint64_t end) {
+	uint32_t status;
+
+	// Tolerate \r\n line endings here, since we never point past the end of the scores
+	if (end > start && scan->data[end-1] == '\r')
+		end -= 1;
+
+	switch (scan->record_line) {
+		case 0:
+			if (end == start || scan->data[start] != '@')
+				return LF_ERROR_NOT_FASTQ;
+			scan->record_start = start;
+			break;
+		case 1:
+			scan->sequence_length = end - start;
+			break;
+		case 2:
+			if (end == start || scan->data[start] != '+')
+				return LF_ERROR_NOT_FASTQ;
+			break;
+		case 3:
+			if (end - start != scan->sequence_length)
+				return LF_ERROR_NOT_FASTQ;
+			status = index_line(scan->info, &scan->capacity, scan->data + start, end - start);
+			if (status != LF_ERROR_NONE)
+				return status;
+
+			if (scan->sidecar)
+				fwrite(scan->data + scan->record_start, sizeof(char), start - scan->record_start, scan->sidecar);
+			break;
+		default:
+			break;
+	}
+
+	scan->record_line = (scan->record_line + 1) & 3;
+	return LF_ERROR_NONE;
+}
+
+/**
+ * Maps a FASTQ file and points the lines directly at the quality scores of each record, so
+ * that nothing is copied. The newlines are found a chunk at a time with the vectorized
+ * kernel. If a sidecar path is given, the header, sequence and separator lines of every
+ * record are written to it, in order, so the file can be put back together later
+ */
+uint32_t load_fastq(const char *path, struct quality_file_t *info, const char *sidecar) {
+	struct fastq_scan_t scan;
+	struct _stat finfo;
+	newline_kernel_t kernel;
+	uint32_t *offsets;
+	uint32_t status = LF_ERROR_NONE, len, count, i;
+	uint64_t pos, line_start = 0;
+	void *file_mmap;
+	int fd;
+
+	info->path = strdup(path);
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || _stat(path, &finfo) != 0 || finfo.st_size == 0) {
+		if (fd != -1)
+			close(fd);
+		return LF_ERROR_NOT_FOUND;
 	}
-	
-	status = alloc_blocks(info);
-	if (status != LF_ERROR_NONE)
-		return status;
 
-	// mmap the file to set up constant pointers indexing it
 	file_mmap = mmap(NULL, finfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (file_mmap == MAP_FAILED)
+		return LF_ERROR_NOT_FOUND;
+	madvise(file_mmap, finfo.st_size, MADV_SEQUENTIAL);
+
+	memset(&scan, 0, sizeof(struct fastq_scan_t));
+	scan.info = info;
+	scan.data = (const char *) file_mmap;
+	if (sidecar) {
+		scan.sidecar = fopen(sidecar, "wb");
+		if (!scan.sidecar) {
+			munmap(file_mmap, finfo.st_size);
+			return LF_ERROR_SIDECAR;
+		}
+	}
 
-	// Process the file
-	block_idx = 0;
-	line_idx = 0;
-	while ((block_idx * MAX_LINES_PER_BLOCK + line_idx) < info->lines) {
-		// Setting up mmap indexing assumes we have only one line ending!
-		info->blocks[block_idx].lines[line_idx].m_data = file_mmap + ((uint64_t) (block_idx * MAX_LINES_PER_BLOCK + line_idx)) * (info->columns+1);
-
-		// Increment line/block pointers as necesary
-		line_idx += 1;
-		if (line_idx == info->blocks[block_idx].count) {
-			line_idx = 0;
-			block_idx += 1;
+	info->lines = 0;
+	info->columns = 0;
+	info->symbols = 0;
+	info->variable_length = 0;
+	info->block_count = 0;
+	info->blocks = NULL;
+
+	kernel = select_newline_kernel(info->opts ? info->opts->verbose : 0);
+	offsets = (uint32_t *) malloc(NEWLINE_SCAN_CHUNK * sizeof(uint32_t));
+
+	for (pos = 0; pos < (uint64_t) finfo.st_size && status == LF_ERROR_NONE; pos += len) {
+		len = (finfo.st_size - pos < NEWLINE_SCAN_CHUNK) ? (uint32_t) (finfo.st_size - pos) : NEWLINE_SCAN_CHUNK;
+		count = kernel(scan.data + pos, len, offsets);
+		for (i = 0; i < count && status == LF_ERROR_NONE; ++i) {
+			status = fastq_line(&scan, line_start, pos + offsets[i]);
+			line_start = pos + offsets[i] + 1;
 		}
 	}
 
+	// The last line may not end in a newline
+	if (status == LF_ERROR_NONE && line_start < (uint64_t) finfo.st_size)
+		status = fastq_line(&scan, line_start, finfo.st_size);
+	if (status == LF_ERROR_NONE && (scan.record_line != 0 || info->lines == 0))
+		status = LF_ERROR_NOT_FASTQ;
+	if (status == LF_ERROR_NONE && info->columns == 0)
+		status = LF_ERROR_BAD_LENGTH;
+
+	free(offsets);
+	if (scan.sidecar)
+		fclose(scan.sidecar);
+
+	return status;
+}
+
+/**
+ * Indexes lines of quality scores that are already in memory, such as quality blocks handed
+ * over by another program, without copying them. The lines must stay in place for as long
+ * as info refers to them
+ * @param lines Quality scores of each line, with no newline
+ * @param lengths Number of scores in each line
+ */
+uint32_t load_lines(const uint8_t **lines, const uint32_t *lengths, uint64_t count, struct quality_file_t *info) {
+	uint32_t status, capacity = 0;
+	uint64_t i;
+
+	info->lines = 0;
+	info->columns = 0;
+	info->symbols = 0;
+	info->variable_length = 0;
+	info->block_count = 0;
+	info->blocks = NULL;
+
+	for (i = 0; i < count; ++i) {
+		status = index_line(info, &capacity, (const char *) lines[i], lengths[i]);
+		if (status != LF_ERROR_NONE)
+			return status;
+	}
+
 	return LF_ERROR_NONE;
 }
 
@@ -135,6 +447,7 @@ void free_blocks(struct quality_file_t *info) {
 
 	for (i = 0; i < info->block_count; ++i) {
 		free(info->blocks[i].lines);
+		free(info->blocks[i].data);
 	}
 	free(info->blocks);
 }
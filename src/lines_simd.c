@@ -0,0 +1,181 @@
+/**
+ * Newline scanning kernels for indexing the lines of a file in memory. Each kernel writes
+ * the offset of every newline in a chunk, and the fastest kernel supported by the processor
+ * is chosen at runtime.
+ *
+ * The vector kernels compare a register's worth of bytes against '\n' at a time and turn
+ * the result into a bit mask, so that the cost is one compare per 16 or 32 bytes plus one
+ * step per newline found, instead of one branch per byte.
+ */
+
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lines.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define LINES_SIMD_X86
+#elif defined(__aarch64__)
+	#include <arm_neon.h>
+	#define LINES_SIMD_NEON
+#endif
+
+/**
+ * Portable kernel, which relies on the C library's memchr
+ */
+static uint32_t find_newlines_scalar(const char *data, uint32_t len, uint32_t *out) {
+	const char *p = data, *end = data + len;
+	uint32_t n = 0;
+
+	while (p < end && (p = (const char *) memchr(p, '\n', end - p)) != NULL) {
+		out[n++] = (uint32_t) (p - data);
+		p += 1;
+	}
+	return n;
+}
+
+/**
+ * Finishes the bytes left over after the vector loop
+ */
+static uint32_t find_newlines_tail(const char *data, uint32_t first, uint32_t len, uint32_t *out, uint32_t n) {
+	uint32_t i;
+
+	for (i = first; i < len; ++i) {
+		if (data[i] == '\n')
+			out[n++] = i;
+	}
+	return n;
+}
+
+#ifdef LINES_SIMD_X86
+
+/**
+ * SSE2 kernel, 16 bytes per step
+ */
+__attribute__((target("sse2")))
+static uint32_t find_newlines_sse2(const char *data, uint32_t len, uint32_t *out) {
+	const __m128i nl = _mm_set1_epi8('\n');
+	uint32_t i, n = 0, mask;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (data + i)), nl));
+		while (mask) {
+			out[n++] = i + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+	return find_newlines_tail(data, i, len, out, n);
+}
+
+/**
+ * AVX2 kernel, 32 bytes per step
+ */
+__attribute__((target("avx2")))
+static uint32_t find_newlines_avx2(const char *data, uint32_t len, uint32_t *out) {
+	const __m256i nl = _mm256_set1_epi8('\n');
+	uint32_t i, n = 0, mask;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (data + i)), nl));
+		while (mask) {
+			out[n++] = i + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+	return find_newlines_tail(data, i, len, out, n);
+}
+
+#endif
+
+#ifdef LINES_SIMD_NEON
+
+/**
+ * NEON kernel, 16 bytes per step. There is no byte mask instruction, so the compare result
+ * is narrowed to four bits per byte instead
+ */
+static uint32_t find_newlines_neon(const char *data, uint32_t len, uint32_t *out) {
+	const uint8x16_t nl = vdupq_n_u8('\n');
+	uint32_t i, n = 0, t;
+	uint64_t mask;
+	uint8x16_t eq;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		eq = vceqq_u8(vld1q_u8((const uint8_t *) (data + i)), nl);
+		mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+		while (mask) {
+			t = __builtin_ctzll(mask);
+			out[n++] = i + (t >> 2);
+			mask &= ~(0xfULL << (t & ~3u));
+		}
+	}
+	return find_newlines_tail(data, i, len, out, n);
+}
+
+#endif
+
+/**
+ * Chooses the best newline kernel for the processor we're running on
+ */
+newline_kernel_t select_newline_kernel(uint8_t verbose) {
+#ifdef LINES_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		if (verbose)
+			printf("Using AVX2 newline kernel.\n");
+		return find_newlines_avx2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		if (verbose)
+			printf("Using SSE2 newline kernel.\n");
+		return find_newlines_sse2;
+	}
+#endif
+#ifdef LINES_SIMD_NEON
+	if (verbose)
+		printf("Using NEON newline kernel.\n");
+	return find_newlines_neon;
+#endif
+	if (verbose)
+		printf("Using scalar newline kernel.\n");
+	return find_newlines_scalar;
+}
+
+/**
+ * Lists the newline kernels the processor we're running on supports, the portable one
+ * first, so that they can be checked against each other
+ * @param i Index of the kernel
+ * @param name Set to the name of the kernel, may be NULL
+ * @return The kernel, or NULL once i is past the last one
+ */
+newline_kernel_t list_newline_kernels(uint32_t i, const char **name) {
+	newline_kernel_t kernels[4];
+	const char *names[4];
+	uint32_t n = 0;
+
+	kernels[n] = find_newlines_scalar;
+	names[n++] = "scalar";
+#ifdef LINES_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		kernels[n] = find_newlines_sse2;
+		names[n++] = "SSE2";
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		kernels[n] = find_newlines_avx2;
+		names[n++] = "AVX2";
+	}
+#endif
+#ifdef LINES_SIMD_NEON
+	kernels[n] = find_newlines_neon;
+	names[n++] = "NEON";
+#endif
+
+	if (i >= n)
+		return NULL;
+	if (name)
+		*name = names[i];
+	return kernels[i];
+}
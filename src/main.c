@@ -8,70 +8,194 @@
 
 #include "codebook.h"
 #include "qv_compressor.h"
+#include "container.h"
 #include "cluster.h"
+#include "thread_pool.h"
+#include "qvz.h"
+#include "metrics.h"
 
-#define ALPHABET_SIZE 72
+// Descriptor of the real standard output once it is reserved for data
+static int data_stdout = -1;
 
 /**
- *
+ * Reserves standard output for the data when the output is "-". Messages that would go to
+ * standard output are sent to standard error from then on, so they can't end up in the data
  */
-void encode(char *input_name, char *output_name, struct qv_options_t *opts) {
-	struct quality_file_t qv_info;
-	struct distortion_t *dist;
-	struct alphabet_t *alphabet = alloc_alphabet(ALPHABET_SIZE);
-	uint32_t status;
-	struct hrtimer_t cluster_time, stats, encoding, total;
-	FILE *fout, *funcompressed = NULL;
-	uint64_t bytes_used;
-    double distortion;
+static void reserve_stdout(void) {
+	fflush(stdout);
+	data_stdout = dup(fileno(stdout));
+	dup2(fileno(stderr), fileno(stdout));
+}
 
-	start_timer(&total);
+/**
+ * Opens the named output for writing, where "-" is the reserved standard output
+ */
+static FILE *open_output(char *name, const char *mode) {
+	if (strcmp(name, "-") == 0)
+		return fdopen(data_stdout, mode);
+	return fopen(name, mode);
+}
+
+/**
+ * Loads the input file into a fresh info set up from the options. When streaming, only the
+ * training lines are loaded and the input stream is returned at the first line after them,
+ * otherwise the whole file is loaded and NULL is returned
+ */
+static FILE *load_input(char *input_name, struct qv_options_t *opts, struct quality_file_t *qv_info) {
+	uint32_t status;
+	struct stage_timer_t stage;
+	FILE *fin = NULL;
 
+	memset(qv_info, 0, sizeof(struct quality_file_t));
 	if (opts->distortion == DISTORTION_CUSTOM) {
-		dist = gen_custom_distortion(ALPHABET_SIZE, opts->dist_file);
+		qv_info->dist = gen_custom_distortion(ALPHABET_SIZE, opts->dist_file);
 	}
 	else {
-		dist = generate_distortion_matrix(ALPHABET_SIZE, opts->distortion);
+		qv_info->dist = generate_distortion_matrix(ALPHABET_SIZE, opts->distortion);
 	}
+	if (!qv_info->dist)
+		exit(1);
     
-	qv_info.alphabet = alphabet;
-	qv_info.dist = dist;
-	qv_info.cluster_count = opts->clusters;
-
-	// Load input file all at once
-	status = load_file(input_name, &qv_info, 0);
+	qv_info->alphabet = alloc_alphabet(ALPHABET_SIZE);
+	qv_info->cluster_count = opts->clusters;
+	qv_info->coder = opts->coder;
+	qv_info->dither = opts->dither;
+	qv_info->stats_step = opts->stats_step;
+	qv_info->stats_fast_step = opts->stats_fast_step;
+	qv_info->stats_limit = opts->stats_limit;
+	qv_info->stats_priors = opts->stats_priors;
+
+	qv_info->opts = opts;
+	if (opts->metrics)
+		start_stage(&stage);
+
+	// Load input file all at once, or just the start of the stream for training
+	if (opts->fastq) {
+		if (opts->stream_training) {
+			printf("FASTQ input must be a file and can't be streamed.\n");
+			exit(1);
+		}
+		status = load_fastq(input_name, qv_info, opts->sidecar_name);
+	}
+	else if (opts->stream_training) {
+		fin = (strcmp(input_name, "-") == 0) ? stdin : fopen(input_name, "rb");
+		if (!fin) {
+			perror("Unable to open input file");
+			exit(1);
+		}
+		status = load_stream(fin, qv_info, opts->stream_training);
+	}
+	else {
+		status = load_file(input_name, qv_info, 0);
+	}
+	if (status == LF_ERROR_BAD_LENGTH && opts->stream_training) {
+		printf("Streamed input lines must all have the same number of quality scores.\n");
+		exit(1);
+	}
+	if (status == LF_ERROR_NOT_FASTQ) {
+		printf("%s isn't a FASTQ file, or a record's quality line isn't as long as its sequence.\n", input_name);
+		exit(1);
+	}
+	if (status == LF_ERROR_SIDECAR) {
+		printf("Unable to open the header sidecar %s for writing.\n", opts->sidecar_name);
+		exit(1);
+	}
 	if (status != LF_ERROR_NONE) {
 		printf("load_file returned error: %d\n", status);
 		exit(1);
 	}
+	if (opts->metrics)
+		stop_stage(opts->metrics, &stage, "load");
+
+	return fin;
+}
+
+/**
+ * Loads the input file and clusters it, which is shared by every encoding mode, see
+ * load_input for what is returned
+ */
+static FILE *load_and_cluster(char *input_name, struct qv_options_t *opts, struct quality_file_t *qv_info) {
+	struct hrtimer_t cluster_time;
+	struct stage_timer_t stage;
+	FILE *fin = load_input(input_name, opts, qv_info);
 
 	// Set up clustering data structures
-	qv_info.clusters = alloc_cluster_list(&qv_info);
-	qv_info.opts = opts;
+	qv_info->clusters = alloc_cluster_list(qv_info);
 
 	// Do k-means clustering
+	if (opts->metrics)
+		start_stage(&stage);
 	start_timer(&cluster_time);
-	do_kmeans_clustering(&qv_info);
+	if (!do_kmeans_clustering(qv_info))
+		exit(1);
 	stop_timer(&cluster_time);
+	if (opts->metrics)
+		stop_stage(opts->metrics, &stage, "clustering");
 	if (opts->verbose) {
 		printf("Clustering took %.4f seconds\n", get_timer_interval(&cluster_time));
 	}
+
+	return fin;
+}
+
+/**
+ * Encodes the input, and writes the metrics of the run to metrics_name unless it is NULL
+ */
+void encode(char *input_name, char *output_name, struct qv_options_t *opts, char *metrics_name) {
+	struct quality_file_t qv_info;
+	struct hrtimer_t stats, encoding, total;
+	struct stage_timer_t stage;
+	FILE *fin, *fout, *funcompressed = NULL;
+	uint64_t bytes_used;
+	off_t lines_pos;
+    double distortion, *measured;
+
+	if (metrics_name && !opts->estimate)
+		opts->metrics = alloc_metrics();
+
+	start_timer(&total);
+	fin = load_and_cluster(input_name, opts, &qv_info);
     
 	// Then find stats and generate codebooks for each cluster
 	start_timer(&stats);
-	calculate_statistics(&qv_info);
-	generate_codebooks(&qv_info);
+	if (opts->metrics)
+		start_stage(&stage);
+	if (!calculate_statistics(&qv_info))
+		exit(1);
+	if (opts->metrics) {
+		stop_stage(opts->metrics, &stage, "statistics");
+		start_stage(&stage);
+	}
+	if (opts->estimate || !opts->codebook_file || !read_codebook_cache(opts->codebook_file, &qv_info)) {
+		generate_codebooks(&qv_info);
+		// -E bypasses the cache, so it mustn't replace one that may still be good
+		if (opts->codebook_file && !opts->estimate && !write_codebook_cache(opts->codebook_file, &qv_info))
+			exit(1);
+		if (opts->verbose) {
+			printf("Expected rate: %f bits per symbol\n", opts->e_rate);
+			printf("Expected distortion: %f\n", opts->e_dist);
+		}
+	}
+	if (qv_info.stats_priors && !opts->estimate)
+		train_stats_priors(&qv_info);
 	stop_timer(&stats);
+	if (opts->metrics)
+		stop_stage(opts->metrics, &stage, "codebooks");
     
 	if (opts->verbose) {
 		printf("Stats and codebook generation took %.4f seconds\n", get_timer_interval(&stats));
-		// @todo expected distortion is inaccurate due to lack of pmf
-		//printf("Expected distortion: %f\n", opts->e_dist);
+	}
+
+	// The size excludes the codebooks and the container, which are small next to the data
+	if (opts->estimate) {
+		stop_timer(&total);
+		printf("rate, %.4f, distortion, %.4f, time, %.4f, size, %llu \n", opts->e_rate, opts->e_dist, get_timer_interval(&total), (unsigned long long) (opts->e_rate*qv_info.symbols/8.0));
+		return;
 	}
     
 	// Note that we want \r\n translation in the input
 	// but we do not want it in the output
-	fout = fopen(output_name, "wb");
+	fout = open_output(output_name, "wb");
 	if (!fout) {
 		perror("Unable to open output file");
 		exit(1);
@@ -87,12 +211,35 @@ void encode(char *input_name, char *output_name, struct qv_options_t *opts) {
 	
 	// @todo qv_compression should use quality_file structure with data in memory, now
 	start_timer(&encoding);
+	if (opts->metrics)
+		start_stage(&stage);
+	choose_well_seed(&qv_info);
+	lines_pos = write_container_header(fout, &qv_info, fin != NULL, 0);
 	write_codebooks(fout, &qv_info);
-    bytes_used = start_qv_compression(&qv_info, fout, &distortion, funcompressed);
+	// The distortion is only measured when it will be printed
+	measured = (opts->verbose || opts->stats) ? &distortion : NULL;
+	if (fin) {
+		bytes_used = start_qv_stream_compression(&qv_info, fin, fout, measured, funcompressed);
+		update_container_lines(fout, lines_pos, qv_info.lines);
+	}
+	else
+		bytes_used = start_qv_compression(&qv_info, fout, measured, funcompressed);
 	stop_timer(&encoding);
 	stop_timer(&total);
+	if (opts->metrics) {
+		stop_stage(opts->metrics, &stage, "coding");
+		start_stage(&stage);
+	}
 
 	fclose(fout);
+	if (funcompressed)
+		fclose(funcompressed);
+	if (opts->metrics) {
+		stop_stage(opts->metrics, &stage, "flush");
+		write_metrics(metrics_name, opts->metrics, &qv_info, bytes_used, measured);
+		free_metrics(opts->metrics);
+		opts->metrics = NULL;
+	}
     
 	// Verbose stats
 	if (opts->verbose) {
@@ -116,46 +263,313 @@ void encode(char *input_name, char *output_name, struct qv_options_t *opts) {
 		printf("Lines: %llu\n", qv_info.lines);
 		printf("Columns: %u\n", qv_info.columns);
 		printf("Total bytes used: %llu\n", bytes_used);
-		printf("Encoding took %.4f seconds.\n", get_timer_interval(&total));
+		printf("Encoding took %.4f seconds.\n", get_timer_interval(&encoding));
 		printf("Total time elapsed: %.4f seconds.\n", get_timer_interval(&total));
 	}
 
 	// Parse-able stats
 	if (opts->stats) {
-		printf("rate, %.4f, distortion, %.4f, time, %.4f, size, %llu \n", (bytes_used*8.)/((double)(qv_info.lines)*qv_info.columns), distortion, get_timer_interval(&total), bytes_used);
+		printf("rate, %.4f, distortion, %.4f, time, %.4f, size, %llu \n", (bytes_used*8.)/((double) qv_info.symbols), distortion, get_timer_interval(&total), bytes_used);
 	}
 }
 
 /**
- *
+ * Encodes the input at every target from:to:step of the current mode, loading, clustering and
+ * calculating statistics only once. Each point designs its own codebooks and is coded into
+ * a temporary file, so the -s stats line printed for it (with the target appended) matches
+ * what a separate run would report, and the time covers only that point
+ */
+void sweep(char *input_name, struct qv_options_t *opts, double from, double to, double step) {
+	struct quality_file_t qv_info;
+	struct hrtimer_t timer;
+	FILE *fout;
+	uint64_t bytes_used;
+	uint32_t points, k;
+	uint8_t c;
+	double distortion;
+
+	if (step <= 0.0 || to < from) {
+		printf("Sweep must be given as from:to:step with from <= to and step > 0.\n");
+		exit(1);
+	}
+	points = (uint32_t) floor((to - from) / step + 1e-9) + 1;
+
+	load_and_cluster(input_name, opts, &qv_info);
+	if (!calculate_statistics(&qv_info))
+		exit(1);
+
+	for (k = 0; k < points; ++k) {
+		start_timer(&timer);
+		opts->ratio = from + k*step;
+
+		fout = tmpfile();
+		if (!fout) {
+			perror("Unable to open temporary file for sweep");
+			exit(1);
+		}
+
+		generate_codebooks(&qv_info);
+		if (qv_info.stats_priors)
+			train_stats_priors(&qv_info);
+		choose_well_seed(&qv_info);
+		write_container_header(fout, &qv_info, 0, 0);
+		write_codebooks(fout, &qv_info);
+		bytes_used = start_qv_compression(&qv_info, fout, &distortion, NULL);
+		fclose(fout);
+
+		for (c = 0; c < qv_info.cluster_count; ++c) {
+			free_cond_quantizer_list(qv_info.clusters->clusters[c].qlist);
+			qv_info.clusters->clusters[c].qlist = NULL;
+		}
+		stop_timer(&timer);
+
+		printf("rate, %.4f, distortion, %.4f, time, %.4f, size, %llu, target, %.4f\n", (bytes_used*8.)/((double) qv_info.symbols), distortion, get_timer_interval(&timer), (unsigned long long) bytes_used, opts->ratio);
+		fflush(stdout);
+	}
+}
+
+/**
+ * One input of a batch, with the options it is trained with
+ */
+struct batch_file_t {
+	char *input_name;
+	char *output_name;
+	struct qv_options_t opts;
+	struct quality_file_t info;
+};
+
+struct batch_job_t {
+	struct batch_file_t *files;
+	uint8_t shared;				// Only load the inputs, their codebooks are trained together
+};
+
+/**
+ * Reads the list of a batch, which names an input on every line, optionally followed by
+ * whitespace and the output to write it to, or else the input's name with .qvz appended.
+ * Blank lines and lines starting with # are skipped. Names can't contain whitespace
+ */
+static struct batch_file_t *read_batch_list(char *list_name, struct qv_options_t *opts, uint32_t *count) {
+	FILE *fp = fopen(list_name, "r");
+	char buf[4096];
+	char *input, *output;
+	uint32_t capacity = 0;
+	struct batch_file_t *files = NULL, *file;
+
+	if (!fp) {
+		perror("Unable to open batch list");
+		exit(1);
+	}
+
+	*count = 0;
+	while (fgets(buf, sizeof(buf), fp)) {
+		input = strtok(buf, " \t\r\n");
+		if (!input || input[0] == '#')
+			continue;
+		output = strtok(NULL, " \t\r\n");
+		if (strcmp(input, "-") == 0 || (output && strcmp(output, "-") == 0) || strtok(NULL, " \t\r\n")) {
+			printf("Every line of a batch list must name an input file and optionally an output file.\n");
+			exit(1);
+		}
+
+		if (*count == capacity) {
+			capacity = capacity ? 2*capacity : 16;
+			files = (struct batch_file_t *) realloc(files, capacity*sizeof(struct batch_file_t));
+		}
+		file = &files[*count];
+		*count += 1;
+
+		memset(file, 0, sizeof(struct batch_file_t));
+		file->input_name = strdup(input);
+		if (output)
+			file->output_name = strdup(output);
+		else {
+			file->output_name = (char *) malloc(strlen(input) + 5);
+			sprintf(file->output_name, "%s.qvz", input);
+		}
+		file->opts = *opts;
+	}
+	fclose(fp);
+
+	if (*count == 0) {
+		printf("Batch list %s names no inputs.\n", list_name);
+		exit(1);
+	}
+	return files;
+}
+
+/**
+ * Loads one input of a batch and, unless the codebooks are shared, trains its own
+ */
+static void train_batch_file_task(void *arg, uint32_t task, uint32_t thread) {
+	struct batch_job_t *job = (struct batch_job_t *) arg;
+	struct batch_file_t *file = &job->files[task];
+
+	if (job->shared) {
+		load_input(file->input_name, &file->opts, &file->info);
+		return;
+	}
+
+	load_and_cluster(file->input_name, &file->opts, &file->info);
+	if (!calculate_statistics(&file->info))
+		exit(1);
+	generate_codebooks(&file->info);
+	if (file->info.stats_priors)
+		train_stats_priors(&file->info);
+	choose_well_seed(&file->info);
+}
+
+/**
+ * Trains one set of clusters and codebooks on an evenly spaced sample of the lines of all
+ * the inputs of a batch together, at most BATCH_TRAINING_LINES in all, then assigns every
+ * line of every input to the shared clusters. The sample shares the inputs' data, only the
+ * line records are copied, and the codebooks cover the longest line of any input
  */
-void decode(char *input_file, char *output_file, struct qv_options_t *opts) {
+static void train_batch_shared(struct batch_file_t *files, uint32_t count, struct qv_options_t *opts, struct quality_file_t *shared) {
+	uint64_t total = 0, offset = 0, i, k;
+	uint32_t f;
+	struct line_t *line;
+
+	*shared = files[0].info;
+	shared->opts = opts;
+	for (f = 0; f < count; ++f) {
+		total += files[f].info.lines;
+		if (files[f].info.columns > shared->columns)
+			shared->columns = files[f].info.columns;
+		if (files[f].info.variable_length || files[f].info.columns != files[0].info.columns)
+			shared->variable_length = 1;
+	}
+
+	shared->lines = (total < BATCH_TRAINING_LINES) ? total : BATCH_TRAINING_LINES;
+	shared->symbols = 0;
+	if (alloc_blocks(shared) != LF_ERROR_NONE) {
+		printf("Unable to allocate the batch training sample.\n");
+		exit(1);
+	}
+	f = 0;
+	for (i = 0; i < shared->lines; ++i) {
+		k = (i * total) / shared->lines;
+		while (k >= offset + files[f].info.lines) {
+			offset += files[f].info.lines;
+			f += 1;
+		}
+		k -= offset;
+		line = &shared->blocks[i / MAX_LINES_PER_BLOCK].lines[i % MAX_LINES_PER_BLOCK];
+		*line = files[f].info.blocks[k / MAX_LINES_PER_BLOCK].lines[k % MAX_LINES_PER_BLOCK];
+		shared->symbols += line->length;
+	}
+
+	shared->clusters = alloc_cluster_list(shared);
+	if (!do_kmeans_clustering(shared) || !calculate_statistics(shared))
+		exit(1);
+	generate_codebooks(shared);
+	if (shared->stats_priors)
+		train_stats_priors(shared);
+	choose_well_seed(shared);
+	free_blocks(shared);
+	shared->blocks = NULL;
+	shared->block_count = 0;
+
+	for (f = 0; f < count; ++f) {
+		files[f].info.clusters = shared->clusters;
+		files[f].info.columns = shared->columns;
+		files[f].info.variable_length = shared->variable_length;
+		files[f].info.well = shared->well;
+		assign_clusters(&files[f].info, files[f].info.blocks, files[f].info.block_count);
+	}
+}
+
+/**
+ * Encodes every input named in the batch list, each to its own output. Either every input
+ * trains its own codebooks, several inputs at a time with the threads divided between
+ * them, or with shared set one set of codebooks is trained on a sample of all of them.
+ * The segments of every input are then coded on the same worker threads, so small inputs
+ * don't leave threads idle. Each output is a normal compressed file
+ */
+void batch(char *list_name, struct qv_options_t *opts, uint8_t shared) {
+	struct batch_file_t *files;
+	struct batch_job_t job;
+	struct quality_file_t shared_info;
+	struct qv_batch_file_t *coded;
+	struct hrtimer_t timer;
+	uint32_t count, f;
+
+	start_timer(&timer);
+	files = read_batch_list(list_name, opts, &count);
+	for (f = 0; f < count; ++f) {
+		files[f].opts.threads = (opts->threads > count) ? opts->threads / count : 1;
+		// Files trained side by side would interleave their progress lines
+		if (opts->threads > 1 && count > 1)
+			files[f].opts.verbose = 0;
+	}
+
+	job.files = files;
+	job.shared = shared;
+	run_parallel(opts->threads, count, train_batch_file_task, &job);
+	if (shared)
+		train_batch_shared(files, count, opts, &shared_info);
+
+	coded = (struct qv_batch_file_t *) calloc(count, sizeof(struct qv_batch_file_t));
+	for (f = 0; f < count; ++f) {
+		coded[f].info = &files[f].info;
+		coded[f].fout = fopen(files[f].output_name, "wb");
+		if (!coded[f].fout) {
+			perror("Unable to open output file");
+			exit(1);
+		}
+		write_container_header(coded[f].fout, &files[f].info, 0, 0);
+		write_codebooks(coded[f].fout, &files[f].info);
+	}
+
+	// The distortion is only measured when it will be printed
+	start_qv_batch_compression(coded, count, opts->threads, opts->verbose || opts->stats);
+	stop_timer(&timer);
+
+	for (f = 0; f < count; ++f) {
+		fclose(coded[f].fout);
+		if (opts->verbose)
+			printf("%s: %llu lines, %llu bytes written to %s\n", files[f].input_name, (unsigned long long) files[f].info.lines, (unsigned long long) coded[f].bytes, files[f].output_name);
+		if (opts->stats)
+			printf("rate, %.4f, distortion, %.4f, size, %llu, input, %s\n", (coded[f].bytes*8.)/((double) files[f].info.symbols), coded[f].distortion, (unsigned long long) coded[f].bytes, files[f].input_name);
+	}
+	if (opts->verbose)
+		printf("Encoding the batch took %.4f seconds.\n", get_timer_interval(&timer));
+
+	free(coded);
+}
+
+/**
+ * Decodes count lines starting at first_line, which covers the whole file by default
+ */
+void decode(char *input_file, char *output_file, struct qv_options_t *opts, uint64_t first_line, uint64_t count) {
 	FILE *fin, *fout;
 	struct hrtimer_t timer;
-	struct quality_file_t qv_info;
-	struct alphabet_t *A = alloc_alphabet(ALPHABET_SIZE);
-    
-	qv_info.alphabet = A;
-	qv_info.opts = opts;
+	uint64_t lines;
+	uint32_t status;
 
 	start_timer(&timer);
 
-	fin = fopen(input_file, "rb");
-	fout = fopen(output_file, "wt");
+	fin = (strcmp(input_file, "-") == 0) ? stdin : fopen(input_file, "rb");
+	fout = open_output(output_file, "wt");
 	if (!fin || !fout) {
 		perror("Unable to open input or output files");
 		exit(1);
 	}
 
-	read_codebooks(fin, &qv_info);
-    start_qv_decompression(fout, fin, &qv_info);
+	lines = qvz_decode_stream(fin, fout, opts, first_line, count, &status);
+	if (lines == QVZ_DECODE_FAILED) {
+		if (status == QVZ_ERROR_TRUNCATED)
+			printf("Compressed file is truncated, it ends inside its segment index or a segment.\n");
+		else if (status == QVZ_ERROR_CORRUPT)
+			printf("Compressed file is corrupt, its segment index doesn't add up or a segment doesn't match its checksum.\n");
+		exit(1);
+	}
 
 	fclose(fout);
 	fclose(fin);
 	stop_timer(&timer);
 
 	if (opts->verbose) {
-		printf("Decoded %llu lines in %f seconds.\n", qv_info.lines, get_timer_interval(&timer));
+		printf("Decoded %llu lines in %f seconds.\n", (unsigned long long) lines, get_timer_interval(&timer));
 	}
 }
 
@@ -165,18 +579,41 @@ void decode(char *input_file, char *output_file, struct qv_options_t *opts) {
  */
 void usage(char *name) {
 	printf("Usage: %s (options) [input file] [output file]\n", name);
+	printf("Either file may be - for standard input or output.\n");
 	printf("Options are:\n");
 	printf("   -q           : Store quality values in compressed file (default)\n");
 	printf("   -x           : Extract quality values from compressed file\n");
+	printf("   -R [a]:[n]   : Only extract the [n] lines starting at line [a] (counting from 0)\n");
 	printf("   -f [ratio]   : Compress using [ratio] bits per bit of input entropy per symbol\n");
 	printf("   -r [rate]    : Compress using fixed [rate] bits per symbol\n");
     printf("   -d [M|L|A]   : Optimize for MSE, Log(1+L1), L1 distortions, respectively (default: MSE)\n");
 	printf("   -D [FILE]    : Optimize using the custom distortion matrix specified in FILE\n");
+	printf("   -e [A|R]     : Entropy code with the bitwise arithmetic coder or the bytewise range coder (default: A)\n");
+	printf("   -g [W|C]     : Choose between quantizers with the WELL-1024a generator or the counter based generator (default: C)\n");
 	printf("   -c [#]       : Compress using [#] clusters (default: 1)\n");
+	printf("   -K [#]       : Fit cluster centers on a sample of [#] lines, then assign every line once (default: all lines)\n");
+	printf("   -P [#]       : Gather statistics from an evenly spaced sample of [#] lines (default: all lines)\n");
 	printf("   -T [#]       : Use [#] as a threshold for cluster center movement (L2 norm) to declare a stable solution (default: 4).\n");
     printf("   -u [FILE]    : Write the uncompressed lossy values to FILE (default: off)\n");
+	printf("   -B [FILE]    : Reuse the codebooks in FILE if they fit the input, otherwise save new ones there (default: off)\n");
+	printf("   -b [#]       : Reuse -B codebooks if no column's statistics diverge by more than [#] bits (default: %g)\n", CODEBOOK_CACHE_TOLERANCE);
+	printf("   -t [#]       : Use [#] worker threads for codebooks, encoding and decoding (default: number of processors)\n");
+	printf("   -F           : The input is a FASTQ file, whose quality lines are compressed in place\n");
+	printf("   -H [FILE]    : Like -F, and also write the other three lines of every record to FILE\n");
+	printf("   -m [#]       : Stream the input with bounded memory, training on its first [#] lines (default with input -: %d)\n", STREAM_TRAINING_LINES);
+	printf("   -S [#]       : Code [#] lines per independent segment, 0 for a single segment (default: %d)\n", MAX_LINES_PER_BLOCK);
+	printf("   --model [s]:[l](:[f]) : Count each symbol [s] times (1-255) and halve a context's counts past [l] (%u-%u),\n", STATS_LIMIT_MIN, STATS_LIMIT_MAX);
+	printf("                  mixing in fast counts with step [f] that are halved at a quarter of [l] (default: %d:%u:0)\n", STATS_STEP_DEFAULT, STATS_LIMIT_MAX);
+	printf("   --priors     : Start the adaptive stats of every context from priors trained with the codebooks and stored with them\n");
+	printf("   --batch [FILE] : Encode every input listed in FILE, one per line and optionally followed by its output\n");
+	printf("                  (default: the input with .qvz appended), coding all of them on the same threads; no file names are needed\n");
+	printf("   --shared     : With --batch, train one set of codebooks on a sample of every input rather than one per input\n");
+	printf("   --metrics [FILE] : Write per stage timings, per cluster and per column rates and peak memory of the encoding to FILE as JSON\n");
+	printf("   --sweep [a]:[b]:[s] : Print -s stats for every -f (or -r after -r) target from [a] to [b] in steps of [s],\n");
+	printf("                  clustering and training once; no output file is needed\n");
 	printf("   -h           : Print this help\n");
 	printf("   -s           : Print summary stats\n");
+	printf("   -E           : Print the expected summary stats of the codebooks without encoding; no output file is needed\n");
 	printf("   -v           : Enable verbose output\n");
 	printf("\nFor custom distortion matrices, a 72x72 matrix of values must be provided as the cost of reconstructing\n");
 	printf("the x-th row as the y-th column, where x and y range from 0 to 71 (inclusive) corresponding to the possible\n");
@@ -194,21 +631,23 @@ int main(int argc, char **argv) {
 
 	uint8_t extract = 0;
 	uint8_t file_idx = 0;
+	uint8_t sweep_mode = 0;
+	char *metrics_name = NULL;
+	char *batch_name = NULL;
+	uint8_t batch_shared = 0;
+	uint64_t first_line = 0, line_count = UINT64_MAX;
+	double sweep_from = 0, sweep_to = 0, sweep_step = 0;
+	unsigned long model_step, model_limit, model_fast;
+	char *sep;
 
-	opts.verbose = 0;
-	opts.stats = 0;
-	opts.ratio = 0.5;
-	opts.clusters = 1;
-    opts.uncompressed = 0;
-    opts.distortion = DISTORTION_MSE;
-	opts.cluster_threshold = 4;
+	qvz_default_options(&opts);
 
 	// No dependency, cross-platform command line parsing means no getopt
 	// So we need to settle for less than optimal flexibility (no combining short opts, maybe that will be added later)
 	i = 1;
 	while (i < argc) {
 		// Handle file names and reject any other untagged arguments
-		if (argv[i][0] != '-') {
+		if (argv[i][0] != '-' || argv[i][1] == '\0') {
 			switch (file_idx) {
 				case 0:
 					input_name = argv[i];
@@ -229,10 +668,76 @@ int main(int argc, char **argv) {
 
 		// Flags for options
 		switch(argv[i][1]) {
+			case '-':
+				if (strcmp(argv[i], "--metrics") == 0 && i+1 < argc) {
+					metrics_name = argv[i+1];
+					i += 2;
+					break;
+				}
+				if (strcmp(argv[i], "--batch") == 0 && i+1 < argc) {
+					batch_name = argv[i+1];
+					i += 2;
+					break;
+				}
+				if (strcmp(argv[i], "--shared") == 0) {
+					batch_shared = 1;
+					i += 1;
+					break;
+				}
+				if (strcmp(argv[i], "--priors") == 0) {
+					opts.stats_priors = 1;
+					i += 1;
+					break;
+				}
+				if (strcmp(argv[i], "--model") == 0 && i+1 < argc) {
+					model_step = strtoul(argv[i+1], &sep, 10);
+					model_limit = (*sep == ':') ? strtoul(sep+1, &sep, 10) : 0;
+					model_fast = (*sep == ':') ? strtoul(sep+1, &sep, 10) : 0;
+					if (*sep != '\0' || model_step < 1 || model_step > 255 || model_limit < STATS_LIMIT_MIN || model_limit > STATS_LIMIT_MAX || model_fast > 255) {
+						printf("Model must be given as step:limit or step:limit:fast, with step and fast at most 255 and limit from %u to %u.\n", STATS_LIMIT_MIN, STATS_LIMIT_MAX);
+						usage(argv[0]);
+						exit(1);
+					}
+					opts.stats_step = (uint8_t) model_step;
+					opts.stats_limit = (uint32_t) model_limit;
+					opts.stats_fast_step = (uint8_t) model_fast;
+					i += 2;
+					break;
+				}
+				if (strcmp(argv[i], "--sweep") != 0 || i+1 >= argc) {
+					printf("Unrecognized option %s.\n", argv[i]);
+					usage(argv[0]);
+					exit(1);
+				}
+				sweep_mode = 1;
+				extract = 0;
+				sweep_from = strtod(argv[i+1], &sep);
+				if (*sep == ':')
+					sweep_to = strtod(sep+1, &sep);
+				if (*sep == ':')
+					sweep_step = strtod(sep+1, &sep);
+				if (*sep != '\0' || sweep_step <= 0.0) {
+					printf("Sweep must be given as from:to:step.\n");
+					usage(argv[0]);
+					exit(1);
+				}
+				i += 2;
+				break;
 			case 'x':
 				extract = 1;
 				i += 1;
 				break;
+			case 'R':
+				extract = 1;
+				first_line = strtoull(argv[i+1], &sep, 10);
+				if (*sep != ':') {
+					printf("Line range must be given as first:count.\n");
+					usage(argv[0]);
+					exit(1);
+				}
+				line_count = strtoull(sep+1, NULL, 10);
+				i += 2;
+				break;
 			case 'q':
 				extract = 0;
 				i += 1;
@@ -269,10 +774,53 @@ int main(int argc, char **argv) {
                 opts.uncompressed_name = argv[i+1];
                 i += 2;
                 break;
+			case 'B':
+				opts.codebook_file = argv[i+1];
+				i += 2;
+				break;
+			case 'b':
+				opts.codebook_tolerance = atof(argv[i+1]);
+				i += 2;
+				break;
+			case 'P':
+				opts.stats_sample = strtoull(argv[i+1], NULL, 10);
+				i += 2;
+				break;
+			case 'E':
+				opts.estimate = 1;
+				i += 1;
+				break;
+			case 'F':
+				opts.fastq = 1;
+				i += 1;
+				break;
+			case 'H':
+				opts.fastq = 1;
+				opts.sidecar_name = argv[i+1];
+				i += 2;
+				break;
+			case 'm':
+				opts.stream_training = strtoull(argv[i+1], NULL, 10);
+				i += 2;
+				break;
+			case 'K':
+				opts.kmeans_sample = strtoull(argv[i+1], NULL, 10);
+				i += 2;
+				break;
 			case 'T':
 				opts.cluster_threshold = atoi(argv[i+1]);
 				i += 2;
 				break;
+			case 't':
+				opts.threads = atoi(argv[i+1]);
+				if (opts.threads < 1)
+					opts.threads = 1;
+				i += 2;
+				break;
+			case 'S':
+				opts.segment_lines = (uint32_t) strtoul(argv[i+1], NULL, 10);
+				i += 2;
+				break;
             case 'd':
                 switch (argv[i+1][0]) {
                     case 'M':
@@ -290,6 +838,34 @@ int main(int argc, char **argv) {
                 }
                 i += 2;
                 break;
+			case 'e':
+				switch (argv[i+1][0]) {
+					case 'A':
+						opts.coder = CODER_ARITHMETIC;
+						break;
+					case 'R':
+						opts.coder = CODER_RANGE;
+						break;
+					default:
+						printf("Entropy coder not supported, using arithmetic coder.\n");
+						break;
+				}
+				i += 2;
+				break;
+			case 'g':
+				switch (argv[i+1][0]) {
+					case 'W':
+						opts.dither = DITHER_WELL;
+						break;
+					case 'C':
+						opts.dither = DITHER_COUNTER;
+						break;
+					default:
+						printf("Quantizer selection generator not supported, using the counter based generator.\n");
+						break;
+				}
+				i += 2;
+				break;
 			case 'D':
 				opts.distortion = DISTORTION_CUSTOM;
 				opts.dist_file = argv[i+1];
@@ -302,18 +878,54 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	if (file_idx != 2) {
+	if (batch_name && (file_idx != 0 || extract || sweep_mode || opts.estimate || opts.stream_training || opts.sidecar_name || opts.uncompressed || opts.codebook_file || metrics_name)) {
+		printf("--batch takes no file names and can't be combined with -x, -R, -m, -H, -u, -B, -E, --sweep or --metrics.\n");
+		usage(argv[0]);
+		exit(1);
+	}
+	if (batch_shared && !batch_name) {
+		printf("--shared only applies to --batch.\n");
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if (!batch_name && file_idx != 2 && !((sweep_mode || opts.estimate) && file_idx == 1)) {
 		printf("Missing required filenames.\n");
 		usage(argv[0]);
 		exit(1);
 	}
 
+	if (output_name && strcmp(output_name, "-") == 0)
+		reserve_stdout();
+
+	// A pipe can only be read once, so it is always streamed
+	if (!extract && input_name && strcmp(input_name, "-") == 0 && opts.stream_training == 0)
+		opts.stream_training = STREAM_TRAINING_LINES;
+
+	// Every sweep point codes the lines held in memory, which would only be the training prefix
+	if (sweep_mode && opts.stream_training) {
+		printf("--sweep needs the whole input in memory, so it can't read from - or be combined with -m.\n");
+		usage(argv[0]);
+		exit(1);
+	}
+
 	if (opts.verbose) {
-		if (extract) {
+		if (batch_name) {
+			if (batch_shared)
+				printf("The inputs listed in %s will be encoded with codebooks trained on all of them.\n", batch_name);
+			else
+				printf("The inputs listed in %s will be encoded, each with its own codebooks.\n", batch_name);
+		}
+		else if (extract) {
 			printf("%s will be decoded to %s.\n", input_name, output_name);
 		}
 		else {
-			printf("%s will be encoded as %s.\n", input_name, output_name);
+			if (sweep_mode)
+				printf("%s will be encoded at every target from %f to %f in steps of %f.\n", input_name, sweep_from, sweep_to, sweep_step);
+			else if (opts.estimate)
+				printf("The expected rate and distortion of %s will be found without encoding.\n", input_name);
+			else
+				printf("%s will be encoded as %s.\n", input_name, output_name);
 			if (opts.mode == MODE_RATIO)
 				printf("Ratio mode selected, targeting %f compression ratio.\n", opts.ratio);
 			else if (opts.mode == MODE_FIXED)
@@ -337,14 +949,26 @@ int main(int argc, char **argv) {
 			}
 
 			printf("Compression will use %d clusters, with a movement threshold of %.0f.\n", opts.clusters, opts.cluster_threshold);
+			if (opts.codebook_file)
+				printf("Codebooks will be reused from or saved to %s.\n", opts.codebook_file);
+			if (opts.segment_lines)
+				printf("Segments of %u lines will be coded on %u threads.\n", opts.segment_lines, opts.threads);
+			else
+				printf("The file will be coded as a single segment.\n");
 		}
 	}
 
-	if (extract) {
-		decode(input_name, output_name, &opts);
+	if (batch_name) {
+		batch(batch_name, &opts, batch_shared);
+	}
+	else if (extract) {
+		decode(input_name, output_name, &opts, first_line, line_count);
+	}
+	else if (sweep_mode) {
+		sweep(input_name, &opts, sweep_from, sweep_to, sweep_step);
 	}
 	else {
-		encode(input_name, output_name, &opts);
+		encode(input_name, output_name, &opts, metrics_name);
 	}
 
 #ifdef _WIN32
@@ -0,0 +1,258 @@
+/**
+ * Collection and JSON output of per stage timings, coding statistics and memory use. Stages
+ * are recorded by the thread that runs them, while segments are merged from the coding
+ * threads under the lock
+ */
+
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(LINUX) || defined(__APPLE__)
+	#include <sys/time.h>
+	#include <sys/resource.h>
+#endif
+
+#include "metrics.h"
+#include "codebook.h"
+
+/**
+ * Processor time used so far by every thread of the process, in seconds, or 0 where it
+ * can't be read
+ */
+static double get_cpu_time(void) {
+#if defined(LINUX) || defined(__APPLE__)
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0.0;
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#else
+	return 0.0;
+#endif
+}
+
+/**
+ * Largest resident set size of the process so far, in bytes, or 0 where it can't be read
+ */
+uint64_t get_peak_rss(void) {
+#if defined(LINUX) || defined(__APPLE__)
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	return (uint64_t) usage.ru_maxrss;
+#else
+	// Linux reports kilobytes
+	return ((uint64_t) usage.ru_maxrss) * 1024;
+#endif
+#else
+	return 0;
+#endif
+}
+
+struct metrics_t *alloc_metrics(void) {
+	struct metrics_t *m = (struct metrics_t *) calloc(1, sizeof(struct metrics_t));
+
+	pthread_mutex_init(&m->lock, NULL);
+	return m;
+}
+
+void free_metrics(struct metrics_t *m) {
+	pthread_mutex_destroy(&m->lock);
+	free(m->iterations);
+	free(m->totals.column_bits);
+	free(m->totals.column_symbols);
+	free(m->totals.cluster_bits);
+	free(m->totals.cluster_symbols);
+	free(m);
+}
+
+void start_stage(struct stage_timer_t *timer) {
+	start_timer(&timer->wall);
+	timer->cpu = get_cpu_time();
+}
+
+/**
+ * Finishes a stage that timer was started for, and records it under the given name, which
+ * must outlive the metrics. Stages beyond METRICS_MAX_STAGES are dropped
+ */
+void stop_stage(struct metrics_t *m, struct stage_timer_t *timer, const char *name) {
+	struct stage_metric_t *stage;
+
+	stop_timer(&timer->wall);
+	if (m->stage_count == METRICS_MAX_STAGES)
+		return;
+
+	stage = &m->stages[m->stage_count++];
+	stage->name = name;
+	stage->wall = get_timer_interval(&timer->wall);
+	stage->cpu = get_cpu_time() - timer->cpu;
+	stage->moved = 0.0;
+}
+
+/**
+ * Records one k-means iteration, which timer was started for, and how far it moved the means
+ */
+void add_kmeans_iteration(struct metrics_t *m, struct stage_timer_t *timer, double moved) {
+	struct stage_metric_t *it;
+
+	stop_timer(&timer->wall);
+	if (m->iteration_count == m->iteration_capacity) {
+		m->iteration_capacity = m->iteration_capacity ? 2*m->iteration_capacity : 16;
+		m->iterations = (struct stage_metric_t *) realloc(m->iterations, m->iteration_capacity*sizeof(struct stage_metric_t));
+	}
+
+	it = &m->iterations[m->iteration_count++];
+	it->name = "kmeans_iteration";
+	it->wall = get_timer_interval(&timer->wall);
+	it->cpu = get_cpu_time() - timer->cpu;
+	it->moved = moved;
+}
+
+/**
+ * Allocates zeroed statistics for one segment
+ */
+struct segment_metrics_t *alloc_segment_metrics(uint32_t columns, uint8_t clusters) {
+	struct segment_metrics_t *s = (struct segment_metrics_t *) calloc(1, sizeof(struct segment_metrics_t));
+
+	s->column_bits = (double *) calloc(columns, sizeof(double));
+	s->column_symbols = (uint64_t *) calloc(columns, sizeof(uint64_t));
+	s->cluster_bits = (double *) calloc(clusters, sizeof(double));
+	s->cluster_symbols = (uint64_t *) calloc(clusters, sizeof(uint64_t));
+	return s;
+}
+
+/**
+ * Adds a segment's statistics to the totals and releases them. Safe to call from several
+ * coding threads at once
+ */
+void merge_segment_metrics(struct metrics_t *m, struct segment_metrics_t *s, uint32_t columns, uint8_t clusters) {
+	uint32_t i;
+
+	pthread_mutex_lock(&m->lock);
+	if (!m->totals.column_bits) {
+		m->columns = columns;
+		m->clusters = clusters;
+		m->totals.column_bits = (double *) calloc(columns, sizeof(double));
+		m->totals.column_symbols = (uint64_t *) calloc(columns, sizeof(uint64_t));
+		m->totals.cluster_bits = (double *) calloc(clusters, sizeof(double));
+		m->totals.cluster_symbols = (uint64_t *) calloc(clusters, sizeof(uint64_t));
+	}
+
+	for (i = 0; i < m->columns; ++i) {
+		m->totals.column_bits[i] += s->column_bits[i];
+		m->totals.column_symbols[i] += s->column_symbols[i];
+	}
+	for (i = 0; i < m->clusters; ++i) {
+		m->totals.cluster_bits[i] += s->cluster_bits[i];
+		m->totals.cluster_symbols[i] += s->cluster_symbols[i];
+	}
+	m->totals.rescales += s->rescales;
+	pthread_mutex_unlock(&m->lock);
+
+	free(s->column_bits);
+	free(s->column_symbols);
+	free(s->cluster_bits);
+	free(s->cluster_symbols);
+	free(s);
+}
+
+/**
+ * Writes a string as a JSON string literal
+ */
+static void write_json_string(FILE *fp, const char *str) {
+	const unsigned char *c;
+
+	fputc('"', fp);
+	for (c = (const unsigned char *) str; *c; ++c) {
+		if (*c == '"' || *c == '\\')
+			fprintf(fp, "\\%c", *c);
+		else if (*c < 0x20)
+			fprintf(fp, "\\u%04x", *c);
+		else
+			fputc(*c, fp);
+	}
+	fputc('"', fp);
+}
+
+static void write_json_timing(FILE *fp, struct stage_metric_t *stage) {
+	fprintf(fp, "\"wall_seconds\": %.6f, \"cpu_seconds\": %.6f", stage->wall, stage->cpu);
+}
+
+/**
+ * Writes the bytes and bits per symbol spent on some number of symbols
+ */
+static void write_json_rate(FILE *fp, double bits, uint64_t symbols) {
+	fprintf(fp, "\"symbols\": %llu, \"bytes\": %.1f, \"bits_per_symbol\": %.6f", (unsigned long long) symbols, bits / 8.0, symbols ? bits / symbols : 0.0);
+}
+
+/**
+ * Writes everything collected for an encoding of info that took bytes in total to path, as
+ * a single JSON object. The distortion is written as null if it wasn't measured
+ */
+void write_metrics(const char *path, struct metrics_t *m, struct quality_file_t *info, uint64_t bytes, const double *distortion) {
+	FILE *fp = fopen(path, "w");
+	uint32_t i;
+
+	if (!fp) {
+		perror("Unable to open metrics file");
+		exit(1);
+	}
+
+	fprintf(fp, "{\n\t\"input\": ");
+	write_json_string(fp, info->path ? info->path : "");
+	fprintf(fp, ",\n\t\"lines\": %llu,\n", (unsigned long long) info->lines);
+	fprintf(fp, "\t\"columns\": %u,\n", info->columns);
+	fprintf(fp, "\t\"symbols\": %llu,\n", (unsigned long long) info->symbols);
+	fprintf(fp, "\t\"variable_length\": %s,\n", info->variable_length ? "true" : "false");
+	fprintf(fp, "\t\"cluster_count\": %u,\n", info->cluster_count);
+	fprintf(fp, "\t\"threads\": %u,\n", info->opts->threads);
+	fprintf(fp, "\t\"bytes\": %llu,\n", (unsigned long long) bytes);
+	fprintf(fp, "\t\"bits_per_symbol\": %.6f,\n", info->symbols ? (bytes*8.0) / info->symbols : 0.0);
+	if (distortion)
+		fprintf(fp, "\t\"distortion\": %.6f,\n", *distortion);
+	else
+		fprintf(fp, "\t\"distortion\": null,\n");
+	fprintf(fp, "\t\"stats_rescales\": %llu,\n", (unsigned long long) m->totals.rescales);
+	fprintf(fp, "\t\"peak_rss_bytes\": %llu,\n", (unsigned long long) get_peak_rss());
+
+	fprintf(fp, "\t\"stages\": [");
+	for (i = 0; i < m->stage_count; ++i) {
+		fprintf(fp, "%s\n\t\t{\"name\": ", i ? "," : "");
+		write_json_string(fp, m->stages[i].name);
+		fprintf(fp, ", ");
+		write_json_timing(fp, &m->stages[i]);
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "\n\t],\n");
+
+	fprintf(fp, "\t\"kmeans_iterations\": [");
+	for (i = 0; i < m->iteration_count; ++i) {
+		fprintf(fp, "%s\n\t\t{\"iteration\": %u, ", i ? "," : "", i);
+		write_json_timing(fp, &m->iterations[i]);
+		fprintf(fp, ", \"moved\": %.6f}", m->iterations[i].moved);
+	}
+	fprintf(fp, "\n\t],\n");
+
+	fprintf(fp, "\t\"per_cluster\": [");
+	for (i = 0; i < m->clusters; ++i) {
+		fprintf(fp, "%s\n\t\t{\"cluster\": %u, ", i ? "," : "", i);
+		write_json_rate(fp, m->totals.cluster_bits[i], m->totals.cluster_symbols[i]);
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "\n\t],\n");
+
+	fprintf(fp, "\t\"per_column\": [");
+	for (i = 0; i < m->columns; ++i) {
+		fprintf(fp, "%s\n\t\t{\"column\": %u, ", i ? "," : "", i);
+		write_json_rate(fp, m->totals.column_bits[i], m->totals.column_symbols[i]);
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "\n\t]\n}\n");
+
+	fclose(fp);
+}
@@ -1,28 +1,40 @@
 #include "qv_compressor.h"
 
 /**
- * Allocates a file stream wrapper for the arithmetic encoder, with a given
- * already opened file handle
+ * Bit streams for the entropy coders. Output is collected in a growable memory buffer
+ * through a 64 bit accumulator, so that runs of bits are appended with a few shifts and
+ * whole 32 bit words are stored at a time. Input is read in place from a caller owned
+ * buffer (usually a read only mapping of the compressed file) and is never modified.
+ * Bits are always stored msb first.
  */
-struct os_stream_t *alloc_os_stream(FILE *fp, uint8_t in) {
+
+/**
+ * Allocates an output stream that collects its bytes in memory
+ */
+struct os_stream_t *alloc_os_stream(void) {
 	struct os_stream_t *rtn = (struct os_stream_t *) calloc(1, sizeof(struct os_stream_t));
 
-	rtn->fp = fp;
-	rtn->buf = (uint8_t *) calloc(OS_STREAM_BUF_LEN, sizeof(uint8_t));
+	rtn->size = OS_STREAM_INITIAL_LEN;
+	rtn->buf = (uint8_t *) malloc(rtn->size);
 
-	if (in) {
-		fread(rtn->buf, sizeof(uint8_t), OS_STREAM_BUF_LEN, fp);
-	}
-	rtn->bufPos = 0;
-	rtn->bitPos = 0;
-	rtn->written = 0;
+	return rtn;
+}
+
+/**
+ * Allocates an input stream that reads from the given data without copying it. Reads past
+ * the end of the data return zero bits
+ */
+struct os_stream_t *alloc_os_stream_reader(const uint8_t *data, size_t size) {
+	struct os_stream_t *rtn = (struct os_stream_t *) calloc(1, sizeof(struct os_stream_t));
+
+	rtn->in = data;
+	rtn->size = size;
 
 	return rtn;
 }
 
 /**
- * Deallocate the output stream. Note that this doesn't close the file because
- * this stream doesn't own it
+ * Deallocate the stream. Input data is not freed because this stream doesn't own it
  */
 void free_os_stream(struct os_stream_t *os) {
 	free(os->buf);
@@ -30,91 +42,169 @@ void free_os_stream(struct os_stream_t *os) {
 }
 
 /**
- * Reads a single bit from the stream
+ * Takes ownership of the bytes written to an output stream, which must have been flushed
+ * with stream_finish_byte or stream_write_buffer first
  */
-uint8_t stream_read_bit(struct os_stream_t *os) {
-	uint8_t rtn = os->buf[os->bufPos] >> 7;
+uint8_t *stream_release_buffer(struct os_stream_t *os, size_t *size) {
+	uint8_t *rtn = os->buf;
 
-	os->buf[os->bufPos] = os->buf[os->bufPos] << 1;
-	os->bitPos += 1;
+	*size = os->pos;
+	os->buf = NULL;
+	os->size = 0;
+	os->pos = 0;
 
-	if (os->bitPos == 8) {
-		os->bitPos = 0;
-		os->bufPos += 1;
-		if (os->bufPos == OS_STREAM_BUF_LEN) {
-			fread(os->buf, sizeof(uint8_t), OS_STREAM_BUF_LEN, os->fp);
-			os->bufPos = 0;
+	return rtn;
+}
+
+/**
+ * Starts a stream over without giving up its memory. An output stream keeps its buffer
+ * and writes from the start of it again, and an input stream reads from the given data
+ */
+void stream_rewind(struct os_stream_t *os, const uint8_t *data, size_t size) {
+	if (data) {
+		os->in = data;
+		os->size = size;
+	}
+	os->pos = 0;
+	os->bits = 0;
+	os->bit_count = 0;
+	os->written = 0;
+}
+
+/**
+ * Makes sure there is room for at least len more bytes in the output buffer
+ */
+static void stream_reserve(struct os_stream_t *os, size_t len) {
+	if (os->pos + len > os->size) {
+		while (os->pos + len > os->size) {
+			os->size *= 2;
+		}
+		os->buf = (uint8_t *) realloc(os->buf, os->size);
+		if (!os->buf) {
+			printf("Unable to grow output stream buffer.\n");
+			exit(1);
 		}
 	}
+}
+
+/**
+ * Refills the input accumulator so that it holds at least 57 bits
+ */
+static void stream_refill(struct os_stream_t *os) {
+	while (os->bit_count <= 56) {
+		if (os->pos < os->size)
+			os->bits |= ((uint64_t) os->in[os->pos]) << (56 - os->bit_count);
+		os->pos += 1;
+		os->bit_count += 8;
+	}
+}
+
+/**
+ * Reads a single bit from the stream
+ */
+uint8_t stream_read_bit(struct os_stream_t *os) {
+	uint8_t rtn;
+
+	if (os->bit_count == 0)
+		stream_refill(os);
+
+	rtn = (uint8_t) (os->bits >> 63);
+	os->bits <<= 1;
+	os->bit_count -= 1;
 
 	return rtn;
 }
 
 /**
- * Reads a grouping of bits to be interpreted as a single integer, regardless of length
- * Bits are implicitly written in bit endian order ONE AT A TIME elsewhere in the code,
- * so this must read that way too
+ * Reads a grouping of up to 32 bits to be interpreted as a single integer, msb first
  */
 uint32_t stream_read_bits(struct os_stream_t *os, uint8_t len) {
-	uint32_t rtn = 0;
-	int8_t bit;
+	uint32_t rtn;
 
-	for (bit = len-1; bit >= 0; --bit) {
-		rtn |= stream_read_bit(os) << bit;
-	}
+	if (len == 0)
+		return 0;
+	if (os->bit_count < len)
+		stream_refill(os);
+
+	rtn = (uint32_t) (os->bits >> (64 - len));
+	os->bits <<= len;
+	os->bit_count -= len;
 
 	return rtn;
 }
 
 /**
- * Writes a single bit to the stream
+ * Reads a whole byte, for streams that are only ever read bytewise
  */
-void stream_write_bit(struct os_stream_t *os, uint8_t bit) {
-	bit = (bit & 1);
-	os->buf[os->bufPos] |= bit;
-
-	os->bitPos += 1;
+uint8_t stream_read_byte(struct os_stream_t *os) {
+	return (uint8_t) stream_read_bits(os, 8);
+}
 
-	if (os->bitPos == 8) {
-		os->bitPos = 0;
-		os->bufPos += 1;
-		if (os->bufPos == OS_STREAM_BUF_LEN) {
-			stream_write_buffer(os);
-		}
-	}
-	else {
-		os->buf[os->bufPos] <<= 1;
+/**
+ * Moves every complete byte in the output accumulator into the buffer
+ */
+static void stream_flush_bytes(struct os_stream_t *os) {
+	stream_reserve(os, 8);
+	while (os->bit_count >= 8) {
+		os->bit_count -= 8;
+		os->buf[os->pos] = (uint8_t) (os->bits >> os->bit_count);
+		os->pos += 1;
 	}
 }
 
 /**
- * Writes a grouping of bits to be interpreted as a single integer and read back the
- * same way. Bits need to be written msb first
+ * Writes a single bit to the stream
  */
-void stream_write_bits(struct os_stream_t *os, uint32_t dw, uint8_t len) {
-	int8_t bit;
+void stream_write_bit(struct os_stream_t *os, uint8_t bit) {
+	stream_write_bits(os, bit & 1, 1);
+}
 
-	for (bit = len-1; bit >= 0; --bit) {
-		stream_write_bit(os, (uint8_t)(dw >> bit));
+/**
+ * Writes a grouping of up to 32 bits to be interpreted as a single integer and read back
+ * the same way. Bits need to be written msb first
+ */
+void stream_write_bits(struct os_stream_t *os, uint32_t dw, uint8_t len) {
+	uint32_t word;
+
+	if (len == 0)
+		return;
+
+	os->bits = (os->bits << len) | (dw & (uint32_t) ((1ull << len) - 1));
+	os->bit_count += len;
+
+	// Store a full word big endian once we have one
+	if (os->bit_count >= 32) {
+		os->bit_count -= 32;
+		word = (uint32_t) (os->bits >> os->bit_count);
+		stream_reserve(os, 4);
+		os->buf[os->pos] = (uint8_t) (word >> 24);
+		os->buf[os->pos+1] = (uint8_t) (word >> 16);
+		os->buf[os->pos+2] = (uint8_t) (word >> 8);
+		os->buf[os->pos+3] = (uint8_t) word;
+		os->pos += 4;
 	}
 }
 
 /**
- * Finishes the current byte in progress and writes the buffer out
+ * Writes a whole byte, for streams that are only ever written bytewise
+ */
+void stream_write_byte(struct os_stream_t *os, uint8_t byte) {
+	stream_write_bits(os, byte, 8);
+}
+
+/**
+ * Pads the current byte in progress with zeros and flushes the stream
  */
 void stream_finish_byte(struct os_stream_t *os) {
-	os->buf[os->bufPos] <<= (7 - os->bitPos);
-	os->bitPos = 0;
-	os->bufPos += 1;
+	if (os->bit_count & 7)
+		stream_write_bits(os, 0, 8 - (os->bit_count & 7));
 	stream_write_buffer(os);
 }
 
 /**
- * Writes out the current stream buffer regardless of fill amount
+ * Moves everything written so far into the buffer, which must be byte aligned
  */
 void stream_write_buffer(struct os_stream_t *os) {
-	fwrite(os->buf, sizeof(uint8_t), os->bufPos, os->fp);
-	memset(os->buf, 0, sizeof(uint8_t)*os->bufPos);
-	os->written += os->bufPos;
-	os->bufPos = 0;
+	stream_flush_bytes(os);
+	os->written = os->pos;
 }
@@ -1,19 +1,31 @@
 #include <stdio.h>
 #include <string.h>
+#include <assert.h>
 
 #include "pmf.h"
 
 //#define log2(a) log(a)/log(2.0)
+/**
+ * Allocates an alphabet structure with room for every input symbol, with the symbol list
+ * and index table stored after the structure in the same allocation
+ */
+static struct alphabet_t *alloc_alphabet_storage(void) {
+	struct alphabet_t *rtn = (struct alphabet_t *) calloc(1, sizeof(struct alphabet_t) + ALPHABET_INDEX_SIZE_HINT*sizeof(uint32_t) + ALPHABET_SIZE*sizeof(symbol_t));
+	rtn->indexes = (uint32_t *) (rtn + 1);
+	rtn->symbols = (symbol_t *) (rtn->indexes + ALPHABET_INDEX_SIZE_HINT);
+	return rtn;
+}
+
 /**
  * Allocates the memory for an alphabet structure and fills the symbols
  * with a default list of 0 through size-1
  */
 struct alphabet_t *alloc_alphabet(uint32_t size) {
 	symbol_t i;
-	struct alphabet_t *rtn = (struct alphabet_t *) calloc(1, sizeof(struct alphabet_t));
-	rtn->size = size;
-	rtn->symbols = (symbol_t *) calloc(size, sizeof(symbol_t));
+	struct alphabet_t *rtn = alloc_alphabet_storage();
 
+	assert(size <= ALPHABET_SIZE);
+	rtn->size = size;
 	for (i = 0; i < size; ++i) {
 		rtn->symbols[i] = i;
 	}
@@ -26,57 +38,92 @@ struct alphabet_t *alloc_alphabet(uint32_t size) {
  * Makes a copy of the given alphabet
  */
 struct alphabet_t *duplicate_alphabet(const struct alphabet_t *a) {
-	struct alphabet_t *rtn = (struct alphabet_t *) calloc(1, sizeof(struct alphabet_t));
-	rtn->size = a->size;
-	rtn->symbols = (symbol_t *) calloc(a->size, sizeof(symbol_t));
+	struct alphabet_t *rtn = alloc_alphabet_storage();
+	copy_alphabet(rtn, a);
+	return rtn;
+}
 
-	memcpy(rtn->symbols, a->symbols, a->size*sizeof(symbol_t));
-	alphabet_compute_index(rtn);
+/**
+ * Overwrites an existing alphabet with the contents of another one, reusing its storage
+ */
+void copy_alphabet(struct alphabet_t *dst, const struct alphabet_t *src) {
+	dst->size = src->size;
+	memcpy(dst->symbols, src->symbols, src->size*sizeof(symbol_t));
+	memcpy(dst->indexes, src->indexes, ALPHABET_INDEX_SIZE_HINT*sizeof(uint32_t));
+	memcpy(dst->mask, src->mask, sizeof(dst->mask));
+}
 
-	return rtn;
+/**
+ * Bytes needed for one PMF including its probability and count slabs
+ */
+#define PMF_STORAGE_SIZE	(sizeof(struct pmf_t) + ALPHABET_SIZE*sizeof(double) + ALPHABET_SIZE*sizeof(uint32_t))
+
+/**
+ * Points a zeroed PMF at its slabs, which follow the structure
+ */
+static void init_pmf_storage(struct pmf_t *pmf, const struct alphabet_t *alphabet) {
+	pmf->alphabet = alphabet;
+	pmf->pmf = (double *) (pmf + 1);
+	pmf->counts = (uint32_t *) (pmf->pmf + ALPHABET_SIZE);
 }
 
 /**
  * Allocates a PMF structure for the given alphabet, but it does not copy the alphabet
  */
 struct pmf_t *alloc_pmf(const struct alphabet_t *alphabet) {
-	struct pmf_t *rtn = (struct pmf_t *) calloc(1, sizeof(struct pmf_t));
-	rtn->alphabet = alphabet;
-	rtn->pmf = (double *) calloc(alphabet->size, sizeof(double));
-	rtn->counts = (uint32_t *) calloc(alphabet->size, sizeof(uint32_t));
+	struct pmf_t *rtn = (struct pmf_t *) calloc(1, PMF_STORAGE_SIZE);
+	init_pmf_storage(rtn, alphabet);
 	return rtn;
 }
 
 /**
- * Allocates an array for tracking a list of PMFs along with the underlying PMFs
+ * Allocates an array for tracking a list of PMFs along with the underlying PMFs, all in
+ * a single arena allocation
  */
 struct pmf_list_t *alloc_pmf_list(uint32_t size, const struct alphabet_t *alphabet) {
 	uint32_t i;
-	struct pmf_list_t *rtn = (struct pmf_list_t *) calloc(1, sizeof(struct pmf_list_t));
+	uint8_t *arena;
+	struct pmf_list_t *rtn = (struct pmf_list_t *) calloc(1, sizeof(struct pmf_list_t) + size*sizeof(struct pmf_t *) + ((size_t) size)*PMF_STORAGE_SIZE);
+
 	rtn->size = size;
-	rtn->pmfs = (struct pmf_t **) calloc(size, sizeof(struct pmf_t *));
-	
+	rtn->capacity = size;
+	rtn->pmfs = (struct pmf_t **) (rtn + 1);
+
+	arena = (uint8_t *) (rtn->pmfs + size);
 	for (i = 0; i < size; ++i) {
-		rtn->pmfs[i] = alloc_pmf(alphabet);
+		rtn->pmfs[i] = (struct pmf_t *) (arena + i*PMF_STORAGE_SIZE);
+		init_pmf_storage(rtn->pmfs[i], alphabet);
 	}
 
 	return rtn;
 }
 
+/**
+ * Reuses a list as size empty PMFs over a new alphabet, without reallocating. The list must
+ * have been allocated with at least that many PMFs
+ */
+void reset_pmf_list(struct pmf_list_t *list, uint32_t size, const struct alphabet_t *alphabet) {
+	uint32_t i;
+
+	assert(size <= list->capacity);
+	list->size = size;
+	for (i = 0; i < size; ++i) {
+		memset(list->pmfs[i], 0, PMF_STORAGE_SIZE);
+		init_pmf_storage(list->pmfs[i], alphabet);
+	}
+}
+
 /**
  * Frees an alphabet
  */
 void free_alphabet(struct alphabet_t *alphabet) {
-	free(alphabet->symbols);
-	free(alphabet->indexes);
 	free(alphabet);
 }
 
 /**
- * Frees a PMF
+ * Frees a PMF, which must have come from alloc_pmf rather than a list
  */
 void free_pmf(struct pmf_t *pmf) {
-	free(pmf->counts);
 	free(pmf);
 }
 
@@ -84,11 +131,6 @@ void free_pmf(struct pmf_t *pmf) {
  * Frees a list of PMFs
  */
 void free_pmf_list(struct pmf_list_t *pmfs) {
-	uint32_t i;
-	for (i = 0; i < pmfs->size; ++i) {
-		free_pmf(pmfs->pmfs[i]);
-	}
-	free(pmfs->pmfs);
 	free(pmfs);
 }
 
@@ -121,6 +163,16 @@ double get_probability(struct pmf_t *pmf, uint32_t idx) {
 	return pmf->pmf[idx];
 }
 
+/**
+ * Gets the whole array of probabilities, triggering lazy re-eval if necessary, so that
+ * loops over them don't have to check each time
+ */
+const double *get_probabilities(struct pmf_t *pmf) {
+	if (!pmf->pmf_ready)
+		recalculate_pmf(pmf);
+	return pmf->pmf;
+}
+
 /**
  * Gets the probability for a specific symbol, triggering lazy re-eval if
  * necessary
@@ -294,7 +346,7 @@ void clear_pmf_list(struct pmf_list_t *list) {
  * Determines if the given alphabet contains the given symbol
  */
 uint32_t alphabet_contains(const struct alphabet_t *alphabet, symbol_t symbol) {
-	return alphabet->indexes[symbol] != ALPHABET_SYMBOL_NOT_FOUND ? 1 : 0;
+	return (alphabet->mask[symbol >> 6] >> (symbol & 63)) & 1;
 }
 
 /**
@@ -307,77 +359,47 @@ uint32_t get_symbol_index(const struct alphabet_t *alphabet, symbol_t symbol) {
 
 /**
  * Finds the unique set of symbols across both input alphabets and creates an
- * output alphabet
+ * output alphabet. The union is an OR of the bitsets, and since the bits are in
+ * symbol order the symbol list comes out sorted. The result may be either input
  */
-void alphabet_union(const struct alphabet_t *restrict a, const struct alphabet_t *restrict b, struct alphabet_t *result) {
-	symbol_t *sym = (symbol_t *) _alloca((a->size+b->size)*sizeof(symbol_t));
-	uint32_t i = 0;
-	uint32_t j = 0;
-	uint32_t k = 0;
-
-	// Combine with a merge algorithm since alphabets are required to be sorted
-	while (i < a->size && j < b->size) {
-		if (a->symbols[i] < b->symbols[j]) {
-			sym[k] = a->symbols[i];
-			i += 1;
-		}
-		else if (a->symbols[i] == b->symbols[j]) {
-			sym[k] = a->symbols[i];
-			i += 1;
-			j += 1;
-		}
-		else {
-			sym[k] = b->symbols[j];
-			j += 1;
-		}
-		k += 1;
-	}
+void alphabet_union(const struct alphabet_t *a, const struct alphabet_t *b, struct alphabet_t *result) {
+	uint32_t w, k = 0;
+	uint64_t bits;
 
-	// Tail of the merge
-	while (i < a->size) {
-		sym[k] = a->symbols[i];
-		k += 1;
-		i += 1;
+	for (w = 0; w < ALPHABET_MASK_WORDS; ++w) {
+		result->mask[w] = a->mask[w] | b->mask[w];
 	}
-	while (j < b->size) {
-		sym[k] = b->symbols[j];
-		k += 1;
-		j += 1;
-	}
-
-	// If we already have an output array, replace it with a new one
-	if (result->symbols)
-		free(result->symbols);
-	result->symbols = (symbol_t *) calloc(k, sizeof(symbol_t));
 
-	// Copy over temporary data
-	memcpy(result->symbols, sym, k*sizeof(symbol_t));
+	for (w = 0; w < ALPHABET_MASK_WORDS; ++w) {
+		bits = result->mask[w];
+		while (bits) {
+			result->symbols[k] = (symbol_t) (64*w + __builtin_ctzll(bits));
+			k += 1;
+			bits &= bits - 1;
+		}
+	}
 	result->size = k;
 	alphabet_compute_index(result);
 }
 
 /**
  * Computes the index table (reverse mapping of symbols in the alphabet)
- * that is used to speed up searches for symbols). This isn't a proper
- * hash table and it will consume exponential memory if symbol_t changes
- * size, so be careful
+ * that is used to speed up searches for symbols), and the membership bitset.
+ * This isn't a proper hash table and it will consume exponential memory if
+ * symbol_t changes size, so be careful
  */
 void alphabet_compute_index(struct alphabet_t *A) {
 	uint32_t i;
 
-	if (A->indexes)
-		free(A->indexes);
-	
-	// Cheating but whatever
-	A->indexes = (uint32_t *) calloc(ALPHABET_INDEX_SIZE_HINT, sizeof(uint32_t));
-
 	// Fill gaps in the table with an appropriate index so we can use this for search too
 	for (i = 0; i < ALPHABET_INDEX_SIZE_HINT; ++i) {
 		A->indexes[i] = ALPHABET_SYMBOL_NOT_FOUND;
 	}
+	memset(A->mask, 0, sizeof(A->mask));
 
 	for (i = 0; i < A->size; ++i) {
 		A->indexes[A->symbols[i]] = i;
+		A->mask[A->symbols[i] >> 6] |= 1ULL << (A->symbols[i] & 63);
 	}
 }
 
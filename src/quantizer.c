@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 
 #include "quantizer.h"
 #include "util.h"
@@ -26,6 +27,70 @@ void free_quantizer(struct quantizer_t *q) {
 	free(q);
 }
 
+/**
+ * Finds the reconstruction point with the lowest expected distortion over the region
+ * [lo, hi), preferring the smallest such point on ties. MSE and L1 have closed forms in
+ * terms of prefix sums of p and p*x (the rounded mean and the median of the region), while
+ * any other distortion measure tries every point in the region
+ * @param p Probability of each symbol
+ * @param cp Sum of p over symbols below each index, size+1 entries
+ * @param cpx Sum of p*x over symbols below each index, size+1 entries
+ */
+static uint32_t find_reconstruction(const double *p, const double *cp, const double *cpx, const struct distortion_t *dist, uint32_t lo, uint32_t hi) {
+	double s0 = cp[hi] - cp[lo];
+	double mse, min_mse;
+	uint32_t i, r, min_r = lo;
+	const float *column;
+
+	switch (dist->type) {
+		case DISTORTION_MSE:
+			// Expected distortion is s0*(r - mean)^2 plus a constant, so take the nearest point to the mean
+			if (s0 > 0) {
+				mse = ceil((cpx[hi] - cpx[lo]) / s0 - 0.5);
+				if (mse > lo)
+					min_r = (mse < hi - 1) ? (uint32_t) mse : hi - 1;
+			}
+			return min_r;
+		case DISTORTION_MANHATTAN:
+			// The first point with at least half of the region's mass at or below it is a median
+			for (r = lo; r < hi - 1; ++r) {
+				if (2*(cp[r+1] - cp[lo]) >= s0)
+					break;
+			}
+			return r;
+		default:
+			break;
+	}
+
+	// Initial guess for min values
+	min_mse = DBL_MAX;
+
+	// For each possible reconstruction point
+	for (r = lo; r < hi; ++r) {
+		// Find its distortion when used for the whole region
+		mse = 0.0;
+		if (dist->matrix) {
+			column = get_custom_distortion_column(dist, r);
+			for (i = lo; i < hi; ++i) {
+				mse += p[i] * column[i];
+			}
+		}
+		else {
+			for (i = lo; i < hi; ++i) {
+				mse += p[i] * get_difference_distortion(dist, i, r);
+			}
+		}
+
+		// Compare to minimums, save if better
+		if (mse < min_mse) {
+			min_r = r;
+			min_mse = mse;
+		}
+	}
+
+	return min_r;
+}
+
 /**
  * Produce a quantizer with the given number of states for the given pmf, and
  * optionally computes the expected distortion produced by this quantizer.
@@ -37,9 +102,10 @@ struct quantizer_t *generate_quantizer(struct pmf_t *restrict pmf, struct distor
 	uint32_t iter = 0;
 	uint32_t i, j, r, size;
 	uint32_t min_r;
-	double mse, min_mse, next_mse;
+	double mse, next_mse;
 	symbol_t *bounds = (symbol_t *) _alloca((states+1)*sizeof(symbol_t));
 	symbol_t *reconstruction = (symbol_t *) _alloca(states*sizeof(symbol_t));
+	double *p, *cp, *cpx;
 
 	// Initial bounds and reconstruction points
 	bounds[0] = 0;
@@ -51,33 +117,28 @@ struct quantizer_t *generate_quantizer(struct pmf_t *restrict pmf, struct distor
 		reconstruction[j] = (bounds[j] + bounds[j+1] - 1) / 2;
 	}
 
+	// Probabilities and their prefix sums, so region costs don't need to be summed each iteration
+	size = pmf->alphabet->size;
+	p = (double *) _alloca(size*sizeof(double));
+	cp = (double *) _alloca((size+1)*sizeof(double));
+	cpx = (double *) _alloca((size+1)*sizeof(double));
+	cp[0] = 0.0;
+	cpx[0] = 0.0;
+	for (i = 0; i < size; ++i) {
+		p[i] = get_probability(pmf, i);
+		cp[i+1] = cp[i] + p[i];
+		cpx[i+1] = cpx[i] + p[i]*i;
+	}
+
 	// Lloyd-Max quantizer design alternating between adjustment of bounds
 	// and of reconstruction point locations until there is no change
-	size = pmf->alphabet->size;
 	while (changed && iter < QUANTIZER_MAX_ITER) {
 		changed = 0;
 		iter += 1;
 
 		// First, adjust the reconstruction points for fixed bounds
 		for (j = 0; j < states; ++j) {
-			// Initial guess for min values
-			min_mse = DBL_MAX;
-			min_r = bounds[j];
-			
-			// For each possible reconstruction point
-			for (r = bounds[j]; r < bounds[j+1]; ++r) {
-				// Find its distortion when used for the whole region
-				mse = 0.0;
-				for (i = bounds[j]; i < bounds[j+1]; ++i) {
-					mse += get_probability(pmf, i) * get_distortion(dist, i, r);
-				}
-
-				// Compare to minimums, save if better
-				if (mse < min_mse) {
-					min_r = r;
-					min_mse = mse;
-				}
-			}
+			min_r = find_reconstruction(p, cp, cpx, dist, bounds[j], bounds[j+1]);
 
 			// Check if we've changed our reconstruction and save it
 			if (min_r != reconstruction[j]) {
@@ -124,7 +185,7 @@ struct quantizer_t *generate_quantizer(struct pmf_t *restrict pmf, struct distor
 	q->mse = 0.0;
 	for (j = 0; j < states; ++j) {
 		for (i = bounds[j]; i < bounds[j+1]; ++i) {
-			q->mse += get_distortion(dist, i, reconstruction[j]) * get_probability(pmf, i);
+			q->mse += get_distortion(dist, i, reconstruction[j]) * p[i];
 		}
 	}
     
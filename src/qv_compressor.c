@@ -1,34 +1,70 @@
-#include <assert.h>
 #include "qv_compressor.h"
+#include "thread_pool.h"
+#include "cluster.h"
+#include "container.h"
+#include "writer.h"
+#include "metrics.h"
+
+#if defined(LINUX) || defined(__APPLE__)
+	#include <arpa/inet.h>
+	#include <sys/mman.h>
+#endif
 
 /**
- * Compress a quality value and send it into the arithmetic encoder output stream,
+ * Compress a quality value and send it into the entropy coder output stream,
  * with appropriate context information
  */
-void compress_qv(arithStream as, uint32_t x, uint8_t cluster, uint32_t column, uint32_t idx) {
-    arithmetic_encoder_step(as->a, as->stats[cluster][column][idx], x, as->os);
-    update_stats(as->stats[cluster][column][idx], x, as->a->r);
+void compress_qv(arithStream as, uint32_t x, uint8_t cluster, uint32_t idx) {
+	stream_stats_ptr_t stats = &as->stats[cluster][idx];
+
+	if (as->coder == CODER_RANGE)
+		range_encoder_step(as->rc, stats, x, as->os);
+	else
+    	arithmetic_encoder_step(as->a, stats, x, as->os);
+    update_stats(stats, x);
+}
+
+/**
+ * Adds the information content of a quality value, under the stats it is about to be coded
+ * with, to the segment's totals for its column and cluster. Must be called before the value
+ * is compressed, since compressing it updates the stats
+ */
+static void measure_qv(struct segment_metrics_t *sm, arithStream as, uint32_t x, uint8_t cluster, uint32_t idx, uint32_t column) {
+	stream_stats_ptr_t stats = &as->stats[cluster][idx];
+	double bits = log2(((double) stats->n) / stats->counts[x]);
+
+	sm->column_bits[column] += bits;
+	sm->column_symbols[column] += 1;
+	sm->cluster_bits[cluster] += bits;
+	sm->cluster_symbols[cluster] += 1;
 }
 
 /**
- * Writes a cluster value to the arithmetic encoder
+ * Writes a cluster value to the entropy coder
  * We don't need to do adaptive stats here but it saves us a number of bytes
  * on writing the number of lines in each cluster.
  * @todo Determine which has a lower bitrate (probably almost the same)
  */
 void qv_write_cluster(arithStream as, uint8_t cluster) {
-	arithmetic_encoder_step(as->a, as->cluster_stats, cluster, as->os);
-	update_stats(as->cluster_stats, cluster, as->a->r);
+	if (as->coder == CODER_RANGE)
+		range_encoder_step(as->rc, as->cluster_stats, cluster, as->os);
+	else
+		arithmetic_encoder_step(as->a, as->cluster_stats, cluster, as->os);
+	update_stats(as->cluster_stats, cluster);
 }
 
 /**
- * Retrieve a quality value from the arithmetic decoder input stream
+ * Retrieve a quality value from the entropy decoder input stream
  */
-uint32_t decompress_qv(arithStream as, uint8_t cluster, uint32_t column, uint32_t idx) {
+uint32_t decompress_qv(arithStream as, uint8_t cluster, uint32_t idx) {
     uint32_t x;
+	stream_stats_ptr_t stats = &as->stats[cluster][idx];
     
-    x = arithmetic_decoder_step(as->a, as->stats[cluster][column][idx], as->os);
-    update_stats(as->stats[cluster][column][idx], x, as->a->r);
+	if (as->coder == CODER_RANGE)
+		x = range_decoder_step(as->rc, stats, as->os);
+	else
+    	x = arithmetic_decoder_step(as->a, stats, as->os);
+    update_stats(stats, x);
     
     return x;
 }
@@ -36,196 +72,1145 @@ uint32_t decompress_qv(arithStream as, uint8_t cluster, uint32_t column, uint32_
 uint8_t qv_read_cluster(arithStream as) {
 	uint32_t x;
 	
-	x = arithmetic_decoder_step(as->a, as->cluster_stats, as->os);
-	update_stats(as->cluster_stats, x, as->a->r);
+	if (as->coder == CODER_RANGE)
+		x = range_decoder_step(as->rc, as->cluster_stats, as->os);
+	else
+		x = arithmetic_decoder_step(as->a, as->cluster_stats, as->os);
+	update_stats(as->cluster_stats, x);
 
 	return (uint8_t) x;
 }
 
 /**
- * Compress a sequence of quality scores including dealing with organization by cluster
+ * Codes one symbol with the given adaptive stats on whichever entropy coder the stream uses
  */
-uint32_t start_qv_compression(struct quality_file_t *info, FILE *fout, double *dis, FILE * funcompressed) {
-    unsigned int osSize = 0;
-    
-    qv_compressor qvc;
+static void qv_write_symbol(arithStream as, stream_stats_ptr_t stats, uint32_t x) {
+	if (as->coder == CODER_RANGE)
+		range_encoder_step(as->rc, stats, x, as->os);
+	else
+		arithmetic_encoder_step(as->a, stats, x, as->os);
+	update_stats(stats, x);
+}
+
+static uint32_t qv_read_symbol(arithStream as, stream_stats_ptr_t stats) {
+	uint32_t x;
+
+	if (as->coder == CODER_RANGE)
+		x = range_decoder_step(as->rc, stats, as->os);
+	else
+		x = arithmetic_decoder_step(as->a, stats, as->os);
+	update_stats(stats, x);
+
+	return x;
+}
+
+/**
+ * Number of bytes needed to code any line length up to the given number of columns
+ */
+static uint32_t length_code_bytes(uint32_t columns) {
+	uint32_t bytes = 1;
+
+	while (bytes < LENGTH_CODE_BYTES && (columns >> (8*bytes)) != 0)
+		bytes += 1;
+	return bytes;
+}
+
+/**
+ * Writes the length of a line in a variable length file. Full length lines cost a single
+ * adaptive flag, and other lengths follow the flag as big endian bytes, each with its own
+ * adaptive stats, using only as many bytes as the longest line needs
+ */
+void qv_write_length(arithStream as, uint32_t length, uint32_t columns) {
+	uint32_t i, bytes;
+
+	qv_write_symbol(as, as->length_stats[0], length != columns);
+	if (length == columns)
+		return;
+
+	bytes = length_code_bytes(columns);
+	for (i = 0; i < bytes; ++i) {
+		qv_write_symbol(as, as->length_stats[i+1], (length >> (8*(bytes-1-i))) & 0xff);
+	}
+}
+
+/**
+ * Reads a line length written by qv_write_length
+ */
+uint32_t qv_read_length(arithStream as, uint32_t columns) {
+	uint32_t i, bytes, length = 0;
+
+	if (qv_read_symbol(as, as->length_stats[0]) == 0)
+		return columns;
+
+	bytes = length_code_bytes(columns);
+	for (i = 0; i < bytes; ++i) {
+		length = (length << 8) | qv_read_symbol(as, as->length_stats[i+1]);
+	}
+	return length;
+}
+
+/**
+ * Flushes whichever entropy coder the stream uses at the end of a segment
+ */
+void qv_finish_stream(arithStream as) {
+	if (as->coder == CODER_RANGE)
+		range_encoder_last_step(as->rc, as->os);
+	else
+		encoder_last_step(as->a, as->os);
+}
+
+/**
+ * Compress the lines of a single segment into an in-memory stream owned by the segment,
+ * optionally keeping a text copy of the quantized values and measuring the distortion.
+ * The distortion of each line is found in one pass over the line once it is quantized,
+ * and when it isn't measured the quantized values aren't kept either. With a coder from an
+ * earlier segment, its stats and output buffer are reused and the coded bytes are left in
+ * that buffer, marked as not owned by the segment, until the coder is used again. Otherwise
+ * a coder is made for the segment, and the segment owns the coded bytes
+ */
+void compress_segment(struct quality_file_t *info, struct qv_segment_t *segment, uint8_t keep_text, uint8_t measure, qv_compressor reuse) {
+    qv_compressor qvc = reuse;
     
-	uint32_t s = 0, idx = 0, q_state = 0;
-	double distortion = 0.0;
-	double error = 0.0;
+	uint32_t s = 0, idx = 0, q_state = 0, i;
     uint8_t qv = 0, prev_qv = 0;
     uint32_t columns = info->columns;
-    struct quantizer_t *q;
-	struct cond_quantizer_list_t *qlist;
+    struct codebook_quantizer_t *q;
+	struct compiled_codebook_t *book;
 
 	uint32_t block_idx, line_idx;
 	uint8_t cluster_id;
 
 	struct line_t *line;
 	symbol_t data;
-        
+	char *text = NULL;
+	symbol_t *recon = NULL, *scratch = NULL;
+	struct segment_metrics_t *sm = NULL;
+
+	block_idx = (uint32_t) (segment->first_line / MAX_LINES_PER_BLOCK);
+	line_idx = (uint32_t) (segment->first_line % MAX_LINES_PER_BLOCK);
+
+	if (keep_text) {
+		segment->text_size = ((size_t) segment->lines) * (columns+1);
+		if (info->variable_length) {
+			segment->text_size = segment->lines;
+			for (i = 0; i < segment->lines; ++i) {
+				segment->text_size += info->blocks[block_idx + (line_idx + i) / MAX_LINES_PER_BLOCK].lines[(line_idx + i) % MAX_LINES_PER_BLOCK].length;
+			}
+		}
+		segment->text = (char *) malloc(segment->text_size);
+		text = segment->text;
+	}
+	else if (measure) {
+		scratch = (symbol_t *) malloc(info->columns);
+		recon = scratch;
+	}
     
     // Initialize the compressor
-    qvc = initialize_qv_compressor(fout, COMPRESSION, info);
+	if (qvc)
+		reset_qv_compressor(qvc, COMPRESSION, info, segment->id, NULL, 0);
+	else
+		qvc = initialize_qv_compressor(alloc_os_stream(), COMPRESSION, info, segment->id);
+	if (info->opts->metrics)
+		sm = alloc_segment_metrics(info->columns, info->cluster_count);
     
-    // Start compressing the file
-	distortion = 0.0;
-	block_idx = 0;
-	line_idx = 0;
+    // Start compressing the segment
+	segment->distortion = 0.0;
 
-	do {
+	for (i = 0; i < segment->lines; ++i) {
 		line = &info->blocks[block_idx].lines[line_idx];
-		
-        if (info->opts->verbose && line_idx == 0) {
-            printf("Line: %dM\n", block_idx);
-        }
+		columns = line->length;
+
+		// Set up next set of pointers
+		line_idx += 1;
+		if (line_idx == info->blocks[block_idx].count) {
+			line_idx = 0;
+			block_idx += 1;
+		}
 
 		// Write clustering information and pull the correct codebook
 		cluster_id = line->cluster;
-		qlist = info->clusters->clusters[cluster_id].qlist;
+		book = info->clusters->clusters[cluster_id].book;
 		qv_write_cluster(qvc->Quals, cluster_id);
+		if (info->variable_length) {
+			qv_write_length(qvc->Quals, columns, info->columns);
+			if (columns == 0) {
+				if (text)
+					*text++ = '\n';
+				continue;
+			}
+		}
         
 		// Select first column's codebook with no left context
-		q = choose_quantizer(qlist, &info->well, 0, 0, &idx);
+		draw_line_selection(qvc, info, i, columns);
+		idx = choose_compiled_quantizer(book, qvc->selection[0], 0, 0);
+		q = COMPILED_QUANTIZER(book, idx);
+		if (text)
+			recon = (symbol_t *) text;
         
-		// Quantize, compress and calculate error simultaneously
+		// Quantize and compress
 		data = line->m_data[0] - 33;
 		qv = q->q[data];
+        q_state = q->state[data];
+		if (sm)
+			measure_qv(sm, qvc->Quals, q_state, cluster_id, idx, 0);
+        compress_qv(qvc->Quals, q_state, cluster_id, idx);
         
-        q_state = get_symbol_index(q->output_alphabet, qv);
-        compress_qv(qvc->Quals, q_state, cluster_id, 0, idx);
-		error = get_distortion(info->dist, data, qv);
-        
-        // @todo use buffer to speed up the writing
-        if (funcompressed != NULL) {
-            fputc(qv+33, funcompressed);
+        if (recon) {
+            recon[0] = qv+33;
         }
         
         prev_qv = qv;
         
 		for (s = 1; s < columns; ++s) {
-			q = choose_quantizer(qlist, &info->well, s, prev_qv, &idx);
+			idx = choose_compiled_quantizer(book, qvc->selection[s], s, prev_qv);
+			q = COMPILED_QUANTIZER(book, idx);
 			data = line->m_data[s] - 33;
 			qv = q->q[data];
-            q_state = get_symbol_index(q->output_alphabet, qv);
+            q_state = q->state[data];
             
-            // @todo use buffer to speed up the writing
-            if (funcompressed != NULL) {
-                fputc(qv+33, funcompressed);
+            if (recon) {
+                recon[s] = qv+33;
             }
             
-            compress_qv(qvc->Quals, q_state, cluster_id, s, idx);
-			error += get_distortion(info->dist, data, qv);
+			if (sm)
+				measure_qv(sm, qvc->Quals, q_state, cluster_id, idx, s);
+            compress_qv(qvc->Quals, q_state, cluster_id, idx);
             prev_qv = qv;
 		}
+
+		if (measure)
+			segment->distortion += get_line_distortion(info->dist, line->m_data, recon, columns) / ((double) columns);
         
-       	// @todo use buffer to speed up the writing
-        if (funcompressed != NULL) {
-            fputc('\n', funcompressed);
+        if (text) {
+            text[columns] = '\n';
+			text += columns+1;
         }
-        
-        distortion += error / ((double) columns);
-
-		// Set up next set of pointers
-		line_idx += 1;
-		if (line_idx == info->blocks[block_idx].count) {
-			line_idx = 0;
-			block_idx += 1;
-		}
-	} while (block_idx < info->block_count);
-    
-    osSize = encoder_last_step(qvc->Quals->a, qvc->Quals->os);
-    
-	if (dis)
-    	*dis = distortion / ((double) info->lines);
+	}
     
-    return osSize;
+    qv_finish_stream(qvc->Quals);
+	if (sm) {
+		sm->rescales = count_stream_rescales(qvc->Quals, info);
+		merge_segment_metrics(info->opts->metrics, sm, info->columns, info->cluster_count);
+	}
+	if (reuse) {
+		segment->data = qvc->Quals->os->buf;
+		segment->size = qvc->Quals->os->pos;
+		segment->mapped = 1;
+	}
+	else {
+		segment->data = stream_release_buffer(qvc->Quals->os, &segment->size);
+		free_qv_compressor(qvc, info);
+	}
+	segment->checksum = segment_checksum(segment->data, segment->size);
+	free(scratch);
 }
 
-void start_qv_decompression(FILE *fout, FILE *fin, struct quality_file_t *info) {
-    qv_compressor qvc;
+/**
+ * Decompress a single segment from its coded bytes into the segment's text buffer. The coded
+ * bytes are read in place and not modified. A coder from an earlier segment may be given to
+ * reuse its stats, otherwise one is made for the segment
+ * @return DECODE_OK, or DECODE_ERROR_CORRUPT with no text if the coded bytes don't match
+ * their checksum or don't decode to lines the codebooks could have made
+ */
+uint8_t decompress_segment(struct quality_file_t *info, struct qv_segment_t *segment, qv_compressor reuse) {
+    qv_compressor qvc = reuse;
     
-	uint32_t s = 0, idx = 0, lineCtr = 0, q_state = 0;
+	uint32_t s = 0, idx = 0, q_state = 0, i;
     uint8_t prev_qv = 0, cluster_id;
     
     uint32_t columns = info->columns;
-	uint32_t lines = info->lines;
-	struct cond_quantizer_list_t *qlist;
-    struct quantizer_t *q;
+	struct compiled_codebook_t *book;
+    struct codebook_quantizer_t *q;
+	char *line;
+	size_t capacity, used;
+
+	if (segment->size == 0 || segment_checksum(segment->data, segment->size) != segment->checksum) {
+		segment->text = NULL;
+		return DECODE_ERROR_CORRUPT;
+	}
 
-	char *line = (char *) _alloca(columns+2);
-    line[columns] = '\n';
-	line[columns+1] = '\0';
+	// Variable length lines go into a buffer that grows as needed, since the lengths
+	// aren't known until they're decoded
+	capacity = ((size_t) segment->lines) * (columns+1);
+	if (info->variable_length && capacity > OS_STREAM_INITIAL_LEN)
+		capacity = OS_STREAM_INITIAL_LEN;
+	segment->text = (char *) malloc(capacity);
+	if (!segment->text)
+		return DECODE_ERROR_CORRUPT;
+	line = segment->text;
     
     // Initialize the compressor
-    qvc = initialize_qv_compressor(fin, DECOMPRESSION, info);
+	if (qvc)
+		reset_qv_compressor(qvc, DECOMPRESSION, info, segment->id, segment->data, segment->size);
+	else
+		qvc = initialize_qv_compressor(alloc_os_stream_reader(segment->data, segment->size), DECOMPRESSION, info, segment->id);
     
-	// Last line has to be handled separately to clear the arithmetic decoder
-	while (lineCtr < lines - 1) {
-        if (info->opts->verbose && lineCtr%1000000 == 0){
-            printf("Line: %dM\n", lineCtr/1000000);
-        }
-        lineCtr++;
-
+	// Reading past the end of the stream yields zero bits, so the final line needs no special handling
+	for (i = 0; i < segment->lines; ++i) {
 		cluster_id = qv_read_cluster(qvc->Quals);
-		assert(cluster_id < info->cluster_count);
-		qlist = info->clusters->clusters[cluster_id].qlist;
+		if (cluster_id >= info->cluster_count)
+			break;
+		book = info->clusters->clusters[cluster_id].book;
+
+		if (info->variable_length) {
+			columns = qv_read_length(qvc->Quals, info->columns);
+			if (columns > info->columns)
+				break;
+			used = line - segment->text;
+			if (used + columns + 1 > capacity) {
+				while (used + columns + 1 > capacity)
+					capacity *= 2;
+				segment->text = (char *) realloc(segment->text, capacity);
+				line = segment->text + used;
+			}
+			if (columns == 0) {
+				*line++ = '\n';
+				continue;
+			}
+		}
         
 		// Select first column's codebook with no left context
-		q = choose_quantizer(qlist, &info->well, 0, 0, &idx);
+		draw_line_selection(qvc, info, i, columns);
+		idx = choose_compiled_quantizer(book, qvc->selection[0], 0, 0);
+		q = COMPILED_QUANTIZER(book, idx);
         
-		// Quantize, compress and calculate error simultaneously
 		// Note that in this version the quantizer outputs are 0-72, so the +33 offset is different from before
-        q_state = decompress_qv(qvc->Quals, cluster_id, 0, idx);
-        line[0] = q->output_alphabet->symbols[q_state] + 33;
+        q_state = decompress_qv(qvc->Quals, cluster_id, idx);
+        line[0] = q->symbols[q_state] + 33;
         prev_qv = line[0] - 33;
         
 		for (s = 1; s < columns; ++s) {
-			// Quantize and compute error for MSE
-			q = choose_quantizer(qlist, &info->well, s, prev_qv, &idx);
-            q_state = decompress_qv(qvc->Quals, cluster_id, s, idx);
-            line[s] = q->output_alphabet->symbols[q_state] + 33;
+			idx = choose_compiled_quantizer(book, qvc->selection[s], s, prev_qv);
+			q = COMPILED_QUANTIZER(book, idx);
+            q_state = decompress_qv(qvc->Quals, cluster_id, idx);
+            line[s] = q->symbols[q_state] + 33;
             prev_qv = line[s] - 33;
 		}
-        
-        // Write this line to the output file, note '\n' at the end of the line buffer to get the right length
-		fwrite(line, columns+1, sizeof(uint8_t), fout);
+
+		line[columns] = '\n';
+		line += columns+1;
 	}
-    
-    // Last Line
-    if (info->opts->verbose && lineCtr%1000000 == 0){
-        printf("Line: %dM\n", lineCtr/1000000);
-    }
-    lineCtr++;
-    
-	cluster_id = qv_read_cluster(qvc->Quals);
-		assert(cluster_id < info->cluster_count);
-	qlist = info->clusters->clusters[cluster_id].qlist;
 
-    // Select first column's codebook with no left context
-    q = choose_quantizer(qlist, &info->well, 0, 0, &idx);
-    
-    // Quantize, compress and calculate error simultaneously
-    // Note that in this version the quantizer outputs are 0-72, so the +33 offset is different from before
-    q_state = decompress_qv(qvc->Quals, cluster_id, 0, idx);
-    line[0] = q->output_alphabet->symbols[q_state] + 33;
-    prev_qv = line[0] - 33;
-    
-    for (s = 1; s < columns - 1; ++s) {
-        // Quantize and compute error for MSE
-        q = choose_quantizer(qlist, &info->well, s, prev_qv, &idx);
-        q_state = decompress_qv(qvc->Quals, cluster_id, s, idx);
-        line[s] = q->output_alphabet->symbols[q_state] + 33;
-        prev_qv = line[s] - 33;
-    }
+	segment->text_size = line - segment->text;
+	if (!reuse)
+		free_qv_compressor(qvc, info);
+
+	// A segment that passed its checksum but names a cluster or a length the codebooks
+	// don't have was made by something other than qvz
+	if (i < segment->lines) {
+		free(segment->text);
+		segment->text = NULL;
+		return DECODE_ERROR_CORRUPT;
+	}
+	return DECODE_OK;
+}
+
+/**
+ * Number of lines to put in each segment, where 0 in the options means one segment for the whole file
+ */
+static uint32_t get_segment_lines(struct quality_file_t *info) {
+	if (info->opts->segment_lines == 0 || info->opts->segment_lines > info->lines)
+		return info->lines > UINT32_MAX ? UINT32_MAX : (uint32_t) info->lines;
+	return info->opts->segment_lines;
+}
+
+/**
+ * Writes the segment index: the segment count, then for each segment its line count, the
+ * offset of its coded bytes from the end of the index, their size and their checksum, all
+ * in network order. A streamed file has SEGMENTS_STREAMED as its count instead, and each
+ * segment carries its own counts, see write_segment_record
+ */
+static void write_segment_index(FILE *fp, struct qv_segment_t *segments, uint32_t count) {
+	uint32_t i;
+	uint8_t buf[SEGMENT_INDEX_ENTRY];
+
+	put_be32(buf, count);
+	fwrite(buf, sizeof(uint8_t), 4, fp);
+	for (i = 0; i < count && count != SEGMENTS_STREAMED; ++i) {
+		put_be32(buf, segments[i].lines);
+		put_be64(buf+4, segments[i].offset);
+		put_be64(buf+12, segments[i].size);
+		put_be32(buf+20, segments[i].checksum);
+		fwrite(buf, sizeof(uint8_t), SEGMENT_INDEX_ENTRY, fp);
+	}
+}
+
+/**
+ * Stores the line count, byte count and checksum that go in front of a segment of a
+ * streamed file, or the empty record that ends the file when segment is NULL
+ */
+void put_segment_record(uint8_t *buf, struct qv_segment_t *segment) {
+	memset(buf, 0, SEGMENT_RECORD_LENGTH);
+	if (segment) {
+		put_be32(buf, segment->lines);
+		put_be64(buf+4, segment->size);
+		put_be32(buf+12, segment->checksum);
+	}
+}
+
+/**
+ * Reads the counts stored by put_segment_record
+ * @return 0 for the record ending the file, 1 otherwise
+ */
+uint8_t get_segment_record(const uint8_t *buf, struct qv_segment_t *segment) {
+	segment->lines = get_be32(buf);
+	segment->size = get_be64(buf+4);
+	segment->checksum = get_be32(buf+12);
+	return segment->lines != 0;
+}
+
+/**
+ * Writes the record in front of a segment of a streamed file, see put_segment_record
+ * @return Number of bytes written
+ */
+static uint32_t write_segment_record(FILE *fp, struct qv_segment_t *segment) {
+	uint8_t buf[SEGMENT_RECORD_LENGTH];
+
+	put_segment_record(buf, segment);
+	fwrite(buf, sizeof(uint8_t), SEGMENT_RECORD_LENGTH, fp);
+	return SEGMENT_RECORD_LENGTH;
+}
+
+/**
+ * Reads the record in front of the next segment of a streamed file
+ * @param more Set to 0 at the record ending the file, 1 otherwise
+ * @return DECODE_OK, or DECODE_ERROR_TRUNCATED if the stream ends without its final record
+ */
+static uint8_t read_segment_record(FILE *fp, struct qv_segment_t *segment, uint8_t *more) {
+	uint8_t buf[SEGMENT_RECORD_LENGTH];
+
+	if (fread(buf, sizeof(uint8_t), SEGMENT_RECORD_LENGTH, fp) != SEGMENT_RECORD_LENGTH)
+		return DECODE_ERROR_TRUNCATED;
+	*more = get_segment_record(buf, segment);
+	return DECODE_OK;
+}
+
+/**
+ * Reads the segment index written by write_segment_index and fills in the first line of each
+ * segment. For a streamed file the count is SEGMENTS_STREAMED and no segments are returned.
+ * Segments may be spaced apart but must be stored in order without overlapping, so that
+ * the decoder can read them front to back, and must add up to the lines in the header.
+ * Every segment with lines must have coded bytes too, or the index is only a placeholder
+ * @param segments Set to the segments, or NULL for a streamed file or on an error
+ * @return DECODE_OK, or why the index can't be used
+ */
+static uint8_t read_segment_index(FILE *fp, struct quality_file_t *info, struct qv_segment_t **segments, uint32_t *count) {
+	uint32_t i;
+	uint64_t first_line = 0, end = 0;
+	uint8_t buf[SEGMENT_INDEX_ENTRY];
+	uint8_t status = DECODE_OK;
+	struct qv_segment_t *s;
+
+	*segments = NULL;
+	if (fread(buf, sizeof(uint8_t), 4, fp) != 4)
+		return DECODE_ERROR_TRUNCATED;
+	*count = get_be32(buf);
+	if (*count == SEGMENTS_STREAMED)
+		return DECODE_OK;
+
+	s = (struct qv_segment_t *) calloc(*count, sizeof(struct qv_segment_t));
+	for (i = 0; i < *count && status == DECODE_OK; ++i) {
+		if (fread(buf, sizeof(uint8_t), SEGMENT_INDEX_ENTRY, fp) != SEGMENT_INDEX_ENTRY) {
+			status = DECODE_ERROR_TRUNCATED;
+			break;
+		}
+		s[i].id = i;
+		s[i].first_line = first_line;
+		s[i].lines = get_be32(buf);
+		s[i].offset = get_be64(buf+4);
+		s[i].size = get_be64(buf+12);
+		s[i].checksum = get_be32(buf+20);
+
+		// Segments must not overlap, and a segment with lines but no bytes was never filled in
+		if (s[i].offset < end || s[i].size > UINT64_MAX - s[i].offset || (s[i].lines > 0 && s[i].size == 0))
+			status = DECODE_ERROR_CORRUPT;
+		end = s[i].offset + s[i].size;
+		first_line += s[i].lines;
+	}
+	if (status == DECODE_OK && first_line != info->lines)
+		status = DECODE_ERROR_CORRUPT;
+
+	if (status != DECODE_OK) {
+		free(s);
+		return status;
+	}
+	*segments = s;
+	return DECODE_OK;
+}
+
+struct qv_segment_job_t {
+	struct quality_file_t *info;
+	struct qv_segment_t *segments;
+	uint8_t keep_text;
+	uint8_t measure;			// Find the distortion of every line
+};
+
+static void compress_segment_task(void *arg, uint32_t task, uint32_t thread) {
+	struct qv_segment_job_t *job = (struct qv_segment_job_t *) arg;
+	compress_segment(job->info, &job->segments[task], job->keep_text, job->measure, NULL);
+}
+
+static void decompress_segment_task(void *arg, uint32_t task, uint32_t thread) {
+	struct qv_segment_job_t *job = (struct qv_segment_job_t *) arg;
+	job->segments[task].status = decompress_segment(job->info, &job->segments[task], NULL);
+}
+
+/**
+ * Queues a batch of coded segments to be written out in order, preceded by their records in
+ * a streamed file. The writer takes over and releases their buffers
+ * @return Sum of the per line distortion of the batch
+ */
+static double write_segment_batch(struct async_writer_t *writer, FILE *fout, struct quality_file_t *info, struct qv_segment_t *segments, uint32_t batch, uint8_t streamed, FILE *funcompressed) {
+	uint32_t i;
+	uint8_t record[SEGMENT_RECORD_LENGTH];
+	double distortion = 0.0;
+
+	for (i = 0; i < batch; ++i) {
+		if (streamed) {
+			put_segment_record(record, &segments[i]);
+			async_write_copy(writer, fout, record, SEGMENT_RECORD_LENGTH);
+		}
+		async_write(writer, fout, segments[i].data, segments[i].data, segments[i].size);
+		if (funcompressed)
+			async_write(writer, funcompressed, segments[i].text, segments[i].text, segments[i].text_size);
+		else
+			free(segments[i].text);
+		distortion += segments[i].distortion;
+
+		if (info->opts->verbose) {
+			printf("Segment %u: %u lines, %llu bytes\n", segments[i].id, segments[i].lines, (unsigned long long) segments[i].size);
+		}
+
+		segments[i].data = NULL;
+		segments[i].text = NULL;
+	}
+
+	return distortion;
+}
+
+/**
+ * Codes the given segments of info in batches of one segment per thread and queues each
+ * batch on the writer in order, so a batch is written while the next one is coded
+ * @return Sum of the per line distortion of the segments, or 0 if it isn't measured
+ */
+static double code_segments(struct async_writer_t *writer, FILE *fout, struct quality_file_t *info, struct qv_segment_t *segments, uint32_t count, uint8_t streamed, uint8_t measure, FILE *funcompressed) {
+	uint32_t threads = info->opts->threads;
+	uint32_t base, batch;
+	double distortion = 0.0;
+	struct qv_segment_job_t job;
+
+	job.info = info;
+	job.keep_text = funcompressed != NULL;
+	job.measure = measure;
+	for (base = 0; base < count; base += batch) {
+		batch = (count - base < threads) ? count - base : threads;
+		job.segments = &segments[base];
+		run_parallel(threads, batch, compress_segment_task, &job);
+
+		distortion += write_segment_batch(writer, fout, info, &segments[base], batch, streamed, funcompressed);
+	}
+
+	return distortion;
+}
+
+/**
+ * Splits the lines of info into segments of the configured size, the last one taking the rest
+ */
+static struct qv_segment_t *plan_segments(struct quality_file_t *info, uint32_t *count) {
+	uint32_t segment_lines = get_segment_lines(info);
+	uint32_t i;
+	struct qv_segment_t *segments;
+
+	*count = (uint32_t) ((info->lines + segment_lines - 1) / segment_lines);
+	segments = (struct qv_segment_t *) calloc(*count, sizeof(struct qv_segment_t));
+	for (i = 0; i < *count; ++i) {
+		segments[i].id = i;
+		segments[i].first_line = ((uint64_t) i) * segment_lines;
+		segments[i].lines = segment_lines;
+		segments[i].checksum = SEGMENT_CHECKSUM_PLACEHOLDER;
+	}
+	segments[*count-1].lines = (uint32_t) (info->lines - segments[*count-1].first_line);
+
+	return segments;
+}
+
+/**
+ * Writes the start of the segment layout of a file that is about to be coded, a placeholder
+ * index to be filled in by finish_segment_index, unless the output can't seek back to it,
+ * like a pipe. Then it is marked as streamed, and each segment is written behind a record
+ * of its own instead
+ * @param index_pos Where the index starts, or -1 if the file is streamed
+ */
+static void start_segment_index(FILE *fout, struct qv_segment_t *segments, uint32_t count, off_t *index_pos) {
+	*index_pos = ftello(fout);
+	if (*index_pos < 0 || fseeko(fout, *index_pos, SEEK_SET) != 0)
+		*index_pos = -1;
+	write_segment_index(fout, segments, (*index_pos < 0) ? SEGMENTS_STREAMED : count);
+}
+
+/**
+ * Finishes the file once every segment has been written behind the start of its index, back
+ * to back, by going back to fill in the index, or by ending a streamed file with the empty
+ * segment record
+ * @return Number of bytes written for the segment index or records and the segments
+ */
+static uint64_t finish_segment_index(FILE *fout, off_t index_pos, struct qv_segment_t *segments, uint32_t count) {
+	uint64_t bytes;
+	uint32_t i;
+	off_t end;
+
+	if (index_pos < 0) {
+		bytes = sizeof(uint32_t) + write_segment_record(fout, NULL);
+		for (i = 0; i < count; ++i) {
+			bytes += SEGMENT_RECORD_LENGTH + segments[i].size;
+		}
+		return bytes;
+	}
+
+	for (i = 1; i < count; ++i) {
+		segments[i].offset = segments[i-1].offset + segments[i-1].size;
+	}
+
+	end = ftello(fout);
+	if (end < 0 || fseeko(fout, index_pos, SEEK_SET) != 0) {
+		perror("Unable to go back to write the segment index");
+		exit(1);
+	}
+	write_segment_index(fout, segments, count);
+	if (fseeko(fout, 0, SEEK_END) != 0 || ftello(fout) != end) {
+		perror("Unable to return to the end of the output");
+		exit(1);
+	}
+	bytes = end - index_pos;
+	return bytes;
+}
+
+/**
+ * Compress a sequence of quality scores including dealing with organization by cluster. The
+ * file is split into segments which are coded in batches of one segment per thread, and
+ * written in order behind an index that is filled in once all segment sizes are known. If
+ * the output can't seek, the segments are written the way a streamed input's are
+ * @return Number of bytes written for the segment index and segments
+ */
+uint64_t start_qv_compression(struct quality_file_t *info, FILE *fout, double *dis, FILE * funcompressed) {
+	uint32_t count;
+	uint64_t bytes = 0;
+	double distortion = 0.0;
+	off_t index_pos;
+	struct qv_segment_t *segments = plan_segments(info, &count);
+	struct async_writer_t *writer;
+
+	compile_codebooks(info);
+
+	// A placeholder index first, to be overwritten when sizes are known
+	start_segment_index(fout, segments, count, &index_pos);
+
+	writer = start_async_writer();
+	distortion = code_segments(writer, fout, info, segments, count, index_pos < 0, dis != NULL, funcompressed);
+	stop_async_writer(writer);
+
+	bytes = finish_segment_index(fout, index_pos, segments, count);
+	free(segments);
+	free_compiled_codebooks(info);
     
-    // Last column
-    q = choose_quantizer(qlist, &info->well, s, prev_qv, &idx);
-    q_state = decoder_last_step(qvc->Quals->a, qvc->Quals->stats[cluster_id][s][idx]);
-    line[s] = q->output_alphabet->symbols[q_state] + 33;
+	if (dis)
+    	*dis = distortion / ((double) info->lines);
     
-    // Write this line to the output file, note '\n' at the end of the line buffer to get the right length
-    fwrite(line, columns+1, sizeof(uint8_t), fout);
+    return bytes;
+}
+
+/**
+ * One segment of one file of a batch
+ */
+struct qv_batch_task_t {
+	struct quality_file_t *info;
+	struct qv_segment_t *segment;
+};
 
-	info->lines = lineCtr;
+struct qv_batch_job_t {
+	struct qv_batch_task_t *tasks;
+	uint8_t measure;
+};
+
+static void compress_batch_task(void *arg, uint32_t task, uint32_t thread) {
+	struct qv_batch_job_t *job = (struct qv_batch_job_t *) arg;
+	compress_segment(job->tasks[task].info, job->tasks[task].segment, 0, job->measure, NULL);
+}
+
+/**
+ * Compresses several files at once, whose container headers and codebooks must already be
+ * written to their outputs. The segments of every file go into a single list of tasks for
+ * the worker threads, so the threads stay busy across the ends of files, however small
+ * each file is. Files may share their clusters, whose codebooks are then compiled once. All
+ * the coded segments are kept until every task is done and then written out in order, so
+ * the batch takes about as much memory again as its inputs compress to
+ * @param measure Find the distortion of every file
+ */
+void start_qv_batch_compression(struct qv_batch_file_t *files, uint32_t count, uint32_t threads, uint8_t measure) {
+	struct qv_segment_t **segments = (struct qv_segment_t **) calloc(count, sizeof(struct qv_segment_t *));
+	uint32_t *segment_count = (uint32_t *) calloc(count, sizeof(uint32_t));
+	off_t *index_pos = (off_t *) calloc(count, sizeof(off_t));
+	uint32_t f, i, tasks = 0;
+	struct qv_batch_job_t job;
+	struct async_writer_t *writer;
+	double distortion;
+
+	for (f = 0; f < count; ++f) {
+		segments[f] = plan_segments(files[f].info, &segment_count[f]);
+		tasks += segment_count[f];
+		if (!files[f].info->clusters->clusters[0].book)
+			compile_codebooks(files[f].info);
+
+		start_segment_index(files[f].fout, segments[f], segment_count[f], &index_pos[f]);
+	}
+
+	job.measure = measure;
+	job.tasks = (struct qv_batch_task_t *) malloc(tasks*sizeof(struct qv_batch_task_t));
+	tasks = 0;
+	for (f = 0; f < count; ++f) {
+		for (i = 0; i < segment_count[f]; ++i) {
+			job.tasks[tasks].info = files[f].info;
+			job.tasks[tasks].segment = &segments[f][i];
+			tasks += 1;
+		}
+	}
+	run_parallel(threads, tasks, compress_batch_task, &job);
+
+	writer = start_async_writer();
+	for (f = 0; f < count; ++f) {
+		distortion = write_segment_batch(writer, files[f].fout, files[f].info, segments[f], segment_count[f], index_pos[f] < 0, NULL);
+		files[f].distortion = measure ? distortion / ((double) files[f].info->lines) : 0.0;
+	}
+	stop_async_writer(writer);
+
+	for (f = 0; f < count; ++f) {
+		files[f].bytes = finish_segment_index(files[f].fout, index_pos[f], segments[f], segment_count[f]);
+		free(segments[f]);
+	}
+	for (f = 0; f < count; ++f) {
+		if (files[f].info->clusters->clusters[0].book)
+			free_compiled_codebooks(files[f].info);
+	}
+
+	free(job.tasks);
+	free(index_pos);
+	free(segment_count);
+	free(segments);
+}
+
+/**
+ * Compress the lines already in info, normally a training prefix, followed by every line left
+ * in fin, holding at most one segment per thread of the rest of the input in memory at any time.
+ * The lines read from fin are assigned to the clusters as they arrive. Neither the line
+ * count nor the sizes are known until the end, so each segment is written with its own
+ * record instead of an index and the output doesn't have to be seekable. Afterwards
+ * info->lines is the total number of lines coded
+ * @return Number of bytes written for the segment records and segments
+ */
+uint64_t start_qv_stream_compression(struct quality_file_t *info, FILE *fin, FILE *fout, double *dis, FILE *funcompressed) {
+	uint32_t segment_lines = info->opts->segment_lines;
+	uint32_t threads = info->opts->threads;
+	uint32_t count, batch, i, id;
+	uint64_t bytes, lines;
+	uint8_t done = 0;
+	double distortion;
+	struct quality_file_t chunk;
+	struct line_block_t *ring;
+	struct qv_segment_t *segments;
+	struct async_writer_t *writer;
+
+	// Streamed segments are read into one block each
+	if (segment_lines == 0 || segment_lines > MAX_LINES_PER_BLOCK)
+		segment_lines = MAX_LINES_PER_BLOCK;
+
+	compile_codebooks(info);
+	write_segment_index(fout, NULL, SEGMENTS_STREAMED);
+	bytes = sizeof(uint32_t);
+	writer = start_async_writer();
+
+	// Lines already in memory first, as ordinary segments
+	count = (uint32_t) ((info->lines + segment_lines - 1) / segment_lines);
+	segments = (struct qv_segment_t *) calloc(count > threads ? count : threads, sizeof(struct qv_segment_t));
+	for (i = 0; i < count; ++i) {
+		segments[i].id = i;
+		segments[i].first_line = ((uint64_t) i) * segment_lines;
+		segments[i].lines = (info->lines - segments[i].first_line < segment_lines) ? (uint32_t) (info->lines - segments[i].first_line) : segment_lines;
+	}
+	distortion = code_segments(writer, fout, info, segments, count, 1, dis != NULL, funcompressed);
+	for (i = 0; i < count; ++i) {
+		bytes += SEGMENT_RECORD_LENGTH + segments[i].size;
+	}
+	lines = info->lines;
+	id = count;
+
+	// Then a batch per thread at a time from the rest of the input, reusing the same buffers
+	ring = (struct line_block_t *) calloc(threads, sizeof(struct line_block_t));
+	for (i = 0; i < threads; ++i) {
+		ring[i].lines = (struct line_t *) calloc(segment_lines, sizeof(struct line_t));
+		ring[i].data = (symbol_t *) malloc(((size_t) segment_lines) * (info->columns+1));
+		if (!ring[i].lines || !ring[i].data) {
+			printf("Unable to allocate stream buffers.\n");
+			exit(1);
+		}
+	}
+	chunk = *info;
+	chunk.blocks = ring;
+
+	while (!done) {
+		for (batch = 0; batch < threads && !done; ++batch) {
+			ring[batch].count = 0;
+			if (read_stream_block(fin, info, &ring[batch], segment_lines) != LF_ERROR_NONE) {
+				printf("Every input line must have %u quality scores, a line after line %llu doesn't.\n", info->columns, (unsigned long long) lines);
+				exit(1);
+			}
+			if (ring[batch].count < segment_lines)
+				done = 1;
+			if (ring[batch].count == 0)
+				break;
+
+			memset(&segments[batch], 0, sizeof(struct qv_segment_t));
+			segments[batch].id = id++;
+			segments[batch].first_line = ((uint64_t) batch) * MAX_LINES_PER_BLOCK;
+			segments[batch].lines = ring[batch].count;
+			lines += ring[batch].count;
+		}
+		if (batch == 0)
+			break;
+
+		chunk.block_count = batch;
+		assign_clusters(&chunk, ring, batch);
+		distortion += code_segments(writer, fout, &chunk, segments, batch, 1, dis != NULL, funcompressed);
+		for (i = 0; i < batch; ++i) {
+			bytes += SEGMENT_RECORD_LENGTH + segments[i].size;
+		}
+	}
+	stop_async_writer(writer);
+	bytes += write_segment_record(fout, NULL);
+
+	for (i = 0; i < threads; ++i) {
+		free(ring[i].lines);
+		free(ring[i].data);
+	}
+	free(ring);
+	free(segments);
+	free_compiled_codebooks(info);
+
+	info->lines = lines;
+	if (dis)
+		*dis = distortion / ((double) lines);
+
+	return bytes;
+}
+
+/**
+ * Maps the whole input file read only so that segments can be decoded from it in place
+ * @return The mapping, or NULL if the input can't be mapped (e.g. it is a pipe)
+ */
+static uint8_t *map_input(FILE *fin, size_t *size) {
+	struct stat st;
+	void *map;
+
+	if (fstat(fileno(fin), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return NULL;
+
+	map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fileno(fin), 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	*size = (size_t) st.st_size;
+	return (uint8_t *) map;
+}
+
+/**
+ * Queues the decoded lines of a segment that fall in the range starting at first_line, but
+ * no more than count of them. The writer takes over the segment's text and releases it
+ * @return Number of lines written
+ */
+static uint64_t write_decoded_lines(struct async_writer_t *writer, FILE *fout, struct quality_file_t *info, struct qv_segment_t *segment, uint64_t first_line, uint64_t count) {
+	uint64_t skip, take, i;
+	const char *start, *end, *text_end;
+
+	skip = (first_line > segment->first_line) ? first_line - segment->first_line : 0;
+	take = segment->lines - skip;
+	if (take > count)
+		take = count;
+
+	if (!info->variable_length) {
+		start = segment->text + skip*(info->columns+1);
+		end = start + take*(info->columns+1);
+	}
+	else if (take == segment->lines) {
+		start = segment->text;
+		end = segment->text + segment->text_size;
+	}
+	else {
+		// Lines have to be counted off to find the ends of a partial segment
+		start = segment->text;
+		text_end = segment->text + segment->text_size;
+		for (i = 0; i < skip; ++i) {
+			start = (const char *) memchr(start, '\n', text_end - start) + 1;
+		}
+		end = start;
+		for (i = 0; i < take; ++i) {
+			end = (const char *) memchr(end, '\n', text_end - end) + 1;
+		}
+	}
+
+	async_write(writer, fout, segment->text, start, end - start);
+	segment->text = NULL;
+	return take;
+}
+
+/**
+ * Moves past bytes of the input that aren't needed, reading through them if it's a pipe
+ * @return DECODE_OK, or DECODE_ERROR_TRUNCATED if the pipe ends first
+ */
+static uint8_t skip_input(FILE *fin, uint64_t size) {
+	char buf[4096];
+	size_t len;
+
+	if (fseeko(fin, (off_t) size, SEEK_CUR) == 0)
+		return DECODE_OK;
+
+	while (size > 0) {
+		len = (size > sizeof(buf)) ? sizeof(buf) : (size_t) size;
+		if (fread(buf, sizeof(char), len, fin) != len)
+			return DECODE_ERROR_TRUNCATED;
+		size -= len;
+	}
+	return DECODE_OK;
+}
+
+/**
+ * Finds the first segment of a decoded batch that couldn't be decoded, and releases the
+ * buffers of the whole batch if there is one
+ * @return DECODE_OK, or the status of that segment
+ */
+static uint8_t check_decoded_batch(struct qv_segment_t *segments, uint32_t batch) {
+	uint8_t status = DECODE_OK;
+	uint32_t i;
+
+	for (i = 0; i < batch && status == DECODE_OK; ++i) {
+		status = segments[i].status;
+	}
+	if (status == DECODE_OK)
+		return DECODE_OK;
+
+	for (i = 0; i < batch; ++i) {
+		if (!segments[i].mapped)
+			free(segments[i].data);
+		free(segments[i].text);
+	}
+	return status;
+}
+
+/**
+ * Decompress the given range of lines from a streamed file, reading its segments in order
+ * and decoding them in batches of one segment per thread. Segments before the range are
+ * skipped without decoding, and nothing after the range is read
+ * @param lines Set to the number of lines written, including those written before an error
+ * @return DECODE_OK, or why the file couldn't be decoded
+ */
+static uint8_t decompress_streamed_range(FILE *fout, FILE *fin, struct quality_file_t *info, uint64_t first_line, uint64_t count, uint64_t *lines) {
+	uint32_t threads = info->opts->threads;
+	uint32_t i, batch, id = 0;
+	uint64_t next_line = 0;
+	uint64_t end = (count > UINT64_MAX - first_line) ? UINT64_MAX : first_line + count;
+	uint8_t more = 1, status = DECODE_OK;
+	struct qv_segment_t *segments = (struct qv_segment_t *) calloc(threads, sizeof(struct qv_segment_t));
+	struct qv_segment_job_t job;
+	struct async_writer_t *writer;
+
+	*lines = 0;
+	compile_codebooks(info);
+	writer = start_async_writer();
+	job.info = info;
+	job.keep_text = 1;
+	job.measure = 0;
+	job.segments = segments;
+
+	while (more && next_line < end && status == DECODE_OK) {
+		batch = 0;
+		while (batch < threads) {
+			segments[batch].id = id++;
+			segments[batch].first_line = next_line;
+			status = read_segment_record(fin, &segments[batch], &more);
+			if (status != DECODE_OK || !more)
+				break;
+			next_line += segments[batch].lines;
+
+			if (next_line <= first_line) {
+				status = skip_input(fin, segments[batch].size);
+				if (status != DECODE_OK)
+					break;
+				continue;
+			}
+
+			segments[batch].data = (uint8_t *) malloc(segments[batch].size);
+			segments[batch].text = NULL;
+			if (!segments[batch].data || fread(segments[batch].data, sizeof(char), segments[batch].size, fin) != segments[batch].size) {
+				free(segments[batch].data);
+				status = DECODE_ERROR_TRUNCATED;
+				break;
+			}
+			batch += 1;
+
+			// Stop reading once the batch covers the end of the range
+			if (next_line >= end)
+				break;
+		}
+
+		if (status != DECODE_OK) {
+			for (i = 0; i < batch; ++i) {
+				free(segments[i].data);
+			}
+			break;
+		}
+
+		run_parallel(threads, batch, decompress_segment_task, &job);
+		status = check_decoded_batch(segments, batch);
+		if (status != DECODE_OK)
+			break;
+
+		for (i = 0; i < batch; ++i) {
+			if (info->opts->verbose) {
+				printf("Segment %u: %u lines\n", segments[i].id, segments[i].lines);
+			}
+			if (*lines < count)
+				*lines += write_decoded_lines(writer, fout, info, &segments[i], first_line, count - *lines);
+			free(segments[i].data);
+			free(segments[i].text);
+		}
+	}
+
+	stop_async_writer(writer);
+	free(segments);
+	free_compiled_codebooks(info);
+	return status;
+}
+
+/**
+ * Decompress the given range of lines, seeking directly to the segments that contain it.
+ * Segments are decoded in batches of one segment per thread and the lines are written to
+ * the output in order. When the input is a regular file the segments are decoded directly
+ * from a shared read only mapping of it, otherwise they are read into memory first. The
+ * input must be positioned just after the codebooks. A damaged file stops the decoding at
+ * the first segment that can't be read or decoded, after the lines before it are written
+ * @param lines Set to the number of lines written, which is less than count if the file ends
+ * before the range
+ * @return DECODE_OK, or why the file couldn't be decoded
+ */
+uint8_t decompress_range(FILE *fout, FILE *fin, struct quality_file_t *info, uint64_t first_line, uint64_t count, uint64_t *lines) {
+	uint32_t segment_count, first, last, i, base, batch;
+	uint32_t threads = info->opts->threads;
+	uint64_t end, read_pos = 0;
+	off_t data_pos;
+	uint8_t *map;
+	uint8_t status;
+	size_t map_size = 0;
+	struct qv_segment_t *segments;
+	struct qv_segment_job_t job;
+	struct async_writer_t *writer;
+
+	*lines = 0;
+	status = read_segment_index(fin, info, &segments, &segment_count);
+	if (status != DECODE_OK)
+		return status;
+	if (segment_count == SEGMENTS_STREAMED)
+		return decompress_streamed_range(fout, fin, info, first_line, count, lines);
+	data_pos = ftello(fin);
+
+	// Clip the range to the file and find the first segment that overlaps it
+	end = segment_count ? segments[segment_count-1].first_line + segments[segment_count-1].lines : 0;
+	if (first_line >= end || count == 0) {
+		free(segments);
+		return DECODE_OK;
+	}
+	if (count > end - first_line)
+		count = end - first_line;
+
+	first = 0;
+	while (segments[first].first_line + segments[first].lines <= first_line) {
+		first += 1;
+	}
+	last = first;
+	while (segments[last].first_line + segments[last].lines < first_line + count) {
+		last += 1;
+	}
+	compile_codebooks(info);
+	map = map_input(fin, &map_size);
+	writer = start_async_writer();
+
+	job.info = info;
+	job.keep_text = 1;
+	job.measure = 0;
+	for (base = first; base <= last && status == DECODE_OK; base += batch) {
+		batch = (last + 1 - base < threads) ? last + 1 - base : threads;
+
+		// Segments are stored in order, so they can be read front to back once we're in position
+		for (i = base; i < base + batch && status == DECODE_OK; ++i) {
+			if (map) {
+				if ((uint64_t) data_pos + segments[i].offset + segments[i].size > map_size) {
+					status = DECODE_ERROR_TRUNCATED;
+					break;
+				}
+				segments[i].data = map + data_pos + segments[i].offset;
+				segments[i].mapped = 1;
+			}
+			else {
+				status = skip_input(fin, segments[i].offset - read_pos);
+				if (status != DECODE_OK)
+					break;
+				segments[i].data = (uint8_t *) malloc(segments[i].size);
+				if (!segments[i].data || fread(segments[i].data, sizeof(char), segments[i].size, fin) != segments[i].size) {
+					free(segments[i].data);
+					status = DECODE_ERROR_TRUNCATED;
+					break;
+				}
+				read_pos = segments[i].offset + segments[i].size;
+			}
+		}
+
+		if (status != DECODE_OK) {
+			while (i > base) {
+				i -= 1;
+				if (!segments[i].mapped)
+					free(segments[i].data);
+			}
+			break;
+		}
+
+		job.segments = &segments[base];
+		run_parallel(threads, batch, decompress_segment_task, &job);
+		status = check_decoded_batch(&segments[base], batch);
+		if (status != DECODE_OK)
+			break;
+
+		// Only the requested lines are written from the segments at either end of the range
+		for (i = base; i < base + batch; ++i) {
+			if (info->opts->verbose) {
+				printf("Segment %u: %u lines\n", i, segments[i].lines);
+			}
+
+			*lines += write_decoded_lines(writer, fout, info, &segments[i], first_line, count - *lines);
+			if (!segments[i].mapped)
+				free(segments[i].data);
+			free(segments[i].text);
+		}
+	}
+
+	stop_async_writer(writer);
+	if (map)
+		munmap(map, map_size);
+	free(segments);
+	free_compiled_codebooks(info);
+	return status;
+}
+
+/**
+ * Decompress every line in the file
+ * @return DECODE_OK, or why the file couldn't be decoded
+ */
+uint8_t start_qv_decompression(FILE *fout, FILE *fin, struct quality_file_t *info) {
+	return decompress_range(fout, fin, info, 0, UINT64_MAX, &info->lines);
 }
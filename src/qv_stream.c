@@ -1,18 +1,65 @@
 #include "qv_compressor.h"
 
 /**
- * Update stats structure used for adaptive arithmetic coding
+ * Halves either the fast or the slow part of the counts of stats that mix two rates, and
+ * rebuilds the totals and cumulative counts. The slow part of every count stays at least
+ * one, so no symbol ever becomes impossible to code
+ */
+static void rescale_mixed_stats(stream_stats_ptr_t stats, uint8_t halve_slow) {
+	uint32_t i, slow;
+
+	stats->n = 0;
+	stats->fast_n = 0;
+	for (i = 0; i < stats->alphabetCard; ++i) {
+		slow = stats->counts[i] - stats->fast[i];
+		if (halve_slow) {
+			if (slow)
+				slow = (slow >> 1) + 1;
+		}
+		else
+			stats->fast[i] >>= 1;
+
+		stats->counts[i] = slow + stats->fast[i];
+		stats->n += stats->counts[i];
+		stats->fast_n += stats->fast[i];
+		stats->cumulative[i+1] = stats->n;
+	}
+}
+
+/**
+ * Update stats structure used for adaptive arithmetic coding. The cumulative counts are
+ * kept up to date here so that the coder never has to sum counts itself. Once the total
+ * passes the limit of the stats every count is halved, so recent symbols weigh more. With
+ * two-rate mixing, part of each step also goes to a fast set of counts that are halved at
+ * a fraction of the limit, and the coder sees the sum of the fast and the slow counts
  * @param stats Pointer to stats structure
  * @param x Symbol to update
- * @param r Rescaling condition (if n > r, rescale all stats)
  */
-void update_stats(stream_stats_ptr_t stats, uint32_t x, uint32_t r) {
+void update_stats(stream_stats_ptr_t stats, uint32_t x) {
     uint32_t i = 0;
 
 	stats->counts[x] += stats->step;
 	stats->n += stats->step;
+	for (i = x+1; i <= stats->alphabetCard; ++i) {
+		stats->cumulative[i] += stats->step;
+	}
 
-	if (stats->n > r) {
+	if (stats->fast) {
+		stats->fast[x] += stats->fast_step;
+		stats->fast_n += stats->fast_step;
+		if (stats->fast_n > (stats->limit >> STATS_FAST_SHIFT)) {
+			stats->rescales += 1;
+			rescale_mixed_stats(stats, 0);
+		}
+		if (stats->n > stats->limit) {
+			stats->rescales += 1;
+			rescale_mixed_stats(stats, 1);
+		}
+		return;
+	}
+
+	if (stats->n > stats->limit) {
+		stats->rescales += 1;
 		stats->n = 0;
 		for (i = 0; i < stats->alphabetCard; ++i) {
 			if (stats->counts[i]) {
@@ -20,106 +67,385 @@ void update_stats(stream_stats_ptr_t stats, uint32_t x, uint32_t r) {
 				stats->counts[i] += 1;
 				stats->n += stats->counts[i];
 			}
+			stats->cumulative[i+1] = stats->n;
 		}
 	}
 }
 
 /**
- * Initialize stats structures used for adaptive arithmetic coding based on
- * the number of contexts required to handle the set of conditional quantizers
- * that we have (one context per quantizer)
+ * Returns count consecutive sets of adaptive stats to the uniform distribution they start
+ * from, in place, with the default model
  */
-stream_stats_ptr_t **initialize_stream_stats(struct cond_quantizer_list_t *q_list) {
-    stream_stats_ptr_t **s;
-    uint32_t i = 0, j = 0, k = 0;
-    
-    s = (stream_stats_ptr_t **) calloc(q_list->columns, sizeof(stream_stats_ptr_t *));
-
-    // Allocate jagged array, one set of stats per column
-    for (i = 0; i < q_list->columns; ++i) {
-		// And for each column, one set of stats per low/high quantizer per previous context
-        s[i] = (stream_stats_ptr_t *) calloc(2*q_list->input_alphabets[i]->size, sizeof(stream_stats_ptr_t));
-        
-		// Finally each individual stat structure needs to be filled in uniformly
-        for (j = 0; j < 2*q_list->input_alphabets[i]->size; ++j) {
-            s[i][j] = (stream_stats_ptr_t) calloc(1, sizeof(struct stream_stats_t));
-            s[i][j]->counts = (uint32_t *) calloc(q_list->q[i][j]->output_alphabet->size, sizeof(uint32_t));
-            
-            // Initialize the quantizer's stats uniformly
-            for (k = 0; k < q_list->q[i][j]->output_alphabet->size; k++) {
-                s[i][j]->counts[k] = 1;
-            }
-			s[i][j]->n = q_list->q[i][j]->output_alphabet->size;
-            s[i][j]->alphabetCard = q_list->q[i][j]->output_alphabet->size;
-            
-            // Step size is 8 counts per symbol seen to speed convergence
-            s[i][j]->step = 8;
-        }
-    }
-    
-    return s;
+void reset_stream_stats(struct stream_stats_t *s, uint32_t count) {
+	uint32_t i, k;
+
+	for (i = 0; i < count; ++i) {
+		s[i].cumulative[0] = 0;
+		for (k = 0; k < s[i].alphabetCard; ++k) {
+			s[i].counts[k] = 1;
+			s[i].cumulative[k+1] = k+1;
+		}
+		s[i].n = s[i].alphabetCard;
+		s[i].rescales = 0;
+		s[i].limit = STATS_LIMIT_MAX;
+
+		// Step size is 8 counts per symbol seen to speed convergence
+		s[i].step = STATS_STEP_DEFAULT;
+	}
 }
 
 /**
- * @todo add cluster stats
+ * Returns the stats of every quantizer of a compiled codebook to where coding a segment
+ * starts from, in place. Each count starts at one plus the quantizer's prior for that
+ * state, if there are priors, scaled to be worth STATS_PRIOR_SYMBOLS symbols of evidence,
+ * and the step, limit and mixing come from the model of the file
  */
-arithStream initialize_arithStream(FILE *fout, uint8_t decompressor_flag, struct quality_file_t *info) {
-    arithStream as;
-	uint32_t i;
+void reset_context_stats(struct stream_stats_t *s, const struct compiled_codebook_t *book, const uint8_t *priors, struct quality_file_t *info) {
+	uint32_t i, k, card;
 
-	memset(&info->well, 0, sizeof(struct well_state_t));
+	for (i = 0; i < 2*book->contexts; ++i) {
+		card = s[i].alphabetCard;
+		s[i].cumulative[0] = 0;
+		s[i].n = 0;
+		for (k = 0; k < card; ++k) {
+			s[i].counts[k] = 1;
+			if (priors)
+				s[i].counts[k] += (((uint32_t) priors[k]) * info->stats_step * STATS_PRIOR_SYMBOLS) / STATS_PRIOR_SCALE;
+			s[i].n += s[i].counts[k];
+			s[i].cumulative[k+1] = s[i].n;
+		}
+		if (priors)
+			priors += card;
+
+		if (s[i].fast)
+			memset(s[i].fast, 0, card*sizeof(uint32_t));
+		s[i].fast_n = 0;
+		s[i].fast_step = info->stats_fast_step;
+		s[i].step = info->stats_step + info->stats_fast_step;
+		s[i].limit = info->stats_limit;
+		s[i].rescales = 0;
+	}
+}
 
-    if (decompressor_flag) {
-        fread(info->well.state, sizeof(uint32_t), 32, fout);
-    }
-    else {
-        // Initialize WELL state vector with libc rand
-        srand((uint32_t) time(0));
-        for (i = 0; i < 32; ++i) {
+/**
+ * Allocates the adaptive stats for one context, initialized uniformly
+ */
+stream_stats_ptr_t alloc_stream_stats(uint32_t alphabetCard) {
+	stream_stats_ptr_t s = (stream_stats_ptr_t) calloc(1, sizeof(struct stream_stats_t));
+
+	s->counts = (uint32_t *) calloc(alphabetCard, sizeof(uint32_t));
+	s->cumulative = (uint32_t *) calloc(alphabetCard+1, sizeof(uint32_t));
+	s->alphabetCard = alphabetCard;
+	reset_stream_stats(s, 1);
+	return s;
+}
+
+/**
+ * Deallocates the adaptive stats for one context
+ */
+void free_stream_stat(stream_stats_ptr_t stats) {
+	free(stats->counts);
+	free(stats->cumulative);
+	free(stats);
+}
+
+/**
+ * Initialize stats structures used for adaptive arithmetic coding based on the contexts
+ * of a compiled codebook (one set of stats per quantizer). The stats and all of their
+ * counts are stored in a single allocation, in the same order as the quantizers, so that
+ * the whole arena is released with one free
+ */
+struct stream_stats_t *initialize_stream_stats(const struct compiled_codebook_t *book, const uint8_t *priors, struct quality_file_t *info) {
+	struct stream_stats_t *s;
+	uint32_t *pool;
+	uint32_t i, card;
+	uint32_t arrays = info->stats_fast_step ? 3 : 2;
+	size_t words = 0;
+
+	for (i = 0; i < 2*book->contexts; ++i) {
+		words += arrays*COMPILED_QUANTIZER(book, i)->states + 1;
+	}
+
+	s = (struct stream_stats_t *) malloc(2*book->contexts*sizeof(struct stream_stats_t) + words*sizeof(uint32_t));
+	pool = (uint32_t *) &s[2*book->contexts];
+
+	// Each set of stats has its counts followed by its cumulative counts and its fast counts
+	for (i = 0; i < 2*book->contexts; ++i) {
+		card = COMPILED_QUANTIZER(book, i)->states;
+		s[i].counts = pool;
+		s[i].cumulative = pool + card;
+		s[i].fast = info->stats_fast_step ? pool + 2*card + 1 : NULL;
+		s[i].alphabetCard = card;
+		pool += arrays*card + 1;
+	}
+	reset_context_stats(s, book, priors, info);
+
+	return s;
+}
+
+/**
+ * Chooses a new WELL seed state when compressing. The seed is stored in the container
+ * header, and every segment derives its own state from it. It is mixed from the time and
+ * the file's own address rather than libc rand, so files seeded at the same time on
+ * different threads neither share a generator nor get the same seed
+ */
+void choose_well_seed(struct quality_file_t *info) {
+	uint32_t i;
 #ifndef DEBUG
-            info->well.state[i] = rand();
+	uint64_t mix = ((uint64_t) time(0) << 32) ^ (uint64_t) clock() ^ (uint64_t) (uintptr_t) info;
+	struct well_state_t seed;
+
+	// Spread the mixed words over the whole state, which also leaves it at n = 0
+	for (i = 0; i < 32; ++i) {
+		seed.state[i] = (uint32_t) (mix >> ((i & 1) ? 32 : 0));
+	}
+	well_seed_segment(&info->well, &seed, 0);
 #else
-            info->well.state[i] = 0x55555555;
-#endif
-        }
-        
-        // Write the initial WELL state vector to the file first (fixed size of 32 bytes)
-		// @todo strictly this needs to be stored in network order because we're interpreting it as a 32 bit int
-		// but I am a bit too lazy for that right now
-        fwrite(info->well.state, sizeof(uint32_t), 32, fout);
+	memset(&info->well, 0, sizeof(struct well_state_t));
+	for (i = 0; i < 32; ++i) {
+		info->well.state[i] = 0x55555555;
 	}
+#endif
+}
+
+/**
+ * Primes the decoder with the first bits of its input, encoders start empty
+ */
+static void start_arithStream(arithStream as, uint8_t decompressor_flag) {
+	if (!decompressor_flag)
+		return;
+
+	if (as->coder == CODER_RANGE)
+		range_decoder_start(as->rc, as->os);
+	else
+		as->a->t = stream_read_bits(as->os, as->a->m);
+}
+
+/**
+ * Sets up the arithmetic coder and a fresh set of adaptive stats for every cluster, reading
+ * from or writing to the given stream, which the arithmetic stream takes ownership of
+ */
+arithStream initialize_arithStream(struct os_stream_t *os, uint8_t decompressor_flag, struct quality_file_t *info) {
+    arithStream as;
+	uint32_t i;
 
-	// Must start at zero
-	info->well.n = 0;
-    
     as = (arithStream) calloc(1, sizeof(struct arithStream_t));
 
-	as->cluster_stats = (stream_stats_ptr_t) calloc(1, sizeof(struct stream_stats_t));
-	as->cluster_stats->step = 8;
-	as->cluster_stats->counts = (uint32_t *) calloc(info->cluster_count, sizeof(uint32_t));
-	as->cluster_stats->alphabetCard = info->cluster_count;
-	as->cluster_stats->n = info->cluster_count;
+	as->cluster_stats = alloc_stream_stats(info->cluster_count);
+	if (info->variable_length) {
+		as->length_stats[0] = alloc_stream_stats(2);
+		for (i = 1; i <= LENGTH_CODE_BYTES; ++i) {
+			as->length_stats[i] = alloc_stream_stats(256);
+		}
+	}
 
-	as->stats = (stream_stats_ptr_t ***) calloc(info->cluster_count, sizeof(stream_stats_ptr_t **));
+	as->stats = (struct stream_stats_t **) calloc(info->cluster_count, sizeof(struct stream_stats_t *));
 	for (i = 0; i < info->cluster_count; ++i) {
-    	as->stats[i] = initialize_stream_stats(info->clusters->clusters[i].qlist);
-		as->cluster_stats->counts[i] = 1;
+    	as->stats[i] = initialize_stream_stats(info->clusters->clusters[i].book, info->clusters->clusters[i].priors, info);
 	}
     
+	as->coder = info->coder;
 	as->a = initialize_arithmetic_encoder(m_arith);
-	as->os = alloc_os_stream(fout, decompressor_flag);
-
-	if (decompressor_flag)
-		as->a->t = stream_read_bits(as->os, as->a->m);
-	else
-		as->a->t = 0;
+	as->os = os;
+	if (as->coder == CODER_RANGE)
+		as->rc = initialize_range_coder();
+	start_arithStream(as, decompressor_flag);
     
     return as;
 }
 
-qv_compressor initialize_qv_compressor(FILE *fout, uint8_t streamDirection, struct quality_file_t *info) {
+/**
+ * Starts a new stream with an arithmetic stream that was already used, putting every set
+ * of stats and the coder back the way initialize_arithStream leaves them without
+ * allocating anything. Output goes to the start of the stream's buffer again, and input
+ * is read from data
+ */
+void reset_arithStream(arithStream as, uint8_t decompressor_flag, struct quality_file_t *info, const uint8_t *data, size_t size) {
+	uint32_t i;
+
+	reset_stream_stats(as->cluster_stats, 1);
+	for (i = 0; i <= LENGTH_CODE_BYTES; ++i) {
+		if (as->length_stats[i])
+			reset_stream_stats(as->length_stats[i], 1);
+	}
+	for (i = 0; i < info->cluster_count; ++i) {
+		reset_context_stats(as->stats[i], info->clusters->clusters[i].book, info->clusters->clusters[i].priors, info);
+	}
+
+	stream_rewind(as->os, data, size);
+	reset_arithmetic_encoder(as->a);
+	if (as->rc)
+		reset_range_coder(as->rc);
+	start_arithStream(as, decompressor_flag);
+}
+
+/**
+ * Counts how many times the stats of every context of an arithmetic stream were rescaled
+ * since it was started or reset
+ */
+uint64_t count_stream_rescales(arithStream as, struct quality_file_t *info) {
+	uint64_t rescales = as->cluster_stats->rescales;
+	uint32_t i, k;
+
+	for (i = 0; i <= LENGTH_CODE_BYTES; ++i) {
+		if (as->length_stats[i])
+			rescales += as->length_stats[i]->rescales;
+	}
+	for (i = 0; i < info->cluster_count; ++i) {
+		for (k = 0; k < 2*info->clusters->clusters[i].book->contexts; ++k) {
+			rescales += as->stats[i][k].rescales;
+		}
+	}
+
+	return rescales;
+}
+
+/**
+ * Deallocates an arithmetic stream, its stats and its bit stream (but not the file)
+ */
+void free_arithStream(arithStream as, struct quality_file_t *info) {
+	uint32_t i;
+
+	for (i = 0; i < info->cluster_count; ++i) {
+		free(as->stats[i]);
+	}
+	free(as->stats);
+	free_stream_stat(as->cluster_stats);
+	for (i = 0; i <= LENGTH_CODE_BYTES; ++i) {
+		if (as->length_stats[i])
+			free_stream_stat(as->length_stats[i]);
+	}
+	free(as->a);
+	free(as->rc);
+	free_os_stream(as->os);
+	free(as);
+}
+
+/**
+ * Creates the coder for a single segment, with its WELL state derived from the file seed
+ */
+qv_compressor initialize_qv_compressor(struct os_stream_t *os, uint8_t streamDirection, struct quality_file_t *info, uint32_t segment) {
     qv_compressor s;
     s = calloc(1, sizeof(struct qv_compressor_t));
-    s->Quals = initialize_arithStream(fout, streamDirection, info);
+    s->Quals = initialize_arithStream(os, streamDirection, info);
+	well_seed_segment(&s->well, &info->well, segment);
+	dither_seed_segment(&s->key, &info->well, segment);
+	s->kernel = select_dither_kernel(0);
+	s->selection = (uint8_t *) malloc((info->columns + DITHER_BLOCK) & ~(DITHER_BLOCK - 1));
     return s;
 }
+
+/**
+ * Sets up a segment coder that was already used for another segment, keeping all of its
+ * memory. Compression starts over at the beginning of the coder's output buffer, and
+ * decompression reads the given coded bytes in place
+ */
+void reset_qv_compressor(qv_compressor qvc, uint8_t streamDirection, struct quality_file_t *info, uint32_t segment, const uint8_t *data, size_t size) {
+	reset_arithStream(qvc->Quals, streamDirection, info, data, size);
+	well_seed_segment(&qvc->well, &info->well, segment);
+	dither_seed_segment(&qvc->key, &info->well, segment);
+}
+
+/**
+ * Deallocates a segment coder
+ */
+void free_qv_compressor(qv_compressor qvc, struct quality_file_t *info) {
+	free_arithStream(qvc->Quals, info);
+	free(qvc->selection);
+	free(qvc);
+}
+
+/**
+ * Produces the values that choose between the low and high quantizer for every symbol of
+ * the next line, either all at once from the counter based generator or drawn one after
+ * another from WELL, in the same order as the symbols are coded
+ * @param line Line number within the segment
+ * @param columns Length of the line
+ */
+void draw_line_selection(qv_compressor qvc, struct quality_file_t *info, uint32_t line, uint32_t columns) {
+	uint32_t s;
+
+	if (info->dither == DITHER_COUNTER) {
+		qvc->kernel(&qvc->key, line, columns, qvc->selection);
+		return;
+	}
+
+	for (s = 0; s < columns; ++s) {
+		qvc->selection[s] = (uint8_t) well_1024a_bits(&qvc->well, 7);
+	}
+}
+
+/**
+ * Trains the priors that the adaptive stats of every quantizer start from, so that small
+ * segments don't pay to learn the same statistics over and over. Up to STATS_PRIOR_LINES
+ * evenly spaced loaded lines are run through the codebooks the way the encoder would, and
+ * the frequency of each state of each quantizer is kept, out of STATS_PRIOR_SCALE. Both
+ * quantizers of a context see the same input, so each symbol counts toward both, and the
+ * one that provides the next left context is picked with the context's ratio from a hash
+ * of the line and column rather than the file's generator
+ */
+void train_stats_priors(struct quality_file_t *info) {
+	struct compiled_codebook_t **books = (struct compiled_codebook_t **) calloc(info->cluster_count, sizeof(struct compiled_codebook_t *));
+	uint32_t **offsets = (uint32_t **) calloc(info->cluster_count, sizeof(uint32_t *));
+	uint32_t **counts = (uint32_t **) calloc(info->cluster_count, sizeof(uint32_t *));
+	struct compiled_codebook_t *book;
+	struct codebook_quantizer_t *q;
+	struct cluster_t *cluster;
+	struct line_t *line;
+	uint64_t i, stride, total;
+	uint32_t k, j, s, idx, ctx;
+	uint8_t c, r;
+	symbol_t prev, x;
+
+	for (c = 0; c < info->cluster_count; ++c) {
+		cluster = &info->clusters->clusters[c];
+		books[c] = compile_codebook(cluster->qlist);
+		offsets[c] = (uint32_t *) malloc((2*books[c]->contexts + 1)*sizeof(uint32_t));
+		offsets[c][0] = 0;
+		for (k = 0; k < 2*books[c]->contexts; ++k) {
+			offsets[c][k+1] = offsets[c][k] + COMPILED_QUANTIZER(books[c], k)->states;
+		}
+		counts[c] = (uint32_t *) calloc(offsets[c][2*books[c]->contexts], sizeof(uint32_t));
+	}
+
+	stride = (info->lines > STATS_PRIOR_LINES) ? info->lines / STATS_PRIOR_LINES : 1;
+	for (i = 0; i < info->lines; i += stride) {
+		line = &info->blocks[i / MAX_LINES_PER_BLOCK].lines[i % MAX_LINES_PER_BLOCK];
+		c = line->cluster;
+		book = books[c];
+		prev = 0;
+		for (s = 0; s < line->length; ++s) {
+			x = line->m_data[s] - 33;
+			ctx = book->context_index[s*ALPHABET_SIZE + prev];
+			counts[c][offsets[c][2*ctx] + book->ctx[ctx].q[0].state[x]] += 1;
+			counts[c][offsets[c][2*ctx+1] + book->ctx[ctx].q[1].state[x]] += 1;
+
+			r = (uint8_t) ((((uint32_t) i * 0x9e3779b1u) ^ (s * 0x85ebca6bu)) >> 25);
+			idx = choose_compiled_quantizer(book, r, s, prev);
+			prev = COMPILED_QUANTIZER(book, idx)->q[x];
+		}
+	}
+
+	for (c = 0; c < info->cluster_count; ++c) {
+		cluster = &info->clusters->clusters[c];
+		free(cluster->priors);
+		cluster->priors = (uint8_t *) malloc(offsets[c][2*books[c]->contexts] + 1);
+		for (k = 0; k < 2*books[c]->contexts; ++k) {
+			q = COMPILED_QUANTIZER(books[c], k);
+			total = 0;
+			for (j = 0; j < q->states; ++j) {
+				total += counts[c][offsets[c][k] + j];
+			}
+			for (j = 0; j < q->states; ++j) {
+				cluster->priors[offsets[c][k] + j] = total ? (uint8_t) ((counts[c][offsets[c][k] + j] * STATS_PRIOR_SCALE + total/2) / total) : 0;
+			}
+		}
+
+		free(counts[c]);
+		free(offsets[c]);
+		free_compiled_codebook(books[c]);
+	}
+	free(counts);
+	free(offsets);
+	free(books);
+}
@@ -0,0 +1,532 @@
+/**
+ * Library level wrappers around the codebook and segment coding functions
+ */
+
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "qvz.h"
+#include "lines.h"
+#include "cluster.h"
+#include "qv_compressor.h"
+#include "container.h"
+#include "thread_pool.h"
+
+/**
+ * Trained or loaded codebooks. Contexts copy the info and share everything it points to
+ */
+struct qvz_codebooks_t {
+	struct quality_file_t info;		// Clusters with their quantizers and compiled codebooks, and the coding parameters
+	struct qv_options_t opts;
+	uint8_t has_means;				// Cluster centers are known, so new lines can be assigned to clusters
+};
+
+struct qvz_encoder_t {
+	struct quality_file_t info;		// Copy of the codebooks' info, with blocks over the chunk being coded
+	struct qv_options_t opts;
+	qv_compressor qvc;				// Coder and stats reused by every chunk
+	struct line_t *lines;
+	struct line_block_t *blocks;	// Blocks over lines, as compress_segment expects them
+	uint32_t capacity;				// Lines that lines and blocks have room for
+	distance_kernel_t kernel;
+	uint64_t *distances;			// Distance from the current line to each cluster center
+	uint32_t next_chunk;
+};
+
+struct qvz_decoder_t {
+	struct quality_file_t info;
+	struct qv_options_t opts;
+	qv_compressor qvc;
+	uint32_t next_chunk;
+};
+
+/**
+ * Fills in the options an encode from the command line starts from
+ */
+void qvz_default_options(struct qv_options_t *opts) {
+	memset(opts, 0, sizeof(struct qv_options_t));
+	opts->ratio = 0.5;
+	opts->mode = MODE_RATIO;
+	opts->clusters = 1;
+	opts->distortion = DISTORTION_MSE;
+	opts->coder = CODER_ARITHMETIC;
+	opts->dither = DITHER_COUNTER;
+	opts->cluster_threshold = 4;
+	opts->threads = get_cpu_count();
+	opts->segment_lines = MAX_LINES_PER_BLOCK;
+	opts->codebook_tolerance = CODEBOOK_CACHE_TOLERANCE;
+	opts->stats_step = STATS_STEP_DEFAULT;
+	opts->stats_limit = STATS_LIMIT_MAX;
+}
+
+/**
+ * Makes room for size more bytes in the buffer
+ * @return 1, or 0 if it can't grow, leaving it as it was
+ */
+static uint8_t buffer_reserve(struct qvz_buffer_t *buf, size_t size) {
+	size_t capacity = buf->capacity ? buf->capacity : OS_STREAM_INITIAL_LEN;
+	uint8_t *data;
+
+	if (buf->size + size <= buf->capacity)
+		return 1;
+
+	while (buf->size + size > capacity) {
+		capacity *= 2;
+	}
+	data = (uint8_t *) realloc(buf->data, capacity);
+	if (!data)
+		return 0;
+	buf->data = data;
+	buf->capacity = capacity;
+	return 1;
+}
+
+/**
+ * Appends size bytes to the buffer, which must have room for them
+ */
+static void buffer_append(struct qvz_buffer_t *buf, const void *data, size_t size) {
+	memcpy(buf->data + buf->size, data, size);
+	buf->size += size;
+}
+
+/**
+ * Releases the memory of a buffer and leaves it empty, ready to be used again
+ */
+void qvz_free_buffer(struct qvz_buffer_t *buf) {
+	free(buf->data);
+	memset(buf, 0, sizeof(struct qvz_buffer_t));
+}
+
+/**
+ * Checks that every score of a line is a Phred+33 character the codebooks can code
+ */
+static uint8_t valid_scores(const uint8_t *line, uint32_t length) {
+	uint32_t i;
+
+	for (i = 0; i < length; ++i) {
+		if (line[i] < 33 || line[i] - 33 >= ALPHABET_SIZE)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Frees the quantizers, clusters and alphabet of a file's info, whose codebooks must not be
+ * compiled any more
+ */
+static void release_codebooks(struct quality_file_t *info) {
+	uint8_t j;
+
+	if (info->clusters) {
+		for (j = 0; j < info->cluster_count; ++j) {
+			if (info->clusters->clusters[j].qlist)
+				free_cond_quantizer_list(info->clusters->clusters[j].qlist);
+		}
+		free_cluster_list(info->clusters);
+	}
+	free_alphabet(info->alphabet);
+	if (info->dist)
+		free_distortion_matrix(info->dist);
+}
+
+/**
+ * Clusters the given lines and designs codebooks for them, the same way an encode from the
+ * command line does with the same options. The lines are only read during the call. Later
+ * chunks may reach contexts these lines never did, so those are given quantizers for the
+ * column as a whole, as for a streamed input
+ * @param lines Phred+33 quality scores of each line, with no newline
+ * @param lengths Number of scores in each line
+ * @param opts Options as given on the command line, such as the mode, target and clusters
+ * @return The codebooks, or NULL if there are no scores, a score is outside the alphabet, the
+ * distortion file can't be read, or the tables for training can't be allocated
+ */
+struct qvz_codebooks_t *qvz_train_codebooks(const uint8_t **lines, const uint32_t *lengths, uint64_t count, struct qv_options_t *opts) {
+	struct qvz_codebooks_t *books;
+	struct quality_file_t *info;
+	uint64_t i;
+
+	for (i = 0; i < count; ++i) {
+		if (!valid_scores(lines[i], lengths[i]))
+			return NULL;
+	}
+
+	books = (struct qvz_codebooks_t *) calloc(1, sizeof(struct qvz_codebooks_t));
+	info = &books->info;
+	books->opts = *opts;
+	books->opts.stream_training = count;
+	if (books->opts.threads == 0)
+		books->opts.threads = get_cpu_count();
+	if (books->opts.clusters == 0)
+		books->opts.clusters = 1;
+	info->opts = &books->opts;
+
+	info->alphabet = alloc_alphabet(ALPHABET_SIZE);
+	if (opts->distortion == DISTORTION_CUSTOM)
+		info->dist = gen_custom_distortion(ALPHABET_SIZE, opts->dist_file);
+	else
+		info->dist = generate_distortion_matrix(ALPHABET_SIZE, opts->distortion);
+
+	if (!info->dist || load_lines(lines, lengths, count, info) != LF_ERROR_NONE || info->columns == 0) {
+		free_blocks(info);
+		release_codebooks(info);
+		free(books);
+		return NULL;
+	}
+
+	info->cluster_count = books->opts.clusters;
+	info->coder = opts->coder;
+	info->dither = opts->dither;
+	info->stats_step = opts->stats_step;
+	info->stats_fast_step = opts->stats_fast_step;
+	info->stats_limit = opts->stats_limit;
+	info->stats_priors = opts->stats_priors;
+
+	info->clusters = alloc_cluster_list(info);
+	if (!do_kmeans_clustering(info) || !calculate_statistics(info)) {
+		free_blocks(info);
+		release_codebooks(info);
+		free(books);
+		return NULL;
+	}
+	generate_codebooks(info);
+	if (info->stats_priors)
+		train_stats_priors(info);
+	choose_well_seed(info);
+	compile_codebooks(info);
+	books->has_means = 1;
+
+	// Nothing may point at the caller's lines once we return
+	free_blocks(info);
+	info->blocks = NULL;
+	info->block_count = 0;
+	info->lines = 0;
+	info->symbols = 0;
+
+	return books;
+}
+
+/**
+ * Saves codebooks to be read back with qvz_read_codebooks, as a container header and the
+ * codebooks followed by the cluster centers
+ */
+void qvz_write_codebooks(FILE *fp, struct qvz_codebooks_t *books) {
+	uint8_t j;
+
+	write_container_header(fp, &books->info, 0, books->has_means ? CONTAINER_CLUSTER_MEANS : 0);
+	write_codebooks(fp, &books->info);
+	if (books->has_means) {
+		for (j = 0; j < books->info.cluster_count; ++j) {
+			fwrite(books->info.clusters->clusters[j].mean, sizeof(symbol_t), books->info.columns, fp);
+		}
+	}
+}
+
+/**
+ * Reads codebooks saved by qvz_write_codebooks. The start of a compressed file can be read
+ * this way too, but it has no cluster centers, so it can only make decoders unless it has
+ * a single cluster
+ * @return The codebooks, or NULL if the header, the codebooks or the cluster centers are
+ * damaged or cut short
+ */
+struct qvz_codebooks_t *qvz_read_codebooks(FILE *fp) {
+	struct qvz_codebooks_t *books = (struct qvz_codebooks_t *) calloc(1, sizeof(struct qvz_codebooks_t));
+	struct quality_file_t *info = &books->info;
+	uint8_t flags, j;
+
+	books->opts.threads = 1;
+	info->opts = &books->opts;
+	info->alphabet = alloc_alphabet(ALPHABET_SIZE);
+
+	if (!read_container_header(fp, info, &flags) || !read_codebooks(fp, info)) {
+		release_codebooks(info);
+		free(books);
+		return NULL;
+	}
+	info->lines = 0;
+
+	if (flags & CONTAINER_CLUSTER_MEANS) {
+		for (j = 0; j < info->cluster_count; ++j) {
+			if (fread(info->clusters->clusters[j].mean, sizeof(symbol_t), info->columns, fp) != info->columns) {
+				release_codebooks(info);
+				free(books);
+				return NULL;
+			}
+		}
+		books->has_means = 1;
+	}
+
+	compile_codebooks(info);
+	return books;
+}
+
+/**
+ * Deallocates codebooks, which no context may still be using
+ */
+void qvz_free_codebooks(struct qvz_codebooks_t *books) {
+	free_compiled_codebooks(&books->info);
+	release_codebooks(&books->info);
+	free(books);
+}
+
+/**
+ * Creates an encoder that codes chunks of lines with the given codebooks, which must stay
+ * alive until the encoder is freed. A context codes one chunk at a time, and several
+ * contexts can share the same codebooks from different threads
+ * @param opts Options for the context, only verbose is used, may be NULL
+ * @return The encoder, or NULL if the codebooks have several clusters but no centers to
+ * assign lines to them
+ */
+struct qvz_encoder_t *qvz_encoder_create(struct qvz_codebooks_t *books, struct qv_options_t *opts) {
+	struct qvz_encoder_t *ctx;
+
+	if (books->info.cluster_count > 1 && !books->has_means)
+		return NULL;
+
+	ctx = (struct qvz_encoder_t *) calloc(1, sizeof(struct qvz_encoder_t));
+	ctx->info = books->info;
+	if (opts)
+		ctx->opts = *opts;
+	ctx->info.opts = &ctx->opts;
+	ctx->qvc = initialize_qv_compressor(alloc_os_stream(), COMPRESSION, &ctx->info, 0);
+	ctx->kernel = select_distance_kernel(0);
+	ctx->distances = (uint64_t *) malloc(books->info.cluster_count * sizeof(uint64_t));
+
+	return ctx;
+}
+
+/**
+ * Makes room for a chunk of the given number of lines, in blocks of MAX_LINES_PER_BLOCK
+ * @return 1, or 0 if there isn't enough memory, leaving the encoder with room for none
+ */
+static uint8_t reserve_encoder_lines(struct qvz_encoder_t *ctx, uint32_t count) {
+	uint32_t blocks = (count + MAX_LINES_PER_BLOCK - 1) / MAX_LINES_PER_BLOCK;
+
+	free(ctx->lines);
+	free(ctx->blocks);
+	ctx->lines = (struct line_t *) calloc(count, sizeof(struct line_t));
+	ctx->blocks = (struct line_block_t *) calloc(blocks, sizeof(struct line_block_t));
+	ctx->capacity = (ctx->lines && ctx->blocks) ? count : 0;
+	return ctx->capacity != 0;
+}
+
+/**
+ * Codes the lines as the next chunk of the encoder and appends its record and coded bytes
+ * to out. The lines are only read during the call
+ * @param lines Phred+33 quality scores of each line, with no newline
+ * @param lengths Number of scores in each line. Codebooks trained on lines of equal length
+ * can only code lines of that length, otherwise lines may be up to the longest one trained on
+ * @return QVZ_OK, or QVZ_ERROR_BAD_LINE or QVZ_ERROR_MEMORY with nothing appended
+ */
+uint32_t qvz_encode_lines(struct qvz_encoder_t *ctx, const uint8_t **lines, const uint32_t *lengths, uint32_t count, struct qvz_buffer_t *out) {
+	struct quality_file_t *info = &ctx->info;
+	struct qv_segment_t segment;
+	struct line_t *line;
+	uint8_t record[SEGMENT_RECORD_LENGTH];
+	uint32_t i, b;
+
+	if (count == 0)
+		return QVZ_OK;
+
+	for (i = 0; i < count; ++i) {
+		if (lengths[i] > info->columns || (!info->variable_length && lengths[i] != info->columns) || !valid_scores(lines[i], lengths[i]))
+			return QVZ_ERROR_BAD_LINE;
+	}
+
+	if (count > ctx->capacity && !reserve_encoder_lines(ctx, count))
+		return QVZ_ERROR_MEMORY;
+
+	// New lines go to the nearest center without moving it, as they do when streaming
+	for (i = 0; i < count; ++i) {
+		line = &ctx->lines[i];
+		line->m_data = lines[i];
+		line->length = lengths[i];
+		line->cluster = 0;
+		if (info->cluster_count > 1) {
+			ctx->kernel(line->m_data, info->clusters->clusters, info->cluster_count, line->length, ctx->distances);
+			assign_cluster(line, info, ctx->distances);
+		}
+	}
+
+	info->block_count = (count + MAX_LINES_PER_BLOCK - 1) / MAX_LINES_PER_BLOCK;
+	for (b = 0; b < info->block_count; ++b) {
+		ctx->blocks[b].lines = ctx->lines + ((size_t) b) * MAX_LINES_PER_BLOCK;
+		ctx->blocks[b].count = (count - b*MAX_LINES_PER_BLOCK < MAX_LINES_PER_BLOCK) ? count - b*MAX_LINES_PER_BLOCK : MAX_LINES_PER_BLOCK;
+	}
+	info->blocks = ctx->blocks;
+	info->lines = count;
+
+	memset(&segment, 0, sizeof(struct qv_segment_t));
+	segment.id = ctx->next_chunk++;
+	segment.lines = count;
+	compress_segment(info, &segment, 0, 0, ctx->qvc);
+
+	if (!buffer_reserve(out, SEGMENT_RECORD_LENGTH + segment.size))
+		return QVZ_ERROR_MEMORY;
+	put_segment_record(record, &segment);
+	buffer_append(out, record, SEGMENT_RECORD_LENGTH);
+	buffer_append(out, segment.data, segment.size);
+
+	if (ctx->opts.verbose) {
+		printf("Chunk %u: %u lines, %llu bytes\n", segment.id, segment.lines, (unsigned long long) segment.size);
+	}
+
+	return QVZ_OK;
+}
+
+/**
+ * Starts the encoder over at chunk 0, for a new record or file
+ */
+void qvz_encoder_reset(struct qvz_encoder_t *ctx) {
+	ctx->next_chunk = 0;
+}
+
+/**
+ * Deallocates an encoder, but not its codebooks
+ */
+void qvz_encoder_free(struct qvz_encoder_t *ctx) {
+	free_qv_compressor(ctx->qvc, &ctx->info);
+	free(ctx->lines);
+	free(ctx->blocks);
+	free(ctx->distances);
+	free(ctx);
+}
+
+/**
+ * Creates a decoder for chunks coded with the given codebooks, which must stay alive until
+ * the decoder is freed
+ */
+struct qvz_decoder_t *qvz_decoder_create(struct qvz_codebooks_t *books) {
+	struct qvz_decoder_t *ctx = (struct qvz_decoder_t *) calloc(1, sizeof(struct qvz_decoder_t));
+
+	ctx->info = books->info;
+	ctx->info.opts = &ctx->opts;
+	ctx->qvc = initialize_qv_compressor(alloc_os_stream_reader(NULL, 0), DECOMPRESSION, &ctx->info, 0);
+
+	return ctx;
+}
+
+/**
+ * Decodes the chunk at the start of data as the next chunk of the decoder, and appends its
+ * lines to out as text, one per line. The empty record that ends a streamed file decodes
+ * to nothing
+ * @param used Set to the bytes of data taken by the chunk, so chunks stored back to back
+ * can be walked through, may be NULL
+ * @return QVZ_OK, or an error with nothing appended
+ */
+uint32_t qvz_decode_lines(struct qvz_decoder_t *ctx, const uint8_t *data, size_t size, size_t *used, struct qvz_buffer_t *out) {
+	struct qv_segment_t segment;
+
+	if (size < SEGMENT_RECORD_LENGTH)
+		return QVZ_ERROR_TRUNCATED;
+
+	memset(&segment, 0, sizeof(struct qv_segment_t));
+	if (get_segment_record(data, &segment)) {
+		if (segment.size > size - SEGMENT_RECORD_LENGTH)
+			return QVZ_ERROR_TRUNCATED;
+		segment.data = (uint8_t *) data + SEGMENT_RECORD_LENGTH;
+		segment.mapped = 1;
+		segment.id = ctx->next_chunk;
+		if (decompress_segment(&ctx->info, &segment, ctx->qvc) != DECODE_OK)
+			return QVZ_ERROR_CORRUPT;
+		ctx->next_chunk += 1;
+		if (!buffer_reserve(out, segment.text_size)) {
+			free(segment.text);
+			return QVZ_ERROR_MEMORY;
+		}
+		buffer_append(out, segment.text, segment.text_size);
+		free(segment.text);
+	}
+
+	if (used)
+		*used = SEGMENT_RECORD_LENGTH + segment.size;
+	return QVZ_OK;
+}
+
+/**
+ * Starts the decoder over at chunk 0
+ */
+void qvz_decoder_reset(struct qvz_decoder_t *ctx) {
+	ctx->next_chunk = 0;
+}
+
+/**
+ * Deallocates a decoder, but not its codebooks
+ */
+void qvz_decoder_free(struct qvz_decoder_t *ctx) {
+	free_qv_compressor(ctx->qvc, &ctx->info);
+	free(ctx);
+}
+
+/**
+ * Decodes a range of lines from an already opened compressed stream, only decoding the
+ * segments that overlap the range. Pass first_line = 0 and count = UINT64_MAX for the
+ * whole file. A damaged file is reported rather than decoded, though lines before the
+ * damage may already have been written to fout
+ * @param fin Compressed input, positioned at the start of the file
+ * @param fout Destination for the decoded lines as text
+ * @param opts Options controlling threads and verbosity
+ * @param status Set to QVZ_OK, or to why the file couldn't be decoded, may be NULL
+ * @return Number of lines written, or QVZ_DECODE_FAILED if the file couldn't be decoded
+ */
+uint64_t qvz_decode_stream(FILE *fin, FILE *fout, struct qv_options_t *opts, uint64_t first_line, uint64_t count, uint32_t *status) {
+	struct quality_file_t qv_info;
+	uint64_t lines = QVZ_DECODE_FAILED;
+	uint32_t result = QVZ_ERROR_FORMAT;
+	uint8_t flags;
+
+	memset(&qv_info, 0, sizeof(struct quality_file_t));
+	qv_info.alphabet = alloc_alphabet(ALPHABET_SIZE);
+	qv_info.opts = opts;
+
+	if (read_container_header(fin, &qv_info, &flags) && read_codebooks(fin, &qv_info)) {
+		switch (decompress_range(fout, fin, &qv_info, first_line, count, &lines)) {
+			case DECODE_OK:
+				result = QVZ_OK;
+				break;
+			case DECODE_ERROR_TRUNCATED:
+				result = QVZ_ERROR_TRUNCATED;
+				break;
+			default:
+				result = QVZ_ERROR_CORRUPT;
+				break;
+		}
+		if (result != QVZ_OK)
+			lines = QVZ_DECODE_FAILED;
+	}
+	release_codebooks(&qv_info);
+
+	if (status)
+		*status = result;
+	return lines;
+}
+
+/**
+ * Decodes count lines starting at first_line from the compressed file at path, seeking
+ * straight to the segments that hold them instead of decoding the whole file. A damaged,
+ * truncated or foreign file is reported through the result, never by stopping the caller
+ * @param status Set to QVZ_OK, or to why the lines couldn't be decoded, may be NULL
+ * @return Number of lines written to fout, or QVZ_DECODE_FAILED if the file can't be opened
+ * or decoded, see qvz_decode_stream
+ */
+uint64_t qvz_decode_range(const char *path, uint64_t first_line, uint64_t count, FILE *fout, uint32_t *status) {
+	struct qv_options_t opts;
+	FILE *fin;
+	uint64_t lines;
+
+	memset(&opts, 0, sizeof(struct qv_options_t));
+	opts.threads = get_cpu_count();
+
+	fin = fopen(path, "rb");
+	if (!fin) {
+		if (status)
+			*status = QVZ_ERROR_FORMAT;
+		return QVZ_DECODE_FAILED;
+	}
+
+	lines = qvz_decode_stream(fin, fout, &opts, first_line, count, status);
+	fclose(fin);
+
+	return lines;
+}
@@ -0,0 +1,121 @@
+#include <assert.h>
+#include <stdio.h>
+#include "qv_compressor.h"
+
+/**
+ * Bytewise range coder using the same adaptive stats as the arithmetic coder. The low end
+ * of the interval is kept in 64 bits so that carries out of the top byte can be detected
+ * and propagated into bytes that haven't been written yet, and the interval is renormalized
+ * a whole byte at a time. The stats total must stay below RANGE_CODER_TOP / 16 for the
+ * interval to keep enough precision, which the m_arith rescaling limit guarantees
+ */
+
+Range_code initialize_range_coder(void) {
+	Range_code rc = (Range_code) calloc(1, sizeof(struct range_coder_t));
+
+	reset_range_coder(rc);
+	return rc;
+}
+
+/**
+ * Returns the coder to its initial range so it can start another stream
+ */
+void reset_range_coder(Range_code rc) {
+	rc->low = 0;
+	rc->range = UINT32_MAX;
+	rc->code = 0;
+	rc->cache = 0;
+	rc->cache_size = 1;
+}
+
+/**
+ * Moves the top byte of low out to the stream. A byte is only written once it is known
+ * that no later carry can change it, so runs of 0xFF are held back until then
+ */
+static void range_shift_low(Range_code rc, osStream os) {
+	uint8_t carry, temp;
+
+	if ((uint32_t) rc->low < 0xFF000000u || (rc->low >> 32) != 0) {
+		carry = (uint8_t) (rc->low >> 32);
+		temp = rc->cache;
+		do {
+			stream_write_byte(os, temp + carry);
+			temp = 0xFF;
+		} while (--rc->cache_size != 0);
+		rc->cache = (uint8_t) (rc->low >> 24);
+	}
+	rc->cache_size += 1;
+	rc->low = (rc->low & 0x00FFFFFFu) << 8;
+}
+
+void range_encoder_step(Range_code rc, stream_stats_ptr_t stats, uint32_t x, osStream os) {
+	uint32_t r;
+
+	assert(x < stats->alphabetCard);
+
+	r = rc->range / stats->n;
+	rc->low += (uint64_t) r * stats->cumulative[x];
+	rc->range = r * (stats->cumulative[x+1] - stats->cumulative[x]);
+
+	while (rc->range < RANGE_CODER_TOP) {
+		rc->range <<= 8;
+		range_shift_low(rc, os);
+	}
+}
+
+/**
+ * Flushes all of low so the decoder can resolve the final symbols, then writes the buffer
+ */
+void range_encoder_last_step(Range_code rc, osStream os) {
+	uint32_t i;
+
+	for (i = 0; i < 5; ++i) {
+		range_shift_low(rc, os);
+	}
+	stream_write_buffer(os);
+}
+
+/**
+ * Primes the decoder with the first bytes of the stream. The first byte is always the
+ * empty cache byte from the encoder
+ */
+void range_decoder_start(Range_code rc, osStream is) {
+	uint32_t i;
+
+	rc->code = 0;
+	rc->range = UINT32_MAX;
+	for (i = 0; i < 5; ++i) {
+		rc->code = (rc->code << 8) | stream_read_byte(is);
+	}
+}
+
+uint32_t range_decoder_step(Range_code rc, stream_stats_ptr_t stats, osStream is) {
+	uint32_t r, value, x, lo, hi, mid;
+
+	r = rc->range / stats->n;
+	value = rc->code / r;
+	if (value >= stats->n)
+		value = stats->n - 1;
+
+	// Binary search over the cumulative counts for the symbol containing value
+	lo = 0;
+	hi = stats->alphabetCard;
+	while (hi - lo > 1) {
+		mid = (lo + hi) >> 1;
+		if (stats->cumulative[mid] <= value)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	x = lo;
+
+	rc->code -= r * stats->cumulative[x];
+	rc->range = r * (stats->cumulative[x+1] - stats->cumulative[x]);
+
+	while (rc->range < RANGE_CODER_TOP) {
+		rc->code = (rc->code << 8) | stream_read_byte(is);
+		rc->range <<= 8;
+	}
+
+	return x;
+}
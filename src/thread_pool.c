@@ -0,0 +1,106 @@
+/**
+ * Simple fork/join parallel loop on top of pthreads. Tasks are handed out dynamically
+ * from a shared counter so that uneven task sizes still balance across the threads
+ */
+
+#include "util.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "thread_pool.h"
+
+struct parallel_job_t {
+	parallel_task_t fn;
+	void *arg;
+	uint32_t tasks;
+	uint32_t next;
+	pthread_mutex_t lock;
+};
+
+struct parallel_worker_t {
+	struct parallel_job_t *job;
+	uint32_t thread;
+	pthread_t handle;
+};
+
+/**
+ * Finds the number of online processors, falling back to a single thread if unknown
+ */
+uint32_t get_cpu_count(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		return 1;
+	return (uint32_t) n;
+}
+
+/**
+ * Worker loop that keeps claiming the next unprocessed task until none are left
+ */
+static void *parallel_worker(void *arg) {
+	struct parallel_worker_t *worker = (struct parallel_worker_t *) arg;
+	struct parallel_job_t *job = worker->job;
+	uint32_t task;
+
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		task = job->next;
+		if (task < job->tasks)
+			job->next += 1;
+		pthread_mutex_unlock(&job->lock);
+
+		if (task >= job->tasks)
+			break;
+		job->fn(job->arg, task, worker->thread);
+	}
+
+	return NULL;
+}
+
+/**
+ * Runs every task through fn, using the calling thread as worker 0 and returning only
+ * once all tasks have completed. With one thread (or one task) no threads are created
+ */
+void run_parallel(uint32_t threads, uint32_t tasks, parallel_task_t fn, void *arg) {
+	struct parallel_job_t job;
+	struct parallel_worker_t *workers;
+	uint32_t i;
+
+	if (threads > tasks)
+		threads = tasks;
+
+	if (threads <= 1) {
+		for (i = 0; i < tasks; ++i) {
+			fn(arg, i, 0);
+		}
+		return;
+	}
+
+	job.fn = fn;
+	job.arg = arg;
+	job.tasks = tasks;
+	job.next = 0;
+	pthread_mutex_init(&job.lock, NULL);
+
+	workers = (struct parallel_worker_t *) calloc(threads, sizeof(struct parallel_worker_t));
+	for (i = 0; i < threads; ++i) {
+		workers[i].job = &job;
+		workers[i].thread = i;
+	}
+
+	// If a thread can't be created its share of the work is picked up by the others
+	for (i = 1; i < threads; ++i) {
+		if (pthread_create(&workers[i].handle, NULL, parallel_worker, &workers[i]) != 0)
+			workers[i].thread = UINT32_MAX;
+	}
+	parallel_worker(&workers[0]);
+
+	for (i = 1; i < threads; ++i) {
+		if (workers[i].thread != UINT32_MAX)
+			pthread_join(workers[i].handle, NULL);
+	}
+
+	pthread_mutex_destroy(&job.lock);
+	free(workers);
+}
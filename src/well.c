@@ -44,3 +44,28 @@ uint32_t well_1024a_bits(struct well_state_t *state, uint8_t bits) {
 	state->bits_left -= bits;
 	return rtn;
 }
+
+/**
+ * Derives an independent WELL state for one segment of a file from the file's seed state,
+ * so that every segment can be encoded or decoded on its own without replaying the
+ * generator over all of the segments before it
+ * @param state RNG state to initialize
+ * @param seed Seed state stored with the file
+ * @param segment Index of the segment the state will be used for
+ */
+void well_seed_segment(struct well_state_t *state, const struct well_state_t *seed, uint32_t segment) {
+	uint32_t i, z;
+
+	for (i = 0; i < 32; ++i) {
+		// Murmur3 finalizer over the segment and word position to decorrelate the segments
+		z = segment * 32 + i;
+		z = (z ^ (z >> 16)) * 0x85ebca6b;
+		z = (z ^ (z >> 13)) * 0xc2b2ae35;
+		z = z ^ (z >> 16);
+		state->state[i] = seed->state[i] ^ z;
+	}
+
+	state->n = 0;
+	state->bit_output = 0;
+	state->bits_left = 0;
+}
@@ -0,0 +1,171 @@
+/**
+ * Background writer on top of pthreads. Buffers are queued in order and written by one
+ * thread, which frees each block once its bytes are out, so the coding threads can start
+ * the next batch while the last one is still being written. If the thread can't be
+ * started every write happens immediately on the caller's thread instead
+ */
+
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "writer.h"
+
+struct write_item_t {
+	FILE *fp;
+	void *block;				// Freed once written, may be NULL
+	const void *data;
+	size_t size;
+	struct write_item_t *next;
+};
+
+struct async_writer_t {
+	struct write_item_t *head;
+	struct write_item_t *tail;
+	size_t pending;				// Bytes queued but not yet written
+	uint8_t busy;				// The thread is writing an item it has taken off the queue
+	uint8_t stopping;
+	uint8_t threaded;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	pthread_t handle;
+};
+
+/**
+ * Writes one item out and releases its block
+ */
+static void write_item(struct write_item_t *item) {
+	if (item->size > 0 && fwrite(item->data, sizeof(char), item->size, item->fp) != item->size) {
+		printf("Unable to write output.\n");
+		exit(1);
+	}
+	free(item->block);
+	free(item);
+}
+
+/**
+ * Writer thread loop that takes items off the front of the queue until told to stop
+ */
+static void *writer_thread(void *arg) {
+	struct async_writer_t *w = (struct async_writer_t *) arg;
+	struct write_item_t *item;
+	size_t size;
+
+	pthread_mutex_lock(&w->lock);
+	while (1) {
+		while (!w->head && !w->stopping) {
+			pthread_cond_wait(&w->changed, &w->lock);
+		}
+		if (!w->head)
+			break;
+
+		item = w->head;
+		w->head = item->next;
+		if (!w->head)
+			w->tail = NULL;
+		w->busy = 1;
+		pthread_mutex_unlock(&w->lock);
+
+		size = item->size;
+		write_item(item);
+
+		pthread_mutex_lock(&w->lock);
+		w->pending -= size;
+		w->busy = 0;
+		pthread_cond_broadcast(&w->changed);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+/**
+ * Starts a writer with an empty queue
+ */
+struct async_writer_t *start_async_writer(void) {
+	struct async_writer_t *w = (struct async_writer_t *) calloc(1, sizeof(struct async_writer_t));
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->changed, NULL);
+	w->threaded = pthread_create(&w->handle, NULL, writer_thread, w) == 0;
+	return w;
+}
+
+/**
+ * Queues size bytes at data to be written to fp after everything queued before them. The
+ * bytes must stay valid until written, and block (which may be NULL) is freed afterwards,
+ * so ownership of it passes to the writer. Waits first if too much is already queued, but
+ * a single write larger than the limit is still accepted once the queue is empty
+ */
+void async_write(struct async_writer_t *w, FILE *fp, void *block, const void *data, size_t size) {
+	struct write_item_t *item = (struct write_item_t *) malloc(sizeof(struct write_item_t));
+
+	item->fp = fp;
+	item->block = block;
+	item->data = data;
+	item->size = size;
+	item->next = NULL;
+
+	if (!w->threaded) {
+		write_item(item);
+		return;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	while (w->pending > 0 && w->pending + size > WRITER_QUEUE_LIMIT) {
+		pthread_cond_wait(&w->changed, &w->lock);
+	}
+	if (w->tail)
+		w->tail->next = item;
+	else
+		w->head = item;
+	w->tail = item;
+	w->pending += size;
+	pthread_cond_broadcast(&w->changed);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * Queues a private copy of a small buffer, for ones the caller reuses or keeps on the stack
+ */
+void async_write_copy(struct async_writer_t *w, FILE *fp, const void *data, size_t size) {
+	void *copy = malloc(size);
+
+	memcpy(copy, data, size);
+	async_write(w, fp, copy, copy, size);
+}
+
+/**
+ * Waits until everything queued has been handed to its stream, so that the caller can
+ * seek or write to the same streams directly
+ */
+void flush_async_writer(struct async_writer_t *w) {
+	if (!w->threaded)
+		return;
+
+	pthread_mutex_lock(&w->lock);
+	while (w->head || w->busy) {
+		pthread_cond_wait(&w->changed, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * Writes out everything still queued, then stops the thread and releases the writer
+ */
+void stop_async_writer(struct async_writer_t *w) {
+	if (w->threaded) {
+		pthread_mutex_lock(&w->lock);
+		w->stopping = 1;
+		pthread_cond_broadcast(&w->changed);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->handle, NULL);
+	}
+
+	pthread_cond_destroy(&w->changed);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+}
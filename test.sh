@@ -4,6 +4,8 @@ set -v
 
 make clean
 make 
+make -C src qvz_bench
+src/qvz_bench check || exit 1
 bin/qvz -u fref.txt -c 1 -f 0.5 -s test.in test.q > write
 bin/qvz -x test.q test.dec > read
 diff fref.txt test.dec